@@ -1,5 +1,7 @@
 #include "stdafx.h"
 
+static hv_sandbox_manager sandbox_manager;
+
 extern "C" NTSTATUS
 DriverEntry( _In_ PDRIVER_OBJECT driver_object, _In_ PUNICODE_STRING registry_path )
 {
@@ -10,6 +12,20 @@ DriverEntry( _In_ PDRIVER_OBJECT driver_object, _In_ PUNICODE_STRING registry_pa
 
     driver_object->DriverUnload = DriverUnload;
 
+    hv_trace::initialize( );
+    hv_events::initialize( );
+
+    NTSTATUS status = sandbox_manager.initialize( );
+    if ( !NT_SUCCESS( status ) ) return status;
+
+    status = hv_device::create( driver_object, &sandbox_manager );
+    if ( !NT_SUCCESS( status ) )
+    {
+        sandbox_manager.shutdown( );
+        hv_logger::shutdown( );
+        return status;
+    }
+
     hv_logger::log( hv_logger::level::info, "driver_entry: initialization complete" );
     return STATUS_SUCCESS;
 }
@@ -17,8 +33,11 @@ DriverEntry( _In_ PDRIVER_OBJECT driver_object, _In_ PUNICODE_STRING registry_pa
 extern "C" VOID
 DriverUnload( _In_ PDRIVER_OBJECT driver_object )
 {
-    UNUSED( driver_object );
-
     hv_logger::log( hv_logger::level::info, "driver_unload: unloading hypervisor driver" );
+
+    hv_device::destroy( driver_object );
+    sandbox_manager.shutdown( );
+    hv_events::shutdown( );
+    hv_trace::shutdown( );
     hv_logger::shutdown( );
 }
\ No newline at end of file
@@ -1,15 +1,30 @@
 #pragma once
 
+class hv_sandbox_manager;
+
 class hv_device
 {
 public:
-    static NTSTATUS create( _In_ PDRIVER_OBJECT driver_object );
+    static NTSTATUS create( _In_ PDRIVER_OBJECT driver_object, _In_ hv_sandbox_manager* sandboxes );
     static void destroy( _In_ PDRIVER_OBJECT driver_object );
 
 private:
     static NTSTATUS dispatch_create_close( _In_ PDEVICE_OBJECT device_object, _In_ PIRP irp );
+    static NTSTATUS dispatch_cleanup( _In_ PDEVICE_OBJECT device_object, _In_ PIRP irp );
     static NTSTATUS dispatch_device_control( _In_ PDEVICE_OBJECT device_object, _In_ PIRP irp );
 
+    static NTSTATUS handle_sandbox_request( _In_ PIRP irp, _In_ PIO_STACK_LOCATION stack, _In_ ULONG io_control_code, _Out_ ULONG_PTR* information );
+    static NTSTATUS handle_sandbox_enum( _In_ PIRP irp, _In_ PIO_STACK_LOCATION stack, _Out_ ULONG_PTR* information );
+    static NTSTATUS handle_sandbox_scan( _In_ PIRP irp, _In_ PIO_STACK_LOCATION stack, _Out_ ULONG_PTR* information );
+    static NTSTATUS handle_mem_translate( _In_ PIRP irp, _In_ PIO_STACK_LOCATION stack, _Out_ ULONG_PTR* information );
+    static NTSTATUS handle_mem_transfer( _In_ PIRP irp, _In_ PIO_STACK_LOCATION stack, _In_ BOOLEAN write, _Out_ ULONG_PTR* information );
+    static NTSTATUS handle_trace_control( _In_ PIRP irp, _In_ PIO_STACK_LOCATION stack );
+    static NTSTATUS handle_merge_query( _In_ PIRP irp, _In_ PIO_STACK_LOCATION stack, _Out_ ULONG_PTR* information );
+    static NTSTATUS handle_reclaim_query( _In_ PIRP irp, _In_ PIO_STACK_LOCATION stack, _Out_ ULONG_PTR* information );
+
     static void complete_irp_success( _In_ PIRP irp, ULONG_PTR information = 0 );
     static void complete_irp_error( _In_ PIRP irp, NTSTATUS status, ULONG_PTR information = 0 );
+
+private:
+    static hv_sandbox_manager* sandboxes_;
 };
\ No newline at end of file
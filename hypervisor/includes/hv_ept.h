@@ -6,14 +6,78 @@ public:
     hv_ept( ) = default;
     ~hv_ept( ) = default;
 
-    NTSTATUS build_identity_map( );
+    static constexpr ULONG64 default_guest_bytes = 4ULL * 1024 * 1024;
+    static constexpr ULONG64 max_guest_bytes = 1ULL * 1024 * 1024 * 1024;
+
+    NTSTATUS build_guest_map( _In_ ULONG64 guest_bytes = default_guest_bytes );
     void destroy( );
 
+    // moves every allocation over to `target`, which must be empty, and leaves this ept empty. How a destroyed
+    // sandbox hands its memory to the reclaim thread without freeing anything itself
+    void transfer( _Inout_ hv_ept& target );
+
+    // Scrubs and frees the private pages among page_count guest pages from first_page on, returns how many.
+    // Lets a large guest be freed in batches, destroy() afterwards only has the tables left. Shared pages are
+    // skipped (see below), release them first: a freed page reads as shared from then on
+    _IRQL_requires_max_( DISPATCH_LEVEL )
+    ULONG64 release_guest_pages( _In_ ULONG64 first_page, _In_ ULONG64 page_count );
+
+    _IRQL_requires_max_( DISPATCH_LEVEL )
+    NTSTATUS translate( _In_ ULONG64 gpa, _Out_ hv_ept_walk::translation* out ) const;
+
+    // resolves the host mapping of the contiguous run starting at gpa (see hv_ept_walk::resolve_run)
+    _IRQL_requires_max_( DISPATCH_LEVEL )
+    NTSTATUS resolve_run( _In_ ULONG64 gpa, _In_ ULONG64 max_length, _In_ ULONG64 access, _Out_ hv_ept_walk::run* out ) const;
+
     ULONG64 get_page_count( ) const { return page_count_; }
     ULONG64 get_alloc_bytes( ) const { return alloc_bytes_; }
+    ULONG64 get_guest_bytes( ) const { return guest_bytes_; }
+    ULONG64 get_pml4_physical( ) const { return pml4_physical_; }
+
+    // what a vmcs would load: write back paging structures, 4 level walk
+    ULONG64 get_eptp( ) const { return pml4_physical_ ? pml4_physical_ | 0x6 | ( 3 << 3 ) : 0; }
+    ULONG64 get_shared_pages( ) const { return shared_pages_; }
+
+    // moves whenever the gpa -> hpa mapping changes, anything caching host mappings of guest ram keys on it.
+    // Never repeats across ept instances either, a rebuilt ept on the same pml4 starts past every older value
+    ULONG64 get_generation( ) const { return generation_; }
+
+    // Guest ram is backed page by page so single pages can be swapped for shared ones (see hv_page_share).
+    // A shared page is mapped read / execute only and is not owned by this ept, destroy() leaves it alone.
+
+    // host mapping of the private page backing gpa, nullptr when gpa is shared or outside guest ram
+    void* get_private_page( _In_ ULONG64 gpa ) const;
+    bool  is_shared( _In_ ULONG64 gpa ) const;
+
+    // maps gpa to the shared page at shared_hpa and frees the private page that backed it
+    _IRQL_requires_max_( DISPATCH_LEVEL )
+    NTSTATUS share_page( _In_ ULONG64 gpa, _In_ ULONG64 shared_hpa );
+
+    // hands the private page backing gpa over to the caller as a shared page, it stays mapped here read only
+    _IRQL_requires_max_( DISPATCH_LEVEL )
+    NTSTATUS give_page( _In_ ULONG64 gpa, _Outptr_ void** out_page, _Out_ ULONG64* out_hpa );
+
+    // copy on write: backs gpa with a fresh private copy of its shared page, mapped writable again. out_shared_hpa
+    // receives the page the caller must release
+    _IRQL_requires_max_( DISPATCH_LEVEL )
+    NTSTATUS unshare_page( _In_ ULONG64 gpa, _Out_ ULONG64* out_shared_hpa );
+
+    _IRQL_requires_max_( DISPATCH_LEVEL )
+    static void* allocate_guest_page( );
+    // scrubs the page before it goes back to the pool, private and shared pages alike
+    _IRQL_requires_max_( DISPATCH_LEVEL )
+    static void  free_guest_page( _In_ void* page );
+
+private:
+    ULONG64* pt_entry( _In_ ULONG64 gpa ) const;
 
 private:
     void* ept_pml4_{ nullptr };
+    void** guest_pages_{ nullptr };      // one private page per guest page, nullptr where a shared page is mapped
+    ULONG64 pml4_physical_{ 0 };
+    ULONG64 guest_bytes_{ 0 };
     ULONG64 page_count_{ 0 };
     ULONG64 alloc_bytes_{ 0 };
+    ULONG64 generation_{ 0 };
+    ULONG64 shared_pages_{ 0 };
 };
\ No newline at end of file
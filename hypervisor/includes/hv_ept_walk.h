@@ -0,0 +1,183 @@
+#pragma once
+
+// Layout and software walk of the 4-level EPT hv_ept builds. This is plain integer math over table
+// memory reached through caller supplied phys<->virt translators, it has no dependency on kernel
+// apis beyond the ULONG/ULONG64 typedefs so the host tools build the exact same tables.
+
+namespace hv_ept_walk
+{
+    constexpr ULONG64 ept_read       = 1ULL << 0;
+    constexpr ULONG64 ept_write      = 1ULL << 1;
+    constexpr ULONG64 ept_execute    = 1ULL << 2;
+    constexpr ULONG64 ept_rwx        = ept_read | ept_write | ept_execute;
+    constexpr ULONG64 ept_memtype_wb = 6ULL << 3;
+    constexpr ULONG64 ept_large_page = 1ULL << 7;
+    constexpr ULONG64 ept_pfn_mask   = 0x000FFFFFFFFFF000ULL;
+
+    constexpr ULONG   ept_levels     = 4;
+    constexpr ULONG   entries_per_table = 512;
+    constexpr ULONG64 page_4k        = 0x1000ULL;
+
+    // level 4 = pml4 ... level 1 = pt
+    inline ULONG table_index( ULONG64 gpa, ULONG level )
+    {
+        return static_cast< ULONG >( ( gpa >> ( 12 + 9 * ( level - 1 ) ) ) & 0x1FF );
+    }
+
+    inline ULONG64 level_page_size( ULONG level )
+    {
+        return 1ULL << ( 12 + 9 * ( level - 1 ) );
+    }
+
+    // table pages needed to map [0, guest_bytes) with leaves of leaf_size (4K, 2M or 1G): one pml4, one pdpt,
+    // one pd per 1G unless 1G leaves are used, one pt per 2M when 4K leaves are used. Guest ram is capped at
+    // what a single pml4 entry covers (512G)
+    inline ULONG64 table_pages_for( ULONG64 guest_bytes, ULONG64 leaf_size )
+    {
+        const ULONG64 pd_span = level_page_size( 3 );
+        const ULONG64 pt_span = level_page_size( 2 );
+
+        ULONG64 pages = 2;
+        if ( leaf_size < pd_span ) pages += ( guest_bytes + pd_span - 1 ) / pd_span;
+        if ( leaf_size < pt_span ) pages += ( guest_bytes + pt_span - 1 ) / pt_span;
+        return pages;
+    }
+
+    // entry index, counted from the start of `tables`, of the pt entry that maps gpa in the layout build_tables
+    // produces with 4K leaves
+    inline ULONG64 pt_entry_index( ULONG64 guest_bytes, ULONG64 gpa )
+    {
+        const ULONG64 pd_span = level_page_size( 3 );
+        return ( 2 + ( guest_bytes + pd_span - 1 ) / pd_span ) * entries_per_table + gpa / page_4k;
+    }
+
+    // Fills `tables` (table_pages_for pages, zeroed) in the order pml4, pdpt, pds, pts. table_pa( ULONG64* )
+    // returns the physical address of a table page, guest_pa( gpa ) the host physical address backing the leaf
+    // that starts at gpa. guest_bytes must be a multiple of leaf_size.
+    template < typename table_pa_fn, typename guest_pa_fn >
+    void build_tables( ULONG64* tables, ULONG64 guest_bytes, ULONG64 leaf_size, table_pa_fn&& table_pa, guest_pa_fn&& guest_pa )
+    {
+        const ULONG64 pd_span = level_page_size( 3 );
+        const ULONG64 pt_span = level_page_size( 2 );
+
+        ULONG64* pml4 = tables;
+        ULONG64* pdpt = pml4 + entries_per_table;
+        ULONG64* pds = pdpt + entries_per_table;
+        ULONG64* pts = pds + ( leaf_size < pd_span ? ( guest_bytes + pd_span - 1 ) / pd_span : 0 ) * entries_per_table;
+
+        pml4[ 0 ] = table_pa( pdpt ) | ept_rwx;
+
+        for ( ULONG64 gpa = 0; gpa < guest_bytes; gpa += leaf_size )
+        {
+            const ULONG64 leaf = guest_pa( gpa ) | ept_rwx | ept_memtype_wb;
+            const ULONG pdpt_index = table_index( gpa, 3 );
+
+            if ( leaf_size == pd_span )
+            {
+                pdpt[ pdpt_index ] = leaf | ept_large_page;
+                continue;
+            }
+
+            ULONG64* pd = pds + ( gpa / pd_span ) * entries_per_table;
+            pdpt[ pdpt_index ] = table_pa( pd ) | ept_rwx;
+
+            if ( leaf_size == pt_span )
+            {
+                pd[ table_index( gpa, 2 ) ] = leaf | ept_large_page;
+                continue;
+            }
+
+            ULONG64* pt = pts + ( gpa / pt_span ) * entries_per_table;
+            pd[ table_index( gpa, 2 ) ] = table_pa( pt ) | ept_rwx;
+            pt[ table_index( gpa, 1 ) ] = leaf;
+        }
+    }
+
+    struct translation
+    {
+        ULONG64 hpa{ 0 };        // host physical address backing gpa
+        ULONG64 page_size{ 0 };  // size of the leaf that maps gpa (4K, 2M or 1G)
+        ULONG64 access{ 0 };     // rwx bits of the leaf
+        ULONG   depth{ 0 };      // table reads the walk took
+    };
+
+    struct run
+    {
+        ULONG64 hpa{ 0 };
+        void*   host_va{ nullptr };
+        ULONG64 length{ 0 };
+    };
+
+    // Walks gpa starting at the pml4 located at pml4_pa. Fails on the first non-present entry.
+    template < typename phys_to_virt >
+    bool translate( ULONG64 pml4_pa, ULONG64 gpa, phys_to_virt&& p2v, translation& out )
+    {
+        ULONG64 table_pa = pml4_pa;
+        out.depth = 0;
+
+        for ( ULONG level = ept_levels; level >= 1; --level )
+        {
+            const ULONG64* table = static_cast< const ULONG64* >( p2v( table_pa ) );
+            if ( !table ) return false;
+
+            const ULONG64 entry = table[ table_index( gpa, level ) ];
+            ++out.depth;
+
+            if ( ( entry & ept_rwx ) == 0 ) return false;
+
+            const bool leaf = level == 1 || ( level <= 3 && ( entry & ept_large_page ) );
+            if ( leaf )
+            {
+                const ULONG64 size = level_page_size( level );
+                out.page_size = size;
+                out.hpa = ( entry & ept_pfn_mask & ~( size - 1 ) ) | ( gpa & ( size - 1 ) );
+                out.access = entry & ept_rwx;
+                return true;
+            }
+
+            table_pa = entry & ept_pfn_mask;
+        }
+
+        return false;
+    }
+
+    // how much of a transfer the run at offset `done` may cover: the rest of it, capped at max_chunk so a
+    // copy loop drops its lock at least every max_chunk bytes
+    inline ULONG64 chunk_limit( ULONG64 done, ULONG64 length, ULONG64 max_chunk )
+    {
+        const ULONG64 remaining = length - done;
+        return remaining < max_chunk ? remaining : max_chunk;
+    }
+
+    // Resolves the longest prefix of [gpa, gpa + max_length) that grants `access` and is
+    // contiguous both host-physically and in the host mapping returned by p2v. Callers copy
+    // one run at a time, so a transfer is split exactly where the backing pages stop lining up.
+    template < typename phys_to_virt >
+    bool resolve_run( ULONG64 pml4_pa, ULONG64 gpa, ULONG64 max_length, ULONG64 access, phys_to_virt&& p2v, run& out )
+    {
+        if ( max_length == 0 ) return false;
+
+        translation t{};
+        if ( !translate( pml4_pa, gpa, p2v, t ) || ( t.access & access ) != access ) return false;
+
+        out.hpa = t.hpa;
+        out.host_va = p2v( t.hpa );
+        if ( !out.host_va ) return false;
+
+        const ULONG64 first = t.page_size - ( gpa & ( t.page_size - 1 ) );
+        out.length = first < max_length ? first : max_length;
+
+        while ( out.length < max_length )
+        {
+            translation next{};
+            if ( !translate( pml4_pa, gpa + out.length, p2v, next ) ) break;
+            if ( ( next.access & access ) != access || next.hpa != out.hpa + out.length ) break;
+            if ( p2v( next.hpa ) != static_cast< unsigned char* >( out.host_va ) + out.length ) break;
+
+            const ULONG64 remaining = max_length - out.length;
+            out.length += next.page_size < remaining ? next.page_size : remaining;
+        }
+
+        return true;
+    }
+}
\ No newline at end of file
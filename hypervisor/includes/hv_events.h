@@ -0,0 +1,52 @@
+#pragma once
+
+// Sandbox lifecycle events for user mode listeners. Events go into a fixed ring under increasing
+// sequence numbers. A listener asks for everything after the last sequence it saw with
+// IOCTL_HV_EVENT_WAIT and gets a batch back right away, or has the irp pended in a cancel safe queue
+// until the next post. Listeners keep their own cursor, so any number of them can follow the ring.
+class hv_events
+{
+public:
+    static void initialize( );
+
+    // completes every pended wait with STATUS_CANCELLED
+    static void shutdown( );
+
+    _IRQL_requires_max_( DISPATCH_LEVEL )
+    static void post( _In_ ULONG type, _In_ ULONG sandbox_id, _In_ ULONG64 detail, _In_ NTSTATUS status );
+
+    // STATUS_PENDING means the irp was queued and now belongs to hv_events, the caller must not complete it
+    _IRQL_requires_max_( DISPATCH_LEVEL )
+    static NTSTATUS wait( _In_ PIRP irp, _In_ PIO_STACK_LOCATION stack, _Out_ ULONG_PTR* information );
+
+    // IRP_MJ_CLEANUP, pended waits of a closing handle are cancelled
+    _IRQL_requires_max_( DISPATCH_LEVEL )
+    static void cancel_file( _In_ PFILE_OBJECT file_object );
+
+private:
+    // peek filter: pended irps of `file` (any if null) whose cursor is below `before`
+    struct peek_filter
+    {
+        PFILE_OBJECT file;
+        ULONG64      before;
+    };
+
+    _IRQL_requires_max_( DISPATCH_LEVEL )
+    static NTSTATUS fill( _In_ PIRP irp, _Out_ ULONG_PTR* information );
+    static void complete_matching( _In_ peek_filter* filter, _In_ bool cancel );
+    static ULONG64 resolve_cursor( _Inout_ hv_event_wait_request* req );
+
+    static NTSTATUS csq_insert( _In_ PIO_CSQ csq, _In_ PIRP irp, _In_ PVOID context );
+    static VOID csq_remove( _In_ PIO_CSQ csq, _In_ PIRP irp );
+    static PIRP csq_peek_next( _In_ PIO_CSQ csq, _In_opt_ PIRP irp, _In_opt_ PVOID context );
+    static VOID csq_acquire_lock( _In_ PIO_CSQ csq, _Out_ PKIRQL irql );
+    static VOID csq_release_lock( _In_ PIO_CSQ csq, _In_ KIRQL irql );
+    static VOID csq_complete_canceled( _In_ PIO_CSQ csq, _In_ PIRP irp );
+
+private:
+    static KSPIN_LOCK      lock_;
+    static IO_CSQ          csq_;
+    static LIST_ENTRY      pending_;
+    static hv_event_record ring_[ HV_EVENT_RING_CAPACITY ];
+    static ULONG64         next_sequence_;
+};
\ No newline at end of file
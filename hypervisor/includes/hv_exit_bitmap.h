@@ -0,0 +1,209 @@
+#pragma once
+
+// VMX MSR and I/O bitmaps built from a declarative pass-through policy. Everything traps unless a rule of
+// the policy passes it, so an exit only ever happens where the policy asks for one (or where the hardware
+// gives no choice: msrs outside the two bitmap windows always exit). Policies are constexpr tables checked
+// with static_assert, the builders fill caller supplied 4KB pages. No kernel dependency beyond
+// ULONG/ULONG64/UCHAR, the same code runs in the usermode tool.
+
+namespace hv_exit_bitmap
+{
+    constexpr ULONG bitmap_bytes = 4096;
+
+    // vmcs field encodings the bitmap physical addresses go into
+    constexpr ULONG vmcs_io_bitmap_a = 0x2000;
+    constexpr ULONG vmcs_io_bitmap_b = 0x2002;
+    constexpr ULONG vmcs_msr_bitmap  = 0x2004;
+
+    constexpr ULONG pass_read  = 0x1;
+    constexpr ULONG pass_write = 0x2;
+    constexpr ULONG pass_rw    = pass_read | pass_write;
+
+    // inclusive ranges
+    struct msr_rule
+    {
+        ULONG first;
+        ULONG last;
+        ULONG pass;
+    };
+
+    struct port_rule
+    {
+        ULONG first;
+        ULONG last;
+    };
+
+    struct policy
+    {
+        const char*      name;
+        const msr_rule*  msrs;
+        ULONG            msr_count;
+        const port_rule* ports;
+        ULONG            port_count;
+    };
+
+    template < class T, ULONG n >
+    constexpr ULONG count_of( const T ( & )[ n ] )
+    {
+        return n;
+    }
+
+    constexpr bool msr_low( ULONG msr )
+    {
+        return msr <= 0x1FFF;
+    }
+
+    constexpr bool msr_high( ULONG msr )
+    {
+        return msr >= 0xC0000000 && msr <= 0xC0001FFF;
+    }
+
+    // a rule has to stay inside one bitmap window, passing an msr the bitmap cannot describe is a policy bug
+    constexpr bool valid( const msr_rule& rule )
+    {
+        return rule.first <= rule.last && rule.pass != 0 && ( rule.pass & ~pass_rw ) == 0 &&
+            ( ( msr_low( rule.first ) && msr_low( rule.last ) ) || ( msr_high( rule.first ) && msr_high( rule.last ) ) );
+    }
+
+    constexpr bool valid( const port_rule& rule )
+    {
+        return rule.first <= rule.last && rule.last <= 0xFFFF;
+    }
+
+    constexpr bool valid( const policy& p )
+    {
+        for ( ULONG i = 0; i < p.msr_count; ++i )
+        {
+            if ( !valid( p.msrs[ i ] ) ) return false;
+        }
+
+        for ( ULONG i = 0; i < p.port_count; ++i )
+        {
+            if ( !valid( p.ports[ i ] ) ) return false;
+        }
+
+        return true;
+    }
+
+    inline void fill_trap_all( UCHAR* bitmap )
+    {
+        ULONG64* words = reinterpret_cast< ULONG64* >( bitmap );
+        for ( ULONG i = 0; i < bitmap_bytes / sizeof( ULONG64 ); ++i ) words[ i ] = ~0ULL;
+    }
+
+    inline void clear_bit( UCHAR* bits, ULONG index )
+    {
+        bits[ index / 8 ] = static_cast< UCHAR >( bits[ index / 8 ] & ~( 1u << ( index % 8 ) ) );
+    }
+
+    inline bool test_bit( const UCHAR* bits, ULONG index )
+    {
+        return ( bits[ index / 8 ] >> ( index % 8 ) ) & 1;
+    }
+
+    // sdm layout: read low msrs, read high msrs, write low msrs, write high msrs, 1KB (8192 bits) each
+    inline ULONG msr_bit_offset( ULONG msr, bool write )
+    {
+        return ( write ? 2048u * 8 : 0u ) + ( msr_high( msr ) ? 1024u * 8 : 0u ) + ( msr & 0x1FFF );
+    }
+
+    inline void build_msr_bitmap( const policy& p, UCHAR* bitmap )
+    {
+        fill_trap_all( bitmap );
+
+        for ( ULONG i = 0; i < p.msr_count; ++i )
+        {
+            const msr_rule& rule = p.msrs[ i ];
+            if ( !valid( rule ) ) continue;
+
+            for ( ULONG msr = rule.first; ; ++msr )
+            {
+                if ( rule.pass & pass_read ) clear_bit( bitmap, msr_bit_offset( msr, false ) );
+                if ( rule.pass & pass_write ) clear_bit( bitmap, msr_bit_offset( msr, true ) );
+                if ( msr == rule.last ) break;
+            }
+        }
+    }
+
+    // bitmap a covers ports 0x0000-0x7fff, bitmap b 0x8000-0xffff
+    inline void build_io_bitmaps( const policy& p, UCHAR* bitmap_a, UCHAR* bitmap_b )
+    {
+        fill_trap_all( bitmap_a );
+        fill_trap_all( bitmap_b );
+
+        for ( ULONG i = 0; i < p.port_count; ++i )
+        {
+            const port_rule& rule = p.ports[ i ];
+            if ( !valid( rule ) ) continue;
+
+            for ( ULONG port = rule.first; port <= rule.last; ++port ) clear_bit( port < 0x8000 ? bitmap_a : bitmap_b, port & 0x7FFF );
+        }
+    }
+
+    // what the cpu does with the bitmaps, used to check a built set against its policy
+    inline bool msr_exits( const UCHAR* msr_bitmap, ULONG msr, bool write )
+    {
+        if ( !msr_low( msr ) && !msr_high( msr ) ) return true;
+        return test_bit( msr_bitmap, msr_bit_offset( msr, write ) );
+    }
+
+    // a multi byte access exits if any port it touches is trapped, or if it wraps past 0xffff
+    inline bool io_exits( const UCHAR* bitmap_a, const UCHAR* bitmap_b, ULONG port, ULONG size )
+    {
+        if ( port + size - 1 > 0xFFFF ) return true;
+
+        for ( ULONG p = port; p < port + size; ++p )
+        {
+            if ( test_bit( p < 0x8000 ? bitmap_a : bitmap_b, p & 0x7FFF ) ) return true;
+        }
+
+        return false;
+    }
+
+    // policy catalog, selected per sandbox by HV_EXIT_POLICY_* id
+    namespace catalog
+    {
+        // state the guest owns anyway (segment bases, tsc aux, sysenter) plus the read only counters
+        constexpr msr_rule default_msrs[ ] =
+        {
+            { 0x00000010, 0x00000010, pass_read },   // ia32_time_stamp_counter
+            { 0x00000174, 0x00000176, pass_rw },     // ia32_sysenter_cs / esp / eip
+            { 0x000000E7, 0x000000E8, pass_read },   // ia32_mperf / aperf
+            { 0xC0000100, 0xC0000102, pass_rw },     // fs_base / gs_base / kernel_gs_base
+            { 0xC0000103, 0xC0000103, pass_rw },     // tsc_aux
+        };
+
+        constexpr port_rule default_ports[ ] =
+        {
+            { 0x80, 0x80 },                          // post code port, written on every boot stage
+        };
+
+        // every msr either window describes may be read, no writes
+        constexpr msr_rule msr_read_msrs[ ] =
+        {
+            { 0x00000000, 0x00001FFF, pass_read },
+            { 0xC0000000, 0xC0001FFF, pass_read },
+        };
+
+        constexpr policy default_policy{ "default", default_msrs, count_of( default_msrs ), default_ports, count_of( default_ports ) };
+        constexpr policy strict_policy{ "strict", nullptr, 0, nullptr, 0 };
+        constexpr policy msr_read_policy{ "msr-read", msr_read_msrs, count_of( msr_read_msrs ), nullptr, 0 };
+
+        static_assert( valid( default_policy ), "default exit policy has a rule outside the bitmap windows" );
+        static_assert( valid( msr_read_policy ), "msr-read exit policy has a rule outside the bitmap windows" );
+
+        // ids come from hv_ioctl.h / driver_interface.h
+        inline const policy* find( ULONG id )
+        {
+            switch ( id )
+            {
+            case HV_EXIT_POLICY_DEFAULT: return &default_policy;
+            case HV_EXIT_POLICY_STRICT: return &strict_policy;
+            case HV_EXIT_POLICY_MSR_READ: return &msr_read_policy;
+            default: return nullptr;
+            }
+        }
+
+        constexpr ULONG count = HV_EXIT_POLICY_COUNT;
+    }
+}
\ No newline at end of file
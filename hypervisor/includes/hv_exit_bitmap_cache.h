@@ -0,0 +1,41 @@
+#pragma once
+
+// Built exit bitmap sets, shared between every sandbox whose policy produces the same bytes. The cpu only
+// ever reads the bitmaps, so one set serves all vcpus of all those sandboxes. Not locked, the owner
+// (hv_sandbox_manager) calls in under its own lock.
+class hv_exit_bitmap_cache
+{
+public:
+    struct bitmap_set
+    {
+        ULONG   refs{ 0 };
+        ULONG   policy_id{ 0 };        // policy that built the set, others may share it
+        ULONG   crc{ 0 };              // crc32c over all three pages, cheap pre check before comparing bytes
+        PUCHAR  pages{ nullptr };      // msr bitmap, io bitmap a, io bitmap b
+        ULONG64 msr_physical{ 0 };
+        ULONG64 io_a_physical{ 0 };
+        ULONG64 io_b_physical{ 0 };
+    };
+
+    hv_exit_bitmap_cache( ) = default;
+    ~hv_exit_bitmap_cache( ) = default;
+
+    void shutdown( );
+
+    _IRQL_requires_max_( DISPATCH_LEVEL )
+    NTSTATUS acquire( _In_ ULONG policy_id, _Outptr_ const bitmap_set** out_set );
+
+    _IRQL_requires_max_( DISPATCH_LEVEL )
+    void release( _In_ const bitmap_set* set );
+
+    _Must_inspect_result_ ULONG get_set_count( ) const;
+
+private:
+    void free_set( _Inout_ bitmap_set& set );
+
+private:
+    static constexpr ULONG max_sets_ = 8;
+    static constexpr SIZE_T set_bytes_ = 3 * hv_exit_bitmap::bitmap_bytes;
+
+    bitmap_set sets_[ max_sets_ ] = {};
+};
\ No newline at end of file
@@ -0,0 +1,302 @@
+#pragma once
+
+// Software walk of guest paging, 4 or 5 level with 2M and 1G leaves, where every guest table and the final
+// data page are themselves reached through the sandbox ept. Like hv_ept_walk (which it builds on, include it
+// first) this is integer math over caller supplied accessors, so the host tools run the same walker and cache.
+
+namespace hv_gva_walk
+{
+    constexpr ULONG64 pte_present  = 1ULL << 0;
+    constexpr ULONG64 pte_write    = 1ULL << 1;
+    constexpr ULONG64 pte_user     = 1ULL << 2;
+    constexpr ULONG64 pte_large    = 1ULL << 7;
+    constexpr ULONG64 pte_nx       = 1ULL << 63;
+    constexpr ULONG64 pte_pfn_mask = 0x000FFFFFFFFFF000ULL;
+
+    // effective rights of a translation, what every level of the walk allows together
+    constexpr ULONG access_write   = 0x1;
+    constexpr ULONG access_user    = 0x2;
+    constexpr ULONG access_execute = 0x4;
+    constexpr ULONG access_all     = access_write | access_user | access_execute;
+
+    enum class status : ULONG
+    {
+        mapped        = 1,
+        not_present   = 2,  // a guest paging entry is not present
+        ept_fault     = 3,  // a guest table or the data page is not backed by the ept
+        non_canonical = 4,
+    };
+
+    // bits of virtual address the paging mode translates, 48 or 57
+    inline ULONG address_bits( ULONG levels )
+    {
+        return 12 + 9 * levels;
+    }
+
+    inline bool canonical( ULONG64 gva, ULONG levels )
+    {
+        const ULONG64 upper = gva >> ( address_bits( levels ) - 1 );
+        return upper == 0 || upper == ( ~0ULL >> ( address_bits( levels ) - 1 ) );
+    }
+
+    // bytes from gva to the end of the naturally aligned block of `size` it sits in, never overflows
+    inline ULONG64 bytes_to_boundary( ULONG64 gva, ULONG64 size )
+    {
+        return ( ( size - 1 ) - ( gva & ( size - 1 ) ) ) + 1;
+    }
+
+    struct translation
+    {
+        status  result{ status::not_present };
+        ULONG   access{ 0 };           // access_* bits, mapped only
+        ULONG64 gpa{ 0 };
+        ULONG64 hpa{ 0 };
+        ULONG64 span{ 0 };             // bytes from gva on that translate contiguously (or stay a hole)
+        ULONG64 guest_page_size{ 0 };
+        ULONG   table_reads{ 0 };      // guest paging entries read
+        ULONG   ept_walks{ 0 };        // gpa -> hpa resolutions, one per guest table reached plus the data page
+        bool    cache_hit{ false };    // the walk started below the root
+    };
+
+    // Paging structure cache in front of the walker. Per table level, direct mapped, it remembers which table
+    // a gva prefix leads to (already mapped through the ept) and the rights accumulated above it, so a hit on
+    // the pt level leaves a 4K translation with one guest read and one ept walk instead of levels + 1 of each.
+    // Valid for one cr3, paging mode and ept generation: reset() whenever the caller's key moves. All zero is
+    // a valid empty cache that matches nothing.
+    struct walk_cache
+    {
+        static constexpr ULONG slots_per_level = 64;
+        static constexpr ULONG max_levels      = 4;   // tables at level 1 (pt) up to 4 (pml4 under 5 level paging)
+
+        struct entry
+        {
+            ULONG64        tag;       // gva prefix + 1, 0 = empty
+            const ULONG64* table;
+            ULONG          access;
+        };
+
+        ULONG64 cr3;
+        ULONG64 ept_generation;
+        ULONG   levels;
+        ULONG   reserved;
+        ULONG64 hits;
+        ULONG64 misses;
+        ULONG64 flushes;
+        entry   entries[ max_levels ][ slots_per_level ];
+
+        bool matches( ULONG64 key_cr3, ULONG key_levels, ULONG64 key_generation ) const
+        {
+            return levels == key_levels && cr3 == key_cr3 && ept_generation == key_generation;
+        }
+
+        void reset( ULONG64 key_cr3, ULONG key_levels, ULONG64 key_generation )
+        {
+            for ( ULONG level = 0; level < max_levels; ++level )
+            {
+                for ( ULONG slot = 0; slot < slots_per_level; ++slot ) entries[ level ][ slot ].tag = 0;
+            }
+
+            cr3 = key_cr3;
+            levels = key_levels;
+            ept_generation = key_generation;
+            ++flushes;
+        }
+
+        // drops the key without touching the entries, the next matches() fails and the caller resets. For
+        // writes to guest memory, which may have rewritten the page tables the entries point at
+        void invalidate( ) { levels = 0; }
+
+        // deepest cached table on the path of gva, `level` receives the level of that table
+        bool lookup( ULONG64 gva, ULONG& level, const ULONG64*& table, ULONG& access )
+        {
+            for ( ULONG candidate = 1; candidate < levels; ++candidate )
+            {
+                const ULONG64 prefix = prefix_of( gva, candidate );
+                const entry& e = entries[ candidate - 1 ][ prefix % slots_per_level ];
+                if ( e.tag != prefix + 1 ) continue;
+
+                level = candidate;
+                table = e.table;
+                access = e.access;
+                ++hits;
+                return true;
+            }
+
+            ++misses;
+            return false;
+        }
+
+        void fill( ULONG64 gva, ULONG level, const ULONG64* table, ULONG access )
+        {
+            if ( level == 0 || level >= levels ) return;
+
+            const ULONG64 prefix = prefix_of( gva, level );
+            entry& e = entries[ level - 1 ][ prefix % slots_per_level ];
+            e.tag = prefix + 1;
+            e.table = table;
+            e.access = access;
+        }
+
+    private:
+        // the address bits above the ones a table at `level` indexes, within the paging width
+        ULONG64 prefix_of( ULONG64 gva, ULONG level ) const
+        {
+            const ULONG64 width_mask = ( 1ULL << address_bits( levels ) ) - 1;
+            return ( gva & width_mask ) >> address_bits( level );
+        }
+    };
+
+    // Translates gva under the paging root in cr3. map_table( gpa ) returns the host mapping of the 4K guest
+    // table at gpa or nullptr, to_hpa( gpa, ULONG64& hpa, ULONG64& span ) resolves a data address through the
+    // ept and tells how many bytes from gpa on stay host contiguous. cache may be null.
+    template < typename map_table_fn, typename to_hpa_fn >
+    void translate( ULONG64 cr3, ULONG levels, ULONG64 gva, walk_cache* cache, map_table_fn&& map_table, to_hpa_fn&& to_hpa, translation& out )
+    {
+        out = translation{ };
+
+        if ( !canonical( gva, levels ) )
+        {
+            // skip to the start of the upper half
+            out.result = status::non_canonical;
+            out.span = ( ~0ULL << ( address_bits( levels ) - 1 ) ) - gva;
+            return;
+        }
+
+        ULONG level = levels;
+        ULONG access = access_all;
+        const ULONG64* table = nullptr;
+
+        if ( cache && cache->lookup( gva, level, table, access ) )
+        {
+            out.cache_hit = true;
+        }
+        else
+        {
+            ++out.ept_walks;
+            table = map_table( cr3 & pte_pfn_mask );
+            if ( !table )
+            {
+                out.result = status::ept_fault;
+                out.span = bytes_to_boundary( gva, 1ULL << address_bits( levels ) );
+                return;
+            }
+        }
+
+        for ( ;; )
+        {
+            const ULONG64 entry = table[ hv_ept_walk::table_index( gva, level ) ];
+            const ULONG64 size = hv_ept_walk::level_page_size( level );
+            ++out.table_reads;
+
+            if ( !( entry & pte_present ) )
+            {
+                out.result = status::not_present;
+                out.span = bytes_to_boundary( gva, size );
+                return;
+            }
+
+            if ( !( entry & pte_write ) ) access &= ~access_write;
+            if ( !( entry & pte_user ) ) access &= ~access_user;
+            if ( entry & pte_nx ) access &= ~access_execute;
+
+            const bool leaf = level == 1 || ( level <= 3 && ( entry & pte_large ) );
+            if ( leaf )
+            {
+                out.guest_page_size = size;
+                out.gpa = ( entry & pte_pfn_mask & ~( size - 1 ) ) | ( gva & ( size - 1 ) );
+                out.access = access;
+
+                ULONG64 host_span = 0;
+                ++out.ept_walks;
+                if ( !to_hpa( out.gpa, out.hpa, host_span ) )
+                {
+                    out.result = status::ept_fault;
+                    out.span = bytes_to_boundary( gva, hv_ept_walk::page_4k );
+                    return;
+                }
+
+                const ULONG64 guest_span = bytes_to_boundary( gva, size );
+                out.result = status::mapped;
+                out.span = guest_span < host_span ? guest_span : host_span;
+                return;
+            }
+
+            ++out.ept_walks;
+            const ULONG64* next = map_table( entry & pte_pfn_mask );
+            if ( !next )
+            {
+                out.result = status::ept_fault;
+                out.span = bytes_to_boundary( gva, size );
+                return;
+            }
+
+            --level;
+            table = next;
+            if ( cache ) cache->fill( gva, level, table, access );
+        }
+    }
+
+    // one stretch of a translated range, consecutive translations that continue each other are merged
+    struct span_record
+    {
+        ULONG64 gva;
+        ULONG64 length;
+        ULONG64 gpa;
+        ULONG64 hpa;
+        status  result;
+        ULONG   access;
+    };
+
+    // true when `next` picks up exactly where `last` ends: same outcome and rights, and for mapped stretches
+    // both gpa and hpa contiguous
+    inline bool continues( const span_record& last, const span_record& next )
+    {
+        if ( last.result != next.result || last.access != next.access || last.gva + last.length != next.gva ) return false;
+        if ( last.result != status::mapped ) return true;
+        return last.gpa + last.length == next.gpa && last.hpa + last.length == next.hpa;
+    }
+
+    struct range_stats
+    {
+        ULONG64 translations;
+        ULONG64 cache_hits;
+        ULONG64 table_reads;
+        ULONG64 ept_walks;
+    };
+
+    // Translates [gva, end), end 0 meaning the top of the address space. Holes are skipped a whole missing
+    // table at a time. emit( const span_record& ) gets one record per translation and returns false when it
+    // cannot take it. Stops after max_steps translations and returns where to resume (end once done).
+    template < typename map_table_fn, typename to_hpa_fn, typename emit_fn >
+    ULONG64 translate_range( ULONG64 cr3, ULONG levels, ULONG64 gva, ULONG64 end, ULONG max_steps, walk_cache* cache,
+        map_table_fn&& map_table, to_hpa_fn&& to_hpa, emit_fn&& emit, range_stats& stats )
+    {
+        for ( ULONG step = 0; step < max_steps && gva != end; ++step )
+        {
+            translation t{};
+            translate( cr3, levels, gva, cache, map_table, to_hpa, t );
+
+            ++stats.translations;
+            stats.table_reads += t.table_reads;
+            stats.ept_walks += t.ept_walks;
+            if ( t.cache_hit ) ++stats.cache_hits;
+
+            const ULONG64 left = end - gva;
+            span_record record{ };
+            record.gva = gva;
+            record.length = t.span < left ? t.span : left;
+            record.result = t.result;
+            if ( t.result == status::mapped )
+            {
+                record.gpa = t.gpa;
+                record.hpa = t.hpa;
+                record.access = t.access;
+            }
+
+            if ( !emit( record ) ) break;
+            gva += record.length;
+        }
+
+        return gva;
+    }
+}
\ No newline at end of file
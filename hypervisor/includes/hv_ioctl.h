@@ -10,4 +10,272 @@
 #define IOCTL_HV_NOP         CTL_CODE(FILE_DEVICE_UNKNOWN, HV_IOCTL_BASE + 0, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define IOCTL_HV_QUERY_CAPS  CTL_CODE(FILE_DEVICE_UNKNOWN, HV_IOCTL_BASE + 1, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define IOCTL_HV_START       CTL_CODE(FILE_DEVICE_UNKNOWN, HV_IOCTL_BASE + 2, METHOD_BUFFERED, FILE_ANY_ACCESS)
-#define IOCTL_HV_STOP        CTL_CODE(FILE_DEVICE_UNKNOWN, HV_IOCTL_BASE + 3, METHOD_BUFFERED, FILE_ANY_ACCESS)
\ No newline at end of file
+#define IOCTL_HV_STOP        CTL_CODE(FILE_DEVICE_UNKNOWN, HV_IOCTL_BASE + 3, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_HV_SANDBOX_CREATE  CTL_CODE(FILE_DEVICE_UNKNOWN, HV_IOCTL_BASE + 10, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_HV_SANDBOX_DESTROY CTL_CODE(FILE_DEVICE_UNKNOWN, HV_IOCTL_BASE + 11, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_HV_SANDBOX_LIST    CTL_CODE(FILE_DEVICE_UNKNOWN, HV_IOCTL_BASE + 12, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// paged enumeration with full records, see hv_sandbox_manager::enumerate_sandboxes
+#define IOCTL_HV_SANDBOX_ENUM    CTL_CODE(FILE_DEVICE_UNKNOWN, HV_IOCTL_BASE + 13, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define HV_ENUM_CURSOR_END       0xFFFFFFFF
+#define HV_SANDBOX_MAX_VCPUS     64
+
+#define HV_SANDBOX_STATE_READY   1
+#define HV_SANDBOX_STATE_FAULTED 2  // guest memory access has failed at least once
+
+// bulk guest memory access, the data buffer is locked by the io manager and described by irp->MdlAddress.
+// A transfer that fails part way completes with STATUS_PARTIAL_COPY and the bytes moved until then
+#define IOCTL_HV_MEM_READ        CTL_CODE(FILE_DEVICE_UNKNOWN, HV_IOCTL_BASE + 20, METHOD_OUT_DIRECT, FILE_READ_ACCESS)
+#define IOCTL_HV_MEM_WRITE       CTL_CODE(FILE_DEVICE_UNKNOWN, HV_IOCTL_BASE + 21, METHOD_IN_DIRECT, FILE_WRITE_ACCESS)
+
+#define HV_MEM_MAX_SEGMENTS 256
+
+// integrity scan, see hv_sandbox_manager::scan_sandbox
+#define IOCTL_HV_SANDBOX_SCAN    CTL_CODE(FILE_DEVICE_UNKNOWN, HV_IOCTL_BASE + 22, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// exit policy of a sandbox, see hv_exit_bitmap::catalog
+#define HV_EXIT_POLICY_DEFAULT   0  // guest owned msr state and the post code port pass, the rest exits
+#define HV_EXIT_POLICY_STRICT    1  // every msr and port access exits
+#define HV_EXIT_POLICY_MSR_READ  2  // msr reads pass, msr writes and port accesses exit
+#define HV_EXIT_POLICY_COUNT     3
+
+// guest virtual translation, see hv_sandbox_manager::translate_guest_range
+#define IOCTL_HV_MEM_TRANSLATE   CTL_CODE(FILE_DEVICE_UNKNOWN, HV_IOCTL_BASE + 23, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+#define HV_GVA_LA57              0x1  // 5 level guest paging
+#define HV_GVA_NO_CACHE          0x2  // walk every address from the root, for comparison
+
+#define HV_GVA_MAPPED            1
+#define HV_GVA_NOT_PRESENT       2    // a guest paging entry is not present
+#define HV_GVA_EPT_FAULT         3    // a guest table or the data page is not backed by the ept
+#define HV_GVA_NON_CANONICAL     4
+
+#define HV_GVA_ACCESS_WRITE      0x1
+#define HV_GVA_ACCESS_USER       0x2
+#define HV_GVA_ACCESS_EXECUTE    0x4
+
+// page merger statistics, see hv_sandbox_manager::merge_pass
+#define IOCTL_HV_MERGE_QUERY     CTL_CODE(FILE_DEVICE_UNKNOWN, HV_IOCTL_BASE + 50, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// deferred sandbox teardown backlog, see hv_sandbox_manager::reclaim_pass
+#define IOCTL_HV_RECLAIM_QUERY   CTL_CODE(FILE_DEVICE_UNKNOWN, HV_IOCTL_BASE + 51, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define HV_SCAN_REBASELINE       0x1  // record the current digests, report nothing
+#define HV_SCAN_KEEP_BASELINE    0x2  // report changes but leave the baseline untouched
+
+// ioctl trace recording, see hv_trace
+#define IOCTL_HV_TRACE_CONTROL   CTL_CODE(FILE_DEVICE_UNKNOWN, HV_IOCTL_BASE + 30, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_HV_TRACE_DRAIN     CTL_CODE(FILE_DEVICE_UNKNOWN, HV_IOCTL_BASE + 31, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// sandbox lifecycle events, see hv_events
+#define IOCTL_HV_EVENT_WAIT      CTL_CODE(FILE_DEVICE_UNKNOWN, HV_IOCTL_BASE + 40, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define HV_EVENT_SANDBOX_CREATED    1
+#define HV_EVENT_SANDBOX_DESTROYED  2
+#define HV_EVENT_SANDBOX_FAULTED    3  // guest memory access failed to resolve through the ept, detail = gpa
+
+#define HV_EVENT_WAIT_POLL       0x1                      // never pend, an empty batch is a valid answer
+#define HV_EVENT_FROM_NOW        0xFFFFFFFFFFFFFFFFull    // after_sequence: skip everything already posted
+#define HV_EVENT_RING_CAPACITY   1024
+
+#define HV_TRACE_MAX_INPUT       256
+#define HV_TRACE_DEFAULT_BYTES   ( 1024 * 1024 )
+#define HV_TRACE_MAX_BYTES       ( 64 * 1024 * 1024 )
+#define HV_TRACE_OUTPUT_CRC      0x1  // output_crc holds the crc32c of the returned output bytes
+
+typedef struct _hv_sandbox_request
+{
+    ULONG id;
+} hv_sandbox_request;
+
+// longer form of the create input, fields past the end of a shorter input take their defaults
+// (HV_EXIT_POLICY_DEFAULT, one vcpu)
+typedef struct _hv_sandbox_create_request
+{
+    ULONG id;
+    ULONG exit_policy;
+    ULONG vcpu_count;
+} hv_sandbox_create_request;
+
+typedef struct _hv_sandbox_enum_request
+{
+    ULONG cursor;
+    ULONG reserved;
+} hv_sandbox_enum_request;
+
+// followed by record_count hv_sandbox_record
+typedef struct _hv_sandbox_enum_result
+{
+    ULONG record_count;
+    ULONG next_cursor;
+} hv_sandbox_enum_result;
+
+typedef struct _hv_sandbox_record
+{
+    ULONG   id;
+    ULONG   state;
+    ULONG64 created;
+    ULONG64 ept_pages;
+    ULONG64 ept_bytes;
+    ULONG64 guest_bytes;
+    ULONG   exit_policy;
+    ULONG   vcpu_count;
+    ULONG64 bytes_read;
+    ULONG64 bytes_written;
+    ULONG64 faults;
+    ULONG64 scans;
+    ULONG64 changed_pages;
+    ULONG64 shared_bytes;  // guest ram mapped from shared pages instead of private ones
+    ULONG64 cow_breaks;    // writes that had to unshare a page first
+} hv_sandbox_record;
+
+// saved_bytes is what all sandboxes together no longer allocate: mappings of shared pages minus the shared pages
+typedef struct _hv_merge_stats
+{
+    ULONG64 passes;
+    ULONG64 pages_scanned;
+    ULONG64 merges;
+    ULONG64 cow_breaks;
+    ULONG64 shared_pages;
+    ULONG64 shared_mappings;
+    ULONG64 saved_bytes;
+    ULONG64 last_pass_us;
+} hv_merge_stats;
+
+typedef struct _hv_reclaim_stats
+{
+    ULONG64 destroys;
+    ULONG64 inline_destroys;
+    ULONG64 pending_sandboxes;
+    ULONG64 pending_bytes;
+    ULONG64 reclaimed_sandboxes;
+    ULONG64 reclaimed_bytes;
+    ULONG64 batches;
+    ULONG64 longest_batch_us;
+    ULONG64 last_destroy_us;
+    ULONG64 longest_destroy_us;
+} hv_reclaim_stats;
+
+typedef struct _hv_mem_segment
+{
+    ULONG64 gpa;
+    ULONG64 length;
+} hv_mem_segment;
+
+// followed by segment_count hv_mem_segment entries, the data buffer holds the segments back to back
+typedef struct _hv_mem_request
+{
+    ULONG id;
+    ULONG segment_count;
+} hv_mem_request;
+
+typedef struct _hv_scan_request
+{
+    ULONG id;
+    ULONG flags;
+    ULONG start_page;
+} hv_scan_request;
+
+// followed by changed_count ULONG guest page numbers
+typedef struct _hv_scan_result
+{
+    ULONG guest_pages;
+    ULONG pages_scanned;
+    ULONG next_page;
+    ULONG changed_count;
+} hv_scan_result;
+
+// length 0 translates the single address gva. cr3 bits outside the page frame (pcid, pwt/pcd) are ignored
+typedef struct _hv_gva_request
+{
+    ULONG   id;
+    ULONG   flags;
+    ULONG64 cr3;
+    ULONG64 gva;
+    ULONG64 length;
+} hv_gva_request;
+
+// followed by record_count hv_gva_record. next_gva is where to resume when the records ran out, gva + length
+// (modulo 2^64) once the range is done. The counters cover this call only
+typedef struct _hv_gva_result
+{
+    ULONG   record_count;
+    ULONG   reserved;
+    ULONG64 next_gva;
+    ULONG64 translations;
+    ULONG64 cache_hits;
+    ULONG64 table_reads;
+    ULONG64 ept_walks;
+} hv_gva_result;
+
+typedef struct _hv_gva_record
+{
+    ULONG64 gva;
+    ULONG64 length;
+    ULONG64 gpa;
+    ULONG64 hpa;
+    ULONG   status;        // HV_GVA_MAPPED ...
+    ULONG   access;        // HV_GVA_ACCESS_*, mapped only
+} hv_gva_record;
+
+typedef struct _hv_trace_control
+{
+    ULONG enable;
+    ULONG buffer_bytes;
+} hv_trace_control;
+
+// followed by `bytes` of back to back hv_trace_record
+typedef struct _hv_trace_drain_result
+{
+    ULONG   record_count;
+    ULONG   bytes;
+    ULONG64 dropped;
+    ULONG   recording;
+    ULONG   pending_bytes;
+} hv_trace_drain_result;
+
+// followed by input_captured bytes of the request input, size is padded to 8
+typedef struct _hv_trace_record
+{
+    ULONG   size;
+    ULONG   io_control_code;
+    LONG    status;
+    ULONG   input_length;
+    ULONG   input_captured;
+    ULONG   output_length;
+    ULONG64 information;
+    ULONG64 timestamp_ns;
+    ULONG64 latency_ns;
+    ULONG   output_crc;
+    ULONG   flags;
+} hv_trace_record;
+
+typedef struct _hv_event_wait_request
+{
+    ULONG64 after_sequence;
+    ULONG   flags;
+    ULONG   reserved;
+} hv_event_wait_request;
+
+// followed by record_count hv_event_record. last_sequence is what the next wait passes as after_sequence,
+// lost counts events that fell out of the ring before this listener got to them
+typedef struct _hv_event_wait_result
+{
+    ULONG   record_count;
+    ULONG   reserved;
+    ULONG64 last_sequence;
+    ULONG64 lost;
+} hv_event_wait_result;
+
+typedef struct _hv_event_record
+{
+    ULONG64 sequence;
+    ULONG64 timestamp;     // system time, 100ns units
+    ULONG64 detail;
+    ULONG   type;
+    ULONG   sandbox_id;
+    LONG    status;
+    ULONG   reserved;
+} hv_event_record;
\ No newline at end of file
@@ -0,0 +1,153 @@
+#pragma once
+
+// Per-page digest for guest integrity scans. A 4KB page is cut into four 1KB lanes that each run
+// their own crc32c chain, so the crc32 instruction latency is hidden behind the other three lanes
+// (close to one qword per cycle instead of one per three). The lane crcs are folded into 64 bits.
+// This is not the crc32c of the page, a digest is only ever compared against another digest.
+//
+// crc32 works on general purpose registers only, the sse4.2 path needs no extended state save in
+// the kernel. The portable path produces the exact same digest through a lookup table and is what
+// non x64 builds (ARM64 driver, Win32 usermode) use. No kernel dependency beyond ULONG/ULONG64.
+
+#if defined( _M_X64 ) || defined( __x86_64__ )
+#define HV_PAGE_HASH_SSE42 1
+#if defined( _MSC_VER )
+#include <intrin.h>
+#define HV_PAGE_HASH_TARGET_SSE42
+#else
+#include <nmmintrin.h>
+#define HV_PAGE_HASH_TARGET_SSE42 __attribute__( ( target( "sse4.2" ) ) )
+#endif
+#else
+#define HV_PAGE_HASH_SSE42 0
+#endif
+
+namespace hv_page_hash
+{
+    constexpr ULONG page_bytes  = 4096;
+    constexpr ULONG lane_count  = 4;
+    constexpr ULONG lane_qwords = page_bytes / sizeof( ULONG64 ) / lane_count;
+
+    enum class engine : ULONG
+    {
+        portable,
+        sse42,
+    };
+
+    struct crc32c_table
+    {
+        ULONG entry[ 256 ];
+
+        constexpr crc32c_table( ) : entry( )
+        {
+            for ( ULONG i = 0; i < 256; ++i )
+            {
+                ULONG c = i;
+                for ( ULONG k = 0; k < 8; ++k ) c = ( c & 1 ) ? ( c >> 1 ) ^ 0x82F63B78u : ( c >> 1 );
+                entry[ i ] = c;
+            }
+        }
+    };
+
+    constexpr crc32c_table crc32c_lookup{ };
+
+    inline ULONG rotate16( ULONG v )
+    {
+        return ( v << 16 ) | ( v >> 16 );
+    }
+
+    inline ULONG64 fold( ULONG a, ULONG b, ULONG c, ULONG d )
+    {
+        return ( static_cast< ULONG64 >( a ^ rotate16( c ) ) << 32 ) | ( b ^ rotate16( d ) );
+    }
+
+    inline ULONG crc32c_qword_portable( ULONG crc, ULONG64 value )
+    {
+        for ( ULONG i = 0; i < 8; ++i )
+        {
+            crc = crc32c_lookup.entry[ ( crc ^ static_cast< ULONG >( value ) ) & 0xFF ] ^ ( crc >> 8 );
+            value >>= 8;
+        }
+        return crc;
+    }
+
+    inline ULONG64 digest_portable( const void* page )
+    {
+        const ULONG64* q = static_cast< const ULONG64* >( page );
+        ULONG crc[ lane_count ] = { 0xFFFFFFFFu, 0xFFFFFFFFu, 0xFFFFFFFFu, 0xFFFFFFFFu };
+
+        for ( ULONG i = 0; i < lane_qwords; ++i )
+        {
+            for ( ULONG lane = 0; lane < lane_count; ++lane )
+            {
+                crc[ lane ] = crc32c_qword_portable( crc[ lane ], q[ lane * lane_qwords + i ] );
+            }
+        }
+
+        return fold( ~crc[ 0 ], ~crc[ 1 ], ~crc[ 2 ], ~crc[ 3 ] );
+    }
+
+#if HV_PAGE_HASH_SSE42
+    HV_PAGE_HASH_TARGET_SSE42 inline ULONG64 digest_sse42( const void* page )
+    {
+        const ULONG64* l0 = static_cast< const ULONG64* >( page );
+        const ULONG64* l1 = l0 + lane_qwords;
+        const ULONG64* l2 = l1 + lane_qwords;
+        const ULONG64* l3 = l2 + lane_qwords;
+        ULONG64 c0 = 0xFFFFFFFFu, c1 = 0xFFFFFFFFu, c2 = 0xFFFFFFFFu, c3 = 0xFFFFFFFFu;
+
+        for ( ULONG i = 0; i < lane_qwords; ++i )
+        {
+            c0 = _mm_crc32_u64( c0, l0[ i ] );
+            c1 = _mm_crc32_u64( c1, l1[ i ] );
+            c2 = _mm_crc32_u64( c2, l2[ i ] );
+            c3 = _mm_crc32_u64( c3, l3[ i ] );
+        }
+
+        return fold( ~static_cast< ULONG >( c0 ), ~static_cast< ULONG >( c1 ), ~static_cast< ULONG >( c2 ), ~static_cast< ULONG >( c3 ) );
+    }
+#endif
+
+    // plain crc32c over an arbitrary buffer, for small payloads where the lane layout does not apply
+    inline ULONG crc32c_buffer( const void* data, SIZE_T length )
+    {
+        const unsigned char* bytes = static_cast< const unsigned char* >( data );
+        ULONG crc = 0xFFFFFFFFu;
+        for ( SIZE_T i = 0; i < length; ++i )
+        {
+            crc = crc32c_lookup.entry[ ( crc ^ bytes[ i ] ) & 0xFF ] ^ ( crc >> 8 );
+        }
+        return ~crc;
+    }
+
+    inline bool cpu_has_sse42( )
+    {
+#if HV_PAGE_HASH_SSE42 && defined( _MSC_VER )
+        int regs[ 4 ] = { 0 };
+        __cpuid( regs, 1 );
+        return ( regs[ 2 ] & ( 1 << 20 ) ) != 0; // ECX bit 20
+#elif HV_PAGE_HASH_SSE42
+        return __builtin_cpu_supports( "sse4.2" ) != 0;
+#else
+        return false;
+#endif
+    }
+
+    inline engine select_engine( )
+    {
+        return cpu_has_sse42( ) ? engine::sse42 : engine::portable;
+    }
+
+    inline const char* engine_name( engine e )
+    {
+        return e == engine::sse42 ? "sse4.2" : "portable";
+    }
+
+    inline ULONG64 digest( engine e, const void* page )
+    {
+#if HV_PAGE_HASH_SSE42
+        if ( e == engine::sse42 ) return digest_sse42( page );
+#endif
+        return digest_portable( page );
+    }
+}
\ No newline at end of file
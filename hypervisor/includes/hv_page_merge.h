@@ -0,0 +1,75 @@
+#pragma once
+
+// Bookkeeping of the page merger that does not touch kernel objects, shared with the host merge-sim so both
+// make the same decisions. Like hv_page_hash it only needs the ULONG/ULONG64 typedefs.
+//
+// A pass hashes every private guest page. A page is a merge candidate only when its digest did not move since
+// the previous pass (volatile pages would just be unshared again on the next write). A stable page is merged
+// into an existing shared page with the same bytes, or else into an earlier stable page of this pass with the
+// same digest, found in the candidate table (which is rebuilt every pass, so stale entries never outlive one).
+
+namespace hv_page_merge
+{
+    // digests stored for the stability check and in the table have the low bit forced on, 0 means none
+    inline ULONG64 tag_digest( ULONG64 digest )
+    {
+        return digest | 1;
+    }
+
+    struct candidate
+    {
+        ULONG64 digest;      // 0 = empty
+        ULONG   owner;       // whatever identifies the page holder, a sandbox slot in the driver
+        ULONG   owner_id;    // second check that the holder is still the same one
+        ULONG   page;        // guest page number
+        ULONG   reserved;
+    };
+
+    // Open addressing over a caller supplied array of `capacity` entries (a power of two), short probe runs.
+    // A full neighbourhood just drops the insert, the page gets another chance next pass.
+    class candidate_table
+    {
+    public:
+        candidate_table( candidate* slots, ULONG capacity ) : slots_( slots ), mask_( capacity - 1 ) { }
+
+        void clear( )
+        {
+            for ( ULONG i = 0; i <= mask_; ++i ) slots_[ i ] = candidate{ };
+        }
+
+        candidate* find( ULONG64 digest ) const
+        {
+            for ( ULONG probe = 0; probe < max_probe_; ++probe )
+            {
+                candidate& c = slots_[ ( static_cast< ULONG >( digest >> 1 ) + probe ) & mask_ ];
+                if ( c.digest == digest ) return &c;
+                if ( c.digest == 0 ) return nullptr;
+            }
+
+            return nullptr;
+        }
+
+        bool insert( ULONG64 digest, ULONG owner, ULONG owner_id, ULONG page )
+        {
+            for ( ULONG probe = 0; probe < max_probe_; ++probe )
+            {
+                candidate& c = slots_[ ( static_cast< ULONG >( digest >> 1 ) + probe ) & mask_ ];
+                if ( c.digest != 0 && c.digest != digest ) continue;
+
+                c.digest = digest;
+                c.owner = owner;
+                c.owner_id = owner_id;
+                c.page = page;
+                return true;
+            }
+
+            return false;
+        }
+
+    private:
+        static constexpr ULONG max_probe_ = 16;
+
+        candidate* slots_;
+        ULONG      mask_;
+    };
+}
\ No newline at end of file
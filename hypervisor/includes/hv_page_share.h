@@ -0,0 +1,53 @@
+#pragma once
+
+// Read only guest pages shared between sandboxes by the page merger (see hv_sandbox_manager::merge_pass).
+// Each shared page is one former private guest page that every merged mapping points at, refcounted per
+// mapping and freed with the last one. Looked up by digest when merging and by host physical address when a
+// mapping goes away. Not locked, the owner (hv_sandbox_manager) calls in under its own lock.
+class hv_page_share
+{
+public:
+    struct shared_page
+    {
+        shared_page* next_by_digest{ nullptr };
+        shared_page* next_by_hpa{ nullptr };
+        ULONG64      digest{ 0 };
+        ULONG64      hpa{ 0 };
+        void*        page{ nullptr };
+        ULONG        refs{ 0 };
+    };
+
+    hv_page_share( ) = default;
+    ~hv_page_share( ) = default;
+
+    void shutdown( );
+
+    // shared page holding exactly the bytes of `content`, the digest only narrows the search
+    _IRQL_requires_max_( DISPATCH_LEVEL )
+    _Must_inspect_result_ const shared_page* find( _In_ ULONG64 digest, _In_ const void* content ) const;
+
+    // takes ownership of a guest page (hv_ept::give_page) as a new shared page with one reference.
+    // nullptr when out of memory, the page then still belongs to the caller
+    _IRQL_requires_max_( DISPATCH_LEVEL )
+    _Must_inspect_result_ const shared_page* adopt( _In_ ULONG64 digest, _In_ void* page, _In_ ULONG64 hpa );
+
+    _IRQL_requires_max_( DISPATCH_LEVEL )
+    void acquire( _In_ const shared_page* shared );
+
+    _IRQL_requires_max_( DISPATCH_LEVEL )
+    void release( _In_ ULONG64 hpa );
+
+    ULONG64 get_page_count( ) const { return page_count_; }
+    ULONG64 get_ref_count( ) const { return ref_count_; }
+
+private:
+    static ULONG bucket_of( _In_ ULONG64 key ) { return static_cast< ULONG >( ( key ^ ( key >> 17 ) ^ ( key >> 31 ) ) % bucket_count_ ); }
+
+private:
+    static constexpr ULONG bucket_count_ = 1024;
+
+    shared_page* by_digest_[ bucket_count_ ] = {};
+    shared_page* by_hpa_[ bucket_count_ ] = {};
+    ULONG64      page_count_{ 0 };
+    ULONG64      ref_count_{ 0 };
+};
\ No newline at end of file
@@ -9,11 +9,47 @@ public:
     NTSTATUS initialize( );
     void     shutdown( );
 
-    NTSTATUS create_sandbox( _In_ ULONG id );
+    NTSTATUS create_sandbox( _In_ ULONG id, _In_ ULONG exit_policy = HV_EXIT_POLICY_DEFAULT, _In_ ULONG vcpu_count = 1 );
     NTSTATUS destroy_sandbox( _In_ ULONG id );
 
     NTSTATUS list_sandboxes( _Out_writes_opt_( max_ids ) ULONG* out_ids, _In_ ULONG max_ids, _Out_opt_ ULONG* out_count ) const;
 
+    // Fills records for active sandboxes in slot order from `cursor` on. The cursor is a slot index, an entry
+    // alive for the whole enumeration is returned exactly once no matter what is created or destroyed in
+    // between. The lock is dropped every enum_chunk_slots_ slots
+    _IRQL_requires_max_( DISPATCH_LEVEL )
+    NTSTATUS enumerate_sandboxes( _In_ ULONG cursor, _Out_writes_( max_records ) hv_sandbox_record* records, _In_ ULONG max_records, _Out_ ULONG* out_count, _Out_ ULONG* out_next_cursor ) const;
+
+    // copies between `buffer` and guest ram of sandbox `id`, one ept run at a time so the lock is never held
+    // for more than max_copy_chunk_ bytes. out_copied receives the bytes moved even on failure
+    _IRQL_requires_max_( DISPATCH_LEVEL )
+    NTSTATUS copy_guest_memory( _In_ ULONG id, _In_ ULONG64 gpa, _Inout_updates_bytes_( length ) void* buffer, _In_ ULONG64 length, _In_ BOOLEAN write, _Out_ ULONG64* out_copied );
+
+    // Hashes guest pages of sandbox `id` from start_page on and reports the ones whose digest moved since the
+    // previous scan. The first scan of a sandbox only records the baseline. Stops once changed_pages is full,
+    // result->next_page tells where to resume
+    _IRQL_requires_max_( DISPATCH_LEVEL )
+    NTSTATUS scan_sandbox( _In_ ULONG id, _In_ ULONG flags, _In_ ULONG start_page, _Out_writes_( max_changed ) ULONG* changed_pages, _In_ ULONG max_changed, _Out_ hv_scan_result* result );
+
+    // Translates [gva, gva + length) of sandbox `id` under the guest paging root cr3 into gva -> gpa -> hpa
+    // records, contiguous stretches and holes merged. The sandbox walk cache carries upper level results between
+    // calls and is dropped on a different cr3 / paging mode or an ept change. The lock is dropped every
+    // translate_chunk_steps_ translations
+    _IRQL_requires_max_( DISPATCH_LEVEL )
+    NTSTATUS translate_guest_range( _In_ ULONG id, _In_ ULONG flags, _In_ ULONG64 cr3, _In_ ULONG64 gva, _In_ ULONG64 length, _Out_writes_( max_records ) hv_gva_record* records, _In_ ULONG max_records, _Out_ hv_gva_result* result );
+
+    _IRQL_requires_max_( DISPATCH_LEVEL )
+    void query_merge_stats( _Out_ hv_merge_stats* out ) const;
+
+    _IRQL_requires_max_( DISPATCH_LEVEL )
+    void query_reclaim_stats( _Out_ hv_reclaim_stats* out ) const;
+
+    // What a per processor vcpu loop calls before resuming `v` (as returned by hv_scheduler::switch_next) on
+    // `cpu`: the single context invalidations to issue first, see hv_vpid. Whatever else that processor has
+    // cached for other vcpus survives the switch
+    _IRQL_requires_max_( DISPATCH_LEVEL )
+    NTSTATUS prepare_vcpu_entry( _In_ ULONG cpu, _In_ const hv_sched::vcpu* v, _Out_ hv_vpid::entry_plan* plan );
+
     _Must_inspect_result_ ULONG get_active_count( ) const;
 
 private:
@@ -23,8 +59,72 @@ private:
         ULONG          id{ 0 };
         hv_ept         ept;
         LARGE_INTEGER  created{};
+        ULONG64*       page_digests{ nullptr };  // scan baseline, one per guest page, 0 = not recorded yet
+        ULONG          exit_policy{ HV_EXIT_POLICY_DEFAULT };
+        const hv_exit_bitmap_cache::bitmap_set* exit_bitmaps{ nullptr };  // shared, what every vcpu vmcs points at
+        hv_sched::vcpu* vcpus{ nullptr };     // owned here, queued on hv_scheduler
+        ULONG          vcpu_count{ 0 };
+        hv_gva_walk::walk_cache* walk_cache{ nullptr };  // allocated on the first translation
+        ULONG64        bytes_read{ 0 };
+        ULONG64        bytes_written{ 0 };
+        ULONG64        faults{ 0 };
+        ULONG64        scans{ 0 };
+        ULONG64        changed_pages{ 0 };
+        ULONG64*       merge_digests{ nullptr };  // digest per guest page from the previous merge pass
+        ULONG64        cow_breaks{ 0 };
+    };
+
+    // a destroyed sandbox's ept and guest ram waiting for the reclaim thread
+    struct retired_sandbox
+    {
+        retired_sandbox* next{ nullptr };
+        ULONG            id{ 0 };
+        hv_ept           ept;
+        ULONG64          next_page{ 0 };
     };
 
+    // Fills the free slot `entry` with sandbox `id` around `ept`, which is moved in on success and left with
+    // the caller on failure. Called with the lock held
+    _IRQL_requires_max_( DISPATCH_LEVEL )
+    NTSTATUS install_entry( _Inout_ sandbox_entry& entry, _In_ ULONG id, _In_ ULONG exit_policy, _In_ ULONG vcpu_count, _Inout_ hv_ept& ept );
+
+    // Unpublishes the entry: vcpus, vpids and the small per sandbox buffers go right away, the ept and guest
+    // ram are queued on `retired` (owned from here on) for the reclaim thread. Without a record, or once the
+    // thread is stopping, everything is torn down in place
+    _IRQL_requires_max_( DISPATCH_LEVEL )
+    void release_entry( _Inout_ sandbox_entry& entry, _In_opt_ retired_sandbox* retired );
+
+    _IRQL_requires_max_( DISPATCH_LEVEL )
+    void release_shared_pages( _Inout_ hv_ept& ept, _In_ ULONG64 first_page, _In_ ULONG64 page_count );
+
+    static retired_sandbox* allocate_retired( );
+
+    // what a vm exit handler calls on an ept violation. Resolves a write to a merged page by unsharing it,
+    // anything else is a real fault
+    _IRQL_requires_max_( DISPATCH_LEVEL )
+    NTSTATUS handle_ept_violation( _Inout_ sandbox_entry& entry, _In_ ULONG64 gpa, _In_ ULONG64 access );
+
+    // Background page merging: a system thread runs merge_pass() every merge_interval_ms_. A pass walks every
+    // sandbox in chunks of merge_chunk_pages_ under the lock, see hv_page_merge for when a page is merged
+    NTSTATUS start_merge_service( );
+    void     stop_merge_service( );
+    static VOID merge_thread( _In_ PVOID context );
+
+    _IRQL_requires_max_( PASSIVE_LEVEL )
+    void merge_pass( );
+
+    _IRQL_requires_max_( DISPATCH_LEVEL )
+    void merge_page( _Inout_ sandbox_entry& entry, _In_ ULONG slot, _In_ ULONG page, _Inout_ hv_page_merge::candidate_table& candidates );
+
+    // Deferred teardown: a system thread woken by every destroy runs reclaim_pass(), which frees the queued
+    // sandboxes reclaim_chunk_pages_ at a time. Stopping drains the queue first
+    NTSTATUS start_reclaim_service( );
+    void     stop_reclaim_service( );
+    static VOID reclaim_thread( _In_ PVOID context );
+
+    _IRQL_requires_max_( PASSIVE_LEVEL )
+    void reclaim_pass( );
+
     _IRQL_requires_max_( DISPATCH_LEVEL ) 
     _Must_inspect_result_ LONG find_entry_by_id( _In_ ULONG id ) const;
 
@@ -33,7 +133,30 @@ private:
 
 private:
     static constexpr ULONG max_sandboxes_ = 16;
+    static constexpr ULONG64 max_copy_chunk_ = 64 * 1024;
+    static constexpr ULONG scan_chunk_pages_ = 64;
+    static constexpr ULONG enum_chunk_slots_ = 8;
+    static constexpr ULONG translate_chunk_steps_ = 256;
+    static constexpr ULONG merge_chunk_pages_ = 64;
+    static constexpr ULONG merge_interval_ms_ = 1000;
+    static constexpr ULONG merge_candidate_slots_ = 16384;   // every page of max_sandboxes_ default sized guests
+    static constexpr ULONG reclaim_chunk_pages_ = 256;
 
     mutable KSPIN_LOCK lock_{};
+    hv_page_hash::engine hash_engine_{ hv_page_hash::engine::portable };
+    hv_exit_bitmap_cache exit_bitmaps_;
+    hv_scheduler       scheduler_;
+    hv_vpid_pool       vpids_;
+    hv_page_share      page_share_;
+    hv_page_merge::candidate* merge_candidates_{ nullptr };
+    PKTHREAD           merge_thread_{ nullptr };
+    KEVENT             merge_stop_{};
+    hv_merge_stats     merge_stats_{};
+    retired_sandbox*   reclaim_head_{ nullptr };
+    retired_sandbox*   reclaim_tail_{ nullptr };
+    PKTHREAD           reclaim_thread_{ nullptr };
+    KEVENT             reclaim_wake_{};
+    BOOLEAN            reclaim_stop_{ FALSE };
+    hv_reclaim_stats   reclaim_stats_{};
     sandbox_entry      entries_[ max_sandboxes_ ] = {};
 };
\ No newline at end of file
@@ -0,0 +1,231 @@
+#pragma once
+
+// vcpu scheduling core shared by hv_scheduler (kernel) and the usermode sched-sim. Every logical
+// processor owns a fifo run queue of vcpus. A processor that runs dry steals from the busiest other
+// processor, preferring its own numa node and only crossing nodes when the victim has a backlog. A
+// vcpu runs for one slice, bounded by the vmx preemption timer, then goes to the back of its queue.
+// No locking in here, hv_scheduler holds the queue locks around these calls. No kernel dependency
+// beyond ULONG/ULONG64/LONG.
+
+namespace hv_sched
+{
+    enum class vcpu_state : ULONG
+    {
+        parked,
+        queued,
+        running,
+    };
+
+    struct vcpu
+    {
+        vcpu*      prev{ nullptr };
+        vcpu*      next{ nullptr };
+        ULONG      sandbox_id{ 0 };
+        ULONG      index{ 0 };
+        ULONG      cpu{ 0 };              // queue it is on / processor it runs on / ran on last
+        ULONG      home_node{ 0 };        // node the sandbox was placed on
+        ULONG      vpid{ 0 };             // tags its tlb entries, from hv_vpid_pool
+        vcpu_state state{ vcpu_state::parked };
+        ULONG64    slices{ 0 };
+        ULONG64    migrations{ 0 };
+        ULONG64    node_migrations{ 0 };
+    };
+
+    struct run_queue
+    {
+        vcpu* head{ nullptr };
+        vcpu* tail{ nullptr };
+        ULONG count{ 0 };
+
+        void push_tail( vcpu* v )
+        {
+            v->next = nullptr;
+            v->prev = tail;
+            if ( tail ) tail->next = v;
+            else head = v;
+            tail = v;
+            ++count;
+        }
+
+        void unlink( vcpu* v )
+        {
+            if ( v->prev ) v->prev->next = v->next;
+            else head = v->next;
+            if ( v->next ) v->next->prev = v->prev;
+            else tail = v->prev;
+            v->prev = v->next = nullptr;
+            --count;
+        }
+
+        vcpu* pop_head( )
+        {
+            vcpu* v = head;
+            if ( v ) unlink( v );
+            return v;
+        }
+
+        // thieves take from the tail, the vcpu that would otherwise wait longest and the one the owner
+        // touches last
+        vcpu* pop_tail( )
+        {
+            vcpu* v = tail;
+            if ( v ) unlink( v );
+            return v;
+        }
+    };
+
+    struct cpu_slot
+    {
+        run_queue queue;
+        vcpu*     current{ nullptr };
+        ULONG     node{ 0 };
+        ULONG64   switches{ 0 };
+        ULONG64   steals{ 0 };
+        ULONG64   idle_picks{ 0 };
+    };
+
+    inline ULONG load_of( const cpu_slot& slot )
+    {
+        return slot.queue.count + ( slot.current ? 1 : 0 );
+    }
+
+    // slot_at( i ) -> cpu_slot&. Node whose processors carry the least load per processor, where a new
+    // sandbox keeps all of its vcpus (and, on a real numa box, its guest ram)
+    template < class SlotAt >
+    ULONG pick_node( SlotAt slot_at, ULONG cpu_count, ULONG node_count )
+    {
+        ULONG best = 0;
+        ULONG64 best_load = ~0ULL;
+
+        for ( ULONG node = 0; node < node_count; ++node )
+        {
+            ULONG64 load = 0;
+            ULONG cpus = 0;
+            for ( ULONG cpu = 0; cpu < cpu_count; ++cpu )
+            {
+                if ( slot_at( cpu ).node != node ) continue;
+                load += load_of( slot_at( cpu ) );
+                ++cpus;
+            }
+
+            if ( cpus == 0 ) continue;
+
+            // compare load / cpus without dividing, scaled so nodes of different sizes compare fairly
+            const ULONG64 scaled = ( load << 16 ) / cpus;
+            if ( scaled < best_load )
+            {
+                best_load = scaled;
+                best = node;
+            }
+        }
+
+        return best;
+    }
+
+    template < class SlotAt >
+    ULONG pick_cpu( SlotAt slot_at, ULONG cpu_count, ULONG node )
+    {
+        ULONG best = 0;
+        ULONG best_load = ~0u;
+
+        for ( ULONG cpu = 0; cpu < cpu_count; ++cpu )
+        {
+            if ( slot_at( cpu ).node != node ) continue;
+            const ULONG load = load_of( slot_at( cpu ) );
+            if ( load < best_load )
+            {
+                best_load = load;
+                best = cpu;
+            }
+        }
+
+        return best;
+    }
+
+    // where a vcpu coming back from a halt queues: its last processor, unless a steal left it on a foreign
+    // node, then the least loaded processor of its home node
+    template < class SlotAt >
+    ULONG wake_cpu( SlotAt slot_at, ULONG cpu_count, const vcpu& v, bool numa_aware )
+    {
+        if ( !numa_aware || slot_at( v.cpu ).node == v.home_node ) return v.cpu;
+        return pick_cpu( slot_at, cpu_count, v.home_node );
+    }
+
+    // busiest processor with queued work on the thief's node, otherwise the busiest remote one with at
+    // least two queued (one waiting vcpu is not worth pulling away from its memory). -1 if none
+    template < class SlotAt >
+    LONG pick_victim( SlotAt slot_at, ULONG cpu_count, ULONG thief, bool numa_aware )
+    {
+        const ULONG thief_node = slot_at( thief ).node;
+        LONG local = -1, remote = -1;
+        ULONG local_count = 0, remote_count = 0;
+
+        for ( ULONG cpu = 0; cpu < cpu_count; ++cpu )
+        {
+            if ( cpu == thief ) continue;
+            const ULONG queued = slot_at( cpu ).queue.count;
+            if ( queued == 0 ) continue;
+
+            if ( !numa_aware || slot_at( cpu ).node == thief_node )
+            {
+                if ( queued > local_count )
+                {
+                    local_count = queued;
+                    local = static_cast< LONG >( cpu );
+                }
+            }
+            else if ( queued > remote_count )
+            {
+                remote_count = queued;
+                remote = static_cast< LONG >( cpu );
+            }
+        }
+
+        if ( local >= 0 ) return local;
+        return remote_count >= 2 ? remote : -1;
+    }
+
+    // moves the tail of victim's queue onto thief as its current vcpu, both slots must be held
+    inline vcpu* steal( cpu_slot& victim, cpu_slot& thief, ULONG thief_cpu )
+    {
+        vcpu* v = victim.queue.pop_tail( );
+        if ( !v ) return nullptr;
+
+        if ( victim.node != thief.node ) ++v->node_migrations;
+        ++v->migrations;
+        ++thief.steals;
+        v->cpu = thief_cpu;
+        return v;
+    }
+
+    // requeues the running vcpu (if any) and makes the head of the local queue current
+    inline vcpu* rotate( cpu_slot& slot )
+    {
+        if ( slot.current )
+        {
+            slot.current->state = vcpu_state::queued;
+            slot.queue.push_tail( slot.current );
+            slot.current = nullptr;
+        }
+
+        vcpu* v = slot.queue.pop_head( );
+        if ( v ) slot.current = v;
+        return v;
+    }
+
+    inline void start( cpu_slot& slot, vcpu* v )
+    {
+        v->state = vcpu_state::running;
+        ++v->slices;
+        ++slot.switches;
+        slot.current = v;
+    }
+
+    // vmx preemption timer counts down at tsc >> IA32_VMX_MISC[4:0], the vmcs field is 32 bits
+    inline ULONG preemption_timer_value( ULONG64 slice_tsc, ULONG64 vmx_misc )
+    {
+        const ULONG64 value = slice_tsc >> ( vmx_misc & 0x1F );
+        if ( value == 0 ) return 1;
+        return value > 0xFFFFFFFFULL ? 0xFFFFFFFFu : static_cast< ULONG >( value );
+    }
+}
\ No newline at end of file
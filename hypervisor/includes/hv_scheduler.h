@@ -0,0 +1,60 @@
+#pragma once
+
+// Places sandbox vcpus on logical processors and hands each processor its next vcpu, see hv_sched for
+// the policy. One run queue and spinlock per processor, a steal takes both locks in processor order.
+// Like hv_ept this is bookkeeping only for now: a per processor vcpu loop calls switch_next() on every
+// preemption timer exit and resumes the returned vcpu with get_preemption_timer_value() as its slice.
+class hv_scheduler
+{
+public:
+    hv_scheduler( ) = default;
+    ~hv_scheduler( ) = default;
+
+    NTSTATUS initialize( );
+    void     shutdown( );
+
+    // all vcpus of a sandbox go to the least loaded numa node, each onto its least loaded processor
+    _IRQL_requires_max_( DISPATCH_LEVEL )
+    void add_vcpus( _Inout_updates_( count ) hv_sched::vcpu* vcpus, _In_ ULONG count );
+
+    // takes the vcpus off whatever queue or processor they are on, afterwards the array may be freed
+    _IRQL_requires_max_( DISPATCH_LEVEL )
+    void remove_vcpus( _Inout_updates_( count ) hv_sched::vcpu* vcpus, _In_ ULONG count );
+
+    // runs on processor `cpu` when its current slice ends: requeues the current vcpu and returns the next
+    // one, stealing when the local queue is empty. nullptr means idle
+    _IRQL_requires_max_( DISPATCH_LEVEL )
+    hv_sched::vcpu* switch_next( _In_ ULONG cpu );
+
+    // hlt style exit on `cpu`: its current vcpu stops being runnable until wake_vcpu()
+    _IRQL_requires_max_( DISPATCH_LEVEL )
+    void park_current( _In_ ULONG cpu );
+
+    // queues a parked vcpu again, back on its home node if a steal had moved it away. v->cpu and v->state are
+    // read under that processor's lock, so a concurrent park or steal is seen consistently. Callers still
+    // serialize this against remove_vcpus() and keep the array alive (the sandbox registry lock does)
+    _IRQL_requires_max_( DISPATCH_LEVEL )
+    void wake_vcpu( _Inout_ hv_sched::vcpu* v );
+
+    ULONG get_processor_count( ) const { return processor_count_; }
+    ULONG get_node_count( ) const { return node_count_; }
+    ULONG get_preemption_timer_value( ) const { return preemption_timer_value_; }
+
+private:
+    struct per_cpu
+    {
+        KSPIN_LOCK         lock;
+        hv_sched::cpu_slot slot;
+    };
+
+    ULONG node_of( _In_ ULONG cpu_index ) const;
+
+private:
+    // ~1ms at 2GHz, converted to preemption timer ticks with the IA32_VMX_MISC rate
+    static constexpr ULONG64 slice_tsc_ = 2000000;
+
+    per_cpu* cpus_{ nullptr };
+    ULONG    processor_count_{ 0 };
+    ULONG    node_count_{ 1 };
+    ULONG    preemption_timer_value_{ 0 };
+};
\ No newline at end of file
@@ -0,0 +1,52 @@
+#pragma once
+
+// Records every dispatched ioctl (code, captured input, status, latency) into a nonpaged ring that
+// user mode drains with IOCTL_HV_TRACE_DRAIN. A full ring drops new records instead of overwriting
+// old ones, so a drained trace is always a gap free prefix and `dropped` tells how much is missing.
+class hv_trace
+{
+public:
+    struct capture
+    {
+        ULONG   io_control_code{ 0 };
+        ULONG   input_length{ 0 };
+        ULONG   input_captured{ 0 };
+        ULONG   output_length{ 0 };
+        ULONG64 started_ns{ 0 };
+        UCHAR   input[ HV_TRACE_MAX_INPUT ];
+    };
+
+    static void initialize( );
+    static void shutdown( );
+
+    _IRQL_requires_max_( APC_LEVEL )
+    static NTSTATUS start( _In_ ULONG buffer_bytes );
+    static void stop( );
+
+    static bool is_recording( ) { return recording_ != 0; }
+
+    // begin() must run before the handler, METHOD_BUFFERED output overwrites the input in the system buffer
+    static void begin( _Out_ capture& c, _In_ PIRP irp, _In_ PIO_STACK_LOCATION stack );
+    static void end( _In_ const capture& c, _In_ PIRP irp, _In_ NTSTATUS status, _In_ ULONG_PTR information );
+
+    _IRQL_requires_max_( DISPATCH_LEVEL )
+    static NTSTATUS drain( _Out_writes_bytes_( out_len ) void* out, _In_ ULONG out_len, _Out_ ULONG_PTR* information );
+
+private:
+    static ULONG64 now_ns( );
+
+    _IRQL_requires_( DISPATCH_LEVEL )
+    static void append( _In_ const hv_trace_record& record, _In_reads_bytes_( input_bytes ) const void* input, _In_ ULONG input_bytes );
+
+private:
+    static KSPIN_LOCK     lock_;
+    static PUCHAR         ring_;
+    static ULONG          ring_size_;
+    static ULONG          head_;
+    static ULONG          tail_;
+    static ULONG          used_;
+    static ULONG64        dropped_;
+    static ULONG64        started_ns_;
+    static LARGE_INTEGER  frequency_;
+    static volatile LONG  recording_;
+};
\ No newline at end of file
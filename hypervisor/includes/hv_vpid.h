@@ -0,0 +1,220 @@
+#pragma once
+
+// VPID allocation and per processor tlb tag tracking, shared by hv_vpid_pool (kernel) and the usermode
+// vpid-bench. Like hv_sched there is no locking in here and no kernel dependency beyond ULONG/ULONG64.
+//
+// Every vcpu gets its own vpid, so switching between vcpus of different sandboxes never needs a full tlb
+// flush. Each processor remembers the epoch it last ran every vpid at and the version it last entered its
+// recent eptps at, and may only hold tagged translations for what it remembers. Entering a vpid or eptp at
+// an older epoch / version (the vpid was recycled, the ept changed under it) invalidates just that tag on
+// just that processor. An eptp that falls out of the table is invalidated right away. Entering a context
+// the processor never ran costs nothing.
+
+namespace hv_vpid
+{
+    constexpr ULONG invalid_vpid = 0;    // vpid 0 tags the host
+
+    // free vpids a processor keeps for itself, so allocate rarely touches the shared bitmap. Only refill()
+    // fills it, released vpids go back to the bitmap (see allocator::retire)
+    struct cpu_cache
+    {
+        static constexpr ULONG capacity = 16;
+        static constexpr ULONG batch    = capacity / 2;   // what one refill / spill moves
+
+        ULONG count;
+        ULONG vpids[ capacity ];
+
+        bool pop( ULONG& vpid )
+        {
+            if ( count == 0 ) return false;
+            vpid = vpids[ --count ];
+            return true;
+        }
+
+        bool push( ULONG vpid )
+        {
+            if ( count == capacity ) return false;
+            vpids[ count++ ] = vpid;
+            return true;
+        }
+    };
+
+    // The shared pool behind the caches: a bitmap of free vpids (bit set = free) and an epoch per vpid that
+    // moves every time the vpid is retired. refill() and spill() are the only calls touching the bitmap, the
+    // caller serializes just those. Storage is the caller's, bitmap_words( vpid_count ) words and vpid_count
+    // epochs. All zero is a valid pool with no vpids until attach()
+    class allocator
+    {
+    public:
+        static ULONG bitmap_words( ULONG vpid_count ) { return ( vpid_count + 63 ) / 64; }
+
+        // every vpid but 0 free, epochs back to 0
+        void attach( ULONG vpid_count, ULONG64* bitmap, ULONG* epochs )
+        {
+            vpid_count_ = vpid_count;
+            bitmap_ = bitmap;
+            epochs_ = epochs;
+            next_word_ = 0;
+            free_count_ = 0;
+
+            for ( ULONG word = 0; word < bitmap_words( vpid_count ); ++word ) bitmap_[ word ] = 0;
+            for ( ULONG vpid = 0; vpid < vpid_count; ++vpid ) epochs_[ vpid ] = 0;
+            for ( ULONG vpid = 1; vpid < vpid_count; ++vpid ) give_back( vpid );
+        }
+
+        // moves up to `wanted` free vpids into the cache, returns how many it found
+        ULONG refill( cpu_cache& cache, ULONG wanted )
+        {
+            const ULONG words = bitmap_words( vpid_count_ );
+            ULONG moved = 0;
+
+            // resume where the last refill stopped, recently released vpids get a rest before reuse
+            for ( ULONG scanned = 0; scanned < words && moved < wanted && cache.count < cpu_cache::capacity; ++scanned )
+            {
+                ULONG64& bits = bitmap_[ next_word_ ];
+                while ( bits && moved < wanted && cache.count < cpu_cache::capacity )
+                {
+                    const ULONG bit = lowest_bit( bits );
+                    bits &= bits - 1;
+                    cache.push( next_word_ * 64 + bit );
+                    --free_count_;
+                    ++moved;
+                }
+
+                if ( !bits ) next_word_ = ( next_word_ + 1 ) % words;
+            }
+
+            return moved;
+        }
+
+        // returns all but `keep` of the cache to the bitmap
+        void spill( cpu_cache& cache, ULONG keep )
+        {
+            ULONG vpid = 0;
+            while ( cache.count > keep && cache.pop( vpid ) ) give_back( vpid );
+        }
+
+        // a vpid stops being used: processors still remembering it at the old epoch flush it before reuse. It goes
+        // back to the bitmap behind the refill cursor, so every other free vpid is handed out before it again
+        void retire( ULONG vpid )
+        {
+            if ( vpid == invalid_vpid || vpid >= vpid_count_ ) return;
+
+            ++epochs_[ vpid ];
+            give_back( vpid );
+
+            // the cursor's own word would hand it straight back out, the rest of that word waits a lap with it
+            if ( vpid / 64 == next_word_ ) next_word_ = ( next_word_ + 1 ) % bitmap_words( vpid_count_ );
+        }
+
+        ULONG epoch( ULONG vpid ) const { return vpid < vpid_count_ ? epochs_[ vpid ] : 0; }
+        ULONG get_free_count( ) const { return free_count_; }
+        ULONG get_vpid_count( ) const { return vpid_count_; }
+
+    private:
+        void give_back( ULONG vpid )
+        {
+            bitmap_[ vpid / 64 ] |= 1ULL << ( vpid % 64 );
+            ++free_count_;
+        }
+
+        static ULONG lowest_bit( ULONG64 bits )
+        {
+            ULONG bit = 0;
+            while ( !( bits & 1 ) )
+            {
+                bits >>= 1;
+                ++bit;
+            }
+            return bit;
+        }
+
+    private:
+        ULONG64* bitmap_{ nullptr };
+        ULONG*   epochs_{ nullptr };
+        ULONG    vpid_count_{ 0 };
+        ULONG    next_word_{ 0 };
+        ULONG    free_count_{ 0 };
+    };
+
+    // one ept a processor may hold guest physical translations for
+    struct context
+    {
+        ULONG64 eptp;        // 0 = empty
+        ULONG64 version;     // ept version it was last entered at
+        ULONG64 last_use;
+    };
+
+    // single context invalidations to issue before a vm entry: the vpid when it was recycled since this
+    // processor last ran it, the eptp when its ept changed, and an eptp dropped from the table to make room
+    struct entry_plan
+    {
+        ULONG   invvpid_count;
+        ULONG   invept_count;
+        ULONG64 invvpid[ 1 ];
+        ULONG64 invept[ 2 ];
+    };
+
+    // What one processor may hold translations for. Vpids are few and dense, so every vpid has a slot in
+    // seen (vpid_count entries) with the epoch it last ran at plus one, 0 = never. Eptps are physical
+    // addresses, the ept_ways most recently entered live in epts, sized above the number of live epts so
+    // only dead ones fall out. Both arrays are the caller's and start zeroed
+    struct cpu_contexts
+    {
+        ULONG*   seen;
+        context* epts;
+        ULONG    ept_ways;
+        ULONG64  clock;
+        ULONG64 entries;
+        ULONG64 stale_flushes;      // a recycled vpid or a changed ept
+        ULONG64 eviction_flushes;   // an eptp dropped from the table
+    };
+
+    // runs on the processor about to enter a vcpu tagged vpid (at vpid_epoch) on the ept at eptp (at
+    // ept_version). ept_version must never repeat for an eptp, not even across a destroyed and rebuilt ept
+    inline void plan_entry( cpu_contexts& cpu, ULONG vpid, ULONG vpid_epoch, ULONG64 eptp, ULONG64 ept_version, entry_plan& plan )
+    {
+        plan = entry_plan{ };
+        ++cpu.clock;
+        ++cpu.entries;
+
+        ULONG& seen = cpu.seen[ vpid ];
+        if ( seen != 0 && seen != vpid_epoch + 1 )
+        {
+            plan.invvpid[ plan.invvpid_count++ ] = vpid;
+            ++cpu.stale_flushes;
+        }
+        seen = vpid_epoch + 1;
+
+        context* victim = &cpu.epts[ 0 ];
+        for ( ULONG way = 0; way < cpu.ept_ways; ++way )
+        {
+            context& c = cpu.epts[ way ];
+            if ( c.eptp == eptp )
+            {
+                c.last_use = cpu.clock;
+                if ( c.version != ept_version )
+                {
+                    c.version = ept_version;
+                    plan.invept[ plan.invept_count++ ] = eptp;
+                    ++cpu.stale_flushes;
+                }
+                return;
+            }
+
+            // an empty way first, otherwise the least recently entered
+            if ( victim->eptp != 0 && ( c.eptp == 0 || c.last_use < victim->last_use ) ) victim = &c;
+        }
+
+        if ( victim->eptp != 0 )
+        {
+            // forgetting an ept means dropping whatever it left on this processor
+            plan.invept[ plan.invept_count++ ] = victim->eptp;
+            ++cpu.eviction_flushes;
+        }
+
+        victim->eptp = eptp;
+        victim->version = ept_version;
+        victim->last_use = cpu.clock;
+    }
+}
\ No newline at end of file
@@ -0,0 +1,56 @@
+#pragma once
+
+// Owns the vpid space and the per processor tag tracking of hv_vpid. Each processor has its own vpid cache
+// and context table behind its own spinlock, the shared bitmap has one more that is only taken to refill or
+// spill a cache and to retire a vpid. Bookkeeping only like hv_scheduler: a per processor vcpu loop calls plan_entry() for the
+// vcpu switch_next() returned and issues the invalidations it lists before vmresume.
+class hv_vpid_pool
+{
+public:
+    hv_vpid_pool( ) = default;
+    ~hv_vpid_pool( ) = default;
+
+    // max_epts: how many epts can be live at once, each processor tracks twice that many eptps
+    NTSTATUS initialize( _In_ ULONG processor_count, _In_ ULONG max_epts );
+    void     shutdown( );
+
+    // a vpid from the current processor's cache, hv_vpid::invalid_vpid once every vpid is taken
+    _IRQL_requires_max_( DISPATCH_LEVEL )
+    _Must_inspect_result_ ULONG allocate( );
+
+    // retires vpid (a new epoch) and returns it to the bitmap, where it is the last free vpid to be reused
+    _IRQL_requires_max_( DISPATCH_LEVEL )
+    void release( _In_ ULONG vpid );
+
+    // runs on processor `cpu` right before entering a vcpu tagged vpid on the ept at eptp / ept_version
+    _IRQL_requires_max_( DISPATCH_LEVEL )
+    void plan_entry( _In_ ULONG cpu, _In_ ULONG vpid, _In_ ULONG64 eptp, _In_ ULONG64 ept_version, _Out_ hv_vpid::entry_plan* plan );
+
+    ULONG get_free_count( ) const { return allocator_.get_free_count( ); }
+
+private:
+    struct per_cpu
+    {
+        KSPIN_LOCK             lock;
+        hv_vpid::cpu_cache     cache;
+        hv_vpid::cpu_contexts  contexts;
+    };
+
+    // pulls every cached vpid back into the bitmap, the last resort before allocate gives up
+    _IRQL_requires_( DISPATCH_LEVEL )
+    void drain_caches( );
+
+private:
+    // 64 vcpus for each of max_sandboxes_ sandboxes, with room for the per processor caches
+    static constexpr ULONG vpid_count_ = 4096;
+
+    KSPIN_LOCK         lock_{};
+    hv_vpid::allocator allocator_;
+    ULONG64*           bitmap_{ nullptr };
+    ULONG*             epochs_{ nullptr };
+    ULONG*             seen_{ nullptr };      // vpid_count_ epochs per processor, see hv_vpid::cpu_contexts
+    hv_vpid::context*  epts_{ nullptr };      // ept_ways_ per processor
+    ULONG              ept_ways_{ 0 };
+    per_cpu*           cpus_{ nullptr };
+    ULONG              processor_count_{ 0 };
+};
\ No newline at end of file
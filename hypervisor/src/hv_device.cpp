@@ -2,7 +2,9 @@
 
 static const ULONG device_tag = 'dVh0';
 
-NTSTATUS hv_device::create( _In_ PDRIVER_OBJECT driver_object )
+hv_sandbox_manager* hv_device::sandboxes_ = nullptr;
+
+NTSTATUS hv_device::create( _In_ PDRIVER_OBJECT driver_object, _In_ hv_sandbox_manager* sandboxes )
 {
     UNICODE_STRING device_name;
     UNICODE_STRING sym_link;
@@ -19,6 +21,8 @@ NTSTATUS hv_device::create( _In_ PDRIVER_OBJECT driver_object )
         return status;
     }
 
+    sandboxes_ = sandboxes;
+
     device_object->Flags |= DO_BUFFERED_IO;
     device_object->Flags &= ~DO_DEVICE_INITIALIZING;
 
@@ -43,6 +47,11 @@ NTSTATUS hv_device::create( _In_ PDRIVER_OBJECT driver_object )
             return hv_device::dispatch_create_close( dev, irp );
         };
 
+    driver_object->MajorFunction[ IRP_MJ_CLEANUP ] = [ ]( PDEVICE_OBJECT dev, PIRP irp ) -> NTSTATUS
+        {
+            return hv_device::dispatch_cleanup( dev, irp );
+        };
+
     driver_object->MajorFunction[ IRP_MJ_DEVICE_CONTROL ] = [ ]( PDEVICE_OBJECT dev, PIRP irp ) -> NTSTATUS
         {
             return hv_device::dispatch_device_control( dev, irp );
@@ -72,6 +81,7 @@ void hv_device::destroy( _In_ PDRIVER_OBJECT driver_object )
         device_object = next;
     }
 
+    sandboxes_ = nullptr;
     hv_logger::log( hv_logger::level::info, "hv_device::destroy: device(s) deleted" );
 }
 
@@ -84,6 +94,16 @@ NTSTATUS hv_device::dispatch_create_close( _In_ PDEVICE_OBJECT device_object, _I
     return STATUS_SUCCESS;
 }
 
+NTSTATUS hv_device::dispatch_cleanup( _In_ PDEVICE_OBJECT device_object, _In_ PIRP irp )
+{
+    UNREFERENCED_PARAMETER( device_object );
+
+    // the handle is going away, nothing may stay pended on it
+    hv_events::cancel_file( IoGetCurrentIrpStackLocation( irp )->FileObject );
+    complete_irp_success( irp, 0 );
+    return STATUS_SUCCESS;
+}
+
 NTSTATUS hv_device::dispatch_device_control( _In_ PDEVICE_OBJECT device_object, _In_ PIRP irp )
 {
     UNREFERENCED_PARAMETER( device_object );
@@ -93,22 +113,309 @@ NTSTATUS hv_device::dispatch_device_control( _In_ PDEVICE_OBJECT device_object,
 
     hv_logger::log( hv_logger::level::info, "hv_device::dispatch_device_control: ioctl 0x%08x", io_control_code );
 
+    // the trace ioctls themselves are never recorded, neither are event waits (a replay would block on them)
+    const bool traced = hv_trace::is_recording( ) && io_control_code != IOCTL_HV_TRACE_CONTROL && io_control_code != IOCTL_HV_TRACE_DRAIN &&
+        io_control_code != IOCTL_HV_EVENT_WAIT;
+    hv_trace::capture capture;
+    if ( traced ) hv_trace::begin( capture, irp, stack );
+
+    ULONG_PTR information = 0;
+    NTSTATUS status = STATUS_SUCCESS;
+
     switch ( io_control_code )
     {
     case IOCTL_HV_NOP:
     {
         hv_logger::log( hv_logger::level::info, "hv_device::dispatch_device_control: IOCTL_HV_NOP" );
-        complete_irp_success( irp, 0 );
-        return STATUS_SUCCESS;
+        break;
+    }
+
+    case IOCTL_HV_SANDBOX_CREATE:
+    case IOCTL_HV_SANDBOX_DESTROY:
+    case IOCTL_HV_SANDBOX_LIST:
+    {
+        status = handle_sandbox_request( irp, stack, io_control_code, &information );
+        break;
+    }
+
+    case IOCTL_HV_SANDBOX_ENUM:
+    {
+        status = handle_sandbox_enum( irp, stack, &information );
+        break;
+    }
+
+    case IOCTL_HV_SANDBOX_SCAN:
+    {
+        status = handle_sandbox_scan( irp, stack, &information );
+        break;
+    }
+
+    case IOCTL_HV_MEM_READ:
+    case IOCTL_HV_MEM_WRITE:
+    {
+        status = handle_mem_transfer( irp, stack, io_control_code == IOCTL_HV_MEM_WRITE, &information );
+        break;
+    }
+
+    case IOCTL_HV_MEM_TRANSLATE:
+    {
+        status = handle_mem_translate( irp, stack, &information );
+        break;
+    }
+
+    case IOCTL_HV_TRACE_CONTROL:
+    {
+        status = handle_trace_control( irp, stack );
+        break;
+    }
+
+    case IOCTL_HV_TRACE_DRAIN:
+    {
+        status = hv_trace::drain( irp->AssociatedIrp.SystemBuffer, stack->Parameters.DeviceIoControl.OutputBufferLength, &information );
+        break;
+    }
+
+    case IOCTL_HV_EVENT_WAIT:
+    {
+        status = hv_events::wait( irp, stack, &information );
+        break;
+    }
+
+    case IOCTL_HV_MERGE_QUERY:
+    {
+        status = handle_merge_query( irp, stack, &information );
+        break;
+    }
+
+    case IOCTL_HV_RECLAIM_QUERY:
+    {
+        status = handle_reclaim_query( irp, stack, &information );
+        break;
     }
 
     default:
     {
         hv_logger::log( hv_logger::level::warning, "hv_device::dispatch_device_control: unknown ioctl 0x%08x", io_control_code );
-        complete_irp_error( irp, STATUS_INVALID_DEVICE_REQUEST, 0 );
-        return STATUS_INVALID_DEVICE_REQUEST;
+        status = STATUS_INVALID_DEVICE_REQUEST;
+        break;
+    }
+    }
+
+    if ( traced ) hv_trace::end( capture, irp, status, information );
+
+    // a pended irp is owned by whoever queued it, it is completed from there
+    if ( status == STATUS_PENDING ) return STATUS_PENDING;
+
+    if ( NT_SUCCESS( status ) ) complete_irp_success( irp, information );
+    else complete_irp_error( irp, status, information );
+    return status;
+}
+
+NTSTATUS hv_device::handle_trace_control( _In_ PIRP irp, _In_ PIO_STACK_LOCATION stack )
+{
+    const hv_trace_control* req = static_cast< const hv_trace_control* >( irp->AssociatedIrp.SystemBuffer );
+    if ( !req || stack->Parameters.DeviceIoControl.InputBufferLength < sizeof( hv_trace_control ) ) return STATUS_BUFFER_TOO_SMALL;
+
+    if ( !req->enable )
+    {
+        hv_trace::stop( );
+        return STATUS_SUCCESS;
+    }
+
+    return hv_trace::start( req->buffer_bytes );
+}
+
+NTSTATUS hv_device::handle_merge_query( _In_ PIRP irp, _In_ PIO_STACK_LOCATION stack, _Out_ ULONG_PTR* information )
+{
+    *information = 0;
+    if ( !sandboxes_ ) return STATUS_INVALID_DEVICE_STATE;
+
+    hv_merge_stats* stats = static_cast< hv_merge_stats* >( irp->AssociatedIrp.SystemBuffer );
+    if ( !stats || stack->Parameters.DeviceIoControl.OutputBufferLength < sizeof( hv_merge_stats ) ) return STATUS_BUFFER_TOO_SMALL;
+
+    sandboxes_->query_merge_stats( stats );
+    *information = sizeof( hv_merge_stats );
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS hv_device::handle_reclaim_query( _In_ PIRP irp, _In_ PIO_STACK_LOCATION stack, _Out_ ULONG_PTR* information )
+{
+    *information = 0;
+    if ( !sandboxes_ ) return STATUS_INVALID_DEVICE_STATE;
+
+    hv_reclaim_stats* stats = static_cast< hv_reclaim_stats* >( irp->AssociatedIrp.SystemBuffer );
+    if ( !stats || stack->Parameters.DeviceIoControl.OutputBufferLength < sizeof( hv_reclaim_stats ) ) return STATUS_BUFFER_TOO_SMALL;
+
+    sandboxes_->query_reclaim_stats( stats );
+    *information = sizeof( hv_reclaim_stats );
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS hv_device::handle_sandbox_request( _In_ PIRP irp, _In_ PIO_STACK_LOCATION stack, _In_ ULONG io_control_code, _Out_ ULONG_PTR* information )
+{
+    *information = 0;
+    if ( !sandboxes_ ) return STATUS_INVALID_DEVICE_STATE;
+
+    const ULONG in_len = stack->Parameters.DeviceIoControl.InputBufferLength;
+    const ULONG out_len = stack->Parameters.DeviceIoControl.OutputBufferLength;
+    void* buffer = irp->AssociatedIrp.SystemBuffer;
+
+    if ( io_control_code == IOCTL_HV_SANDBOX_LIST )
+    {
+        ULONG count = 0;
+        NTSTATUS status = sandboxes_->list_sandboxes( static_cast< ULONG* >( buffer ), out_len / sizeof( ULONG ), &count );
+        const ULONG written = count < out_len / sizeof( ULONG ) ? count : out_len / sizeof( ULONG );
+        *information = written * sizeof( ULONG );
+
+        // a short buffer still returns what fit, same as the usermode side expects
+        return status == STATUS_BUFFER_TOO_SMALL ? STATUS_SUCCESS : status;
+    }
+
+    if ( !buffer || in_len < sizeof( hv_sandbox_request ) ) return STATUS_BUFFER_TOO_SMALL;
+    const hv_sandbox_request* req = static_cast< const hv_sandbox_request* >( buffer );
+    if ( io_control_code == IOCTL_HV_SANDBOX_DESTROY ) return sandboxes_->destroy_sandbox( req->id );
+
+    // older clients send a shorter request, whatever is missing takes its default
+    const hv_sandbox_create_request* create = static_cast< const hv_sandbox_create_request* >( buffer );
+    const ULONG exit_policy = in_len >= RTL_SIZEOF_THROUGH_FIELD( hv_sandbox_create_request, exit_policy ) ? create->exit_policy : HV_EXIT_POLICY_DEFAULT;
+    const ULONG vcpu_count = in_len >= RTL_SIZEOF_THROUGH_FIELD( hv_sandbox_create_request, vcpu_count ) && create->vcpu_count ? create->vcpu_count : 1;
+    return sandboxes_->create_sandbox( req->id, exit_policy, vcpu_count );
+}
+
+NTSTATUS hv_device::handle_sandbox_enum( _In_ PIRP irp, _In_ PIO_STACK_LOCATION stack, _Out_ ULONG_PTR* information )
+{
+    *information = 0;
+    if ( !sandboxes_ ) return STATUS_INVALID_DEVICE_STATE;
+
+    const ULONG in_len = stack->Parameters.DeviceIoControl.InputBufferLength;
+    const ULONG out_len = stack->Parameters.DeviceIoControl.OutputBufferLength;
+    void* buffer = irp->AssociatedIrp.SystemBuffer;
+    if ( !buffer || in_len < sizeof( hv_sandbox_enum_request ) ) return STATUS_BUFFER_TOO_SMALL;
+    if ( out_len < sizeof( hv_sandbox_enum_result ) + sizeof( hv_sandbox_record ) ) return STATUS_BUFFER_TOO_SMALL;
+
+    // the page size is whatever the caller's buffer holds
+    const ULONG cursor = static_cast< const hv_sandbox_enum_request* >( buffer )->cursor;
+    hv_sandbox_enum_result* result = static_cast< hv_sandbox_enum_result* >( buffer );
+    hv_sandbox_record* records = reinterpret_cast< hv_sandbox_record* >( result + 1 );
+    const ULONG max_records = ( out_len - sizeof( hv_sandbox_enum_result ) ) / sizeof( hv_sandbox_record );
+
+    ULONG count = 0;
+    ULONG next_cursor = HV_ENUM_CURSOR_END;
+    NTSTATUS status = sandboxes_->enumerate_sandboxes( cursor, records, max_records, &count, &next_cursor );
+    if ( !NT_SUCCESS( status ) ) return status;
+
+    result->record_count = count;
+    result->next_cursor = next_cursor;
+    *information = sizeof( hv_sandbox_enum_result ) + count * sizeof( hv_sandbox_record );
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS hv_device::handle_mem_transfer( _In_ PIRP irp, _In_ PIO_STACK_LOCATION stack, _In_ BOOLEAN write, _Out_ ULONG_PTR* information )
+{
+    *information = 0;
+    if ( !sandboxes_ ) return STATUS_INVALID_DEVICE_STATE;
+
+    // the request header + scatter list comes through the system buffer, the data buffer is never double buffered:
+    // the io manager probed and locked it and we copy guest pages straight into / out of its mdl mapping
+    const ULONG in_len = stack->Parameters.DeviceIoControl.InputBufferLength;
+    const hv_mem_request* req = static_cast< const hv_mem_request* >( irp->AssociatedIrp.SystemBuffer );
+    if ( !req || in_len < sizeof( hv_mem_request ) ) return STATUS_BUFFER_TOO_SMALL;
+    if ( req->segment_count == 0 || req->segment_count > HV_MEM_MAX_SEGMENTS ) return STATUS_INVALID_PARAMETER;
+    if ( in_len < sizeof( hv_mem_request ) + req->segment_count * sizeof( hv_mem_segment ) ) return STATUS_BUFFER_TOO_SMALL;
+
+    if ( !irp->MdlAddress ) return STATUS_INVALID_PARAMETER;
+    const ULONG64 data_len = MmGetMdlByteCount( irp->MdlAddress );
+
+    const hv_mem_segment* segments = reinterpret_cast< const hv_mem_segment* >( req + 1 );
+    ULONG64 total = 0;
+    for ( ULONG i = 0; i < req->segment_count; ++i )
+    {
+        if ( segments[ i ].length == 0 ) return STATUS_INVALID_PARAMETER;
+        if ( segments[ i ].gpa + segments[ i ].length < segments[ i ].gpa ) return STATUS_INTEGER_OVERFLOW;
+        if ( total + segments[ i ].length < total ) return STATUS_INTEGER_OVERFLOW;
+        total += segments[ i ].length;
     }
+
+    if ( total > data_len ) return STATUS_BUFFER_TOO_SMALL;
+
+    PUCHAR data = static_cast< PUCHAR >( MmGetSystemAddressForMdlSafe( irp->MdlAddress, NormalPagePriority | MdlMappingNoExecute ) );
+    if ( !data ) return STATUS_INSUFFICIENT_RESOURCES;
+
+    ULONG64 offset = 0;
+    for ( ULONG i = 0; i < req->segment_count; ++i )
+    {
+        ULONG64 copied = 0;
+        NTSTATUS status = sandboxes_->copy_guest_memory( req->id, segments[ i ].gpa, data + offset, segments[ i ].length, write, &copied );
+        offset += copied;
+
+        if ( !NT_SUCCESS( status ) )
+        {
+            hv_logger::log( hv_logger::level::warning, "hv_device::handle_mem_transfer: segment %u (gpa=0x%llx) stopped after %llu bytes (0x%08x)",
+                i, segments[ i ].gpa, copied, status );
+            // a warning status still carries information back to the caller, an error would drop the count
+            *information = ( ULONG_PTR )offset;
+            return offset ? STATUS_PARTIAL_COPY : status;
+        }
     }
+
+    *information = ( ULONG_PTR )offset;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS hv_device::handle_mem_translate( _In_ PIRP irp, _In_ PIO_STACK_LOCATION stack, _Out_ ULONG_PTR* information )
+{
+    *information = 0;
+    if ( !sandboxes_ ) return STATUS_INVALID_DEVICE_STATE;
+
+    const ULONG in_len = stack->Parameters.DeviceIoControl.InputBufferLength;
+    const ULONG out_len = stack->Parameters.DeviceIoControl.OutputBufferLength;
+    void* buffer = irp->AssociatedIrp.SystemBuffer;
+
+    if ( !buffer || in_len < sizeof( hv_gva_request ) ) return STATUS_BUFFER_TOO_SMALL;
+    if ( out_len < sizeof( hv_gva_result ) + sizeof( hv_gva_record ) ) return STATUS_BUFFER_TOO_SMALL;
+
+    // request and result share the system buffer, take the request out first
+    const hv_gva_request req = *static_cast< const hv_gva_request* >( buffer );
+
+    hv_gva_result* result = static_cast< hv_gva_result* >( buffer );
+    hv_gva_record* records = reinterpret_cast< hv_gva_record* >( result + 1 );
+    const ULONG max_records = ( out_len - sizeof( hv_gva_result ) ) / sizeof( hv_gva_record );
+
+    hv_gva_result local = {};
+    NTSTATUS status = sandboxes_->translate_guest_range( req.id, req.flags, req.cr3, req.gva, req.length, records, max_records, &local );
+    if ( !NT_SUCCESS( status ) ) return status;
+
+    *result = local;
+    *information = sizeof( hv_gva_result ) + local.record_count * sizeof( hv_gva_record );
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS hv_device::handle_sandbox_scan( _In_ PIRP irp, _In_ PIO_STACK_LOCATION stack, _Out_ ULONG_PTR* information )
+{
+    *information = 0;
+    if ( !sandboxes_ ) return STATUS_INVALID_DEVICE_STATE;
+
+    const ULONG in_len = stack->Parameters.DeviceIoControl.InputBufferLength;
+    const ULONG out_len = stack->Parameters.DeviceIoControl.OutputBufferLength;
+    void* buffer = irp->AssociatedIrp.SystemBuffer;
+
+    if ( !buffer || in_len < sizeof( hv_scan_request ) ) return STATUS_BUFFER_TOO_SMALL;
+    if ( out_len < sizeof( hv_scan_result ) + sizeof( ULONG ) ) return STATUS_BUFFER_TOO_SMALL;
+
+    // request and result share the system buffer, take the request out first
+    const hv_scan_request req = *static_cast< const hv_scan_request* >( buffer );
+
+    hv_scan_result* result = static_cast< hv_scan_result* >( buffer );
+    ULONG* changed = reinterpret_cast< ULONG* >( result + 1 );
+    const ULONG max_changed = ( out_len - sizeof( hv_scan_result ) ) / sizeof( ULONG );
+
+    hv_scan_result local = {};
+    NTSTATUS status = sandboxes_->scan_sandbox( req.id, req.flags, req.start_page, changed, max_changed, &local );
+    if ( !NT_SUCCESS( status ) ) return status;
+
+    *result = local;
+    *information = sizeof( hv_scan_result ) + local.changed_count * sizeof( ULONG );
+    return STATUS_SUCCESS;
 }
 
 void hv_device::complete_irp_success( _In_ PIRP irp, ULONG_PTR information )
@@ -1,42 +1,237 @@
 #include "../stdafx.h"
 
 static const ULONG ept_tag = 'tpeH'; // 'Hpet'
+static const ULONG ept_guest_tag = 'gpeH'; // 'Hepg'
 
-NTSTATUS hv_ept::build_identity_map( )
+static void* ept_phys_to_virt( ULONG64 pa )
 {
-    hv_logger::log( hv_logger::level::info, "hv_ept::build_identity_map starting" );
+    PHYSICAL_ADDRESS phys;
+    phys.QuadPart = static_cast< LONGLONG >( pa );
+    return MmGetVirtualForPhysical( phys );
+}
+
+// upper half of every generation, see get_generation()
+static volatile LONG64 ept_instances = 0;
+
+static ULONG64 ept_virt_to_phys( void* va )
+{
+    return static_cast< ULONG64 >( MmGetPhysicalAddress( va ).QuadPart );
+}
+
+NTSTATUS hv_ept::build_guest_map( _In_ ULONG64 guest_bytes )
+{
+    using namespace hv_ept_walk;
+
+    if ( ept_pml4_ ) return STATUS_INVALID_DEVICE_STATE;
+    if ( guest_bytes == 0 || ( guest_bytes & ( PAGE_SIZE - 1 ) ) || guest_bytes > max_guest_bytes ) return STATUS_INVALID_PARAMETER;
+
+    hv_logger::log( hv_logger::level::info, "hv_ept::build_guest_map starting (guest_bytes=%llu)", guest_bytes );
+
+    // still data structure only, nothing is loaded into a vmcs. But the hierarchy is real: pml4 -> pdpt -> pd -> pts,
+    // every pt entry pointing at a private zeroed page of guest ram so the map can actually be walked and accessed
+    const ULONG64 guest_pages = guest_bytes / PAGE_SIZE;
+    const ULONG64 table_pages = table_pages_for( guest_bytes, page_4k );
 
-    // In a complete code we would here abuse the 4 level hierarchy of pages but in this case we just allocate four to mimic that ^^
-    const ULONG levels = 4;
-    ept_pml4_ = ExAllocatePoolWithTag( NonPagedPoolNx, PAGE_SIZE * levels, ept_tag );
+    ept_pml4_ = ExAllocatePoolWithTag( NonPagedPoolNx, ( SIZE_T )( PAGE_SIZE * table_pages ), ept_tag );
     if ( !ept_pml4_ ) return STATUS_INSUFFICIENT_RESOURCES;
 
-    RtlZeroMemory( ept_pml4_, PAGE_SIZE * levels );
-    page_count_ = levels;
-    alloc_bytes_ = PAGE_SIZE * levels;
+    guest_pages_ = static_cast< void** >( ExAllocatePoolWithTag( NonPagedPoolNx, ( SIZE_T )( sizeof( void* ) * guest_pages ), ept_tag ) );
+    if ( !guest_pages_ )
+    {
+        ExFreePoolWithTag( ept_pml4_, ept_tag );
+        ept_pml4_ = nullptr;
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
 
-    hv_logger::log( hv_logger::level::info, "hv_ept::build_identity_map allocated %llu bytes (%llu pages)", alloc_bytes_, page_count_ );
+    RtlZeroMemory( ept_pml4_, ( SIZE_T )( PAGE_SIZE * table_pages ) );
+    RtlZeroMemory( guest_pages_, ( SIZE_T )( sizeof( void* ) * guest_pages ) );
+    page_count_ = table_pages;
+    alloc_bytes_ = PAGE_SIZE * table_pages;
+    guest_bytes_ = guest_bytes;
 
-    // dummy entries ofc
-    ULONG64* table = reinterpret_cast< ULONG64* >( ept_pml4_ );
-    for ( ULONG i = 0; i < 512; ++i )
+    // one allocation per page so the page merger can give single pages back
+    for ( ULONG64 i = 0; i < guest_pages; ++i )
     {
-        // we mark entry as "present" and point to a dummy physical address
-        table[ i ] = ( static_cast< ULONG64 >( i ) << 12 ) | 0x7ULL; // bits 0-2 as R/W/X
+        guest_pages_[ i ] = allocate_guest_page( );
+        if ( !guest_pages_[ i ] )
+        {
+            hv_logger::log( hv_logger::level::error, "hv_ept::build_guest_map: guest page %llu of %llu failed to allocate", i, guest_pages );
+            destroy( );
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
     }
 
-    hv_logger::log( hv_logger::level::info, "hv_ept::build_identity_map: filled dummy entries" );
+    hv_logger::log( hv_logger::level::info, "hv_ept::build_guest_map allocated %llu bytes (%llu pages)", alloc_bytes_, page_count_ );
+
+    // guest ram comes from pool page by page, so leaves are always 4K here
+    ULONG64* tables = static_cast< ULONG64* >( ept_pml4_ );
+    void** pages = guest_pages_;
+    build_tables( tables, guest_bytes, page_4k,
+        [ ]( ULONG64* table ) { return ept_virt_to_phys( table ); },
+        [ pages ]( ULONG64 gpa ) { return ept_virt_to_phys( pages[ gpa / PAGE_SIZE ] ); } );
+
+    pml4_physical_ = ept_virt_to_phys( tables );
+    generation_ = static_cast< ULONG64 >( InterlockedIncrement64( &ept_instances ) ) << 32;
+
+    hv_logger::log( hv_logger::level::info, "hv_ept::build_guest_map: mapped %llu guest pages through %llu table pages", guest_pages, table_pages );
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS hv_ept::translate( _In_ ULONG64 gpa, _Out_ hv_ept_walk::translation* out ) const
+{
+    if ( !ept_pml4_ ) return STATUS_INVALID_DEVICE_STATE;
+    if ( gpa >= guest_bytes_ ) return STATUS_INVALID_ADDRESS;
+
+    return hv_ept_walk::translate( pml4_physical_, gpa, ept_phys_to_virt, *out ) ? STATUS_SUCCESS : STATUS_INVALID_ADDRESS;
+}
+
+NTSTATUS hv_ept::resolve_run( _In_ ULONG64 gpa, _In_ ULONG64 max_length, _In_ ULONG64 access, _Out_ hv_ept_walk::run* out ) const
+{
+    if ( !ept_pml4_ ) return STATUS_INVALID_DEVICE_STATE;
+    if ( gpa >= guest_bytes_ || max_length == 0 ) return STATUS_INVALID_ADDRESS;
+
+    // never let a run leave guest ram even if the tables would allow it
+    if ( max_length > guest_bytes_ - gpa ) max_length = guest_bytes_ - gpa;
+
+    if ( !hv_ept_walk::resolve_run( pml4_physical_, gpa, max_length, access, ept_phys_to_virt, *out ) ) return STATUS_ACCESS_VIOLATION;
+    return STATUS_SUCCESS;
+}
+
+void* hv_ept::get_private_page( _In_ ULONG64 gpa ) const
+{
+    if ( !guest_pages_ || gpa >= guest_bytes_ ) return nullptr;
+    return guest_pages_[ gpa / PAGE_SIZE ];
+}
+
+bool hv_ept::is_shared( _In_ ULONG64 gpa ) const
+{
+    return guest_pages_ && gpa < guest_bytes_ && !guest_pages_[ gpa / PAGE_SIZE ];
+}
+
+NTSTATUS hv_ept::share_page( _In_ ULONG64 gpa, _In_ ULONG64 shared_hpa )
+{
+    void* page = get_private_page( gpa );
+    if ( !page ) return STATUS_INVALID_ADDRESS;
+
+    *pt_entry( gpa ) = ( shared_hpa & hv_ept_walk::ept_pfn_mask ) | hv_ept_walk::ept_read | hv_ept_walk::ept_execute | hv_ept_walk::ept_memtype_wb;
+    guest_pages_[ gpa / PAGE_SIZE ] = nullptr;
+    free_guest_page( page );
+
+    ++shared_pages_;
+    ++generation_;
     return STATUS_SUCCESS;
 }
 
+NTSTATUS hv_ept::give_page( _In_ ULONG64 gpa, _Outptr_ void** out_page, _Out_ ULONG64* out_hpa )
+{
+    if ( !out_page || !out_hpa ) return STATUS_INVALID_PARAMETER;
+
+    void* page = get_private_page( gpa );
+    if ( !page ) return STATUS_INVALID_ADDRESS;
+
+    ULONG64* entry = pt_entry( gpa );
+    *entry &= ~hv_ept_walk::ept_write;
+    guest_pages_[ gpa / PAGE_SIZE ] = nullptr;
+
+    *out_page = page;
+    *out_hpa = *entry & hv_ept_walk::ept_pfn_mask;
+    ++shared_pages_;
+    ++generation_;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS hv_ept::unshare_page( _In_ ULONG64 gpa, _Out_ ULONG64* out_shared_hpa )
+{
+    if ( !out_shared_hpa ) return STATUS_INVALID_PARAMETER;
+    *out_shared_hpa = 0;
+    if ( !is_shared( gpa ) ) return STATUS_INVALID_ADDRESS;
+
+    ULONG64* entry = pt_entry( gpa );
+    const ULONG64 shared_hpa = *entry & hv_ept_walk::ept_pfn_mask;
+    const void* shared = ept_phys_to_virt( shared_hpa );
+    if ( !shared ) return STATUS_INVALID_ADDRESS;
+
+    void* page = allocate_guest_page( );
+    if ( !page ) return STATUS_INSUFFICIENT_RESOURCES;
+
+    RtlCopyMemory( page, shared, PAGE_SIZE );
+    *entry = ept_virt_to_phys( page ) | hv_ept_walk::ept_rwx | hv_ept_walk::ept_memtype_wb;
+    guest_pages_[ gpa / PAGE_SIZE ] = page;
+
+    *out_shared_hpa = shared_hpa;
+    --shared_pages_;
+    ++generation_;
+    return STATUS_SUCCESS;
+}
+
+void* hv_ept::allocate_guest_page( )
+{
+    // pool allocations of a page are page aligned
+    void* page = ExAllocatePoolWithTag( NonPagedPoolNx, PAGE_SIZE, ept_guest_tag );
+    if ( page ) RtlZeroMemory( page, PAGE_SIZE );
+    return page;
+}
+
+void hv_ept::free_guest_page( _In_ void* page )
+{
+    if ( !page ) return;
+
+    // guest data must not outlive the sandbox in whatever pool allocation gets this page next
+    RtlSecureZeroMemory( page, PAGE_SIZE );
+    ExFreePoolWithTag( page, ept_guest_tag );
+}
+
+ULONG64* hv_ept::pt_entry( _In_ ULONG64 gpa ) const
+{
+    return static_cast< ULONG64* >( ept_pml4_ ) + hv_ept_walk::pt_entry_index( guest_bytes_, gpa );
+}
+
+void hv_ept::transfer( _Inout_ hv_ept& target )
+{
+    target = *this;
+    *this = hv_ept{ };
+}
+
+ULONG64 hv_ept::release_guest_pages( _In_ ULONG64 first_page, _In_ ULONG64 page_count )
+{
+    const ULONG64 guest_pages = guest_bytes_ / PAGE_SIZE;
+    if ( !guest_pages_ || first_page >= guest_pages ) return 0;
+    if ( page_count > guest_pages - first_page ) page_count = guest_pages - first_page;
+
+    ULONG64 released = 0;
+    for ( ULONG64 i = first_page; i < first_page + page_count; ++i )
+    {
+        if ( !guest_pages_[ i ] ) continue;
+
+        free_guest_page( guest_pages_[ i ] );
+        guest_pages_[ i ] = nullptr;
+        ++released;
+    }
+
+    return released;
+}
+
 void hv_ept::destroy( )
 {
+    if ( ept_pml4_ || guest_pages_ ) ++generation_;
+
     if ( ept_pml4_ )
     {
         ExFreePoolWithTag( ept_pml4_, ept_tag );
         ept_pml4_ = nullptr;
+        pml4_physical_ = 0;
         page_count_ = 0;
         alloc_bytes_ = 0;
         hv_logger::log( hv_logger::level::info, "hv_ept::destroy: freed memory" );
     }
+
+    // shared pages are owned by hv_page_share, the caller has released them already
+    if ( guest_pages_ )
+    {
+        for ( ULONG64 i = 0; i < guest_bytes_ / PAGE_SIZE; ++i ) free_guest_page( guest_pages_[ i ] );
+        ExFreePoolWithTag( guest_pages_, ept_tag );
+        guest_pages_ = nullptr;
+        guest_bytes_ = 0;
+        shared_pages_ = 0;
+    }
 }
\ No newline at end of file
@@ -0,0 +1,190 @@
+#include "../stdafx.h"
+
+KSPIN_LOCK      hv_events::lock_ = 0;
+IO_CSQ          hv_events::csq_ = {};
+LIST_ENTRY      hv_events::pending_ = {};
+hv_event_record hv_events::ring_[ HV_EVENT_RING_CAPACITY ] = {};
+ULONG64         hv_events::next_sequence_ = 1;
+
+void hv_events::initialize( )
+{
+    KeInitializeSpinLock( &lock_ );
+    InitializeListHead( &pending_ );
+    IoCsqInitializeEx( &csq_, csq_insert, csq_remove, csq_peek_next, csq_acquire_lock, csq_release_lock, csq_complete_canceled );
+}
+
+void hv_events::shutdown( )
+{
+    peek_filter filter = { nullptr, ~0ULL };
+    complete_matching( &filter, true );
+}
+
+void hv_events::post( _In_ ULONG type, _In_ ULONG sandbox_id, _In_ ULONG64 detail, _In_ NTSTATUS status )
+{
+    ULONG64 sequence = 0;
+    {
+        KIRQL irql;
+        KeAcquireSpinLock( &lock_, &irql );
+
+        sequence = next_sequence_++;
+        hv_event_record& record = ring_[ sequence % HV_EVENT_RING_CAPACITY ];
+        RtlZeroMemory( &record, sizeof( record ) );
+        record.sequence = sequence;
+        record.detail = detail;
+        record.type = type;
+        record.sandbox_id = sandbox_id;
+        record.status = status;
+
+        LARGE_INTEGER now;
+#if (NTDDI_VERSION >= NTDDI_WIN8)
+        KeQuerySystemTimePrecise( &now );
+#else
+        KeQuerySystemTime( &now );
+#endif
+        record.timestamp = static_cast< ULONG64 >( now.QuadPart );
+
+        KeReleaseSpinLock( &lock_, irql );
+    }
+
+    // every pended waiter is behind the new event (a waiter with nothing to read is the only kind that
+    // gets queued), only irps queued after this post already saw it and stay
+    peek_filter filter = { nullptr, sequence };
+    complete_matching( &filter, false );
+}
+
+NTSTATUS hv_events::wait( _In_ PIRP irp, _In_ PIO_STACK_LOCATION stack, _Out_ ULONG_PTR* information )
+{
+    *information = 0;
+
+    const hv_event_wait_request* req = static_cast< const hv_event_wait_request* >( irp->AssociatedIrp.SystemBuffer );
+    if ( !req || stack->Parameters.DeviceIoControl.InputBufferLength < sizeof( hv_event_wait_request ) ) return STATUS_BUFFER_TOO_SMALL;
+    if ( stack->Parameters.DeviceIoControl.OutputBufferLength < sizeof( hv_event_wait_result ) + sizeof( hv_event_record ) ) return STATUS_BUFFER_TOO_SMALL;
+
+    if ( req->flags & HV_EVENT_WAIT_POLL ) return fill( irp, information );
+
+    // csq_insert refuses the irp when events are already waiting, then it is answered right here
+    if ( NT_SUCCESS( IoCsqInsertIrpEx( &csq_, irp, nullptr, nullptr ) ) ) return STATUS_PENDING;
+    return fill( irp, information );
+}
+
+void hv_events::cancel_file( _In_ PFILE_OBJECT file_object )
+{
+    peek_filter filter = { file_object, ~0ULL };
+    complete_matching( &filter, true );
+}
+
+NTSTATUS hv_events::fill( _In_ PIRP irp, _Out_ ULONG_PTR* information )
+{
+    // METHOD_BUFFERED, the result overwrites the request in the same system buffer
+    PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation( irp );
+    hv_event_wait_request* req = static_cast< hv_event_wait_request* >( irp->AssociatedIrp.SystemBuffer );
+    const ULONG capacity = static_cast< ULONG >( ( stack->Parameters.DeviceIoControl.OutputBufferLength - sizeof( hv_event_wait_result ) ) / sizeof( hv_event_record ) );
+
+    hv_event_wait_result result = {};
+    hv_event_record* records = reinterpret_cast< hv_event_record* >( static_cast< PUCHAR >( irp->AssociatedIrp.SystemBuffer ) + sizeof( hv_event_wait_result ) );
+
+    KIRQL irql;
+    KeAcquireSpinLock( &lock_, &irql );
+
+    ULONG64 cursor = resolve_cursor( req );
+    const ULONG64 oldest = next_sequence_ > HV_EVENT_RING_CAPACITY ? next_sequence_ - HV_EVENT_RING_CAPACITY : 1;
+    if ( cursor + 1 < oldest )
+    {
+        result.lost = oldest - ( cursor + 1 );
+        cursor = oldest - 1;
+    }
+
+    while ( cursor + 1 < next_sequence_ && result.record_count < capacity )
+    {
+        ++cursor;
+        records[ result.record_count++ ] = ring_[ cursor % HV_EVENT_RING_CAPACITY ];
+    }
+
+    KeReleaseSpinLock( &lock_, irql );
+
+    result.last_sequence = cursor;
+    RtlCopyMemory( irp->AssociatedIrp.SystemBuffer, &result, sizeof( result ) );
+    *information = sizeof( hv_event_wait_result ) + result.record_count * sizeof( hv_event_record );
+    return STATUS_SUCCESS;
+}
+
+void hv_events::complete_matching( _In_ peek_filter* filter, _In_ bool cancel )
+{
+    PIRP irp = nullptr;
+    while ( ( irp = IoCsqRemoveNextIrp( &csq_, filter ) ) != nullptr )
+    {
+        ULONG_PTR information = 0;
+        NTSTATUS status = cancel ? STATUS_CANCELLED : fill( irp, &information );
+
+        irp->IoStatus.Status = status;
+        irp->IoStatus.Information = information;
+        IoCompleteRequest( irp, IO_NO_INCREMENT );
+    }
+}
+
+ULONG64 hv_events::resolve_cursor( _Inout_ hv_event_wait_request* req )
+{
+    // called under lock_. HV_EVENT_FROM_NOW pins to the newest event so a pended irp keeps its place
+    if ( req->after_sequence == HV_EVENT_FROM_NOW || req->after_sequence >= next_sequence_ ) req->after_sequence = next_sequence_ - 1;
+    return req->after_sequence;
+}
+
+NTSTATUS hv_events::csq_insert( _In_ PIO_CSQ csq, _In_ PIRP irp, _In_ PVOID context )
+{
+    UNREFERENCED_PARAMETER( csq );
+    UNREFERENCED_PARAMETER( context );
+
+    hv_event_wait_request* req = static_cast< hv_event_wait_request* >( irp->AssociatedIrp.SystemBuffer );
+    if ( resolve_cursor( req ) + 1 < next_sequence_ ) return STATUS_UNSUCCESSFUL;
+
+    // marked under the lock, a post on another cpu may complete the irp as soon as it is in the list
+    IoMarkIrpPending( irp );
+    InsertTailList( &pending_, &irp->Tail.Overlay.ListEntry );
+    return STATUS_SUCCESS;
+}
+
+VOID hv_events::csq_remove( _In_ PIO_CSQ csq, _In_ PIRP irp )
+{
+    UNREFERENCED_PARAMETER( csq );
+    RemoveEntryList( &irp->Tail.Overlay.ListEntry );
+}
+
+PIRP hv_events::csq_peek_next( _In_ PIO_CSQ csq, _In_opt_ PIRP irp, _In_opt_ PVOID context )
+{
+    UNREFERENCED_PARAMETER( csq );
+
+    const peek_filter* filter = static_cast< const peek_filter* >( context );
+    for ( PLIST_ENTRY entry = irp ? irp->Tail.Overlay.ListEntry.Flink : pending_.Flink; entry != &pending_; entry = entry->Flink )
+    {
+        PIRP next = CONTAINING_RECORD( entry, IRP, Tail.Overlay.ListEntry );
+        if ( !filter ) return next;
+
+        const hv_event_wait_request* req = static_cast< const hv_event_wait_request* >( next->AssociatedIrp.SystemBuffer );
+        if ( filter->file && IoGetCurrentIrpStackLocation( next )->FileObject != filter->file ) continue;
+        if ( req->after_sequence >= filter->before ) continue;
+        return next;
+    }
+
+    return nullptr;
+}
+
+VOID hv_events::csq_acquire_lock( _In_ PIO_CSQ csq, _Out_ PKIRQL irql )
+{
+    UNREFERENCED_PARAMETER( csq );
+    KeAcquireSpinLock( &lock_, irql );
+}
+
+VOID hv_events::csq_release_lock( _In_ PIO_CSQ csq, _In_ KIRQL irql )
+{
+    UNREFERENCED_PARAMETER( csq );
+    KeReleaseSpinLock( &lock_, irql );
+}
+
+VOID hv_events::csq_complete_canceled( _In_ PIO_CSQ csq, _In_ PIRP irp )
+{
+    UNREFERENCED_PARAMETER( csq );
+
+    irp->IoStatus.Status = STATUS_CANCELLED;
+    irp->IoStatus.Information = 0;
+    IoCompleteRequest( irp, IO_NO_INCREMENT );
+}
\ No newline at end of file
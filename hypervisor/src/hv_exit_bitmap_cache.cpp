@@ -0,0 +1,108 @@
+#include "../stdafx.h"
+
+static const ULONG exit_bitmap_tag = 'bxeH'; // 'Hexb'
+
+void hv_exit_bitmap_cache::shutdown( )
+{
+    for ( ULONG i = 0; i < max_sets_; ++i )
+    {
+        if ( sets_[ i ].pages ) free_set( sets_[ i ] );
+    }
+}
+
+NTSTATUS hv_exit_bitmap_cache::acquire( _In_ ULONG policy_id, _Outptr_ const bitmap_set** out_set )
+{
+    if ( !out_set ) return STATUS_INVALID_PARAMETER;
+    *out_set = nullptr;
+
+    const hv_exit_bitmap::policy* policy = hv_exit_bitmap::catalog::find( policy_id );
+    if ( !policy ) return STATUS_INVALID_PARAMETER;
+
+    // same policy, same bytes, no need to build anything
+    for ( ULONG i = 0; i < max_sets_; ++i )
+    {
+        if ( sets_[ i ].pages && sets_[ i ].policy_id == policy_id )
+        {
+            ++sets_[ i ].refs;
+            *out_set = &sets_[ i ];
+            return STATUS_SUCCESS;
+        }
+    }
+
+    // pool allocations of a page or more are page aligned, each bitmap gets its own page
+    PUCHAR pages = static_cast< PUCHAR >( ExAllocatePoolWithTag( NonPagedPoolNx, set_bytes_, exit_bitmap_tag ) );
+    if ( !pages ) return STATUS_INSUFFICIENT_RESOURCES;
+
+    hv_exit_bitmap::build_msr_bitmap( *policy, pages );
+    hv_exit_bitmap::build_io_bitmaps( *policy, pages + hv_exit_bitmap::bitmap_bytes, pages + 2 * hv_exit_bitmap::bitmap_bytes );
+    const ULONG crc = hv_page_hash::crc32c_buffer( pages, set_bytes_ );
+
+    // a different policy may still come out identical (same rules written another way)
+    LONG free_index = -1;
+    for ( ULONG i = 0; i < max_sets_; ++i )
+    {
+        if ( !sets_[ i ].pages )
+        {
+            if ( free_index < 0 ) free_index = static_cast< LONG >( i );
+            continue;
+        }
+
+        if ( sets_[ i ].crc == crc && RtlCompareMemory( sets_[ i ].pages, pages, set_bytes_ ) == set_bytes_ )
+        {
+            ExFreePoolWithTag( pages, exit_bitmap_tag );
+            ++sets_[ i ].refs;
+            *out_set = &sets_[ i ];
+            return STATUS_SUCCESS;
+        }
+    }
+
+    if ( free_index < 0 )
+    {
+        ExFreePoolWithTag( pages, exit_bitmap_tag );
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    bitmap_set& set = sets_[ free_index ];
+    set.refs = 1;
+    set.policy_id = policy_id;
+    set.crc = crc;
+    set.pages = pages;
+    set.msr_physical = static_cast< ULONG64 >( MmGetPhysicalAddress( pages ).QuadPart );
+    set.io_a_physical = static_cast< ULONG64 >( MmGetPhysicalAddress( pages + hv_exit_bitmap::bitmap_bytes ).QuadPart );
+    set.io_b_physical = static_cast< ULONG64 >( MmGetPhysicalAddress( pages + 2 * hv_exit_bitmap::bitmap_bytes ).QuadPart );
+
+    hv_logger::log( hv_logger::level::info, "hv_exit_bitmap_cache::acquire: built exit bitmaps for policy %s (msr=0x%llx, io_a=0x%llx, io_b=0x%llx)",
+        policy->name, set.msr_physical, set.io_a_physical, set.io_b_physical );
+
+    *out_set = &set;
+    return STATUS_SUCCESS;
+}
+
+void hv_exit_bitmap_cache::release( _In_ const bitmap_set* set )
+{
+    if ( !set ) return;
+
+    for ( ULONG i = 0; i < max_sets_; ++i )
+    {
+        if ( &sets_[ i ] != set ) continue;
+        if ( sets_[ i ].refs && --sets_[ i ].refs == 0 ) free_set( sets_[ i ] );
+        return;
+    }
+}
+
+ULONG hv_exit_bitmap_cache::get_set_count( ) const
+{
+    ULONG count = 0;
+    for ( ULONG i = 0; i < max_sets_; ++i )
+    {
+        if ( sets_[ i ].pages ) ++count;
+    }
+
+    return count;
+}
+
+void hv_exit_bitmap_cache::free_set( _Inout_ bitmap_set& set )
+{
+    ExFreePoolWithTag( set.pages, exit_bitmap_tag );
+    set = bitmap_set{ };
+}
\ No newline at end of file
@@ -0,0 +1,87 @@
+#include "../stdafx.h"
+
+static const ULONG page_share_tag = 'hspH'; // 'Hpsh'
+
+void hv_page_share::shutdown( )
+{
+    // every sandbox is gone by now, whatever is left lost its references to a bug, free it anyway
+    for ( ULONG bucket = 0; bucket < bucket_count_; ++bucket )
+    {
+        while ( shared_page* shared = by_hpa_[ bucket ] )
+        {
+            by_hpa_[ bucket ] = shared->next_by_hpa;
+            hv_ept::free_guest_page( shared->page );
+            ExFreePoolWithTag( shared, page_share_tag );
+        }
+
+        by_digest_[ bucket ] = nullptr;
+    }
+
+    if ( page_count_ ) hv_logger::log( hv_logger::level::warning, "hv_page_share::shutdown: freed %llu shared pages still holding %llu references", page_count_, ref_count_ );
+    page_count_ = 0;
+    ref_count_ = 0;
+}
+
+const hv_page_share::shared_page* hv_page_share::find( _In_ ULONG64 digest, _In_ const void* content ) const
+{
+    if ( !content ) return nullptr;
+
+    for ( const shared_page* shared = by_digest_[ bucket_of( digest ) ]; shared; shared = shared->next_by_digest )
+    {
+        if ( shared->digest == digest && RtlCompareMemory( shared->page, content, PAGE_SIZE ) == PAGE_SIZE ) return shared;
+    }
+
+    return nullptr;
+}
+
+const hv_page_share::shared_page* hv_page_share::adopt( _In_ ULONG64 digest, _In_ void* page, _In_ ULONG64 hpa )
+{
+    if ( !page ) return nullptr;
+
+    shared_page* shared = static_cast< shared_page* >( ExAllocatePoolWithTag( NonPagedPoolNx, sizeof( shared_page ), page_share_tag ) );
+    if ( !shared ) return nullptr;
+
+    *shared = shared_page{ };
+    shared->digest = digest;
+    shared->hpa = hpa;
+    shared->page = page;
+    shared->refs = 1;
+
+    shared->next_by_digest = by_digest_[ bucket_of( digest ) ];
+    by_digest_[ bucket_of( digest ) ] = shared;
+    shared->next_by_hpa = by_hpa_[ bucket_of( hpa >> 12 ) ];
+    by_hpa_[ bucket_of( hpa >> 12 ) ] = shared;
+
+    ++page_count_;
+    ++ref_count_;
+    return shared;
+}
+
+void hv_page_share::acquire( _In_ const shared_page* shared )
+{
+    if ( !shared ) return;
+
+    ++const_cast< shared_page* >( shared )->refs;
+    ++ref_count_;
+}
+
+void hv_page_share::release( _In_ ULONG64 hpa )
+{
+    shared_page** link = &by_hpa_[ bucket_of( hpa >> 12 ) ];
+    while ( *link && ( *link )->hpa != hpa ) link = &( *link )->next_by_hpa;
+
+    shared_page* shared = *link;
+    if ( !shared ) return;
+
+    --ref_count_;
+    if ( --shared->refs ) return;
+
+    *link = shared->next_by_hpa;
+    shared_page** digest_link = &by_digest_[ bucket_of( shared->digest ) ];
+    while ( *digest_link != shared ) digest_link = &( *digest_link )->next_by_digest;
+    *digest_link = shared->next_by_digest;
+
+    hv_ept::free_guest_page( shared->page );
+    ExFreePoolWithTag( shared, page_share_tag );
+    --page_count_;
+}
\ No newline at end of file
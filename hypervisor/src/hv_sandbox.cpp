@@ -1,5 +1,7 @@
 #include "../stdafx.h"
 
+static const ULONG sandbox_tag = 'bsvH';
+
 struct scoped_spin_lock
 {
     KSPIN_LOCK* lock{ nullptr };
@@ -16,63 +18,113 @@ struct scoped_spin_lock
     }
 };
 
+static ULONG64 elapsed_us( _In_ LARGE_INTEGER started, _In_ LARGE_INTEGER frequency )
+{
+    const LARGE_INTEGER finished = KeQueryPerformanceCounter( nullptr );
+    return frequency.QuadPart ? static_cast< ULONG64 >( finished.QuadPart - started.QuadPart ) * 1000000 / static_cast< ULONG64 >( frequency.QuadPart ) : 0;
+}
+
+// what reclaiming an ept gives back: its private guest pages and its tables
+static ULONG64 reclaimable_bytes( _In_ const hv_ept& ept )
+{
+    return ( ept.get_guest_bytes( ) / PAGE_SIZE - ept.get_shared_pages( ) ) * PAGE_SIZE + ept.get_alloc_bytes( );
+}
+
 NTSTATUS hv_sandbox_manager::initialize( )
 {
     KeInitializeSpinLock( &lock_ );
     RtlZeroMemory( entries_, sizeof( entries_ ) );
-    hv_logger::log( hv_logger::level::info, "hv_sandbox_manager::initialize: ready (capacity=%u)", max_sandboxes_ );
+    hash_engine_ = hv_page_hash::select_engine( );
+
+    NTSTATUS status = scheduler_.initialize( );
+    if ( !NT_SUCCESS( status ) ) return status;
+
+    status = vpids_.initialize( scheduler_.get_processor_count( ), max_sandboxes_ );
+    if ( !NT_SUCCESS( status ) )
+    {
+        scheduler_.shutdown( );
+        return status;
+    }
+
+    status = start_reclaim_service( );
+    if ( !NT_SUCCESS( status ) )
+    {
+        vpids_.shutdown( );
+        scheduler_.shutdown( );
+        return status;
+    }
+
+    status = start_merge_service( );
+    if ( !NT_SUCCESS( status ) )
+    {
+        stop_reclaim_service( );
+        vpids_.shutdown( );
+        scheduler_.shutdown( );
+        return status;
+    }
+
+    hv_logger::log( hv_logger::level::info, "hv_sandbox_manager::initialize: ready (capacity=%u, page hash=%s)", max_sandboxes_, hv_page_hash::engine_name( hash_engine_ ) );
     return STATUS_SUCCESS;
 }
 
 void hv_sandbox_manager::shutdown( )
 {
-    scoped_spin_lock guard( &lock_ );
+    // no pass may run while the entries go away
+    stop_merge_service( );
+
+    // every sandbox goes the way a destroy sends it, the lock is only held to unpublish one at a time and the
+    // reclaim thread frees the memory with it dropped between batches
     for ( ULONG i = 0; i < max_sandboxes_; ++i )
     {
-        if ( entries_[ i ].active )
-        {
-            entries_[ i ].ept.destroy( );
-            entries_[ i ].active = FALSE;
-            entries_[ i ].id = 0;
-            entries_[ i ].created.QuadPart = 0;
-        }
+        retired_sandbox* retired = allocate_retired( );
+
+        scoped_spin_lock guard( &lock_ );
+        if ( entries_[ i ].active ) release_entry( entries_[ i ], retired );
+        else if ( retired ) ExFreePoolWithTag( retired, sandbox_tag );
     }
 
+    stop_reclaim_service( );
+
+    // every vcpu is off the run queues and every shared page lost its last mapping now
+    scheduler_.shutdown( );
+    vpids_.shutdown( );
+    page_share_.shutdown( );
+
     hv_logger::log( hv_logger::level::info, "hv_sandbox_manager::shutdown: all sandboxes cleared" );
 }
 
-NTSTATUS hv_sandbox_manager::create_sandbox( _In_ ULONG id )
+NTSTATUS hv_sandbox_manager::create_sandbox( _In_ ULONG id, _In_ ULONG exit_policy, _In_ ULONG vcpu_count )
 {
-    if ( id == 0 ) return STATUS_INVALID_PARAMETER;
-    scoped_spin_lock guard( &lock_ );
-    if ( find_entry_by_id( id ) >= 0 ) return STATUS_OBJECT_NAME_COLLISION;
+    if ( id == 0 || exit_policy >= HV_EXIT_POLICY_COUNT ) return STATUS_INVALID_PARAMETER;
+    if ( vcpu_count == 0 || vcpu_count > HV_SANDBOX_MAX_VCPUS ) return STATUS_INVALID_PARAMETER;
 
-    LONG free_index = find_free_slot( );
-    if ( free_index < 0 ) return STATUS_INSUFFICIENT_RESOURCES;
-
-    // we build a test ept for our sandbox (this is data structure only ofc)
-    NTSTATUS status = entries_[ free_index ].ept.build_identity_map( );
+    // we build a test ept for our sandbox (this is data structure only ofc). It costs a zeroed page per guest
+    // page, so it is built before the registry lock and only moved into the claimed slot under it
+    hv_ept ept;
+    NTSTATUS status = ept.build_guest_map( );
     if ( !NT_SUCCESS( status ) )
     {
         hv_logger::log( hv_logger::level::error, "hv_sandbox_manager::create_sandbox: ept build failed (0x%08x)", status );
         return status;
     }
 
-    entries_[ free_index ].id = id;
-    entries_[ free_index ].active = TRUE;
-
-#if (NTDDI_VERSION >= NTDDI_WIN8)
-    KeQuerySystemTimePrecise( &entries_[ free_index ].created );
-#else
-    KeQuerySystemTime( &entries_[ free_index ].created );
-#endif
+    {
+        scoped_spin_lock guard( &lock_ );
+        LONG free_index = -1;
+        if ( find_entry_by_id( id ) >= 0 ) status = STATUS_OBJECT_NAME_COLLISION;
+        else if ( ( free_index = find_free_slot( ) ) < 0 ) status = STATUS_INSUFFICIENT_RESOURCES;
+        else status = install_entry( entries_[ free_index ], id, exit_policy, vcpu_count, ept );
+    }
 
-    hv_logger::log( hv_logger::level::info,
-        "hv_sandbox_manager::create_sandbox: id=%u created (ept_pages=%llu, bytes=%llu)",
-        id,
-        entries_[ free_index ].ept.get_page_count( ),
-        entries_[ free_index ].ept.get_alloc_bytes( ) );
+    if ( !NT_SUCCESS( status ) )
+    {
+        // nothing was published, the guest map is freed outside the lock as well
+        ept.destroy( );
+        return status;
+    }
 
+    // posted after the registry lock is dropped, like every event the manager raises
+    hv_events::post( HV_EVENT_SANDBOX_CREATED, id, exit_policy, STATUS_SUCCESS );
     return STATUS_SUCCESS;
 }
 
@@ -80,16 +132,30 @@ NTSTATUS hv_sandbox_manager::destroy_sandbox( _In_ ULONG id )
 {
     if ( id == 0 ) return STATUS_INVALID_PARAMETER;
 
-    scoped_spin_lock guard( &lock_ );
-    LONG idx = find_entry_by_id( id );
-    if ( idx < 0 ) return STATUS_NOT_FOUND;
+    // allocated before the lock is taken, all the lock covers is unpublishing the sandbox
+    retired_sandbox* retired = allocate_retired( );
+
+    {
+        scoped_spin_lock guard( &lock_ );
+        LARGE_INTEGER frequency = {};
+        const LARGE_INTEGER started = KeQueryPerformanceCounter( &frequency );
+
+        LONG idx = find_entry_by_id( id );
+        if ( idx < 0 )
+        {
+            if ( retired ) ExFreePoolWithTag( retired, sandbox_tag );
+            return STATUS_NOT_FOUND;
+        }
+
+        release_entry( entries_[ idx ], retired );
+
+        reclaim_stats_.last_destroy_us = elapsed_us( started, frequency );
+        if ( reclaim_stats_.last_destroy_us > reclaim_stats_.longest_destroy_us ) reclaim_stats_.longest_destroy_us = reclaim_stats_.last_destroy_us;
 
-    entries_[ idx ].ept.destroy( );
-    entries_[ idx ].active = FALSE;
-    entries_[ idx ].id = 0;
-    entries_[ idx ].created.QuadPart = 0;
+        hv_logger::log( hv_logger::level::info, "hv_sandbox_manager::destroy_sandbox: id=%u destroyed", id );
+    }
 
-    hv_logger::log( hv_logger::level::info, "hv_sandbox_manager::destroy_sandbox: id=%u destroyed", id );
+    hv_events::post( HV_EVENT_SANDBOX_DESTROYED, id, 0, STATUS_SUCCESS );
     return STATUS_SUCCESS;
 }
 
@@ -115,6 +181,492 @@ NTSTATUS hv_sandbox_manager::list_sandboxes( _Out_writes_opt_( max_ids ) ULONG*
     return STATUS_SUCCESS;
 }
 
+NTSTATUS hv_sandbox_manager::enumerate_sandboxes( _In_ ULONG cursor, _Out_writes_( max_records ) hv_sandbox_record* records, _In_ ULONG max_records, _Out_ ULONG* out_count, _Out_ ULONG* out_next_cursor ) const
+{
+    if ( !records || !out_count || !out_next_cursor || max_records == 0 ) return STATUS_INVALID_PARAMETER;
+    *out_count = 0;
+    *out_next_cursor = HV_ENUM_CURSOR_END;
+
+    ULONG slot = cursor;
+    while ( slot < max_sandboxes_ && *out_count < max_records )
+    {
+        scoped_spin_lock guard( const_cast< KSPIN_LOCK* >( &lock_ ) );
+
+        const ULONG chunk_end = max_sandboxes_ - slot > enum_chunk_slots_ ? slot + enum_chunk_slots_ : max_sandboxes_;
+        for ( ; slot < chunk_end && *out_count < max_records; ++slot )
+        {
+            const sandbox_entry& entry = entries_[ slot ];
+            if ( !entry.active ) continue;
+
+            hv_sandbox_record& record = records[ ( *out_count )++ ];
+            RtlZeroMemory( &record, sizeof( record ) );
+            record.id = entry.id;
+            record.state = entry.faults ? HV_SANDBOX_STATE_FAULTED : HV_SANDBOX_STATE_READY;
+            record.created = static_cast< ULONG64 >( entry.created.QuadPart );
+            record.ept_pages = entry.ept.get_page_count( );
+            record.ept_bytes = entry.ept.get_alloc_bytes( );
+            record.guest_bytes = entry.ept.get_guest_bytes( );
+            record.exit_policy = entry.exit_policy;
+            record.vcpu_count = entry.vcpu_count;
+            record.bytes_read = entry.bytes_read;
+            record.bytes_written = entry.bytes_written;
+            record.faults = entry.faults;
+            record.scans = entry.scans;
+            record.changed_pages = entry.changed_pages;
+            record.shared_bytes = entry.ept.get_shared_pages( ) * PAGE_SIZE;
+            record.cow_breaks = entry.cow_breaks;
+        }
+    }
+
+    if ( slot < max_sandboxes_ ) *out_next_cursor = slot;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS hv_sandbox_manager::copy_guest_memory( _In_ ULONG id, _In_ ULONG64 gpa, _Inout_updates_bytes_( length ) void* buffer, _In_ ULONG64 length, _In_ BOOLEAN write, _Out_ ULONG64* out_copied )
+{
+    if ( id == 0 || !buffer || !out_copied ) return STATUS_INVALID_PARAMETER;
+    if ( gpa + length < gpa ) return STATUS_INTEGER_OVERFLOW;
+
+    PUCHAR cursor = static_cast< PUCHAR >( buffer );
+    const ULONG64 access = write ? hv_ept_walk::ept_write : hv_ept_walk::ept_read;
+    NTSTATUS status = STATUS_SUCCESS;
+    ULONG64 done = 0;
+    bool faulted = false;
+
+    while ( done < length )
+    {
+        // re-resolve under the lock on every run, the sandbox may be destroyed between two chunks
+        scoped_spin_lock guard( &lock_ );
+        LONG idx = find_entry_by_id( id );
+        if ( idx < 0 )
+        {
+            status = STATUS_NOT_FOUND;
+            break;
+        }
+
+        hv_ept_walk::run run = {};
+        status = entries_[ idx ].ept.resolve_run( gpa + done, hv_ept_walk::chunk_limit( done, length, max_copy_chunk_ ), access, &run );
+        if ( !NT_SUCCESS( status ) )
+        {
+            // what would be an ept violation for a running guest, a write to a merged page just gets its own
+            // copy and the run is resolved again
+            if ( NT_SUCCESS( handle_ept_violation( entries_[ idx ], gpa + done, access ) ) ) continue;
+
+            ++entries_[ idx ].faults;
+            faulted = true;
+            break;
+        }
+
+        if ( write ) RtlCopyMemory( run.host_va, cursor + done, ( SIZE_T )run.length );
+        else RtlCopyMemory( cursor + done, run.host_va, ( SIZE_T )run.length );
+
+        if ( write )
+        {
+            entries_[ idx ].bytes_written += run.length;
+            if ( entries_[ idx ].walk_cache ) entries_[ idx ].walk_cache->invalidate( );
+        }
+        else entries_[ idx ].bytes_read += run.length;
+
+        done += run.length;
+    }
+
+    if ( faulted ) hv_events::post( HV_EVENT_SANDBOX_FAULTED, id, gpa + done, status );
+
+    *out_copied = done;
+    return status;
+}
+
+NTSTATUS hv_sandbox_manager::scan_sandbox( _In_ ULONG id, _In_ ULONG flags, _In_ ULONG start_page, _Out_writes_( max_changed ) ULONG* changed_pages, _In_ ULONG max_changed, _Out_ hv_scan_result* result )
+{
+    if ( !result ) return STATUS_INVALID_PARAMETER;
+    RtlZeroMemory( result, sizeof( *result ) );
+    if ( id == 0 || !changed_pages || max_changed == 0 ) return STATUS_INVALID_PARAMETER;
+
+    ULONG page = start_page;
+    for ( ;; )
+    {
+        // like copy_guest_memory the lock is dropped every scan_chunk_pages_ so a scan never stalls the registry
+        scoped_spin_lock guard( &lock_ );
+        LONG idx = find_entry_by_id( id );
+        if ( idx < 0 ) return STATUS_NOT_FOUND;
+
+        sandbox_entry& entry = entries_[ idx ];
+        const ULONG guest_pages = static_cast< ULONG >( entry.ept.get_guest_bytes( ) / PAGE_SIZE );
+        result->guest_pages = guest_pages;
+        if ( page >= guest_pages )
+        {
+            ++entry.scans;
+            break;
+        }
+
+        if ( !entry.page_digests )
+        {
+            const SIZE_T digest_bytes = sizeof( ULONG64 ) * guest_pages;
+            entry.page_digests = static_cast< ULONG64* >( ExAllocatePoolWithTag( NonPagedPoolNx, digest_bytes, sandbox_tag ) );
+            if ( !entry.page_digests ) return STATUS_INSUFFICIENT_RESOURCES;
+            RtlZeroMemory( entry.page_digests, digest_bytes );
+        }
+
+        const ULONG chunk_end = guest_pages - page > scan_chunk_pages_ ? page + scan_chunk_pages_ : guest_pages;
+        while ( page < chunk_end )
+        {
+            hv_ept_walk::run run = {};
+            NTSTATUS status = entry.ept.resolve_run( static_cast< ULONG64 >( page ) * PAGE_SIZE, static_cast< ULONG64 >( chunk_end - page ) * PAGE_SIZE, hv_ept_walk::ept_read, &run );
+            if ( !NT_SUCCESS( status ) )
+            {
+                // not readable through the ept, nothing to hash
+                ++page;
+                continue;
+            }
+
+            const PUCHAR host = static_cast< PUCHAR >( run.host_va );
+            for ( ULONG64 offset = 0; offset < run.length; offset += PAGE_SIZE )
+            {
+                // low bit forced on so a recorded digest is never confused with "no baseline"
+                const ULONG64 digest = hv_page_hash::digest( hash_engine_, host + offset ) | 1;
+                ULONG64& baseline = entry.page_digests[ page ];
+                const bool changed = baseline != 0 && baseline != digest && !( flags & HV_SCAN_REBASELINE );
+
+                if ( changed )
+                {
+                    if ( result->changed_count == max_changed )
+                    {
+                        result->next_page = page;
+                        return STATUS_SUCCESS;
+                    }
+                    changed_pages[ result->changed_count++ ] = page;
+                    ++entry.changed_pages;
+                }
+
+                if ( !changed || !( flags & HV_SCAN_KEEP_BASELINE ) ) baseline = digest;
+                ++result->pages_scanned;
+                ++page;
+            }
+        }
+    }
+
+    result->next_page = page;
+    return STATUS_SUCCESS;
+}
+
+static_assert( static_cast< ULONG >( hv_gva_walk::status::mapped ) == HV_GVA_MAPPED &&
+    static_cast< ULONG >( hv_gva_walk::status::not_present ) == HV_GVA_NOT_PRESENT &&
+    static_cast< ULONG >( hv_gva_walk::status::ept_fault ) == HV_GVA_EPT_FAULT &&
+    static_cast< ULONG >( hv_gva_walk::status::non_canonical ) == HV_GVA_NON_CANONICAL, "hv_gva_walk status values are the ioctl ones" );
+static_assert( hv_gva_walk::access_write == HV_GVA_ACCESS_WRITE && hv_gva_walk::access_user == HV_GVA_ACCESS_USER &&
+    hv_gva_walk::access_execute == HV_GVA_ACCESS_EXECUTE, "hv_gva_walk access bits are the ioctl ones" );
+
+NTSTATUS hv_sandbox_manager::translate_guest_range( _In_ ULONG id, _In_ ULONG flags, _In_ ULONG64 cr3, _In_ ULONG64 gva, _In_ ULONG64 length, _Out_writes_( max_records ) hv_gva_record* records, _In_ ULONG max_records, _Out_ hv_gva_result* result )
+{
+    if ( !result ) return STATUS_INVALID_PARAMETER;
+    RtlZeroMemory( result, sizeof( *result ) );
+    if ( id == 0 || !records || max_records == 0 ) return STATUS_INVALID_PARAMETER;
+
+    // the range may run up to the very top of the address space, end then wraps to 0
+    if ( length == 0 ) length = 1;
+    if ( length - 1 > ~gva ) return STATUS_INTEGER_OVERFLOW;
+
+    const ULONG levels = ( flags & HV_GVA_LA57 ) ? 5 : 4;
+    const ULONG64 root = cr3 & hv_gva_walk::pte_pfn_mask;
+    const ULONG64 end = gva + length;
+    hv_gva_walk::range_stats stats = {};
+    ULONG64 next = gva;
+    bool full = false;
+
+    auto emit = [ records, max_records, result, &full ]( const hv_gva_walk::span_record& span ) -> bool
+    {
+        if ( result->record_count )
+        {
+            hv_gva_record& last = records[ result->record_count - 1 ];
+            const hv_gva_walk::span_record previous = { last.gva, last.length, last.gpa, last.hpa, static_cast< hv_gva_walk::status >( last.status ), last.access };
+            if ( hv_gva_walk::continues( previous, span ) )
+            {
+                last.length += span.length;
+                return true;
+            }
+        }
+
+        if ( result->record_count == max_records )
+        {
+            full = true;
+            return false;
+        }
+
+        hv_gva_record& record = records[ result->record_count++ ];
+        record.gva = span.gva;
+        record.length = span.length;
+        record.gpa = span.gpa;
+        record.hpa = span.hpa;
+        record.status = static_cast< ULONG >( span.result );
+        record.access = span.access;
+        return true;
+    };
+
+    while ( next != end && !full )
+    {
+        // like copy_guest_memory the sandbox is looked up again for every chunk
+        scoped_spin_lock guard( &lock_ );
+        LONG idx = find_entry_by_id( id );
+        if ( idx < 0 ) return STATUS_NOT_FOUND;
+
+        sandbox_entry& entry = entries_[ idx ];
+        if ( !entry.walk_cache )
+        {
+            entry.walk_cache = static_cast< hv_gva_walk::walk_cache* >( ExAllocatePoolWithTag( NonPagedPoolNx, sizeof( hv_gva_walk::walk_cache ), sandbox_tag ) );
+            if ( !entry.walk_cache ) return STATUS_INSUFFICIENT_RESOURCES;
+            RtlZeroMemory( entry.walk_cache, sizeof( hv_gva_walk::walk_cache ) );
+        }
+
+        // the cache holds host pointers to guest tables, they are only good for the ept they were resolved through
+        const hv_ept& ept = entry.ept;
+        if ( !entry.walk_cache->matches( root, levels, ept.get_generation( ) ) ) entry.walk_cache->reset( root, levels, ept.get_generation( ) );
+
+        next = hv_gva_walk::translate_range( root, levels, next, end, translate_chunk_steps_, ( flags & HV_GVA_NO_CACHE ) ? nullptr : entry.walk_cache,
+            [ &ept ]( ULONG64 gpa ) -> const ULONG64*
+            {
+                hv_ept_walk::run run = {};
+                if ( !NT_SUCCESS( ept.resolve_run( gpa, PAGE_SIZE, hv_ept_walk::ept_read, &run ) ) || run.length != PAGE_SIZE ) return nullptr;
+                return static_cast< const ULONG64* >( run.host_va );
+            },
+            [ &ept ]( ULONG64 gpa, ULONG64& hpa, ULONG64& span ) -> bool
+            {
+                hv_ept_walk::translation t = {};
+                if ( !NT_SUCCESS( ept.translate( gpa, &t ) ) ) return false;
+                hpa = t.hpa;
+                span = t.page_size - ( gpa & ( t.page_size - 1 ) );
+                return true;
+            },
+            emit, stats );
+    }
+
+    result->next_gva = next;
+    result->translations = stats.translations;
+    result->cache_hits = stats.cache_hits;
+    result->table_reads = stats.table_reads;
+    result->ept_walks = stats.ept_walks;
+    return STATUS_SUCCESS;
+}
+
+void hv_sandbox_manager::query_merge_stats( _Out_ hv_merge_stats* out ) const
+{
+    if ( !out ) return;
+
+    scoped_spin_lock guard( const_cast< KSPIN_LOCK* >( &lock_ ) );
+    *out = merge_stats_;
+    out->shared_pages = page_share_.get_page_count( );
+    out->shared_mappings = page_share_.get_ref_count( );
+
+    // every shared page stands in for all its mappings but one
+    out->saved_bytes = ( out->shared_mappings - out->shared_pages ) * PAGE_SIZE;
+}
+
+void hv_sandbox_manager::query_reclaim_stats( _Out_ hv_reclaim_stats* out ) const
+{
+    if ( !out ) return;
+
+    scoped_spin_lock guard( const_cast< KSPIN_LOCK* >( &lock_ ) );
+    *out = reclaim_stats_;
+}
+
+NTSTATUS hv_sandbox_manager::prepare_vcpu_entry( _In_ ULONG cpu, _In_ const hv_sched::vcpu* v, _Out_ hv_vpid::entry_plan* plan )
+{
+    if ( !plan ) return STATUS_INVALID_PARAMETER;
+    RtlZeroMemory( plan, sizeof( *plan ) );
+    if ( !v ) return STATUS_INVALID_PARAMETER;
+
+    scoped_spin_lock guard( &lock_ );
+    LONG idx = find_entry_by_id( v->sandbox_id );
+    if ( idx < 0 ) return STATUS_NOT_FOUND;
+
+    // the ept generation moves on every remap (merging, copy on write), exactly when its cached
+    // guest physical translations go stale
+    const hv_ept& ept = entries_[ idx ].ept;
+    vpids_.plan_entry( cpu, v->vpid, ept.get_eptp( ), ept.get_generation( ), plan );
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS hv_sandbox_manager::handle_ept_violation( _Inout_ sandbox_entry& entry, _In_ ULONG64 gpa, _In_ ULONG64 access )
+{
+    // merged pages stay readable and executable, only a write to one is ours to resolve
+    if ( !( access & hv_ept_walk::ept_write ) || !entry.ept.is_shared( gpa ) ) return STATUS_ACCESS_VIOLATION;
+
+    ULONG64 shared_hpa = 0;
+    NTSTATUS status = entry.ept.unshare_page( gpa, &shared_hpa );
+    if ( !NT_SUCCESS( status ) ) return status;
+
+    page_share_.release( shared_hpa );
+    ++entry.cow_breaks;
+    ++merge_stats_.cow_breaks;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS hv_sandbox_manager::start_merge_service( )
+{
+    const SIZE_T candidate_bytes = sizeof( hv_page_merge::candidate ) * merge_candidate_slots_;
+    merge_candidates_ = static_cast< hv_page_merge::candidate* >( ExAllocatePoolWithTag( NonPagedPoolNx, candidate_bytes, sandbox_tag ) );
+    if ( !merge_candidates_ ) return STATUS_INSUFFICIENT_RESOURCES;
+    RtlZeroMemory( merge_candidates_, candidate_bytes );
+    RtlZeroMemory( &merge_stats_, sizeof( merge_stats_ ) );
+
+    KeInitializeEvent( &merge_stop_, NotificationEvent, FALSE );
+
+    HANDLE thread = nullptr;
+    NTSTATUS status = PsCreateSystemThread( &thread, THREAD_ALL_ACCESS, nullptr, nullptr, nullptr, merge_thread, this );
+    if ( NT_SUCCESS( status ) )
+    {
+        status = ObReferenceObjectByHandle( thread, THREAD_ALL_ACCESS, *PsThreadType, KernelMode, reinterpret_cast< PVOID* >( &merge_thread_ ), nullptr );
+        if ( !NT_SUCCESS( status ) )
+        {
+            // without the object there is nothing to wait on later, stop it right away
+            KeSetEvent( &merge_stop_, IO_NO_INCREMENT, FALSE );
+            ZwWaitForSingleObject( thread, FALSE, nullptr );
+        }
+
+        ZwClose( thread );
+    }
+
+    if ( !NT_SUCCESS( status ) )
+    {
+        hv_logger::log( hv_logger::level::error, "hv_sandbox_manager::start_merge_service: merge thread failed (0x%08x)", status );
+        ExFreePoolWithTag( merge_candidates_, sandbox_tag );
+        merge_candidates_ = nullptr;
+        merge_thread_ = nullptr;
+        return status;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+void hv_sandbox_manager::stop_merge_service( )
+{
+    if ( merge_thread_ )
+    {
+        KeSetEvent( &merge_stop_, IO_NO_INCREMENT, FALSE );
+        KeWaitForSingleObject( merge_thread_, Executive, KernelMode, FALSE, nullptr );
+        ObDereferenceObject( merge_thread_ );
+        merge_thread_ = nullptr;
+    }
+
+    if ( merge_candidates_ )
+    {
+        ExFreePoolWithTag( merge_candidates_, sandbox_tag );
+        merge_candidates_ = nullptr;
+    }
+
+    hv_logger::log( hv_logger::level::info, "hv_sandbox_manager::stop_merge_service: %llu passes, %llu merges, %llu cow breaks",
+        merge_stats_.passes, merge_stats_.merges, merge_stats_.cow_breaks );
+}
+
+VOID hv_sandbox_manager::merge_thread( _In_ PVOID context )
+{
+    hv_sandbox_manager* manager = static_cast< hv_sandbox_manager* >( context );
+
+    LARGE_INTEGER interval = {};
+    interval.QuadPart = -static_cast< LONGLONG >( merge_interval_ms_ ) * 10000;
+
+    // the stop event doubles as the pass timer
+    while ( KeWaitForSingleObject( &manager->merge_stop_, Executive, KernelMode, FALSE, &interval ) == STATUS_TIMEOUT )
+    {
+        manager->merge_pass( );
+    }
+
+    PsTerminateSystemThread( STATUS_SUCCESS );
+}
+
+void hv_sandbox_manager::merge_pass( )
+{
+    LARGE_INTEGER frequency = {};
+    const LARGE_INTEGER started = KeQueryPerformanceCounter( &frequency );
+
+    // only this thread touches the table, it is rebuilt every pass so it never points at a stale page for long
+    hv_page_merge::candidate_table candidates( merge_candidates_, merge_candidate_slots_ );
+    candidates.clear( );
+
+    for ( ULONG slot = 0; slot < max_sandboxes_; ++slot )
+    {
+        ULONG id = 0;
+        ULONG page = 0;
+
+        for ( ;; )
+        {
+            // like scan_sandbox the lock is dropped every merge_chunk_pages_, the slot may be destroyed or
+            // reused by another sandbox in between which ends this one
+            scoped_spin_lock guard( &lock_ );
+            sandbox_entry& entry = entries_[ slot ];
+            if ( !entry.active || ( id != 0 && entry.id != id ) ) break;
+            id = entry.id;
+
+            const ULONG guest_pages = static_cast< ULONG >( entry.ept.get_guest_bytes( ) / PAGE_SIZE );
+            if ( page >= guest_pages ) break;
+
+            if ( !entry.merge_digests )
+            {
+                const SIZE_T digest_bytes = sizeof( ULONG64 ) * guest_pages;
+                entry.merge_digests = static_cast< ULONG64* >( ExAllocatePoolWithTag( NonPagedPoolNx, digest_bytes, sandbox_tag ) );
+                if ( !entry.merge_digests ) break;
+                RtlZeroMemory( entry.merge_digests, digest_bytes );
+            }
+
+            const ULONG chunk_end = guest_pages - page > merge_chunk_pages_ ? page + merge_chunk_pages_ : guest_pages;
+            for ( ; page < chunk_end; ++page ) merge_page( entry, slot, page, candidates );
+        }
+    }
+
+    const ULONG64 pass_us = elapsed_us( started, frequency );
+
+    scoped_spin_lock guard( &lock_ );
+    ++merge_stats_.passes;
+    merge_stats_.last_pass_us = pass_us;
+}
+
+void hv_sandbox_manager::merge_page( _Inout_ sandbox_entry& entry, _In_ ULONG slot, _In_ ULONG page, _Inout_ hv_page_merge::candidate_table& candidates )
+{
+    const ULONG64 gpa = static_cast< ULONG64 >( page ) * PAGE_SIZE;
+    const void* content = entry.ept.get_private_page( gpa );
+    if ( !content ) return;
+
+    // only pages that held still since the previous pass, a busy page would be unshared on its next write
+    const ULONG64 digest = hv_page_merge::tag_digest( hv_page_hash::digest( hash_engine_, content ) );
+    const bool stable = entry.merge_digests[ page ] == digest;
+    entry.merge_digests[ page ] = digest;
+    ++merge_stats_.pages_scanned;
+    if ( !stable ) return;
+
+    const hv_page_share::shared_page* shared = page_share_.find( digest, content );
+    if ( !shared )
+    {
+        // no shared copy yet, an earlier stable page of this pass with the same bytes becomes it
+        const hv_page_merge::candidate* match = candidates.find( digest );
+        sandbox_entry* holder = match ? &entries_[ match->owner ] : nullptr;
+        const ULONG64 holder_gpa = match ? static_cast< ULONG64 >( match->page ) * PAGE_SIZE : 0;
+        const void* holder_content = holder && holder->active && holder->id == match->owner_id ? holder->ept.get_private_page( holder_gpa ) : nullptr;
+
+        if ( !holder_content || holder_content == content || RtlCompareMemory( holder_content, content, PAGE_SIZE ) != PAGE_SIZE )
+        {
+            // first of its kind this pass, or the candidate changed since it was recorded
+            candidates.insert( digest, slot, entry.id, page );
+            return;
+        }
+
+        hv_ept_walk::translation t = {};
+        if ( !NT_SUCCESS( holder->ept.translate( holder_gpa, &t ) ) ) return;
+
+        shared = page_share_.adopt( digest, const_cast< void* >( holder_content ), t.hpa );
+        if ( !shared ) return;
+
+        // cannot fail, holder_content is that private page
+        void* given = nullptr;
+        ULONG64 given_hpa = 0;
+        holder->ept.give_page( holder_gpa, &given, &given_hpa );
+    }
+
+    if ( NT_SUCCESS( entry.ept.share_page( gpa, shared->hpa ) ) )
+    {
+        page_share_.acquire( shared );
+        ++merge_stats_.merges;
+    }
+}
+
 ULONG hv_sandbox_manager::get_active_count( ) const
 {
     ULONG count = 0;
@@ -127,6 +679,293 @@ ULONG hv_sandbox_manager::get_active_count( ) const
     return count;
 }
 
+NTSTATUS hv_sandbox_manager::start_reclaim_service( )
+{
+    RtlZeroMemory( &reclaim_stats_, sizeof( reclaim_stats_ ) );
+    reclaim_head_ = reclaim_tail_ = nullptr;
+    reclaim_stop_ = FALSE;
+    KeInitializeEvent( &reclaim_wake_, SynchronizationEvent, FALSE );
+
+    HANDLE thread = nullptr;
+    NTSTATUS status = PsCreateSystemThread( &thread, THREAD_ALL_ACCESS, nullptr, nullptr, nullptr, reclaim_thread, this );
+    if ( NT_SUCCESS( status ) )
+    {
+        status = ObReferenceObjectByHandle( thread, THREAD_ALL_ACCESS, *PsThreadType, KernelMode, reinterpret_cast< PVOID* >( &reclaim_thread_ ), nullptr );
+        if ( !NT_SUCCESS( status ) )
+        {
+            // same as the merge thread, stop it right away. Nothing is queued yet
+            reclaim_stop_ = TRUE;
+            KeSetEvent( &reclaim_wake_, IO_NO_INCREMENT, FALSE );
+            ZwWaitForSingleObject( thread, FALSE, nullptr );
+        }
+
+        ZwClose( thread );
+    }
+
+    if ( !NT_SUCCESS( status ) )
+    {
+        hv_logger::log( hv_logger::level::error, "hv_sandbox_manager::start_reclaim_service: reclaim thread failed (0x%08x)", status );
+        reclaim_thread_ = nullptr;
+        return status;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+void hv_sandbox_manager::stop_reclaim_service( )
+{
+    if ( reclaim_thread_ )
+    {
+        // from here on release_entry tears down in place, the thread leaves once it has freed what is queued
+        {
+            scoped_spin_lock guard( &lock_ );
+            reclaim_stop_ = TRUE;
+        }
+
+        KeSetEvent( &reclaim_wake_, IO_NO_INCREMENT, FALSE );
+        KeWaitForSingleObject( reclaim_thread_, Executive, KernelMode, FALSE, nullptr );
+        ObDereferenceObject( reclaim_thread_ );
+        reclaim_thread_ = nullptr;
+    }
+
+    hv_logger::log( hv_logger::level::info, "hv_sandbox_manager::stop_reclaim_service: %llu destroys, %llu reclaimed (%llu bytes in %llu batches, longest %llu us), %llu in place",
+        reclaim_stats_.destroys, reclaim_stats_.reclaimed_sandboxes, reclaim_stats_.reclaimed_bytes, reclaim_stats_.batches, reclaim_stats_.longest_batch_us,
+        reclaim_stats_.inline_destroys );
+}
+
+VOID hv_sandbox_manager::reclaim_thread( _In_ PVOID context )
+{
+    hv_sandbox_manager* manager = static_cast< hv_sandbox_manager* >( context );
+
+    for ( ;; )
+    {
+        KeWaitForSingleObject( &manager->reclaim_wake_, Executive, KernelMode, FALSE, nullptr );
+        manager->reclaim_pass( );
+
+        scoped_spin_lock guard( &manager->lock_ );
+        if ( manager->reclaim_stop_ && !manager->reclaim_head_ ) break;
+    }
+
+    PsTerminateSystemThread( STATUS_SUCCESS );
+}
+
+void hv_sandbox_manager::reclaim_pass( )
+{
+    for ( ;; )
+    {
+        retired_sandbox* retired = nullptr;
+        {
+            scoped_spin_lock guard( &lock_ );
+            retired = reclaim_head_;
+            if ( !retired ) return;
+
+            reclaim_head_ = retired->next;
+            if ( !reclaim_head_ ) reclaim_tail_ = nullptr;
+        }
+
+        // off the queue the record is this thread's alone, only hv_page_share needs the lock
+        hv_ept& ept = retired->ept;
+        const ULONG64 guest_pages = ept.get_guest_bytes( ) / PAGE_SIZE;
+        while ( retired->next_page < guest_pages )
+        {
+            LARGE_INTEGER frequency = {};
+            const LARGE_INTEGER started = KeQueryPerformanceCounter( &frequency );
+            const ULONG64 first = retired->next_page;
+
+            if ( ept.get_shared_pages( ) )
+            {
+                scoped_spin_lock guard( &lock_ );
+                release_shared_pages( ept, first, reclaim_chunk_pages_ );
+            }
+
+            const ULONG64 freed_bytes = ept.release_guest_pages( first, reclaim_chunk_pages_ ) * PAGE_SIZE;
+            retired->next_page = first + reclaim_chunk_pages_;
+            const ULONG64 batch_us = elapsed_us( started, frequency );
+
+            scoped_spin_lock guard( &lock_ );
+            reclaim_stats_.pending_bytes -= freed_bytes;
+            reclaim_stats_.reclaimed_bytes += freed_bytes;
+            ++reclaim_stats_.batches;
+            if ( batch_us > reclaim_stats_.longest_batch_us ) reclaim_stats_.longest_batch_us = batch_us;
+        }
+
+        // only the tables are left
+        const ULONG64 table_bytes = ept.get_alloc_bytes( );
+        const ULONG id = retired->id;
+        ept.destroy( );
+        ExFreePoolWithTag( retired, sandbox_tag );
+
+        {
+            scoped_spin_lock guard( &lock_ );
+            reclaim_stats_.pending_bytes -= table_bytes;
+            reclaim_stats_.reclaimed_bytes += table_bytes;
+            --reclaim_stats_.pending_sandboxes;
+            ++reclaim_stats_.reclaimed_sandboxes;
+        }
+
+        hv_logger::log( hv_logger::level::info, "hv_sandbox_manager::reclaim_pass: id=%u reclaimed", id );
+    }
+}
+
+hv_sandbox_manager::retired_sandbox* hv_sandbox_manager::allocate_retired( )
+{
+    // all zero is an empty record around an empty ept
+    retired_sandbox* retired = static_cast< retired_sandbox* >( ExAllocatePoolWithTag( NonPagedPoolNx, sizeof( retired_sandbox ), sandbox_tag ) );
+    if ( retired ) RtlZeroMemory( retired, sizeof( retired_sandbox ) );
+    return retired;
+}
+
+void hv_sandbox_manager::release_shared_pages( _Inout_ hv_ept& ept, _In_ ULONG64 first_page, _In_ ULONG64 page_count )
+{
+    const ULONG64 guest_pages = ept.get_guest_bytes( ) / PAGE_SIZE;
+    if ( first_page >= guest_pages ) return;
+    if ( page_count > guest_pages - first_page ) page_count = guest_pages - first_page;
+
+    // shared pages are not the ept's to free, drop this sandbox's references to them
+    for ( ULONG64 page = first_page; ept.get_shared_pages( ) && page < first_page + page_count; ++page )
+    {
+        const ULONG64 gpa = page * PAGE_SIZE;
+        if ( !ept.is_shared( gpa ) ) continue;
+
+        hv_ept_walk::translation t = {};
+        if ( NT_SUCCESS( ept.translate( gpa, &t ) ) ) page_share_.release( t.hpa );
+    }
+}
+
+NTSTATUS hv_sandbox_manager::install_entry( _Inout_ sandbox_entry& entry, _In_ ULONG id, _In_ ULONG exit_policy, _In_ ULONG vcpu_count, _Inout_ hv_ept& ept )
+{
+    // identical policies share one set of bitmap pages
+    NTSTATUS status = exit_bitmaps_.acquire( exit_policy, &entry.exit_bitmaps );
+    if ( !NT_SUCCESS( status ) )
+    {
+        hv_logger::log( hv_logger::level::error, "hv_sandbox_manager::install_entry: exit bitmaps failed (0x%08x)", status );
+        return status;
+    }
+
+    const SIZE_T vcpu_bytes = sizeof( hv_sched::vcpu ) * vcpu_count;
+    hv_sched::vcpu* vcpus = static_cast< hv_sched::vcpu* >( ExAllocatePoolWithTag( NonPagedPoolNx, vcpu_bytes, sandbox_tag ) );
+    if ( !vcpus )
+    {
+        exit_bitmaps_.release( entry.exit_bitmaps );
+        entry.exit_bitmaps = nullptr;
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory( vcpus, vcpu_bytes );
+    for ( ULONG i = 0; i < vcpu_count; ++i )
+    {
+        vcpus[ i ].sandbox_id = id;
+        vcpus[ i ].index = i;
+        vcpus[ i ].vpid = vpids_.allocate( );
+        if ( vcpus[ i ].vpid != hv_vpid::invalid_vpid ) continue;
+
+        hv_logger::log( hv_logger::level::error, "hv_sandbox_manager::install_entry: out of vpids (%u free)", vpids_.get_free_count( ) );
+        for ( ULONG j = 0; j < i; ++j ) vpids_.release( vcpus[ j ].vpid );
+        ExFreePoolWithTag( vcpus, sandbox_tag );
+        exit_bitmaps_.release( entry.exit_bitmaps );
+        entry.exit_bitmaps = nullptr;
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    ept.transfer( entry.ept );
+
+    scheduler_.add_vcpus( vcpus, vcpu_count );
+    entry.vcpus = vcpus;
+    entry.vcpu_count = vcpu_count;
+
+    entry.id = id;
+    entry.exit_policy = exit_policy;
+    entry.active = TRUE;
+
+#if (NTDDI_VERSION >= NTDDI_WIN8)
+    KeQuerySystemTimePrecise( &entry.created );
+#else
+    KeQuerySystemTime( &entry.created );
+#endif
+
+    hv_logger::log( hv_logger::level::info,
+        "hv_sandbox_manager::install_entry: id=%u created (ept_pages=%llu, bytes=%llu, guest_bytes=%llu, exit_policy=%s, bitmap_sets=%u, vcpus=%u on cpu %u.. vpid %u..)",
+        id,
+        entry.ept.get_page_count( ),
+        entry.ept.get_alloc_bytes( ),
+        entry.ept.get_guest_bytes( ),
+        hv_exit_bitmap::catalog::find( exit_policy )->name,
+        exit_bitmaps_.get_set_count( ),
+        vcpu_count,
+        vcpus[ 0 ].cpu,
+        vcpus[ 0 ].vpid );
+    return STATUS_SUCCESS;
+}
+
+void hv_sandbox_manager::release_entry( _Inout_ sandbox_entry& entry, _In_opt_ retired_sandbox* retired )
+{
+    if ( entry.vcpus )
+    {
+        scheduler_.remove_vcpus( entry.vcpus, entry.vcpu_count );
+
+        // off every processor now, the new epoch makes whoever still remembers these vpids flush before reuse
+        for ( ULONG i = 0; i < entry.vcpu_count; ++i ) vpids_.release( entry.vcpus[ i ].vpid );
+        ExFreePoolWithTag( entry.vcpus, sandbox_tag );
+        entry.vcpus = nullptr;
+        entry.vcpu_count = 0;
+    }
+
+    ++reclaim_stats_.destroys;
+    if ( retired && reclaim_thread_ && !reclaim_stop_ )
+    {
+        // the slot is free for the next create as soon as this returns, the memory travels on with the record
+        reclaim_stats_.pending_bytes += reclaimable_bytes( entry.ept );
+        ++reclaim_stats_.pending_sandboxes;
+
+        retired->id = entry.id;
+        entry.ept.transfer( retired->ept );
+        if ( reclaim_tail_ ) reclaim_tail_->next = retired;
+        else reclaim_head_ = retired;
+        reclaim_tail_ = retired;
+
+        KeSetEvent( &reclaim_wake_, IO_NO_INCREMENT, FALSE );
+    }
+    else
+    {
+        if ( retired ) ExFreePoolWithTag( retired, sandbox_tag );
+
+        const ULONG64 guest_pages = entry.ept.get_guest_bytes( ) / PAGE_SIZE;
+        release_shared_pages( entry.ept, 0, guest_pages );
+        entry.ept.release_guest_pages( 0, guest_pages );
+        entry.ept.destroy( );
+        ++reclaim_stats_.inline_destroys;
+    }
+
+    if ( entry.walk_cache )
+    {
+        ExFreePoolWithTag( entry.walk_cache, sandbox_tag );
+        entry.walk_cache = nullptr;
+    }
+
+    if ( entry.page_digests )
+    {
+        ExFreePoolWithTag( entry.page_digests, sandbox_tag );
+        entry.page_digests = nullptr;
+    }
+
+    if ( entry.merge_digests )
+    {
+        ExFreePoolWithTag( entry.merge_digests, sandbox_tag );
+        entry.merge_digests = nullptr;
+    }
+
+    exit_bitmaps_.release( entry.exit_bitmaps );
+    entry.exit_bitmaps = nullptr;
+    entry.exit_policy = HV_EXIT_POLICY_DEFAULT;
+    entry.bytes_read = entry.bytes_written = 0;
+    entry.faults = entry.scans = entry.changed_pages = 0;
+    entry.cow_breaks = 0;
+
+    entry.active = FALSE;
+    entry.id = 0;
+    entry.created.QuadPart = 0;
+}
+
 LONG hv_sandbox_manager::find_entry_by_id( _In_ ULONG id ) const
 {
     for ( ULONG i = 0; i < max_sandboxes_; ++i )
@@ -0,0 +1,233 @@
+#include "../stdafx.h"
+
+static const ULONG scheduler_tag = 'hcsH'; // 'Hsch'
+
+NTSTATUS hv_scheduler::initialize( )
+{
+    processor_count_ = KeQueryActiveProcessorCountEx( ALL_PROCESSOR_GROUPS );
+    if ( processor_count_ == 0 )
+    {
+        hv_logger::log( hv_logger::level::error, "hv_scheduler::initialize: KeQueryActiveProcessorCountEx returned 0" );
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    const SIZE_T alloc_size = sizeof( per_cpu ) * ( SIZE_T )processor_count_;
+    cpus_ = static_cast< per_cpu* >( ExAllocatePoolWithTag( NonPagedPoolNx, alloc_size, scheduler_tag ) );
+    if ( !cpus_ ) return STATUS_INSUFFICIENT_RESOURCES;
+    RtlZeroMemory( cpus_, alloc_size );
+
+    node_count_ = static_cast< ULONG >( KeQueryHighestNodeNumber( ) ) + 1;
+    for ( ULONG i = 0; i < processor_count_; ++i )
+    {
+        KeInitializeSpinLock( &cpus_[ i ].lock );
+        cpus_[ i ].slot.node = node_of( i );
+    }
+
+    // IA32_VMX_MISC (MSR 0x485) bits 4:0, the preemption timer ticks once every 2^rate tsc cycles
+    ULONG64 vmx_misc = 0;
+    __try
+    {
+        vmx_misc = __readmsr( 0x485 );
+    }
+    __except ( EXCEPTION_EXECUTE_HANDLER )
+    {
+        hv_logger::log( hv_logger::level::warning, "hv_scheduler::initialize: reading IA32_VMX_MISC caused exception" );
+        vmx_misc = 0;
+    }
+
+    preemption_timer_value_ = hv_sched::preemption_timer_value( slice_tsc_, vmx_misc );
+
+    hv_logger::log( hv_logger::level::info, "hv_scheduler::initialize: %u processors on %u node(s), preemption timer %u (rate %llu)",
+        processor_count_, node_count_, preemption_timer_value_, vmx_misc & 0x1F );
+    return STATUS_SUCCESS;
+}
+
+void hv_scheduler::shutdown( )
+{
+    if ( !cpus_ ) return;
+
+    for ( ULONG i = 0; i < processor_count_; ++i )
+    {
+        const hv_sched::cpu_slot& slot = cpus_[ i ].slot;
+        hv_logger::log( hv_logger::level::info, "hv_scheduler::shutdown: cpu %u node %u switches=%llu steals=%llu idle=%llu",
+            i, slot.node, slot.switches, slot.steals, slot.idle_picks );
+    }
+
+    ExFreePoolWithTag( cpus_, scheduler_tag );
+    cpus_ = nullptr;
+    processor_count_ = 0;
+}
+
+void hv_scheduler::add_vcpus( _Inout_updates_( count ) hv_sched::vcpu* vcpus, _In_ ULONG count )
+{
+    if ( !cpus_ || !vcpus ) return;
+
+    // loads are read without the queue locks, placement only needs to be roughly right, stealing fixes the rest
+    auto slot_at = [ this ]( ULONG cpu ) -> hv_sched::cpu_slot& { return cpus_[ cpu ].slot; };
+    const ULONG node = hv_sched::pick_node( slot_at, processor_count_, node_count_ );
+
+    for ( ULONG i = 0; i < count; ++i )
+    {
+        const ULONG cpu = hv_sched::pick_cpu( slot_at, processor_count_, node );
+
+        KIRQL irql;
+        KeAcquireSpinLock( &cpus_[ cpu ].lock, &irql );
+        vcpus[ i ].cpu = cpu;
+        vcpus[ i ].home_node = node;
+        vcpus[ i ].state = hv_sched::vcpu_state::queued;
+        cpus_[ cpu ].slot.queue.push_tail( &vcpus[ i ] );
+        KeReleaseSpinLock( &cpus_[ cpu ].lock, irql );
+    }
+}
+
+void hv_scheduler::remove_vcpus( _Inout_updates_( count ) hv_sched::vcpu* vcpus, _In_ ULONG count )
+{
+    if ( !cpus_ || !vcpus ) return;
+
+    for ( ULONG i = 0; i < count; ++i )
+    {
+        hv_sched::vcpu* v = &vcpus[ i ];
+
+        // v->cpu only changes with that processor's lock held, retry if a steal moved it in between
+        for ( ;; )
+        {
+            const ULONG cpu = v->cpu;
+
+            KIRQL irql;
+            KeAcquireSpinLock( &cpus_[ cpu ].lock, &irql );
+            const bool stable = v->cpu == cpu;
+            if ( stable )
+            {
+                hv_sched::cpu_slot& slot = cpus_[ cpu ].slot;
+                if ( v->state == hv_sched::vcpu_state::queued ) slot.queue.unlink( v );
+                if ( slot.current == v ) slot.current = nullptr;
+                v->state = hv_sched::vcpu_state::parked;
+            }
+            KeReleaseSpinLock( &cpus_[ cpu ].lock, irql );
+
+            if ( stable ) break;
+        }
+    }
+}
+
+hv_sched::vcpu* hv_scheduler::switch_next( _In_ ULONG cpu )
+{
+    if ( !cpus_ || cpu >= processor_count_ ) return nullptr;
+
+    per_cpu& self = cpus_[ cpu ];
+    hv_sched::vcpu* next = nullptr;
+    {
+        KIRQL irql;
+        KeAcquireSpinLock( &self.lock, &irql );
+        next = hv_sched::rotate( self.slot );
+        if ( next ) hv_sched::start( self.slot, next );
+        KeReleaseSpinLock( &self.lock, irql );
+    }
+
+    if ( next ) return next;
+
+    // local queue is dry, pull from the busiest processor. The victim is picked without locks, so it may
+    // have drained by the time both locks are held, one retry covers the common race
+    auto slot_at = [ this ]( ULONG index ) -> hv_sched::cpu_slot& { return cpus_[ index ].slot; };
+    for ( ULONG attempt = 0; attempt < 2 && !next; ++attempt )
+    {
+        const LONG victim = hv_sched::pick_victim( slot_at, processor_count_, cpu, true );
+        if ( victim < 0 ) break;
+
+        per_cpu& first = cpus_[ cpu < static_cast< ULONG >( victim ) ? cpu : victim ];
+        per_cpu& second = cpus_[ cpu < static_cast< ULONG >( victim ) ? victim : cpu ];
+
+        KIRQL irql;
+        KeAcquireSpinLock( &first.lock, &irql );
+        KeAcquireSpinLockAtDpcLevel( &second.lock );
+
+        if ( !self.slot.current )
+        {
+            next = hv_sched::steal( cpus_[ victim ].slot, self.slot, cpu );
+            if ( next ) hv_sched::start( self.slot, next );
+        }
+
+        KeReleaseSpinLockFromDpcLevel( &second.lock );
+        KeReleaseSpinLock( &first.lock, irql );
+    }
+
+    if ( !next )
+    {
+        KIRQL irql;
+        KeAcquireSpinLock( &self.lock, &irql );
+        ++self.slot.idle_picks;
+        KeReleaseSpinLock( &self.lock, irql );
+    }
+
+    return next;
+}
+
+void hv_scheduler::park_current( _In_ ULONG cpu )
+{
+    if ( !cpus_ || cpu >= processor_count_ ) return;
+
+    KIRQL irql;
+    KeAcquireSpinLock( &cpus_[ cpu ].lock, &irql );
+    hv_sched::cpu_slot& slot = cpus_[ cpu ].slot;
+    if ( slot.current )
+    {
+        slot.current->state = hv_sched::vcpu_state::parked;
+        slot.current = nullptr;
+    }
+    KeReleaseSpinLock( &cpus_[ cpu ].lock, irql );
+}
+
+void hv_scheduler::wake_vcpu( _Inout_ hv_sched::vcpu* v )
+{
+    if ( !cpus_ || !v ) return;
+
+    auto slot_at = [ this ]( ULONG index ) -> hv_sched::cpu_slot& { return cpus_[ index ].slot; };
+    const ULONG target = hv_sched::wake_cpu( slot_at, processor_count_, *v, true );
+
+    // v->cpu and v->state belong to the lock of the processor v is on, so that one is held together with the
+    // target's (processor order, like a steal). Retry if a steal moved v before the locks were taken
+    for ( ;; )
+    {
+        const ULONG home = v->cpu;
+        per_cpu& first = cpus_[ home < target ? home : target ];
+        per_cpu& second = cpus_[ home < target ? target : home ];
+
+        KIRQL irql;
+        KeAcquireSpinLock( &first.lock, &irql );
+        if ( &second != &first ) KeAcquireSpinLockAtDpcLevel( &second.lock );
+
+        const bool stable = v->cpu == home;
+        if ( stable && v->state == hv_sched::vcpu_state::parked )
+        {
+            if ( home != target )
+            {
+                if ( cpus_[ home ].slot.node != cpus_[ target ].slot.node ) ++v->node_migrations;
+                ++v->migrations;
+            }
+
+            v->cpu = target;
+            v->state = hv_sched::vcpu_state::queued;
+            cpus_[ target ].slot.queue.push_tail( v );
+        }
+
+        if ( &second != &first ) KeReleaseSpinLockFromDpcLevel( &second.lock );
+        KeReleaseSpinLock( &first.lock, irql );
+
+        if ( stable ) break;
+    }
+}
+
+ULONG hv_scheduler::node_of( _In_ ULONG cpu_index ) const
+{
+    PROCESSOR_NUMBER number = {};
+    if ( !NT_SUCCESS( KeGetProcessorNumberFromIndex( cpu_index, &number ) ) ) return 0;
+
+    for ( USHORT node = 0; node < node_count_; ++node )
+    {
+        GROUP_AFFINITY affinity = {};
+        KeQueryNodeActiveAffinity( node, &affinity, nullptr );
+        if ( affinity.Group == number.Group && ( affinity.Mask & ( static_cast< KAFFINITY >( 1 ) << number.Number ) ) ) return node;
+    }
+
+    return 0;
+}
\ No newline at end of file
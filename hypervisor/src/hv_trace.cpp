@@ -0,0 +1,217 @@
+#include "../stdafx.h"
+
+static const ULONG trace_tag = 'rtvH';
+
+KSPIN_LOCK     hv_trace::lock_ = 0;
+PUCHAR         hv_trace::ring_ = nullptr;
+ULONG          hv_trace::ring_size_ = 0;
+ULONG          hv_trace::head_ = 0;
+ULONG          hv_trace::tail_ = 0;
+ULONG          hv_trace::used_ = 0;
+ULONG64        hv_trace::dropped_ = 0;
+ULONG64        hv_trace::started_ns_ = 0;
+LARGE_INTEGER  hv_trace::frequency_ = {};
+volatile LONG  hv_trace::recording_ = 0;
+
+// records are 8 byte aligned, a record that does not fit before the end of the ring is preceded
+// by a pad entry (size = bytes to the end, io_control_code = 0) and written at offset 0
+static ULONG trace_align( ULONG bytes )
+{
+    return ( bytes + 7 ) & ~7u;
+}
+
+void hv_trace::initialize( )
+{
+    KeInitializeSpinLock( &lock_ );
+    KeQueryPerformanceCounter( &frequency_ );
+}
+
+void hv_trace::shutdown( )
+{
+    PUCHAR ring = nullptr;
+    {
+        KIRQL irql;
+        KeAcquireSpinLock( &lock_, &irql );
+        InterlockedExchange( &recording_, 0 );
+        ring = ring_;
+        ring_ = nullptr;
+        ring_size_ = head_ = tail_ = used_ = 0;
+        KeReleaseSpinLock( &lock_, irql );
+    }
+
+    if ( ring ) ExFreePoolWithTag( ring, trace_tag );
+}
+
+NTSTATUS hv_trace::start( _In_ ULONG buffer_bytes )
+{
+    if ( buffer_bytes == 0 ) buffer_bytes = HV_TRACE_DEFAULT_BYTES;
+    if ( buffer_bytes < PAGE_SIZE || buffer_bytes > HV_TRACE_MAX_BYTES ) return STATUS_INVALID_PARAMETER;
+    buffer_bytes = trace_align( buffer_bytes );
+
+    PUCHAR ring = static_cast< PUCHAR >( ExAllocatePoolWithTag( NonPagedPoolNx, buffer_bytes, trace_tag ) );
+    if ( !ring ) return STATUS_INSUFFICIENT_RESOURCES;
+
+    PUCHAR old_ring = nullptr;
+    {
+        KIRQL irql;
+        KeAcquireSpinLock( &lock_, &irql );
+        old_ring = ring_;
+        ring_ = ring;
+        ring_size_ = buffer_bytes;
+        head_ = tail_ = used_ = 0;
+        dropped_ = 0;
+        started_ns_ = now_ns( );
+        InterlockedExchange( &recording_, 1 );
+        KeReleaseSpinLock( &lock_, irql );
+    }
+
+    if ( old_ring ) ExFreePoolWithTag( old_ring, trace_tag );
+
+    hv_logger::log( hv_logger::level::info, "hv_trace::start: recording into %u byte ring", buffer_bytes );
+    return STATUS_SUCCESS;
+}
+
+void hv_trace::stop( )
+{
+    // the ring stays allocated so whatever was recorded can still be drained
+    InterlockedExchange( &recording_, 0 );
+    hv_logger::log( hv_logger::level::info, "hv_trace::stop: recording stopped (dropped=%llu)", dropped_ );
+}
+
+ULONG64 hv_trace::now_ns( )
+{
+    const ULONG64 ticks = static_cast< ULONG64 >( KeQueryPerformanceCounter( nullptr ).QuadPart );
+    const ULONG64 freq = static_cast< ULONG64 >( frequency_.QuadPart );
+    if ( freq == 0 ) return 0;
+
+    // split so ticks * 1e9 cannot overflow
+    return ( ticks / freq ) * 1000000000ULL + ( ( ticks % freq ) * 1000000000ULL ) / freq;
+}
+
+void hv_trace::begin( _Out_ capture& c, _In_ PIRP irp, _In_ PIO_STACK_LOCATION stack )
+{
+    c.io_control_code = stack->Parameters.DeviceIoControl.IoControlCode;
+    c.input_length = stack->Parameters.DeviceIoControl.InputBufferLength;
+    c.output_length = stack->Parameters.DeviceIoControl.OutputBufferLength;
+    c.input_captured = 0;
+
+    // every ioctl this device defines takes its input through the system buffer (buffered or direct)
+    if ( irp->AssociatedIrp.SystemBuffer && c.input_length )
+    {
+        c.input_captured = c.input_length < HV_TRACE_MAX_INPUT ? c.input_length : HV_TRACE_MAX_INPUT;
+        RtlCopyMemory( c.input, irp->AssociatedIrp.SystemBuffer, c.input_captured );
+    }
+
+    c.started_ns = now_ns( );
+}
+
+void hv_trace::end( _In_ const capture& c, _In_ PIRP irp, _In_ NTSTATUS status, _In_ ULONG_PTR information )
+{
+    const ULONG64 finished_ns = now_ns( );
+
+    hv_trace_record record = {};
+    record.size = trace_align( sizeof( hv_trace_record ) + c.input_captured );
+    record.io_control_code = c.io_control_code;
+    record.status = status;
+    record.input_length = c.input_length;
+    record.input_captured = c.input_captured;
+    record.output_length = c.output_length;
+    record.information = information;
+    record.latency_ns = finished_ns - c.started_ns;
+
+    // direct transfers can be megabytes, only buffered output is checksummed for replay comparisons
+    if ( ( c.io_control_code & 3 ) == METHOD_BUFFERED && irp->AssociatedIrp.SystemBuffer && NT_SUCCESS( status ) )
+    {
+        const SIZE_T out_bytes = information < c.output_length ? information : c.output_length;
+        record.output_crc = hv_page_hash::crc32c_buffer( irp->AssociatedIrp.SystemBuffer, out_bytes );
+        record.flags |= HV_TRACE_OUTPUT_CRC;
+    }
+
+    KIRQL irql;
+    KeAcquireSpinLock( &lock_, &irql );
+    if ( recording_ && ring_ )
+    {
+        record.timestamp_ns = c.started_ns - started_ns_;
+        append( record, c.input, c.input_captured );
+    }
+    KeReleaseSpinLock( &lock_, irql );
+}
+
+void hv_trace::append( _In_ const hv_trace_record& record, _In_reads_bytes_( input_bytes ) const void* input, _In_ ULONG input_bytes )
+{
+    const ULONG to_end = ring_size_ - tail_;
+    const ULONG pad = to_end < record.size ? to_end : 0;
+
+    if ( used_ + pad + record.size > ring_size_ )
+    {
+        ++dropped_;
+        return;
+    }
+
+    if ( pad )
+    {
+        ULONG* marker = reinterpret_cast< ULONG* >( ring_ + tail_ );
+        marker[ 0 ] = pad;
+        marker[ 1 ] = 0;
+        used_ += pad;
+        tail_ = 0;
+    }
+
+    RtlCopyMemory( ring_ + tail_, &record, sizeof( record ) );
+    if ( input_bytes ) RtlCopyMemory( ring_ + tail_ + sizeof( record ), input, input_bytes );
+
+    tail_ += record.size;
+    if ( tail_ == ring_size_ ) tail_ = 0;
+    used_ += record.size;
+}
+
+NTSTATUS hv_trace::drain( _Out_writes_bytes_( out_len ) void* out, _In_ ULONG out_len, _Out_ ULONG_PTR* information )
+{
+    *information = 0;
+    // must hold at least one full sized record or a drain could never make progress
+    if ( !out || out_len < sizeof( hv_trace_drain_result ) + sizeof( hv_trace_record ) + HV_TRACE_MAX_INPUT ) return STATUS_BUFFER_TOO_SMALL;
+
+    hv_trace_drain_result* result = static_cast< hv_trace_drain_result* >( out );
+    PUCHAR cursor = reinterpret_cast< PUCHAR >( result + 1 );
+    const ULONG capacity = out_len - sizeof( hv_trace_drain_result );
+    ULONG written = 0;
+    ULONG count = 0;
+
+    KIRQL irql;
+    KeAcquireSpinLock( &lock_, &irql );
+
+    while ( ring_ && used_ )
+    {
+        const ULONG* header = reinterpret_cast< const ULONG* >( ring_ + head_ );
+        const ULONG size = header[ 0 ];
+
+        if ( header[ 1 ] == 0 )
+        {
+            // pad up to the end of the ring
+            used_ -= size;
+            head_ = 0;
+            continue;
+        }
+
+        if ( written + size > capacity ) break;
+
+        RtlCopyMemory( cursor + written, ring_ + head_, size );
+        written += size;
+        ++count;
+
+        head_ += size;
+        if ( head_ == ring_size_ ) head_ = 0;
+        used_ -= size;
+    }
+
+    result->record_count = count;
+    result->bytes = written;
+    result->dropped = dropped_;
+    result->recording = recording_ ? 1 : 0;
+    result->pending_bytes = used_;
+
+    KeReleaseSpinLock( &lock_, irql );
+
+    *information = sizeof( hv_trace_drain_result ) + written;
+    return STATUS_SUCCESS;
+}
\ No newline at end of file
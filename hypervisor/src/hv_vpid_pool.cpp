@@ -0,0 +1,160 @@
+#include "../stdafx.h"
+
+static const ULONG vpid_tag = 'dpvH'; // 'Hvpd'
+
+NTSTATUS hv_vpid_pool::initialize( _In_ ULONG processor_count, _In_ ULONG max_epts )
+{
+    if ( processor_count == 0 || max_epts == 0 ) return STATUS_INVALID_PARAMETER;
+
+    // dead eptps linger until they are the least recently entered, the slack keeps them from pushing out live ones
+    ept_ways_ = max_epts * 2;
+
+    const SIZE_T bitmap_bytes = sizeof( ULONG64 ) * hv_vpid::allocator::bitmap_words( vpid_count_ );
+    const SIZE_T epoch_bytes = sizeof( ULONG ) * vpid_count_;
+    const SIZE_T cpu_bytes = sizeof( per_cpu ) * ( SIZE_T )processor_count;
+    const SIZE_T seen_bytes = sizeof( ULONG ) * vpid_count_ * ( SIZE_T )processor_count;
+    const SIZE_T ept_bytes = sizeof( hv_vpid::context ) * ept_ways_ * ( SIZE_T )processor_count;
+
+    bitmap_ = static_cast< ULONG64* >( ExAllocatePoolWithTag( NonPagedPoolNx, bitmap_bytes, vpid_tag ) );
+    epochs_ = static_cast< ULONG* >( ExAllocatePoolWithTag( NonPagedPoolNx, epoch_bytes, vpid_tag ) );
+    cpus_ = static_cast< per_cpu* >( ExAllocatePoolWithTag( NonPagedPoolNx, cpu_bytes, vpid_tag ) );
+    seen_ = static_cast< ULONG* >( ExAllocatePoolWithTag( NonPagedPoolNx, seen_bytes, vpid_tag ) );
+    epts_ = static_cast< hv_vpid::context* >( ExAllocatePoolWithTag( NonPagedPoolNx, ept_bytes, vpid_tag ) );
+    if ( !bitmap_ || !epochs_ || !cpus_ || !seen_ || !epts_ )
+    {
+        shutdown( );
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory( cpus_, cpu_bytes );
+    RtlZeroMemory( seen_, seen_bytes );
+    RtlZeroMemory( epts_, ept_bytes );
+    processor_count_ = processor_count;
+    for ( ULONG i = 0; i < processor_count_; ++i )
+    {
+        KeInitializeSpinLock( &cpus_[ i ].lock );
+        cpus_[ i ].contexts.seen = seen_ + static_cast< SIZE_T >( i ) * vpid_count_;
+        cpus_[ i ].contexts.epts = epts_ + static_cast< SIZE_T >( i ) * ept_ways_;
+        cpus_[ i ].contexts.ept_ways = ept_ways_;
+    }
+
+    KeInitializeSpinLock( &lock_ );
+    allocator_.attach( vpid_count_, bitmap_, epochs_ );
+
+    hv_logger::log( hv_logger::level::info, "hv_vpid_pool::initialize: %u vpids, %u per processor cache, %u eptps tracked per processor",
+        allocator_.get_free_count( ), hv_vpid::cpu_cache::capacity, ept_ways_ );
+    return STATUS_SUCCESS;
+}
+
+void hv_vpid_pool::shutdown( )
+{
+    if ( cpus_ )
+    {
+        for ( ULONG i = 0; i < processor_count_; ++i )
+        {
+            const hv_vpid::cpu_contexts& contexts = cpus_[ i ].contexts;
+            if ( !contexts.entries ) continue;
+            hv_logger::log( hv_logger::level::info, "hv_vpid_pool::shutdown: cpu %u entries=%llu stale flushes=%llu eviction flushes=%llu",
+                i, contexts.entries, contexts.stale_flushes, contexts.eviction_flushes );
+        }
+
+        ExFreePoolWithTag( cpus_, vpid_tag );
+        cpus_ = nullptr;
+    }
+
+    if ( epts_ )
+    {
+        ExFreePoolWithTag( epts_, vpid_tag );
+        epts_ = nullptr;
+    }
+
+    if ( seen_ )
+    {
+        ExFreePoolWithTag( seen_, vpid_tag );
+        seen_ = nullptr;
+    }
+
+    if ( epochs_ )
+    {
+        ExFreePoolWithTag( epochs_, vpid_tag );
+        epochs_ = nullptr;
+    }
+
+    if ( bitmap_ )
+    {
+        ExFreePoolWithTag( bitmap_, vpid_tag );
+        bitmap_ = nullptr;
+    }
+
+    allocator_ = hv_vpid::allocator{ };
+    processor_count_ = 0;
+    ept_ways_ = 0;
+}
+
+ULONG hv_vpid_pool::allocate( )
+{
+    if ( !cpus_ ) return hv_vpid::invalid_vpid;
+
+    // stay on this processor between picking its cache and locking it
+    KIRQL irql;
+    KeRaiseIrql( DISPATCH_LEVEL, &irql );
+
+    ULONG vpid = hv_vpid::invalid_vpid;
+    for ( ULONG attempt = 0; attempt < 2 && vpid == hv_vpid::invalid_vpid; ++attempt )
+    {
+        // the second attempt comes after every other cache gave its vpids back
+        if ( attempt ) drain_caches( );
+
+        per_cpu& self = cpus_[ KeGetCurrentProcessorNumberEx( nullptr ) % processor_count_ ];
+        KeAcquireSpinLockAtDpcLevel( &self.lock );
+        if ( !self.cache.pop( vpid ) )
+        {
+            KeAcquireSpinLockAtDpcLevel( &lock_ );
+            allocator_.refill( self.cache, hv_vpid::cpu_cache::batch );
+            KeReleaseSpinLockFromDpcLevel( &lock_ );
+
+            if ( !self.cache.pop( vpid ) ) vpid = hv_vpid::invalid_vpid;
+        }
+        KeReleaseSpinLockFromDpcLevel( &self.lock );
+    }
+
+    KeLowerIrql( irql );
+    return vpid;
+}
+
+void hv_vpid_pool::release( _In_ ULONG vpid )
+{
+    if ( !cpus_ || vpid == hv_vpid::invalid_vpid || vpid >= vpid_count_ ) return;
+
+    // epochs are written under the bitmap lock, plan_entry reads them unlocked (a vpid being retired is not
+    // being entered anywhere). No processor cache is involved, a vpid only reaches one again through refill
+    KIRQL irql;
+    KeAcquireSpinLock( &lock_, &irql );
+    allocator_.retire( vpid );
+    KeReleaseSpinLock( &lock_, irql );
+}
+
+void hv_vpid_pool::plan_entry( _In_ ULONG cpu, _In_ ULONG vpid, _In_ ULONG64 eptp, _In_ ULONG64 ept_version, _Out_ hv_vpid::entry_plan* plan )
+{
+    if ( !plan ) return;
+    RtlZeroMemory( plan, sizeof( *plan ) );
+    if ( !cpus_ || cpu >= processor_count_ || vpid >= vpid_count_ ) return;
+
+    KIRQL irql;
+    KeAcquireSpinLock( &cpus_[ cpu ].lock, &irql );
+    hv_vpid::plan_entry( cpus_[ cpu ].contexts, vpid, allocator_.epoch( vpid ), eptp, ept_version, *plan );
+    KeReleaseSpinLock( &cpus_[ cpu ].lock, irql );
+}
+
+void hv_vpid_pool::drain_caches( )
+{
+    // processor lock before the bitmap lock, the same order allocate takes them in
+    for ( ULONG i = 0; i < processor_count_; ++i )
+    {
+        KeAcquireSpinLockAtDpcLevel( &cpus_[ i ].lock );
+        KeAcquireSpinLockAtDpcLevel( &lock_ );
+        allocator_.spill( cpus_[ i ].cache, 0 );
+        KeReleaseSpinLockFromDpcLevel( &lock_ );
+        KeReleaseSpinLockFromDpcLevel( &cpus_[ i ].lock );
+    }
+}
\ No newline at end of file
@@ -17,6 +17,19 @@
 #include "includes/hv_driver.h"
 #include "includes/hv_vmx.h"
 #include "includes/hv_device.h"
+#include "includes/hv_ept_walk.h"
+#include "includes/hv_gva_walk.h"
 #include "includes/hv_ept.h"
+#include "includes/hv_page_hash.h"
+#include "includes/hv_page_merge.h"
+#include "includes/hv_page_share.h"
+#include "includes/hv_trace.h"
+#include "includes/hv_events.h"
+#include "includes/hv_exit_bitmap.h"
+#include "includes/hv_exit_bitmap_cache.h"
+#include "includes/hv_sched.h"
+#include "includes/hv_scheduler.h"
+#include "includes/hv_vpid.h"
+#include "includes/hv_vpid_pool.h"
 
 #include "includes/hv_sandbox.h"
@@ -1,13 +1,28 @@
 #include "includes/driver_interface.h"
+#include "includes/session.h"
+#include "includes/trace.h"
+#include "includes/walk_sim.h"
+#include "includes/sched_sim.h"
+#include "includes/gva_bench.h"
+#include "includes/merge_sim.h"
+#include "includes/vpid_bench.h"
+#include "includes/mem_sim.h"
+#include "includes/teardown_bench.h"
+#include "includes/hash_bench.h"
+#include "includes/exit_policy_check.h"
+#include "../hypervisor/includes/hv_exit_bitmap.h"
 
 #include <iostream>
 #include <vector>
 #include <string>
 #include <sstream>
+#include <fstream>
+#include <iterator>
+#include <cstdio>
 
-static HANDLE open_device( )
+static HANDLE open_device( DWORD flags = FILE_ATTRIBUTE_NORMAL )
 {
-    HANDLE h = CreateFileA( HV_DEVICE_LINK, GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr );
+    HANDLE h = CreateFileA( HV_DEVICE_LINK, GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, flags, nullptr );
     if ( h == INVALID_HANDLE_VALUE ) return nullptr;
     return h;
 }
@@ -18,10 +33,56 @@ static void print_usage( const char* prog )
     std::cout << "commands:\n";
     std::cout << "  query                 - query driver VMX/EPT capabilities\n";
     std::cout << "  build-ept             - ask driver to build demo EPT\n";
-    std::cout << "  sandbox-create <id>   - create sandbox with id\n";
+    std::cout << "  sandbox-create <id> [policy] [vcpus]\n";
+    std::cout << "                        - create sandbox with id, exit policy default|strict|msr-read, 1..64 vcpus\n";
     std::cout << "  sandbox-destroy <id>  - destroy sandbox with id\n";
-    std::cout << "  sandbox-list          - list active sandbox ids\n";
+    std::cout << "  sandbox-list [--page n]\n";
+    std::cout << "                        - list active sandboxes with details, n records per driver call\n";
+    std::cout << "  mem-read <id> <gpa> <len> [file]\n";
+    std::cout << "                        - read guest memory (hex dump, or raw into file)\n";
+    std::cout << "  mem-write <id> <gpa> <file>\n";
+    std::cout << "                        - write the contents of file into guest memory\n";
+    std::cout << "  mem-translate <id> <cr3> <gva> [len] [--la57] [--no-cache]\n";
+    std::cout << "                        - translate guest virtual addresses to gpa / hpa through guest paging and the ept\n";
+    std::cout << "  sandbox-scan <id> [--rebaseline|--keep]\n";
+    std::cout << "                        - hash guest pages, list pages changed since last scan\n";
+    std::cout << "  merge-stats           - show what the background page merger shares and saves\n";
+    std::cout << "  reclaim-stats         - show destroy latency and the memory destroyed sandboxes still hold\n";
+    std::cout << "  teardown-bench [rounds] [count] [vcpus]\n";
+    std::cout << "                        - create and destroy count sandboxes per round, time destroys and reclaim\n";
+    std::cout << "  hash-bench [mb]       - measure page hashing throughput on this core (no driver)\n";
+    std::cout << "  exit-policy [policy]  - build the msr / io exit bitmaps of a policy and check them (no driver)\n";
+    std::cout << "  trace-start [kb]      - record every ioctl into a driver ring (default 1024 kb)\n";
+    std::cout << "  trace-stop            - stop recording (records stay drainable)\n";
+    std::cout << "  trace-drain <file>    - append recorded ioctls to a binary trace file\n";
+    std::cout << "  trace-replay <file> [--mutate]\n";
+    std::cout << "                        - reissue a trace at full speed, report latency and divergences; creates, destroys,\n";
+    std::cout << "                          scans and trace control only with --mutate, mem-read / mem-write, truncated inputs\n";
+    std::cout << "                          and event waits never\n";
+    std::cout << "  walk-sim [options]    - simulate nested guest x ept walk cost per ept layout (no driver)\n";
+    std::cout << "                          --trace <file> | --pattern random|seq|stride --ws-mb n --accesses n\n";
+    std::cout << "                          --guest-mb n --levels 4|5 --guest-leaf 4k|2m --ept-leaf 4k|2m|1g\n";
+    std::cout << "                          --placement packed|spread --tlb n --psc n --ept-psc n --ntlb n --ref-cycles n\n";
+    std::cout << "  sched-sim [options]   - compare pinned / work stealing / numa aware vcpu scheduling (no driver)\n";
+    std::cout << "                          --cpus n --nodes n --sandboxes n --vcpus n --skew x --load x --slices n --halt x --seed n\n";
+    std::cout << "  gva-bench [options]   - measure guest virtual translation with and without the walk cache (no driver)\n";
+    std::cout << "                          --guest-mb n --levels 4|5 --ept-leaf 4k|2m --processes n --regions n --region-kb n\n";
+    std::cout << "                          --large-mb n --lookups n --switch n --seed n\n";
+    std::cout << "  merge-sim [options]   - simulate merging identical guest pages across sandboxes (no driver)\n";
+    std::cout << "                          --sandboxes n --guest-mb n --zero pct --private pct --hot pct --writes pct\n";
+    std::cout << "                          --passes n --candidates n --seed n\n";
+    std::cout << "  vpid-bench [options]  - compare tlb tagging policies for vm entries across sandboxes (no driver)\n";
+    std::cout << "                          --cpus n --sandboxes n --vcpus n --entries n --recycle n --remap n --migrate pct\n";
+    std::cout << "                          --tlb n --working-set n --ept-ways n --vpids n --seed n\n";
+    std::cout << "  mem-sim [options]     - check mem-read / mem-write run splitting on a synthetic ept (no driver)\n";
+    std::cout << "                          --guest-mb n --ept-leaf 4k|2m --contig n --holes pct --readonly pct\n";
+    std::cout << "                          --transfers n --max-kb n --chunk-kb n --seed n\n";
+    std::cout << "  events [--from-now] [--poll]\n";
+    std::cout << "                        - print sandbox created / destroyed / faulted events as they happen\n";
     std::cout << "  nop                   - ping driver (fast test)\n";
+    std::cout << "  session [file] [--depth n]\n";
+    std::cout << "                        - run one command per line from file (or stdin) over a single\n";
+    std::cout << "                          handle, pipelining independent ones; prints json lines\n";
     std::cout << std::endl;
 }
 
@@ -67,10 +128,12 @@ static bool ioctl_build_ept( HANDLE h )
     return true;
 }
 
-static bool ioctl_sandbox_create( HANDLE h, ULONG id )
+static bool ioctl_sandbox_create( HANDLE h, ULONG id, ULONG exit_policy, ULONG vcpu_count )
 {
-    hv_sandbox_request req = {};
+    hv_sandbox_create_request req = {};
     req.id = id;
+    req.exit_policy = exit_policy;
+    req.vcpu_count = vcpu_count;
     DWORD returned = 0;
     BOOL ok = DeviceIoControl( h, IOCTL_HV_SANDBOX_CREATE, &req, sizeof( req ), nullptr, 0, &returned, nullptr );
     if ( !ok )
@@ -78,7 +141,7 @@ static bool ioctl_sandbox_create( HANDLE h, ULONG id )
         std::cerr << "ioctl_sandbox_create failed: " << GetLastError( ) << "\n";
         return false;
     }
-    std::cout << "sandbox-create succeeded (id=" << id << ")\n";
+    std::cout << "sandbox-create succeeded (id=" << id << ", exit policy=" << hv_exit_bitmap::catalog::find( exit_policy )->name << ", vcpus=" << vcpu_count << ")\n";
     return true;
 }
 
@@ -97,34 +160,357 @@ static bool ioctl_sandbox_destroy( HANDLE h, ULONG id )
     return true;
 }
 
-static bool ioctl_sandbox_list( HANDLE h )
+// streams the registry a page at a time through IOCTL_HV_SANDBOX_ENUM, one call per `page` records
+static bool ioctl_sandbox_list( HANDLE h, ULONG page )
 {
-    const ULONG max_ids = 64;
-    std::vector<ULONG> ids( max_ids );
-    DWORD out_sz = ( DWORD )( max_ids * sizeof( ULONG ) );
+    if ( page == 0 ) page = 1;
+    std::vector<BYTE> out( sizeof( hv_sandbox_enum_result ) + page * sizeof( hv_sandbox_record ) );
+
+    hv_sandbox_enum_request req = {};
+    ULONG total = 0;
+    ULONG calls = 0;
+
+    do
+    {
+        DWORD returned = 0;
+        BOOL ok = DeviceIoControl( h, IOCTL_HV_SANDBOX_ENUM, &req, sizeof( req ), out.data( ), ( DWORD )out.size( ), &returned, nullptr );
+        if ( !ok || returned < sizeof( hv_sandbox_enum_result ) )
+        {
+            std::cerr << "ioctl_sandbox_list failed: " << GetLastError( ) << "\n";
+            return false;
+        }
+        ++calls;
+
+        const hv_sandbox_enum_result* result = reinterpret_cast< const hv_sandbox_enum_result* >( out.data( ) );
+        const hv_sandbox_record* records = reinterpret_cast< const hv_sandbox_record* >( result + 1 );
+
+        for ( ULONG i = 0; i < result->record_count; ++i )
+        {
+            const hv_sandbox_record& r = records[ i ];
+            if ( total++ == 0 ) std::cout << "id          state    policy    vcpus  created              ept pages  ept bytes  guest MB  shared MB  cow     read       written    faults  scans  changed\n";
+
+            FILETIME ft = {};
+            ft.dwLowDateTime = static_cast< DWORD >( r.created );
+            ft.dwHighDateTime = static_cast< DWORD >( r.created >> 32 );
+            SYSTEMTIME st = {};
+            FileTimeToSystemTime( &ft, &st );
+
+            const hv_exit_bitmap::policy* policy = hv_exit_bitmap::catalog::find( r.exit_policy );
+            char line[ 256 ];
+            snprintf( line, sizeof( line ), "%-11u %-8s %-9s %5u  %04u-%02u-%02u %02u:%02u:%02u  %9llu  %9llu  %8llu  %9.1f  %-6llu  %-10llu %-10llu %6llu  %5llu  %7llu",
+                r.id, r.state == HV_SANDBOX_STATE_FAULTED ? "faulted" : "ready", policy ? policy->name : "?", r.vcpu_count,
+                st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond,
+                r.ept_pages, r.ept_bytes, r.guest_bytes >> 20, ( double )r.shared_bytes / ( 1 << 20 ), r.cow_breaks,
+                r.bytes_read, r.bytes_written, r.faults, r.scans, r.changed_pages );
+            std::cout << line << "\n";
+        }
+
+        req.cursor = result->next_cursor;
+    } while ( req.cursor != HV_ENUM_CURSOR_END );
+
+    if ( total == 0 ) std::cout << "no sandboxes active\n";
+    else std::cout << total << " sandbox(es), " << calls << " call(s)\n";
+    return true;
+}
+
+static bool ioctl_merge_stats( HANDLE h )
+{
+    hv_merge_stats stats = {};
     DWORD returned = 0;
+    BOOL ok = DeviceIoControl( h, IOCTL_HV_MERGE_QUERY, nullptr, 0, &stats, sizeof( stats ), &returned, nullptr );
+    if ( !ok || returned < sizeof( stats ) )
+    {
+        std::cerr << "ioctl_merge_stats failed: " << GetLastError( ) << "\n";
+        return false;
+    }
+
+    char line[ 256 ];
+    snprintf( line, sizeof( line ), "passes %llu (last %llu us), %llu pages hashed, %llu merges, %llu cow breaks",
+        stats.passes, stats.last_pass_us, stats.pages_scanned, stats.merges, stats.cow_breaks );
+    std::cout << line << "\n";
+    snprintf( line, sizeof( line ), "%llu shared page(s) behind %llu guest mapping(s), %.1f MB saved",
+        stats.shared_pages, stats.shared_mappings, ( double )stats.saved_bytes / ( 1 << 20 ) );
+    std::cout << line << "\n";
+    return true;
+}
 
-    BOOL ok = DeviceIoControl( h, IOCTL_HV_SANDBOX_LIST, nullptr, 0, ids.data( ), out_sz, &returned, nullptr );
+static int run_session_command( int argc, char** argv )
+{
+    std::string script_path;
+    ULONG depth = 16;
+
+    for ( int i = 2; i < argc; ++i )
+    {
+        std::string arg = argv[ i ];
+        if ( arg == "--depth" && i + 1 < argc )
+        {
+            try
+            {
+                depth = ( ULONG )std::stoul( argv[ ++i ] );
+            }
+            catch ( const std::exception& )
+            {
+                std::cerr << "session: --depth needs a number, got " << argv[ i ] << "\n";
+                return 1;
+            }
+        }
+        else script_path = arg;
+    }
+
+    std::ifstream script_file;
+    if ( !script_path.empty( ) && script_path != "-" )
+    {
+        script_file.open( script_path );
+        if ( !script_file )
+        {
+            std::cerr << "failed to open script " << script_path << "\n";
+            return 1;
+        }
+    }
+
+    HANDLE h = open_device( FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED );
+    if ( !h )
+    {
+        std::cerr << "failed to open " << HV_DEVICE_LINK << " (is driver loaded?)\n";
+        return 1;
+    }
+
+    ULONG failed = run_session( h, script_file.is_open( ) ? static_cast< std::istream& >( script_file ) : std::cin, depth );
+
+    CloseHandle( h );
+    return failed == 0 ? 0 : 2;
+}
+
+static bool ioctl_sandbox_scan( HANDLE h, ULONG id, ULONG flags )
+{
+    const ULONG max_changed = 4096;
+    std::vector<BYTE> out( sizeof( hv_scan_result ) + max_changed * sizeof( ULONG ) );
+    const hv_scan_result* result = reinterpret_cast< const hv_scan_result* >( out.data( ) );
+    const ULONG* changed = reinterpret_cast< const ULONG* >( result + 1 );
+
+    hv_scan_request req = {};
+    req.id = id;
+    req.flags = flags;
+
+    ULONG scanned = 0;
+    ULONG total_changed = 0;
+    do
+    {
+        DWORD returned = 0;
+        BOOL ok = DeviceIoControl( h, IOCTL_HV_SANDBOX_SCAN, &req, sizeof( req ), out.data( ), ( DWORD )out.size( ), &returned, nullptr );
+        if ( !ok || returned < sizeof( hv_scan_result ) )
+        {
+            std::cerr << "ioctl_sandbox_scan failed: " << GetLastError( ) << "\n";
+            return false;
+        }
+
+        for ( ULONG i = 0; i < result->changed_count; ++i )
+        {
+            std::cout << "changed page " << changed[ i ] << " (gpa 0x" << std::hex << ( ULONG64 )changed[ i ] * PAGE_SIZE << std::dec << ")\n";
+        }
+
+        scanned += result->pages_scanned;
+        total_changed += result->changed_count;
+        req.start_page = result->next_page;
+    } while ( req.start_page < result->guest_pages );
+
+    std::cout << "sandbox-scan: " << scanned << " pages hashed, " << total_changed << " changed\n";
+    return true;
+}
+
+// blocks in the driver until events arrive (the wait is pended there, nothing polls), prints one json
+// line per event. --poll returns after one batch
+static bool ioctl_events( HANDLE h, bool from_now, bool poll )
+{
+    hv_event_wait_request req = {};
+    req.after_sequence = from_now ? HV_EVENT_FROM_NOW : 0;
+    req.flags = poll ? HV_EVENT_WAIT_POLL : 0;
+
+    std::vector<BYTE> out( sizeof( hv_event_wait_result ) + 64 * sizeof( hv_event_record ) );
+    for ( ;; )
+    {
+        DWORD returned = 0;
+        BOOL ok = DeviceIoControl( h, IOCTL_HV_EVENT_WAIT, &req, sizeof( req ), out.data( ), ( DWORD )out.size( ), &returned, nullptr );
+        if ( !ok || returned < sizeof( hv_event_wait_result ) )
+        {
+            std::cerr << "ioctl_events failed: " << GetLastError( ) << "\n";
+            return false;
+        }
+
+        const hv_event_wait_result* result = reinterpret_cast< const hv_event_wait_result* >( out.data( ) );
+        const hv_event_record* records = reinterpret_cast< const hv_event_record* >( result + 1 );
+        if ( result->lost ) std::cout << "{\"lost\":" << result->lost << "}\n";
+
+        for ( ULONG i = 0; i < result->record_count; ++i )
+        {
+            const hv_event_record& e = records[ i ];
+            const char* type = e.type == HV_EVENT_SANDBOX_CREATED ? "created" : e.type == HV_EVENT_SANDBOX_DESTROYED ? "destroyed" : e.type == HV_EVENT_SANDBOX_FAULTED ? "faulted" : "unknown";
+
+            char line[ 256 ];
+            snprintf( line, sizeof( line ), "{\"seq\":%llu,\"time\":%llu,\"event\":\"%s\",\"id\":%u,\"detail\":\"0x%llx\",\"status\":\"0x%08x\"}",
+                e.sequence, e.timestamp, type, e.sandbox_id, e.detail, ( ULONG )e.status );
+            std::cout << line << "\n";
+        }
+
+        std::cout.flush( );
+        req.after_sequence = result->last_sequence;
+        if ( poll ) return true;
+    }
+}
+
+static std::vector<BYTE> build_mem_request( ULONG id, ULONG64 gpa, ULONG64 length )
+{
+    std::vector<BYTE> req( sizeof( hv_mem_request ) + sizeof( hv_mem_segment ) );
+    hv_mem_request* header = reinterpret_cast< hv_mem_request* >( req.data( ) );
+    hv_mem_segment* segment = reinterpret_cast< hv_mem_segment* >( header + 1 );
+    header->id = id;
+    header->segment_count = 1;
+    segment->gpa = gpa;
+    segment->length = length;
+    return req;
+}
+
+static bool ioctl_mem_read( HANDLE h, ULONG id, ULONG64 gpa, ULONG length, const char* path )
+{
+    std::vector<BYTE> req = build_mem_request( id, gpa, length );
+    std::vector<BYTE> data( length );
+    DWORD returned = 0;
+
+    BOOL ok = DeviceIoControl( h, IOCTL_HV_MEM_READ, req.data( ), ( DWORD )req.size( ), data.data( ), length, &returned, nullptr );
     if ( !ok )
     {
-        std::cerr << "ioctl_sandbox_list failed: " << GetLastError( ) << "\n";
-        return false;
+        const DWORD error = GetLastError( );
+        std::cerr << "ioctl_mem_read failed: " << error << " (" << returned << " bytes read)\n";
+
+        // a partial copy still hands back everything read before the failing page, keep it
+        if ( error != ERROR_PARTIAL_COPY || !returned ) return false;
     }
 
-    if ( returned == 0 )
+    if ( path )
     {
-        std::cout << "no sandboxes active\n";
-        return true;
+        std::ofstream out( path, std::ios::binary );
+        out.write( reinterpret_cast< const char* >( data.data( ) ), returned );
+        if ( !out )
+        {
+            std::cerr << "failed to write " << path << "\n";
+            return false;
+        }
+        std::cout << "mem-read wrote " << returned << " bytes to " << path << "\n";
+        return ok != FALSE;
     }
 
-    ULONG written_count = returned / sizeof( ULONG );
-    std::cout << "active sandboxes (" << written_count << "): ";
-    for ( ULONG i = 0; i < written_count; ++i )
+    char line[ 16 ];
+    for ( DWORD i = 0; i < returned; ++i )
     {
-        std::cout << ids[ i ];
-        if ( i + 1 < written_count ) std::cout << ", ";
+        if ( i % 16 == 0 )
+        {
+            if ( i ) std::cout << "\n";
+            snprintf( line, sizeof( line ), "%012llx:", gpa + i );
+            std::cout << line;
+        }
+        snprintf( line, sizeof( line ), " %02x", data[ i ] );
+        std::cout << line;
     }
     std::cout << "\n";
+    return ok != FALSE;
+}
+
+static bool ioctl_mem_write( HANDLE h, ULONG id, ULONG64 gpa, const char* path )
+{
+    std::ifstream in( path, std::ios::binary );
+    if ( !in )
+    {
+        std::cerr << "failed to open " << path << "\n";
+        return false;
+    }
+
+    std::vector<BYTE> data( ( std::istreambuf_iterator<char>( in ) ), std::istreambuf_iterator<char>( ) );
+    if ( data.empty( ) )
+    {
+        std::cerr << path << " is empty\n";
+        return false;
+    }
+
+    std::vector<BYTE> req = build_mem_request( id, gpa, data.size( ) );
+    DWORD returned = 0;
+
+    BOOL ok = DeviceIoControl( h, IOCTL_HV_MEM_WRITE, req.data( ), ( DWORD )req.size( ), data.data( ), ( DWORD )data.size( ), &returned, nullptr );
+    if ( !ok )
+    {
+        std::cerr << "ioctl_mem_write failed: " << GetLastError( ) << " (" << returned << " bytes written)\n";
+        return false;
+    }
+
+    std::cout << "mem-write wrote " << returned << " bytes at gpa 0x" << std::hex << gpa << std::dec << "\n";
+    return true;
+}
+
+static const char* gva_status_name( ULONG status )
+{
+    switch ( status )
+    {
+    case HV_GVA_MAPPED: return "mapped";
+    case HV_GVA_NOT_PRESENT: return "not present";
+    case HV_GVA_EPT_FAULT: return "ept fault";
+    case HV_GVA_NON_CANONICAL: return "non canonical";
+    default: return "?";
+    }
+}
+
+static bool ioctl_mem_translate( HANDLE h, ULONG id, ULONG flags, ULONG64 cr3, ULONG64 gva, ULONG64 length )
+{
+    const ULONG max_records = 1024;
+    std::vector<BYTE> out( sizeof( hv_gva_result ) + max_records * sizeof( hv_gva_record ) );
+    const hv_gva_result* result = reinterpret_cast< const hv_gva_result* >( out.data( ) );
+    const hv_gva_record* records = reinterpret_cast< const hv_gva_record* >( result + 1 );
+
+    hv_gva_request req = {};
+    req.id = id;
+    req.flags = flags;
+    req.cr3 = cr3;
+    req.gva = gva;
+    req.length = length ? length : 1;
+    const ULONG64 end = req.gva + req.length;
+
+    ULONG64 translations = 0, hits = 0, reads = 0, ept_walks = 0, shown = 0;
+    do
+    {
+        DWORD returned = 0;
+        BOOL ok = DeviceIoControl( h, IOCTL_HV_MEM_TRANSLATE, &req, sizeof( req ), out.data( ), ( DWORD )out.size( ), &returned, nullptr );
+        if ( !ok || returned < sizeof( hv_gva_result ) )
+        {
+            std::cerr << "ioctl_mem_translate failed: " << GetLastError( ) << "\n";
+            return false;
+        }
+
+        for ( ULONG i = 0; i < result->record_count; ++i )
+        {
+            const hv_gva_record& r = records[ i ];
+            char line[ 160 ];
+            if ( r.status == HV_GVA_MAPPED )
+            {
+                snprintf( line, sizeof( line ), "%016llx +%-10llx -> gpa %012llx hpa %012llx %c%c%c",
+                    r.gva, r.length, r.gpa, r.hpa, ( r.access & HV_GVA_ACCESS_WRITE ) ? 'w' : '-',
+                    ( r.access & HV_GVA_ACCESS_USER ) ? 'u' : 'k', ( r.access & HV_GVA_ACCESS_EXECUTE ) ? 'x' : '-' );
+            }
+            else
+            {
+                snprintf( line, sizeof( line ), "%016llx +%-10llx    %s", r.gva, r.length, gva_status_name( r.status ) );
+            }
+            std::cout << line << "\n";
+        }
+
+        shown += result->record_count;
+        translations += result->translations;
+        hits += result->cache_hits;
+        reads += result->table_reads;
+        ept_walks += result->ept_walks;
+        req.length = end - result->next_gva;
+        req.gva = result->next_gva;
+    } while ( req.gva != end );
+
+    std::cout << "mem-translate: " << shown << " record(s), " << translations << " walk(s), " << hits << " from the walk cache, "
+        << reads << " guest entries read, " << ept_walks << " ept walks\n";
     return true;
 }
 
@@ -138,6 +524,51 @@ int main( int argc, char** argv )
 
     std::string cmd = argv[ 1 ];
 
+    if ( cmd == "session" )
+    {
+        return run_session_command( argc, argv );
+    }
+
+    if ( cmd == "walk-sim" )
+    {
+        return walk_sim_main( argc, argv, 2 );
+    }
+
+    if ( cmd == "sched-sim" )
+    {
+        return sched_sim_main( argc, argv, 2 );
+    }
+
+    if ( cmd == "gva-bench" )
+    {
+        return gva_bench_main( argc, argv, 2 );
+    }
+
+    if ( cmd == "merge-sim" )
+    {
+        return merge_sim_main( argc, argv, 2 );
+    }
+
+    if ( cmd == "vpid-bench" )
+    {
+        return vpid_bench_main( argc, argv, 2 );
+    }
+
+    if ( cmd == "mem-sim" )
+    {
+        return mem_sim_main( argc, argv, 2 );
+    }
+
+    if ( cmd == "exit-policy" )
+    {
+        return exit_policy_check( argc > 2 ? argv[ 2 ] : nullptr ) ? 0 : 2;
+    }
+
+    if ( cmd == "hash-bench" )
+    {
+        return hash_bench( argc > 2 ? ( ULONG )std::stoul( argv[ 2 ] ) : 256 ) ? 0 : 2;
+    }
+
     HANDLE h = open_device( );
     if ( !h )
     {
@@ -164,8 +595,20 @@ int main( int argc, char** argv )
         else
         {
             ULONG id = ( ULONG )std::stoul( argv[ 2 ] );
-            ok = ioctl_sandbox_create( h, id );
+            ULONG exit_policy = HV_EXIT_POLICY_DEFAULT;
+            ULONG vcpu_count = argc > 4 ? ( ULONG )std::stoul( argv[ 4 ] ) : 1;
+            if ( argc < 4 || parse_exit_policy( argv[ 3 ], exit_policy ) ) ok = ioctl_sandbox_create( h, id, exit_policy, vcpu_count );
+        }
+    }
+    else if ( cmd == "events" )
+    {
+        bool from_now = false, poll = false;
+        for ( int i = 2; i < argc; ++i )
+        {
+            if ( std::string( argv[ i ] ) == "--from-now" ) from_now = true;
+            else if ( std::string( argv[ i ] ) == "--poll" ) poll = true;
         }
+        ok = ioctl_events( h, from_now, poll );
     }
     else if ( cmd == "sandbox-destroy" )
     {
@@ -178,7 +621,93 @@ int main( int argc, char** argv )
     }
     else if ( cmd == "sandbox-list" )
     {
-        ok = ioctl_sandbox_list( h );
+        ULONG page = 64;
+        if ( argc > 3 && std::string( argv[ 2 ] ) == "--page" ) page = ( ULONG )std::stoul( argv[ 3 ] );
+        ok = ioctl_sandbox_list( h, page );
+    }
+    else if ( cmd == "merge-stats" )
+    {
+        ok = ioctl_merge_stats( h );
+    }
+    else if ( cmd == "reclaim-stats" )
+    {
+        ok = reclaim_stats( h );
+    }
+    else if ( cmd == "teardown-bench" )
+    {
+        ULONG rounds = argc > 2 ? ( ULONG )std::stoul( argv[ 2 ] ) : 10;
+        ULONG count = argc > 3 ? ( ULONG )std::stoul( argv[ 3 ] ) : 16;
+        ULONG vcpus = argc > 4 ? ( ULONG )std::stoul( argv[ 4 ] ) : 1;
+        if ( rounds == 0 || count == 0 || vcpus == 0 || vcpus > HV_SANDBOX_MAX_VCPUS ) { std::cerr << "teardown-bench: rounds, count and 1..64 vcpus\n"; print_usage( argv[ 0 ] ); }
+        else ok = teardown_bench( h, rounds, count, vcpus );
+    }
+    else if ( cmd == "sandbox-scan" )
+    {
+        if ( argc < 3 ) { std::cerr << "sandbox-scan requires id\n"; print_usage( argv[ 0 ] ); }
+        else
+        {
+            ULONG id = ( ULONG )std::stoul( argv[ 2 ] );
+            ULONG flags = 0;
+            if ( argc > 3 && std::string( argv[ 3 ] ) == "--rebaseline" ) flags = HV_SCAN_REBASELINE;
+            else if ( argc > 3 && std::string( argv[ 3 ] ) == "--keep" ) flags = HV_SCAN_KEEP_BASELINE;
+            ok = ioctl_sandbox_scan( h, id, flags );
+        }
+    }
+    else if ( cmd == "trace-start" )
+    {
+        ULONG kb = argc > 2 ? ( ULONG )std::stoul( argv[ 2 ] ) : 0;
+        ok = trace_control( h, true, kb * 1024 );
+    }
+    else if ( cmd == "trace-stop" )
+    {
+        ok = trace_control( h, false, 0 );
+    }
+    else if ( cmd == "trace-drain" || cmd == "trace-replay" )
+    {
+        if ( argc < 3 ) { std::cerr << cmd << " requires a file\n"; print_usage( argv[ 0 ] ); }
+        else if ( cmd == "trace-drain" ) ok = trace_drain( h, argv[ 2 ] );
+        else ok = trace_replay( h, argv[ 2 ], argc > 3 && std::string( argv[ 3 ] ) == "--mutate" );
+    }
+    else if ( cmd == "mem-read" )
+    {
+        if ( argc < 5 ) { std::cerr << "mem-read requires id, gpa and length\n"; print_usage( argv[ 0 ] ); }
+        else
+        {
+            ULONG id = ( ULONG )std::stoul( argv[ 2 ] );
+            ULONG64 gpa = std::stoull( argv[ 3 ], nullptr, 0 );
+            ULONG length = ( ULONG )std::stoul( argv[ 4 ], nullptr, 0 );
+            ok = ioctl_mem_read( h, id, gpa, length, argc > 5 ? argv[ 5 ] : nullptr );
+        }
+    }
+    else if ( cmd == "mem-translate" )
+    {
+        if ( argc < 5 ) { std::cerr << "mem-translate requires id, cr3 and gva\n"; print_usage( argv[ 0 ] ); }
+        else
+        {
+            ULONG id = ( ULONG )std::stoul( argv[ 2 ] );
+            ULONG64 cr3 = std::stoull( argv[ 3 ], nullptr, 0 );
+            ULONG64 gva = std::stoull( argv[ 4 ], nullptr, 0 );
+            ULONG64 length = 0;
+            ULONG flags = 0;
+            for ( int i = 5; i < argc; ++i )
+            {
+                const std::string arg = argv[ i ];
+                if ( arg == "--la57" ) flags |= HV_GVA_LA57;
+                else if ( arg == "--no-cache" ) flags |= HV_GVA_NO_CACHE;
+                else length = std::stoull( arg, nullptr, 0 );
+            }
+            ok = ioctl_mem_translate( h, id, flags, cr3, gva, length );
+        }
+    }
+    else if ( cmd == "mem-write" )
+    {
+        if ( argc < 5 ) { std::cerr << "mem-write requires id, gpa and file\n"; print_usage( argv[ 0 ] ); }
+        else
+        {
+            ULONG id = ( ULONG )std::stoul( argv[ 2 ] );
+            ULONG64 gpa = std::stoull( argv[ 3 ], nullptr, 0 );
+            ok = ioctl_mem_write( h, id, gpa, argv[ 4 ] );
+        }
     }
     else
     {
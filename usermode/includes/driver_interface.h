@@ -16,6 +16,64 @@ extern "C"
 #define IOCTL_HV_SANDBOX_CREATE  CTL_CODE(FILE_DEVICE_UNKNOWN, HV_IOCTL_BASE + 10, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define IOCTL_HV_SANDBOX_DESTROY CTL_CODE(FILE_DEVICE_UNKNOWN, HV_IOCTL_BASE + 11, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define IOCTL_HV_SANDBOX_LIST    CTL_CODE(FILE_DEVICE_UNKNOWN, HV_IOCTL_BASE + 12, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_HV_SANDBOX_ENUM    CTL_CODE(FILE_DEVICE_UNKNOWN, HV_IOCTL_BASE + 13, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define HV_ENUM_CURSOR_END       0xFFFFFFFF
+#define HV_SANDBOX_MAX_VCPUS     64
+
+#define HV_SANDBOX_STATE_READY   1
+#define HV_SANDBOX_STATE_FAULTED 2
+
+// fails with ERROR_PARTIAL_COPY when a transfer stops part way, bytes returned still counts what was moved
+#define IOCTL_HV_MEM_READ        CTL_CODE(FILE_DEVICE_UNKNOWN, HV_IOCTL_BASE + 20, METHOD_OUT_DIRECT, FILE_READ_ACCESS)
+#define IOCTL_HV_MEM_WRITE       CTL_CODE(FILE_DEVICE_UNKNOWN, HV_IOCTL_BASE + 21, METHOD_IN_DIRECT, FILE_WRITE_ACCESS)
+
+#define HV_MEM_MAX_SEGMENTS 256
+
+#define IOCTL_HV_SANDBOX_SCAN    CTL_CODE(FILE_DEVICE_UNKNOWN, HV_IOCTL_BASE + 22, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_HV_MEM_TRANSLATE   CTL_CODE(FILE_DEVICE_UNKNOWN, HV_IOCTL_BASE + 23, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+#define HV_GVA_LA57              0x1
+#define HV_GVA_NO_CACHE          0x2
+
+#define HV_GVA_MAPPED            1
+#define HV_GVA_NOT_PRESENT       2
+#define HV_GVA_EPT_FAULT         3
+#define HV_GVA_NON_CANONICAL     4
+
+#define HV_GVA_ACCESS_WRITE      0x1
+#define HV_GVA_ACCESS_USER       0x2
+#define HV_GVA_ACCESS_EXECUTE    0x4
+
+#define IOCTL_HV_MERGE_QUERY     CTL_CODE(FILE_DEVICE_UNKNOWN, HV_IOCTL_BASE + 50, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_HV_RECLAIM_QUERY   CTL_CODE(FILE_DEVICE_UNKNOWN, HV_IOCTL_BASE + 51, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define HV_EXIT_POLICY_DEFAULT   0
+#define HV_EXIT_POLICY_STRICT    1
+#define HV_EXIT_POLICY_MSR_READ  2
+#define HV_EXIT_POLICY_COUNT     3
+
+#define HV_SCAN_REBASELINE       0x1
+#define HV_SCAN_KEEP_BASELINE    0x2
+
+#define IOCTL_HV_TRACE_CONTROL   CTL_CODE(FILE_DEVICE_UNKNOWN, HV_IOCTL_BASE + 30, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_HV_TRACE_DRAIN     CTL_CODE(FILE_DEVICE_UNKNOWN, HV_IOCTL_BASE + 31, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_HV_EVENT_WAIT      CTL_CODE(FILE_DEVICE_UNKNOWN, HV_IOCTL_BASE + 40, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define HV_EVENT_SANDBOX_CREATED    1
+#define HV_EVENT_SANDBOX_DESTROYED  2
+#define HV_EVENT_SANDBOX_FAULTED    3
+
+#define HV_EVENT_WAIT_POLL       0x1
+#define HV_EVENT_FROM_NOW        0xFFFFFFFFFFFFFFFFull
+#define HV_EVENT_RING_CAPACITY   1024
+
+#define HV_TRACE_MAX_INPUT       256
+#define HV_TRACE_DEFAULT_BYTES   ( 1024 * 1024 )
+#define HV_TRACE_MAX_BYTES       ( 64 * 1024 * 1024 )
+#define HV_TRACE_OUTPUT_CRC      0x1
 
     typedef struct _hv_vmx_caps
     {
@@ -31,11 +89,195 @@ extern "C"
         ULONG id;
     } hv_sandbox_request;
 
+    typedef struct _hv_sandbox_create_request
+    {
+        ULONG id;
+        ULONG exit_policy;  // HV_EXIT_POLICY_*
+        ULONG vcpu_count;   // 0 means 1, at most HV_SANDBOX_MAX_VCPUS
+    } hv_sandbox_create_request;
+
+    typedef struct _hv_sandbox_enum_request
+    {
+        ULONG cursor;                     // 0 to start, then next_cursor of the previous page
+        ULONG reserved;
+    } hv_sandbox_enum_request;
+
+    // followed by record_count hv_sandbox_record
+    typedef struct _hv_sandbox_enum_result
+    {
+        ULONG record_count;               // records that follow
+        ULONG next_cursor;                // HV_ENUM_CURSOR_END once every slot has been visited
+    } hv_sandbox_enum_result;
+
+    typedef struct _hv_sandbox_record
+    {
+        ULONG   id;
+        ULONG   state;                    // HV_SANDBOX_STATE_*
+        ULONG64 created;                  // system time, 100ns units
+        ULONG64 ept_pages;                // ept table pages
+        ULONG64 ept_bytes;                // ept table bytes
+        ULONG64 guest_bytes;              // guest ram mapped by the ept
+        ULONG   exit_policy;              // HV_EXIT_POLICY_*
+        ULONG   vcpu_count;
+        ULONG64 bytes_read;               // guest memory read through IOCTL_HV_MEM_READ
+        ULONG64 bytes_written;            // guest memory written through IOCTL_HV_MEM_WRITE
+        ULONG64 faults;                   // guest accesses that failed to resolve
+        ULONG64 scans;                    // completed integrity scans
+        ULONG64 changed_pages;            // pages integrity scans reported as changed
+        ULONG64 shared_bytes;             // guest ram served from pages shared with other sandboxes
+        ULONG64 cow_breaks;               // writes that unshared a page
+    } hv_sandbox_record;
+
+    typedef struct _hv_merge_stats
+    {
+        ULONG64 passes;                   // completed merge passes
+        ULONG64 pages_scanned;            // private pages hashed
+        ULONG64 merges;                   // private pages replaced by a shared one
+        ULONG64 cow_breaks;               // shared mappings broken by a write
+        ULONG64 shared_pages;             // distinct shared pages
+        ULONG64 shared_mappings;          // guest pages mapping one of them
+        ULONG64 saved_bytes;              // (shared_mappings - shared_pages) pages
+        ULONG64 last_pass_us;             // duration of the latest pass
+    } hv_merge_stats;
+
+    typedef struct _hv_reclaim_stats
+    {
+        ULONG64 destroys;                 // sandboxes unpublished by destroy or driver unload
+        ULONG64 inline_destroys;          // of those, torn down in place for lack of a reclaim record
+        ULONG64 pending_sandboxes;        // handed to the reclaim thread and not fully freed yet
+        ULONG64 pending_bytes;            // guest ram and ept tables they still hold
+        ULONG64 reclaimed_sandboxes;
+        ULONG64 reclaimed_bytes;
+        ULONG64 batches;                  // chunks of pages the reclaim thread scrubbed and freed
+        ULONG64 longest_batch_us;
+        ULONG64 last_destroy_us;          // registry lock hold of the latest destroy
+        ULONG64 longest_destroy_us;
+    } hv_reclaim_stats;
+
     typedef struct _hv_sandbox_list_result
     {
         ULONG count;
     } hv_sandbox_list_result;
 
+    typedef struct _hv_mem_segment
+    {
+        ULONG64 gpa;                      // guest physical start
+        ULONG64 length;                   // bytes
+    } hv_mem_segment;
+
+    // followed by segment_count hv_mem_segment entries; the data buffer holds the segments back to back
+    typedef struct _hv_mem_request
+    {
+        ULONG id;                         // sandbox id
+        ULONG segment_count;              // 1..HV_MEM_MAX_SEGMENTS
+    } hv_mem_request;
+
+    typedef struct _hv_scan_request
+    {
+        ULONG id;                         // sandbox id
+        ULONG flags;                      // HV_SCAN_*
+        ULONG start_page;                 // resume cursor, 0 for a fresh scan
+    } hv_scan_request;
+
+    // followed by changed_count ULONG guest page numbers
+    typedef struct _hv_scan_result
+    {
+        ULONG guest_pages;                // pages of guest ram
+        ULONG pages_scanned;              // pages hashed by this call
+        ULONG next_page;                  // == guest_pages once the scan is complete
+        ULONG changed_count;              // entries that follow
+    } hv_scan_result;
+
+    typedef struct _hv_gva_request
+    {
+        ULONG   id;                       // sandbox id
+        ULONG   flags;                    // HV_GVA_*
+        ULONG64 cr3;                      // guest paging root
+        ULONG64 gva;                      // first address
+        ULONG64 length;                   // bytes, 0 = just gva
+    } hv_gva_request;
+
+    // followed by record_count hv_gva_record
+    typedef struct _hv_gva_result
+    {
+        ULONG   record_count;             // records that follow
+        ULONG   reserved;
+        ULONG64 next_gva;                 // resume point, gva + length once done
+        ULONG64 translations;             // walks done by this call
+        ULONG64 cache_hits;               // walks that started from the walk cache
+        ULONG64 table_reads;              // guest paging entries read
+        ULONG64 ept_walks;                // gpa -> hpa resolutions
+    } hv_gva_result;
+
+    typedef struct _hv_gva_record
+    {
+        ULONG64 gva;
+        ULONG64 length;                   // bytes translating contiguously (or the size of the hole)
+        ULONG64 gpa;
+        ULONG64 hpa;
+        ULONG   status;                   // HV_GVA_MAPPED ...
+        ULONG   access;                   // HV_GVA_ACCESS_*
+    } hv_gva_record;
+
+    typedef struct _hv_trace_control
+    {
+        ULONG enable;                     // 1 starts recording (discarding undrained records), 0 stops
+        ULONG buffer_bytes;               // ring size when starting, 0 for HV_TRACE_DEFAULT_BYTES
+    } hv_trace_control;
+
+    // followed by `bytes` of back to back hv_trace_record
+    typedef struct _hv_trace_drain_result
+    {
+        ULONG   record_count;             // records in this drain
+        ULONG   bytes;                    // bytes of records that follow
+        ULONG64 dropped;                  // records lost to a full ring since recording started
+        ULONG   recording;                // 1 while recording
+        ULONG   pending_bytes;            // bytes still queued in the driver after this drain
+    } hv_trace_drain_result;
+
+    // followed by input_captured bytes of the request input, size is padded to 8
+    typedef struct _hv_trace_record
+    {
+        ULONG   size;                     // record bytes including captured input
+        ULONG   io_control_code;
+        LONG    status;                   // NTSTATUS the driver completed with
+        ULONG   input_length;             // caller input length
+        ULONG   input_captured;           // <= HV_TRACE_MAX_INPUT
+        ULONG   output_length;            // caller output length
+        ULONG64 information;              // bytes returned
+        ULONG64 timestamp_ns;             // since recording started
+        ULONG64 latency_ns;               // time spent in the driver
+        ULONG   output_crc;               // see HV_TRACE_OUTPUT_CRC
+        ULONG   flags;                    // HV_TRACE_*
+    } hv_trace_record;
+
+    typedef struct _hv_event_wait_request
+    {
+        ULONG64 after_sequence;           // last sequence already seen, 0 for everything still in the ring, HV_EVENT_FROM_NOW
+        ULONG   flags;                    // HV_EVENT_WAIT_*
+        ULONG   reserved;
+    } hv_event_wait_request;
+
+    // followed by record_count hv_event_record
+    typedef struct _hv_event_wait_result
+    {
+        ULONG   record_count;             // records that follow
+        ULONG   reserved;
+        ULONG64 last_sequence;            // after_sequence for the next wait
+        ULONG64 lost;                     // events overwritten in the ring before this listener read them
+    } hv_event_wait_result;
+
+    typedef struct _hv_event_record
+    {
+        ULONG64 sequence;
+        ULONG64 timestamp;                // system time, 100ns units
+        ULONG64 detail;                   // created: exit policy, faulted: gpa
+        ULONG   type;                     // HV_EVENT_SANDBOX_*
+        ULONG   sandbox_id;
+        LONG    status;                   // faulted: why the access failed
+        ULONG   reserved;
+    } hv_event_record;
+
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,13 @@
+#pragma once
+#include "driver_interface.h"
+
+#include <string>
+
+// Host side check of the exit policies the driver builds its msr / io bitmaps from (hv_exit_bitmap).
+
+// catalog id of the policy called `name`, reports an unknown name
+bool parse_exit_policy( const std::string& name, ULONG& out );
+
+// builds every catalog policy (or just `name`) into host pages, checks each bitmap bit against the rules
+// and shows which policies would share one set of pages in the driver (exit-policy)
+bool exit_policy_check( const char* name );
\ No newline at end of file
@@ -0,0 +1,22 @@
+#pragma once
+#include "driver_interface.h"
+
+// Host side benchmark of the driver's guest virtual translator (hv_gva_walk). Synthetic processes are laid out
+// in guest ram behind an hv_ept_walk built ept, then range scans and random lookups run with and without the
+// walk cache, and cache hit rate, table reads and lookup throughput are reported next to a correctness check.
+struct gva_bench_config
+{
+    ULONG   guest_mb{ 256 };
+    ULONG   levels{ 4 };                  // 4 or 5 level guest paging
+    ULONG64 ept_leaf{ 0x1000 };           // ept leaf size, 4K or 2M
+    ULONG   processes{ 4 };               // address spaces (cr3s) with the same layout but their own tables
+    ULONG   regions{ 32 };                // 4K mapped regions per process, scattered over the user half
+    ULONG   region_kb{ 4096 };
+    ULONG   large_mb{ 64 };               // kernel half mapped with 2M pages
+    ULONG64 lookups{ 2000000 };
+    ULONG   switch_every{ 1000 };         // lookups between cr3 switches in the switch workload
+    ULONG64 seed{ 1 };
+};
+
+// gva-bench entry point, parses options from argv[ first_arg ] on
+int gva_bench_main( int argc, char** argv, int first_arg );
\ No newline at end of file
@@ -0,0 +1,8 @@
+#pragma once
+#include "driver_interface.h"
+
+// Host side throughput of the page digests the driver's scans and merging run on (hv_page_hash), every
+// engine the build and cpu offer.
+
+// hashes a `megabytes` buffer page by page, best of three passes per engine (hash-bench)
+bool hash_bench( ULONG megabytes );
\ No newline at end of file
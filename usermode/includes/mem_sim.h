@@ -0,0 +1,23 @@
+#pragma once
+#include "driver_interface.h"
+
+// Host side check of the bulk guest memory path (IOCTL_HV_MEM_READ / IOCTL_HV_MEM_WRITE). A synthetic ept is
+// built with hv_ept_walk over a host arena whose frames are shuffled in contiguous segments, with holes and
+// read-only leaves punched into it. Random unaligned transfers are then split into runs exactly like
+// copy_guest_memory does (hv_ept_walk::resolve_run under hv_ept_walk::chunk_limit), and every run, byte count
+// and byte is checked against a per-leaf model of the mapping.
+struct mem_sim_config
+{
+    ULONG   guest_mb{ 64 };
+    ULONG64 ept_leaf{ 0x1000 };           // ept leaf size, 4K or 2M
+    ULONG   contig{ 16 };                 // leaves per host contiguous segment are drawn from 1..contig
+    ULONG   hole_pct{ 2 };                // leaves left unmapped
+    ULONG   readonly_pct{ 5 };            // leaves mapped without write access
+    ULONG64 transfers{ 20000 };
+    ULONG   max_kb{ 256 };                // transfer lengths are drawn from 1 byte..max_kb
+    ULONG   chunk_kb{ 64 };               // run cap, the driver's max_copy_chunk_
+    ULONG64 seed{ 1 };
+};
+
+// mem-sim entry point, parses options from argv[ first_arg ] on
+int mem_sim_main( int argc, char** argv, int first_arg );
\ No newline at end of file
@@ -0,0 +1,23 @@
+#pragma once
+#include "driver_interface.h"
+
+// Host side simulation of the driver's page merger. Sandboxes boot the same synthetic image (a share of it
+// zero pages), each diverges in a private share of its pages and keeps rewriting a hot set, and every pass
+// applies the same rules as hv_sandbox_manager::merge_pass (hv_page_hash digests, the hv_page_merge
+// stability check and candidate table, byte compare before sharing). Reports what gets merged, what writes
+// break again, the memory saved and the scan cost per page.
+struct merge_sim_config
+{
+    ULONG   sandboxes{ 8 };
+    ULONG   guest_mb{ 4 };                // per sandbox, the driver's default guest size
+    ULONG   zero_pct{ 40 };               // image pages that are all zero
+    ULONG   private_pct{ 15 };            // pages every sandbox fills with its own bytes
+    ULONG   hot_pct{ 5 };                 // pages a sandbox keeps writing
+    ULONG   write_pct{ 50 };              // chance a hot page is written between two passes
+    ULONG   passes{ 6 };
+    ULONG   candidates{ 16384 };          // candidate table slots, a power of two
+    ULONG64 seed{ 1 };
+};
+
+// merge-sim entry point, parses options from argv[ first_arg ] on
+int merge_sim_main( int argc, char** argv, int first_arg );
\ No newline at end of file
@@ -0,0 +1,22 @@
+#pragma once
+#include "driver_interface.h"
+
+// Host side simulation of the driver's vcpu scheduler (hv_sched). Vcpus alternate between running and
+// halting, how busy each one is follows a zipf skew over sandboxes. The same workload runs on a modelled
+// numa machine under static pinning, work stealing, and numa aware work stealing; delivered cpu time,
+// load balance, migrations and numa locality are reported for each.
+struct sched_sim_config
+{
+    ULONG   cpus{ 16 };
+    ULONG   nodes{ 2 };
+    ULONG   sandboxes{ 64 };
+    ULONG   max_vcpus{ 4 };           // vcpus per sandbox are drawn from 1..max_vcpus
+    double  skew{ 1.0 };              // zipf exponent of per sandbox demand, 0 = every vcpu equally busy
+    double  load{ 0.9 };              // total demand relative to the number of cpus
+    ULONG64 slices{ 20000 };          // simulated time, in scheduler slices
+    double  mean_halt{ 4.0 };         // shortest average halt in slices, idle vcpus halt longer
+    ULONG64 seed{ 1 };
+};
+
+// sched-sim entry point, parses options from argv[ first_arg ] on
+int sched_sim_main( int argc, char** argv, int first_arg );
\ No newline at end of file
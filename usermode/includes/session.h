@@ -0,0 +1,13 @@
+#pragma once
+#include "driver_interface.h"
+
+#include <istream>
+
+// max ioctls kept in flight by a session (bounded by WaitForMultipleObjects)
+#define HV_SESSION_MAX_DEPTH MAXIMUM_WAIT_OBJECTS
+
+// Runs newline separated commands from `script` over a single overlapped device handle.
+// Commands that do not depend on each other are pipelined up to `depth` in flight, results
+// are printed in script order as one json object per line followed by a summary line.
+// Returns the number of failed commands.
+ULONG run_session( HANDLE device, std::istream& script, ULONG depth );
\ No newline at end of file
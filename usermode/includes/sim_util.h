@@ -0,0 +1,155 @@
+#pragma once
+#include "driver_interface.h"
+
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <cerrno>
+#include <cstring>
+
+// Pieces the host side simulators and benches share: a seeded random source, a perf counter stopwatch
+// and the `--name value` option loop.
+namespace sim_util
+{
+    // splitmix64 finalizer over x + the golden gamma, also usable as a stateless hash
+    inline ULONG64 mix64( ULONG64 x )
+    {
+        x += 0x9E3779B97F4A7C15ULL;
+        x = ( x ^ ( x >> 30 ) ) * 0xBF58476D1CE4E5B9ULL;
+        x = ( x ^ ( x >> 27 ) ) * 0x94D049BB133111EBULL;
+        return x ^ ( x >> 31 );
+    }
+
+    // splitmix64 stream, the same seed always gives the same run
+    struct rng
+    {
+        ULONG64 state;
+
+        ULONG64 next( )
+        {
+            const ULONG64 x = mix64( state );
+            state += 0x9E3779B97F4A7C15ULL;
+            return x;
+        }
+
+        ULONG64 below( ULONG64 n ) { return next( ) % n; }
+
+        // uniform in (0, 1), never exactly 0 so it is safe under log
+        double unit( ) { return ( ( next( ) >> 11 ) + 0.5 ) * ( 1.0 / 9007199254740992.0 ); }
+    };
+
+    // seconds since construction or the last restart
+    class stopwatch
+    {
+    public:
+        stopwatch( )
+        {
+            QueryPerformanceFrequency( &frequency_ );
+            restart( );
+        }
+
+        void restart( ) { QueryPerformanceCounter( &started_ ); }
+
+        double seconds( ) const
+        {
+            LARGE_INTEGER now = {};
+            QueryPerformanceCounter( &now );
+            return ( double )( now.QuadPart - started_.QuadPart ) / ( double )frequency_.QuadPart;
+        }
+
+    private:
+        LARGE_INTEGER frequency_{ };
+        LARGE_INTEGER started_{ };
+    };
+
+    // walks `--name value` pairs from argv[ first_arg ] on:
+    //
+    //     sim_util::options opts( "merge-sim", argc, argv, first_arg );
+    //     while ( opts.next( ) )
+    //     {
+    //         if ( opts.take( "--seed", cfg.seed ) ) continue;
+    //         return opts.unknown( );
+    //     }
+    //     if ( opts.failed( ) ) return 1;
+    //
+    // a value that does not parse is reported and ends the loop with failed( ) set
+    class options
+    {
+    public:
+        options( const char* tool, int argc, char** argv, int first_arg ) : tool_( tool ), argc_( argc ), argv_( argv ), next_( first_arg ) { }
+
+        bool next( )
+        {
+            if ( failed_ || next_ >= argc_ ) return false;
+            current_ = next_++;
+            return true;
+        }
+
+        // true when the current option is `name` and has a value, which is parsed into value
+        template < typename T >
+        bool take( const char* name, T& value )
+        {
+            if ( std::strcmp( argv_[ current_ ], name ) != 0 || next_ >= argc_ ) return false;
+
+            const char* text = argv_[ next_++ ];
+            if ( !parse( text, value ) )
+            {
+                std::cerr << tool_ << ": " << name << " does not take " << text << "\n";
+                failed_ = true;
+            }
+            return true;
+        }
+
+        int unknown( ) const
+        {
+            std::cerr << tool_ << ": unknown or incomplete option " << argv_[ current_ ] << "\n";
+            return 1;
+        }
+
+        bool failed( ) const { return failed_; }
+
+    private:
+        static bool parse( const char* text, std::string& value )
+        {
+            value = text;
+            return true;
+        }
+
+        static bool parse( const char* text, ULONG64& value )
+        {
+            // strtoull would quietly wrap a leading minus
+            if ( !*text || *text == '-' ) return false;
+
+            char* end = nullptr;
+            errno = 0;
+            const unsigned long long parsed = std::strtoull( text, &end, 10 );
+            if ( *end || errno == ERANGE ) return false;
+
+            value = parsed;
+            return true;
+        }
+
+        static bool parse( const char* text, ULONG& value )
+        {
+            ULONG64 wide = 0;
+            if ( !parse( text, wide ) || wide > 0xFFFFFFFFULL ) return false;
+
+            value = static_cast< ULONG >( wide );
+            return true;
+        }
+
+        static bool parse( const char* text, double& value )
+        {
+            char* end = nullptr;
+            value = std::strtod( text, &end );
+            return *text && !*end;
+        }
+
+        const char* tool_;
+        int         argc_;
+        char**      argv_;
+        int         next_;
+        int         current_{ 0 };
+        bool        failed_{ false };
+    };
+}
\ No newline at end of file
@@ -0,0 +1,13 @@
+#pragma once
+#include "driver_interface.h"
+
+// Driver side teardown measurements: the reclaim counters of IOCTL_HV_RECLAIM_QUERY, and a bench that
+// times sandbox destroys and the background reclaim behind them.
+
+// prints destroy latency, the reclaim backlog and what the reclaim thread has given back (reclaim-stats)
+bool reclaim_stats( HANDLE device );
+
+// creates `count` sandboxes with `vcpus` vcpus and destroys them again, `rounds` times. Times every destroy
+// call as seen from here and how long the reclaim thread takes to give the memory back after the last one
+// of a round, then prints reclaim_stats
+bool teardown_bench( HANDLE device, ULONG rounds, ULONG count, ULONG vcpus );
\ No newline at end of file
@@ -0,0 +1,25 @@
+#pragma once
+#include "driver_interface.h"
+
+// on disk layout written by trace_drain: one header followed by raw hv_trace_record entries
+#define HV_TRACE_FILE_MAGIC   0x52545648  // 'HVTR'
+#define HV_TRACE_FILE_VERSION 1
+
+typedef struct _hv_trace_file_header
+{
+    ULONG magic;
+    ULONG version;
+    ULONG record_header_size;             // sizeof( hv_trace_record ) of the writer
+    ULONG reserved;
+} hv_trace_file_header;
+
+bool trace_control( HANDLE device, bool enable, ULONG buffer_bytes );
+
+// drains everything queued in the driver and appends it to `path`, creating the file if needed
+bool trace_drain( HANDLE device, const char* path );
+
+// reissues recorded ioctls back to back and compares outcome against the recording. Records that changed
+// driver state (sandbox create / destroy, scans, trace control) are only reissued when `mutate` is set;
+// direct i/o transfers, inputs cut at HV_TRACE_MAX_INPUT and event waits never are, since what they carried
+// is not in the trace. Skipped records are counted in the report.
+bool trace_replay( HANDLE device, const char* path, bool mutate );
\ No newline at end of file
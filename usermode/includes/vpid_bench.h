@@ -0,0 +1,31 @@
+#pragma once
+#include "driver_interface.h"
+
+// Host side benchmark of the driver's vpid allocator and tlb tag tracking (hv_vpid). Processors switch
+// between sandbox vcpus every slice while sandboxes are destroyed and recreated (vpids and eptps recycled)
+// and epts are remapped under running vcpus. Each processor's tlb is modelled as the translations of its
+// most recently entered contexts. Compares no vpids (flush on every entry), vpids with broadcast
+// invalidation on every recycle / remap, and the tracked single context invalidations of hv_vpid, checking
+// that no entry ever sees a stale translation.
+struct vpid_bench_config
+{
+    ULONG   cpus{ 8 };
+    ULONG   sandboxes{ 16 };
+    ULONG   vcpus{ 2 };                   // per sandbox
+    ULONG64 entries{ 2000000 };           // vm entries across all processors, one per slice
+    ULONG   recycle_every{ 20000 };       // entries between destroying and recreating a random sandbox
+    ULONG   remap_every{ 5000 };          // entries between ept changes (merge / copy on write) of a random sandbox
+    ULONG   migrate_pct{ 5 };             // chance a vcpu moves to another processor when it is picked
+    ULONG   tlb_contexts{ 12 };           // contexts whose translations one processor's tlb keeps warm
+    ULONG   working_set{ 64 };            // pages a vcpu touches per slice, refilled after a cold entry
+    ULONG   walk_cycles{ 150 };           // one nested page walk
+    ULONG   invalidate_cycles{ 400 };     // one single context invvpid / invept
+    ULONG   flush_cycles{ 1000 };         // flushing everything on a vm transition without vpid
+    ULONG   ipi_cycles{ 3000 };           // one remote invalidation request
+    ULONG   vpid_count{ 4096 };
+    ULONG   ept_ways{ 32 };               // eptps each processor tracks, the driver's twice max sandboxes
+    ULONG64 seed{ 1 };
+};
+
+// vpid-bench entry point, parses options from argv[ first_arg ] on
+int vpid_bench_main( int argc, char** argv, int first_arg );
\ No newline at end of file
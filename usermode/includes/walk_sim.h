@@ -0,0 +1,32 @@
+#pragma once
+#include "driver_interface.h"
+
+// Host side model of nested (guest paging x EPT) translation. Memory access traces are replayed against
+// a TLB / paging structure cache model and the EPT hv_ept builds (same hv_ept_walk tables and walk), and
+// walk depth, memory references per miss and estimated cycles are reported per layout.
+struct walk_sim_config
+{
+    ULONG64 guest_bytes{ 1ULL << 30 };
+    ULONG   guest_levels{ 4 };            // 4 or 5 level guest paging
+    ULONG64 guest_leaf{ 0x1000 };         // guest leaf size, 4K or 2M
+    ULONG64 ept_leaf{ 0x1000 };           // ept leaf size, 4K, 2M or 1G
+    bool    spread_tables{ false };       // guest page tables scattered over guest ram instead of packed together
+    ULONG   tlb_entries{ 64 };            // combined gva->hpa entries
+    ULONG   psc_entries{ 32 };            // guest paging structure cache, per level
+    ULONG   ept_psc_entries{ 32 };        // ept paging structure cache, per level
+    ULONG   ntlb_entries{ 32 };           // gpa->hpa nested tlb
+    ULONG   ref_cycles{ 40 };             // cost of one paging structure memory reference
+};
+
+struct walk_sim_stats
+{
+    ULONG64 accesses{ 0 };
+    ULONG64 tlb_misses{ 0 };
+    ULONG64 guest_refs{ 0 };
+    ULONG64 ept_refs{ 0 };
+    ULONG   max_refs{ 0 };
+    ULONG64 ept_table_pages{ 0 };
+};
+
+// walk-sim entry point, parses options from argv[ first_arg ] on
+int walk_sim_main( int argc, char** argv, int first_arg );
\ No newline at end of file
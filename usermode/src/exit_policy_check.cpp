@@ -0,0 +1,115 @@
+#include "../includes/exit_policy_check.h"
+#include "../../hypervisor/includes/hv_exit_bitmap.h"
+#include "../../hypervisor/includes/hv_page_hash.h"
+
+#include <iostream>
+#include <vector>
+#include <cstdio>
+
+bool parse_exit_policy( const std::string& name, ULONG& out )
+{
+    for ( ULONG id = 0; id < hv_exit_bitmap::catalog::count; ++id )
+    {
+        if ( name == hv_exit_bitmap::catalog::find( id )->name )
+        {
+            out = id;
+            return true;
+        }
+    }
+
+    std::cerr << "unknown exit policy " << name << "\n";
+    return false;
+}
+
+bool exit_policy_check( const char* name )
+{
+    using namespace hv_exit_bitmap;
+
+    std::vector<ULONG> ids;
+    if ( name )
+    {
+        ULONG id = 0;
+        if ( !parse_exit_policy( name, id ) ) return false;
+        ids.push_back( id );
+    }
+    else
+    {
+        for ( ULONG id = 0; id < catalog::count; ++id ) ids.push_back( id );
+    }
+
+    std::vector<std::vector<UCHAR>> built;
+    bool ok = true;
+
+    for ( ULONG id : ids )
+    {
+        const policy& p = *catalog::find( id );
+        std::vector<UCHAR> pages( 3 * bitmap_bytes );
+        UCHAR* msr = pages.data( );
+        UCHAR* io_a = msr + bitmap_bytes;
+        UCHAR* io_b = io_a + bitmap_bytes;
+        build_msr_bitmap( p, msr );
+        build_io_bitmaps( p, io_a, io_b );
+
+        // every msr the bitmap can describe, both directions, must exit exactly when no rule passes it
+        ULONG pass_reads = 0, pass_writes = 0, pass_ports = 0, mismatches = 0;
+        const ULONG windows[ 2 ] = { 0x0, 0xC0000000 };
+        for ( ULONG base : windows )
+        {
+            for ( ULONG msr_index = base; msr_index <= base + 0x1FFF; ++msr_index )
+            {
+                ULONG expected = 0;
+                for ( ULONG r = 0; r < p.msr_count; ++r )
+                {
+                    if ( msr_index >= p.msrs[ r ].first && msr_index <= p.msrs[ r ].last ) expected |= p.msrs[ r ].pass;
+                }
+
+                const bool read_exits = msr_exits( msr, msr_index, false );
+                const bool write_exits = msr_exits( msr, msr_index, true );
+                if ( read_exits == ( ( expected & pass_read ) != 0 ) ) ++mismatches;
+                if ( write_exits == ( ( expected & pass_write ) != 0 ) ) ++mismatches;
+                if ( !read_exits ) ++pass_reads;
+                if ( !write_exits ) ++pass_writes;
+            }
+        }
+
+        if ( !msr_exits( msr, 0x40000000, false ) ) ++mismatches;
+
+        for ( ULONG port = 0; port <= 0xFFFF; ++port )
+        {
+            bool expected = false;
+            for ( ULONG r = 0; r < p.port_count; ++r )
+            {
+                if ( port >= p.ports[ r ].first && port <= p.ports[ r ].last ) expected = true;
+            }
+
+            const bool exits = io_exits( io_a, io_b, port, 1 );
+            if ( exits == expected ) ++mismatches;
+            if ( !exits ) ++pass_ports;
+        }
+
+        if ( !io_exits( io_a, io_b, 0xFFFF, 2 ) ) ++mismatches;
+
+        LONG shares_with = -1;
+        for ( size_t i = 0; i < built.size( ); ++i )
+        {
+            if ( built[ i ] == pages ) shares_with = static_cast< LONG >( ids[ i ] );
+        }
+        built.push_back( pages );
+
+        char line[ 200 ];
+        snprintf( line, sizeof( line ), "%-9s msr reads passed %5u, msr writes passed %5u, ports passed %5u, crc32c %08x%s",
+            p.name, pass_reads, pass_writes, pass_ports, hv_page_hash::crc32c_buffer( pages.data( ), pages.size( ) ),
+            mismatches ? "  MISMATCH" : "" );
+        std::cout << line;
+        if ( shares_with >= 0 ) std::cout << " (shares pages with " << catalog::find( shares_with )->name << ")";
+        std::cout << "\n";
+
+        if ( mismatches )
+        {
+            std::cerr << "exit-policy: " << p.name << " has " << mismatches << " bitmap bits that disagree with its rules\n";
+            ok = false;
+        }
+    }
+
+    return ok;
+}
\ No newline at end of file
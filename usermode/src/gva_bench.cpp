@@ -0,0 +1,372 @@
+#include "../includes/gva_bench.h"
+#include "../includes/sim_util.h"
+#include "../../hypervisor/includes/hv_ept_walk.h"
+#include "../../hypervisor/includes/hv_gva_walk.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdio>
+
+namespace
+{
+    using sim_util::rng;
+
+    // one leaf the layout created, what a lookup inside it must translate to
+    struct mapping
+    {
+        ULONG64 gva;
+        ULONG64 size;
+        ULONG64 gpa;
+        ULONG   access;
+    };
+
+    struct process
+    {
+        ULONG64 cr3{ 0 };
+        std::vector<mapping> mappings;
+    };
+
+    // Guest ram with data frames at the bottom and guest paging tables allocated downwards from the top, behind
+    // an ept built by hv_ept_walk::build_tables. Host physical addresses are fake but stable, like walk-sim:
+    // ept tables at ept_base_pa_, guest ram shifted up to guest_ram_pa_.
+    class guest_machine
+    {
+    public:
+        explicit guest_machine( const gva_bench_config& cfg )
+            : cfg_( cfg ),
+            guest_bytes_( static_cast< ULONG64 >( cfg.guest_mb ) << 20 ),
+            ram_( ( size_t )( guest_bytes_ / sizeof( ULONG64 ) ), 0 )
+        {
+            const ULONG64 table_pages = hv_ept_walk::table_pages_for( guest_bytes_, cfg.ept_leaf );
+            ept_tables_.assign( ( size_t )( table_pages * hv_ept_walk::entries_per_table ), 0 );
+            hv_ept_walk::build_tables( ept_tables_.data( ), guest_bytes_, cfg.ept_leaf,
+                [ this ]( ULONG64* table ) { return ept_base_pa_ + ( ULONG64 )( table - ept_tables_.data( ) ) * sizeof( ULONG64 ); },
+                [ ]( ULONG64 gpa ) { return guest_ram_pa_ + gpa; } );
+
+            data_limit_ = guest_bytes_ - guest_bytes_ / 8;
+            next_table_ = guest_bytes_;
+        }
+
+        bool build( std::vector<process>& processes )
+        {
+            rng r{ cfg_.seed };
+            const ULONG64 region_bytes = static_cast< ULONG64 >( cfg_.region_kb ) << 10;
+            const ULONG64 user_top = 1ULL << 47;
+            const ULONG64 kernel_base = ~0ULL << ( hv_gva_walk::address_bits( cfg_.levels ) - 1 );
+
+            // every process gets the same layout, at the same addresses, with its own tables and frames
+            std::vector<ULONG64> region_bases( cfg_.regions );
+            for ( ULONG64& base : region_bases ) base = ( ( 1ULL << 32 ) + r.below( user_top - ( 1ULL << 33 ) - region_bytes ) ) & ~0xFFFULL;
+
+            processes.resize( cfg_.processes );
+            for ( process& p : processes )
+            {
+                p.cr3 = alloc_table( );
+                if ( !p.cr3 ) return false;
+
+                for ( ULONG i = 0; i < cfg_.regions; ++i )
+                {
+                    // every fourth region is an image (read / execute), the rest data, one guard page in 16 left out
+                    const ULONG64 flags = ( i % 4 == 0 ) ? hv_gva_walk::pte_user : hv_gva_walk::pte_user | hv_gva_walk::pte_write | hv_gva_walk::pte_nx;
+                    for ( ULONG64 offset = 0; offset < region_bytes; offset += hv_ept_walk::page_4k )
+                    {
+                        if ( r.below( 16 ) == 0 ) continue;
+                        const ULONG64 gpa = r.below( data_limit_ / hv_ept_walk::page_4k ) * hv_ept_walk::page_4k;
+                        if ( !map( p, region_bases[ i ] + offset, gpa, 1, flags ) ) return false;
+                    }
+                }
+
+                const ULONG64 large = hv_ept_walk::level_page_size( 2 );
+                for ( ULONG64 offset = 0; offset < ( static_cast< ULONG64 >( cfg_.large_mb ) << 20 ); offset += large )
+                {
+                    const ULONG64 gpa = r.below( data_limit_ / large ) * large;
+                    if ( !map( p, kernel_base + offset, gpa, 2, hv_gva_walk::pte_write | hv_gva_walk::pte_nx ) ) return false;
+                }
+
+                // and with enough guest ram one 1G page at the top
+                if ( guest_bytes_ >= hv_ept_walk::level_page_size( 3 ) && !map( p, ~0ULL << 30, 0, 3, hv_gva_walk::pte_write ) ) return false;
+            }
+
+            return true;
+        }
+
+        // what hv_sandbox_manager::translate_guest_range passes: guest tables and data both go through the ept
+        const ULONG64* map_table( ULONG64 gpa ) const
+        {
+            hv_ept_walk::translation t{};
+            if ( gpa >= guest_bytes_ || !hv_ept_walk::translate( ept_base_pa_, gpa, p2v_fn( ), t ) || !( t.access & hv_ept_walk::ept_read ) ) return nullptr;
+            return static_cast< const ULONG64* >( p2v( t.hpa ) );
+        }
+
+        bool to_hpa( ULONG64 gpa, ULONG64& hpa, ULONG64& span ) const
+        {
+            hv_ept_walk::translation t{};
+            if ( gpa >= guest_bytes_ || !hv_ept_walk::translate( ept_base_pa_, gpa, p2v_fn( ), t ) ) return false;
+            hpa = t.hpa;
+            span = t.page_size - ( gpa & ( t.page_size - 1 ) );
+            return true;
+        }
+
+        void translate( ULONG64 cr3, ULONG64 gva, hv_gva_walk::walk_cache* cache, hv_gva_walk::translation& out ) const
+        {
+            hv_gva_walk::translate( cr3, cfg_.levels, gva, cache,
+                [ this ]( ULONG64 gpa ) { return map_table( gpa ); },
+                [ this ]( ULONG64 gpa, ULONG64& hpa, ULONG64& span ) { return to_hpa( gpa, hpa, span ); }, out );
+        }
+
+        template < typename emit_fn >
+        ULONG64 translate_range( ULONG64 cr3, ULONG64 gva, ULONG64 end, hv_gva_walk::walk_cache* cache, emit_fn&& emit, hv_gva_walk::range_stats& stats ) const
+        {
+            return hv_gva_walk::translate_range( cr3, cfg_.levels, gva, end, ~0u, cache,
+                [ this ]( ULONG64 gpa ) { return map_table( gpa ); },
+                [ this ]( ULONG64 gpa, ULONG64& hpa, ULONG64& span ) { return to_hpa( gpa, hpa, span ); }, emit, stats );
+        }
+
+        ULONG64 host_pa( ULONG64 gpa ) const { return guest_ram_pa_ + gpa; }
+        ULONG64 table_pages( ) const { return ( guest_bytes_ - next_table_ ) / hv_ept_walk::page_4k; }
+
+    private:
+        const void* p2v( ULONG64 pa ) const
+        {
+            if ( pa >= ept_base_pa_ && pa - ept_base_pa_ < ept_tables_.size( ) * sizeof( ULONG64 ) ) return &ept_tables_[ ( size_t )( ( pa - ept_base_pa_ ) / sizeof( ULONG64 ) ) ];
+            if ( pa >= guest_ram_pa_ && pa - guest_ram_pa_ < guest_bytes_ ) return reinterpret_cast< const unsigned char* >( ram_.data( ) ) + ( pa - guest_ram_pa_ );
+            return nullptr;
+        }
+
+        // hv_ept_walk::translate wants mutable table pointers, nothing here writes through them
+        struct p2v_adapter
+        {
+            const guest_machine* machine;
+            void* operator( )( ULONG64 pa ) const { return const_cast< void* >( machine->p2v( pa ) ); }
+        };
+
+        p2v_adapter p2v_fn( ) const { return p2v_adapter{ this }; }
+
+        ULONG64 alloc_table( )
+        {
+            if ( next_table_ - data_limit_ < hv_ept_walk::page_4k ) return 0;
+            next_table_ -= hv_ept_walk::page_4k;
+            return next_table_;
+        }
+
+        ULONG64* table_at( ULONG64 gpa ) { return &ram_[ ( size_t )( gpa / sizeof( ULONG64 ) ) ]; }
+
+        bool map( process& p, ULONG64 gva, ULONG64 gpa, ULONG leaf_level, ULONG64 flags )
+        {
+            ULONG64 table = p.cr3;
+            for ( ULONG level = cfg_.levels; level > leaf_level; --level )
+            {
+                ULONG64& entry = table_at( table )[ hv_ept_walk::table_index( gva, level ) ];
+                if ( !( entry & hv_gva_walk::pte_present ) )
+                {
+                    const ULONG64 next = alloc_table( );
+                    if ( !next ) return false;
+                    entry = next | hv_gva_walk::pte_present | hv_gva_walk::pte_write | hv_gva_walk::pte_user;
+                }
+                table = entry & hv_gva_walk::pte_pfn_mask;
+            }
+
+            table_at( table )[ hv_ept_walk::table_index( gva, leaf_level ) ] = gpa | flags | hv_gva_walk::pte_present | ( leaf_level > 1 ? hv_gva_walk::pte_large : 0 );
+
+            ULONG access = hv_gva_walk::access_all;
+            if ( !( flags & hv_gva_walk::pte_write ) ) access &= ~hv_gva_walk::access_write;
+            if ( !( flags & hv_gva_walk::pte_user ) ) access &= ~hv_gva_walk::access_user;
+            if ( flags & hv_gva_walk::pte_nx ) access &= ~hv_gva_walk::access_execute;
+            p.mappings.push_back( { gva, hv_ept_walk::level_page_size( leaf_level ), gpa, access } );
+            return true;
+        }
+
+    private:
+        static constexpr ULONG64 ept_base_pa_ = 0x100000000ULL;
+        static constexpr ULONG64 guest_ram_pa_ = 0x10000000000ULL;
+
+        const gva_bench_config& cfg_;
+        ULONG64 guest_bytes_;
+        ULONG64 data_limit_{ 0 };
+        ULONG64 next_table_{ 0 };
+        std::vector<ULONG64> ram_;
+        std::vector<ULONG64> ept_tables_;
+    };
+
+    struct workload_result
+    {
+        hv_gva_walk::range_stats stats{ };
+        double  seconds{ 0 };
+        ULONG64 records{ 0 };
+        ULONG64 mismatches{ 0 };
+        ULONG64 flushes{ 0 };
+    };
+
+    // the whole canonical address space of every process, both halves, records merged like the driver does
+    workload_result run_scan( const gva_bench_config& cfg, const guest_machine& machine, const std::vector<process>& processes, bool cached,
+        std::vector<hv_gva_walk::span_record>& records )
+    {
+        workload_result result;
+        hv_gva_walk::walk_cache cache{ };
+        records.clear( );
+
+        auto emit = [ &records ]( const hv_gva_walk::span_record& span ) -> bool
+        {
+            if ( !records.empty( ) && hv_gva_walk::continues( records.back( ), span ) ) records.back( ).length += span.length;
+            else records.push_back( span );
+            return true;
+        };
+
+        const ULONG64 half = 1ULL << ( hv_gva_walk::address_bits( cfg.levels ) - 1 );
+        sim_util::stopwatch timer;
+        for ( const process& p : processes )
+        {
+            cache.reset( p.cr3, cfg.levels, 0 );
+            machine.translate_range( p.cr3, 0, half, cached ? &cache : nullptr, emit, result.stats );
+            machine.translate_range( p.cr3, ~0ULL - half + 1, 0, cached ? &cache : nullptr, emit, result.stats );
+        }
+
+        result.seconds = timer.seconds( );
+        result.records = records.size( );
+        return result;
+    }
+
+    // random lookups inside mapped pages, the cr3 moves to the next process every switch_every lookups
+    // (never when switch_every is 0). Every result is checked against the layout
+    workload_result run_lookups( const gva_bench_config& cfg, const guest_machine& machine, const std::vector<process>& processes, bool cached,
+        ULONG switch_every )
+    {
+        workload_result result;
+        hv_gva_walk::walk_cache cache{ };
+
+        // addresses are drawn up front so only the translations are timed
+        rng r{ cfg.seed ^ 0x5DEECE66DULL };
+        std::vector<ULONG64> addresses( ( size_t )cfg.lookups );
+        std::vector<const mapping*> expected( ( size_t )cfg.lookups );
+        std::vector<ULONG> owner( ( size_t )cfg.lookups );
+
+        ULONG current = 0;
+        for ( ULONG64 i = 0; i < cfg.lookups; ++i )
+        {
+            if ( switch_every && i && i % switch_every == 0 ) current = ( current + 1 ) % ( ULONG )processes.size( );
+
+            const process& p = processes[ current ];
+            const mapping& m = p.mappings[ ( size_t )r.below( p.mappings.size( ) ) ];
+            addresses[ ( size_t )i ] = m.gva + ( r.below( m.size ) & ~7ULL );
+            expected[ ( size_t )i ] = &m;
+            owner[ ( size_t )i ] = current;
+        }
+
+        std::vector<hv_gva_walk::translation> out( ( size_t )cfg.lookups );
+        sim_util::stopwatch timer;
+        for ( ULONG64 i = 0; i < cfg.lookups; ++i )
+        {
+            const ULONG64 cr3 = processes[ owner[ ( size_t )i ] ].cr3;
+            if ( cached && !cache.matches( cr3, cfg.levels, 0 ) ) cache.reset( cr3, cfg.levels, 0 );
+            machine.translate( cr3, addresses[ ( size_t )i ], cached ? &cache : nullptr, out[ ( size_t )i ] );
+        }
+        result.seconds = timer.seconds( );
+        result.flushes = cache.flushes;
+
+        for ( ULONG64 i = 0; i < cfg.lookups; ++i )
+        {
+            const hv_gva_walk::translation& t = out[ ( size_t )i ];
+            const mapping& m = *expected[ ( size_t )i ];
+            const ULONG64 gpa = m.gpa + ( addresses[ ( size_t )i ] - m.gva );
+
+            ++result.stats.translations;
+            result.stats.table_reads += t.table_reads;
+            result.stats.ept_walks += t.ept_walks;
+            if ( t.cache_hit ) ++result.stats.cache_hits;
+
+            if ( t.result != hv_gva_walk::status::mapped || t.gpa != gpa || t.hpa != machine.host_pa( gpa ) || t.access != m.access ) ++result.mismatches;
+        }
+
+        return result;
+    }
+
+    void print_row( const char* workload, bool cached, const workload_result& r )
+    {
+        const double n = r.stats.translations ? ( double )r.stats.translations : 1.0;
+        char line[ 200 ];
+        snprintf( line, sizeof( line ), "%-14s %-5s %12llu  %7.1f%%  %10.2f  %14.2f  %8.1f  %8.2f",
+            workload, cached ? "on" : "off", r.stats.translations, 100.0 * r.stats.cache_hits / n,
+            r.stats.table_reads / n, r.stats.ept_walks / n, r.seconds * 1e9 / n, n / r.seconds / 1e6 );
+        std::cout << line << "\n";
+    }
+}
+
+int gva_bench_main( int argc, char** argv, int first_arg )
+{
+    gva_bench_config cfg;
+
+    std::string leaf;
+
+    sim_util::options opts( "gva-bench", argc, argv, first_arg );
+    while ( opts.next( ) )
+    {
+        if ( opts.take( "--guest-mb", cfg.guest_mb ) || opts.take( "--levels", cfg.levels ) || opts.take( "--ept-leaf", leaf ) ||
+            opts.take( "--processes", cfg.processes ) || opts.take( "--regions", cfg.regions ) || opts.take( "--region-kb", cfg.region_kb ) ||
+            opts.take( "--large-mb", cfg.large_mb ) || opts.take( "--lookups", cfg.lookups ) || opts.take( "--switch", cfg.switch_every ) ||
+            opts.take( "--seed", cfg.seed ) )
+            continue;
+
+        return opts.unknown( );
+    }
+
+    if ( opts.failed( ) ) return 1;
+
+    if ( leaf == "4k" ) cfg.ept_leaf = 0x1000;
+    else if ( leaf == "2m" ) cfg.ept_leaf = 0x200000;
+    else if ( !leaf.empty( ) )
+    {
+        std::cerr << "gva-bench: --ept-leaf takes 4k or 2m\n";
+        return 1;
+    }
+
+    if ( ( cfg.levels != 4 && cfg.levels != 5 ) || cfg.guest_mb < 16 || cfg.guest_mb > 4096 || ( cfg.guest_mb % 2 ) || cfg.processes == 0 ||
+        cfg.region_kb == 0 || ( cfg.region_kb % 4 ) || cfg.lookups == 0 )
+    {
+        std::cerr << "gva-bench: need levels 4 or 5, an even 16..4096 guest MB, processes >= 1, region KB a multiple of 4 and lookups >= 1\n";
+        return 1;
+    }
+
+    guest_machine machine( cfg );
+    std::vector<process> processes;
+    if ( !machine.build( processes ) )
+    {
+        std::cerr << "gva-bench: guest page tables do not fit the top eighth of guest ram, use more --guest-mb or fewer regions\n";
+        return 1;
+    }
+
+    char line[ 256 ];
+    snprintf( line, sizeof( line ), "gva-bench: %u level paging, %u MB guest ram, %s ept leaves, %u process(es) with %zu leaves each, %llu guest table pages",
+        cfg.levels, cfg.guest_mb, cfg.ept_leaf == 0x1000 ? "4k" : "2m", cfg.processes, processes[ 0 ].mappings.size( ), machine.table_pages( ) );
+    std::cout << line << "\n\n";
+    std::cout << "workload       cache translations  hit rate  reads/xlat  ept walks/xlat   ns/xlat  Mxlat/s\n";
+
+    // range scans: both runs must produce the same records
+    std::vector<hv_gva_walk::span_record> uncached_records, cached_records;
+    const workload_result scan_off = run_scan( cfg, machine, processes, false, uncached_records );
+    const workload_result scan_on = run_scan( cfg, machine, processes, true, cached_records );
+    print_row( "scan", false, scan_off );
+    print_row( "scan", true, scan_on );
+
+    ULONG64 scan_mismatches = uncached_records.size( ) != cached_records.size( ) ? 1 : 0;
+    for ( size_t i = 0; !scan_mismatches && i < cached_records.size( ); ++i )
+    {
+        const hv_gva_walk::span_record& a = uncached_records[ i ];
+        const hv_gva_walk::span_record& b = cached_records[ i ];
+        if ( a.gva != b.gva || a.length != b.length || a.gpa != b.gpa || a.hpa != b.hpa || a.result != b.result || a.access != b.access ) ++scan_mismatches;
+    }
+
+    const workload_result random_off = run_lookups( cfg, machine, processes, false, 0 );
+    const workload_result random_on = run_lookups( cfg, machine, processes, true, 0 );
+    const workload_result switch_on = run_lookups( cfg, machine, processes, true, cfg.switch_every );
+    print_row( "random", false, random_off );
+    print_row( "random", true, random_on );
+
+    snprintf( line, sizeof( line ), "switch/%u", cfg.switch_every );
+    print_row( line, true, switch_on );
+
+    const ULONG64 lookup_mismatches = random_off.mismatches + random_on.mismatches + switch_on.mismatches;
+    std::cout << "\nscan: " << cached_records.size( ) << " merged records, " << ( scan_mismatches ? "cached and uncached scans DIFFER" : "cached and uncached scans agree" ) << "\n";
+    std::cout << "lookups: " << lookup_mismatches << " of " << 3 * cfg.lookups << " translations disagree with the layout, " << switch_on.flushes << " cache flushes from cr3 switches\n";
+    return scan_mismatches || lookup_mismatches ? 2 : 0;
+}
\ No newline at end of file
@@ -0,0 +1,62 @@
+#include "../includes/hash_bench.h"
+#include "../../hypervisor/includes/hv_page_hash.h"
+
+#include <iostream>
+#include <cstdio>
+
+bool hash_bench( ULONG megabytes )
+{
+    const SIZE_T bytes = ( SIZE_T )megabytes * 1024 * 1024;
+    BYTE* buffer = static_cast< BYTE* >( VirtualAlloc( nullptr, bytes, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE ) );
+    if ( !buffer )
+    {
+        std::cerr << "hash-bench: failed to allocate " << megabytes << " MB\n";
+        return false;
+    }
+
+    // xorshift fill so the buffer is resident and not trivially compressible
+    ULONG64 seed = 0x9E3779B97F4A7C15ULL;
+    ULONG64* q = reinterpret_cast< ULONG64* >( buffer );
+    for ( SIZE_T i = 0; i < bytes / sizeof( ULONG64 ); ++i )
+    {
+        seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+        q[ i ] = seed;
+    }
+
+    LARGE_INTEGER freq = {};
+    QueryPerformanceFrequency( &freq );
+
+    const SIZE_T pages = bytes / hv_page_hash::page_bytes;
+    const hv_page_hash::engine engines[ ] = { hv_page_hash::engine::portable, hv_page_hash::engine::sse42 };
+
+    for ( hv_page_hash::engine e : engines )
+    {
+        if ( e == hv_page_hash::engine::sse42 && hv_page_hash::select_engine( ) != e )
+        {
+            std::cout << hv_page_hash::engine_name( e ) << ": not available on this cpu/build\n";
+            continue;
+        }
+
+        // best of a few passes, the first one also warms the tlb
+        double best = 0.0;
+        ULONG64 sink = 0;
+        for ( int pass = 0; pass < 3; ++pass )
+        {
+            LARGE_INTEGER start = {}, end = {};
+            QueryPerformanceCounter( &start );
+            for ( SIZE_T p = 0; p < pages; ++p ) sink += hv_page_hash::digest( e, buffer + p * hv_page_hash::page_bytes );
+            QueryPerformanceCounter( &end );
+
+            const double seconds = ( double )( end.QuadPart - start.QuadPart ) / ( double )freq.QuadPart;
+            const double gbps = ( double )bytes / seconds / 1e9;
+            if ( gbps > best ) best = gbps;
+        }
+
+        char line[ 128 ];
+        snprintf( line, sizeof( line ), "%-9s %8.2f GB/s per core (%u MB, digest sum %016llx)", hv_page_hash::engine_name( e ), best, megabytes, sink );
+        std::cout << line << "\n";
+    }
+
+    VirtualFree( buffer, 0, MEM_RELEASE );
+    return true;
+}
\ No newline at end of file
@@ -0,0 +1,405 @@
+#include "../includes/mem_sim.h"
+#include "../includes/sim_util.h"
+#include "../../hypervisor/includes/hv_ept_walk.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+
+namespace
+{
+    using sim_util::rng;
+
+    constexpr ULONG64 host_base = 0x100000000ULL;     // host physical address of the first arena byte
+    constexpr ULONG64 no_frame = ~0ULL;
+
+    // what the model expects one ept leaf to map to
+    struct leaf_state
+    {
+        ULONG64 hpa{ no_frame };    // no_frame = hole
+        bool    writable{ false };
+    };
+
+    enum run_end
+    {
+        end_chunk,                  // the run reached the chunk limit, the transfer goes on with the next one
+        end_transfer,               // the run reached the end of the transfer or of guest ram
+        end_access,                 // the next leaf is unmapped or lacks the access
+        end_discontiguous,          // the next leaf is mapped but its host frame does not follow
+        end_count
+    };
+
+    // guest ram behind a synthetic ept: host frames and tables live in one arena addressed from host_base,
+    // image_ holds what every guest byte should read as
+    class guest
+    {
+    public:
+        explicit guest( const mem_sim_config& cfg ) : cfg_( cfg ), guest_bytes_( static_cast< ULONG64 >( cfg.guest_mb ) << 20 ) { }
+
+        ULONG64 guest_bytes( ) const { return guest_bytes_; }
+        ULONG64 segments( ) const { return segments_; }
+
+        void build( rng& r )
+        {
+            const ULONG64 leaves = guest_bytes_ / cfg_.ept_leaf;
+            const ULONG64 table_pages = hv_ept_walk::table_pages_for( guest_bytes_, cfg_.ept_leaf );
+
+            // data frames first so 2M leaves stay 2M aligned, the tables behind them
+            arena_.assign( static_cast< size_t >( guest_bytes_ + table_pages * hv_ept_walk::page_4k ), 0 );
+            tables_ = reinterpret_cast< ULONG64* >( arena_.data( ) + guest_bytes_ );
+
+            // segments of 1..contig leaves keep their host frames in order, the segments themselves are shuffled
+            std::vector<std::pair<ULONG64, ULONG64>> order;
+            for ( ULONG64 leaf = 0; leaf < leaves; )
+            {
+                const ULONG64 count = std::min<ULONG64>( 1 + r.below( cfg_.contig ), leaves - leaf );
+                order.push_back( { leaf, count } );
+                leaf += count;
+            }
+            for ( size_t i = order.size( ); i > 1; --i ) std::swap( order[ i - 1 ], order[ static_cast< size_t >( r.below( i ) ) ] );
+            segments_ = order.size( );
+
+            leaves_.assign( static_cast< size_t >( leaves ), leaf_state{ } );
+            ULONG64 frame = 0;
+            for ( const auto& segment : order )
+            {
+                for ( ULONG64 i = 0; i < segment.second; ++i, ++frame ) leaves_[ static_cast< size_t >( segment.first + i ) ].hpa = host_base + frame * cfg_.ept_leaf;
+            }
+
+            hv_ept_walk::build_tables( tables_, guest_bytes_, cfg_.ept_leaf,
+                [ this ]( ULONG64* table ) { return host_base + ( reinterpret_cast< unsigned char* >( table ) - arena_.data( ) ); },
+                [ this ]( ULONG64 gpa ) { return leaves_[ static_cast< size_t >( gpa / cfg_.ept_leaf ) ].hpa; } );
+
+            image_.resize( static_cast< size_t >( guest_bytes_ / sizeof( ULONG64 ) ) );
+            for ( ULONG64& q : image_ ) q = r.next( );
+
+            for ( ULONG64 leaf = 0; leaf < leaves; ++leaf )
+            {
+                leaf_state& state = leaves_[ static_cast< size_t >( leaf ) ];
+                ULONG64* entry = leaf_entry( leaf * cfg_.ept_leaf );
+                if ( r.below( 100 ) < cfg_.hole_pct )
+                {
+                    *entry = 0;
+                    state.hpa = no_frame;
+                    continue;
+                }
+
+                state.writable = r.below( 100 ) >= cfg_.readonly_pct;
+                if ( !state.writable ) *entry &= ~hv_ept_walk::ept_write;
+                restore( leaf * cfg_.ept_leaf, cfg_.ept_leaf );
+            }
+        }
+
+        void* p2v( ULONG64 pa ) const
+        {
+            if ( pa < host_base || pa - host_base >= arena_.size( ) ) return nullptr;
+            return const_cast< unsigned char* >( arena_.data( ) ) + ( pa - host_base );
+        }
+
+        // the checks hv_ept::resolve_run makes around the walk
+        bool resolve( ULONG64 gpa, ULONG64 max_length, ULONG64 access, hv_ept_walk::run& out ) const
+        {
+            if ( gpa >= guest_bytes_ || max_length == 0 ) return false;
+            if ( max_length > guest_bytes_ - gpa ) max_length = guest_bytes_ - gpa;
+
+            const ULONG64 pml4_pa = host_base + guest_bytes_;
+            return hv_ept_walk::resolve_run( pml4_pa, gpa, max_length, access, [ this ]( ULONG64 pa ) { return p2v( pa ); }, out );
+        }
+
+        // the model's side of a transfer
+        bool allows( ULONG64 gpa, bool write ) const
+        {
+            if ( gpa >= guest_bytes_ ) return false;
+            const leaf_state& state = leaves_[ static_cast< size_t >( gpa / cfg_.ept_leaf ) ];
+            return state.hpa != no_frame && ( !write || state.writable );
+        }
+
+        ULONG64 hpa_of( ULONG64 gpa ) const
+        {
+            return leaves_[ static_cast< size_t >( gpa / cfg_.ept_leaf ) ].hpa + gpa % cfg_.ept_leaf;
+        }
+
+        ULONG64 expected_done( ULONG64 gpa, ULONG64 length, bool write ) const
+        {
+            ULONG64 done = 0;
+            while ( done < length && allows( gpa + done, write ) )
+            {
+                const ULONG64 leaf_left = cfg_.ept_leaf - ( gpa + done ) % cfg_.ept_leaf;
+                done += std::min( leaf_left, length - done );
+            }
+            return done;
+        }
+
+        const unsigned char* image( ULONG64 gpa ) const { return reinterpret_cast< const unsigned char* >( image_.data( ) ) + gpa; }
+
+        // true when the mapped bytes [gpa, gpa + length) hold data
+        bool holds( ULONG64 gpa, ULONG64 length, const unsigned char* data ) const
+        {
+            bool same = true;
+            for_each_piece( gpa, length, [ & ]( ULONG64 offset, unsigned char* host, ULONG64 piece )
+            {
+                if ( std::memcmp( host, data + offset, static_cast< size_t >( piece ) ) != 0 ) same = false;
+            } );
+            return same;
+        }
+
+        // puts the image back over the mapped bytes [gpa, gpa + length)
+        void restore( ULONG64 gpa, ULONG64 length )
+        {
+            for_each_piece( gpa, length, [ & ]( ULONG64 offset, unsigned char* host, ULONG64 piece )
+            {
+                std::memcpy( host, image( gpa + offset ), static_cast< size_t >( piece ) );
+            } );
+        }
+
+    private:
+        ULONG64* leaf_entry( ULONG64 gpa )
+        {
+            ULONG64* table = tables_;
+            for ( ULONG level = hv_ept_walk::ept_levels; ; --level )
+            {
+                ULONG64* entry = &table[ hv_ept_walk::table_index( gpa, level ) ];
+                if ( level == 1 || ( *entry & hv_ept_walk::ept_large_page ) ) return entry;
+                table = static_cast< ULONG64* >( p2v( *entry & hv_ept_walk::ept_pfn_mask ) );
+            }
+        }
+
+        // leaf sized pieces of [gpa, gpa + length) and their host bytes, callers only pass mapped ranges
+        template < typename piece_fn >
+        void for_each_piece( ULONG64 gpa, ULONG64 length, piece_fn&& fn ) const
+        {
+            for ( ULONG64 offset = 0; offset < length; )
+            {
+                const ULONG64 piece = std::min( cfg_.ept_leaf - ( gpa + offset ) % cfg_.ept_leaf, length - offset );
+                fn( offset, static_cast< unsigned char* >( p2v( hpa_of( gpa + offset ) ) ), piece );
+                offset += piece;
+            }
+        }
+
+        const mem_sim_config&      cfg_;
+        ULONG64                    guest_bytes_;
+        ULONG64                    segments_{ 0 };
+        ULONG64*                   tables_{ nullptr };
+        std::vector<unsigned char> arena_;
+        std::vector<leaf_state>    leaves_;
+        std::vector<ULONG64>       image_;
+    };
+
+    struct sim_totals
+    {
+        ULONG64 reads{ 0 };
+        ULONG64 writes{ 0 };
+        ULONG64 bytes{ 0 };
+        ULONG64 stopped{ 0 };
+        ULONG64 runs{ 0 };
+        ULONG64 crossing{ 0 };
+        ULONG64 ends[ end_count ]{ };
+        ULONG64 errors{ 0 };
+        double  seconds{ 0 };
+    };
+
+    struct checked_run
+    {
+        hv_ept_walk::run run;
+        ULONG64          limit;
+    };
+
+    class checker
+    {
+    public:
+        checker( const mem_sim_config& cfg, guest& g, sim_totals& totals ) : cfg_( cfg ), guest_( g ), totals_( totals ) { }
+
+        // one transfer through the copy_guest_memory loop, then everything it did is held against the model
+        void transfer( ULONG64 gpa, ULONG64 length, bool write, std::vector<unsigned char>& buffer )
+        {
+            const ULONG64 access = write ? hv_ept_walk::ept_write : hv_ept_walk::ept_read;
+            const ULONG64 chunk = static_cast< ULONG64 >( cfg_.chunk_kb ) << 10;
+            runs_.clear( );
+
+            sim_util::stopwatch timer;
+            ULONG64 done = 0;
+            while ( done < length )
+            {
+                hv_ept_walk::run run = {};
+                const ULONG64 limit = hv_ept_walk::chunk_limit( done, length, chunk );
+                if ( !guest_.resolve( gpa + done, limit, access, run ) ) break;
+
+                if ( write ) std::memcpy( run.host_va, buffer.data( ) + done, static_cast< size_t >( run.length ) );
+                else std::memcpy( buffer.data( ) + done, run.host_va, static_cast< size_t >( run.length ) );
+
+                runs_.push_back( { run, limit } );
+                done += run.length;
+            }
+            totals_.seconds += timer.seconds( );
+
+            ++( write ? totals_.writes : totals_.reads );
+            totals_.bytes += done;
+            if ( done < length ) ++totals_.stopped;
+
+            const ULONG64 expected = guest_.expected_done( gpa, length, write );
+            if ( done != expected ) fail( gpa, length, write, "copied %llu bytes, the mapping allows %llu", done, expected );
+
+            ULONG64 offset = 0;
+            for ( const checked_run& c : runs_ )
+            {
+                check_run( gpa, length, write, offset, c );
+                offset += c.run.length;
+            }
+
+            if ( !write )
+            {
+                if ( std::memcmp( buffer.data( ), guest_.image( gpa ), static_cast< size_t >( done ) ) != 0 ) fail( gpa, length, write, "read bytes differ from guest ram" );
+                return;
+            }
+
+            if ( !guest_.holds( gpa, done, buffer.data( ) ) ) fail( gpa, length, write, "written bytes did not land in the mapped frames" );
+            if ( done < length && guest_.allows( gpa + done, false ) && !guest_.holds( gpa + done, 1, guest_.image( gpa + done ) ) )
+                fail( gpa, length, write, "write went past the leaf it had to stop at" );
+            guest_.restore( gpa, done );
+        }
+
+    private:
+        void check_run( ULONG64 gpa, ULONG64 length, bool write, ULONG64 offset, const checked_run& c )
+        {
+            const ULONG64 at = gpa + offset;
+            const ULONG64 next = at + c.run.length;
+            ++totals_.runs;
+            if ( at / hv_ept_walk::page_4k != ( next - 1 ) / hv_ept_walk::page_4k ) ++totals_.crossing;
+
+            // the cap the loop asked for must be what is left of the transfer, never more than one chunk
+            const ULONG64 cap = std::min( length - offset, static_cast< ULONG64 >( cfg_.chunk_kb ) << 10 );
+            if ( c.limit != cap )
+            {
+                fail( gpa, length, write, "run at gpa 0x%llx was capped at %llu bytes instead of %llu", at, c.limit, cap );
+                return;
+            }
+
+            if ( c.run.length == 0 || c.run.length > c.limit || c.run.hpa != guest_.hpa_of( at ) || c.run.host_va != guest_.p2v( c.run.hpa ) )
+            {
+                fail( gpa, length, write, "run at gpa 0x%llx is %llu bytes at hpa 0x%llx, limit %llu, the mapping says hpa 0x%llx",
+                    at, c.run.length, c.run.hpa, c.limit, guest_.hpa_of( at ) );
+                return;
+            }
+
+            run_end why;
+            if ( c.run.length == c.limit ) why = offset + c.run.length == length ? end_transfer : end_chunk;
+            else if ( next == guest_.guest_bytes( ) ) why = end_transfer;
+            else if ( !guest_.allows( next, write ) ) why = end_access;
+            else if ( guest_.hpa_of( next ) != c.run.hpa + c.run.length ) why = end_discontiguous;
+            else
+            {
+                fail( gpa, length, write, "run at gpa 0x%llx stops at 0x%llx although the next leaf continues it", at, next );
+                return;
+            }
+
+            ++totals_.ends[ why ];
+        }
+
+        template < typename... args >
+        void fail( ULONG64 gpa, ULONG64 length, bool write, const char* format, args... values )
+        {
+            if ( totals_.errors++ >= 10 ) return;
+
+            char detail[ 200 ];
+            snprintf( detail, sizeof( detail ), format, values... );
+            char line[ 300 ];
+            snprintf( line, sizeof( line ), "mem-sim: %s of %llu bytes at gpa 0x%llx: %s", write ? "write" : "read", length, gpa, detail );
+            std::cout << line << "\n";
+        }
+
+        const mem_sim_config&    cfg_;
+        guest&                   guest_;
+        sim_totals&              totals_;
+        std::vector<checked_run> runs_;
+    };
+}
+
+int mem_sim_main( int argc, char** argv, int first_arg )
+{
+    mem_sim_config cfg;
+    std::string leaf;
+
+    sim_util::options opts( "mem-sim", argc, argv, first_arg );
+    while ( opts.next( ) )
+    {
+        if ( opts.take( "--guest-mb", cfg.guest_mb ) || opts.take( "--ept-leaf", leaf ) || opts.take( "--contig", cfg.contig ) ||
+            opts.take( "--holes", cfg.hole_pct ) || opts.take( "--readonly", cfg.readonly_pct ) || opts.take( "--transfers", cfg.transfers ) ||
+            opts.take( "--max-kb", cfg.max_kb ) || opts.take( "--chunk-kb", cfg.chunk_kb ) || opts.take( "--seed", cfg.seed ) )
+            continue;
+
+        return opts.unknown( );
+    }
+
+    if ( opts.failed( ) ) return 1;
+
+    if ( leaf == "4k" ) cfg.ept_leaf = 0x1000;
+    else if ( leaf == "2m" ) cfg.ept_leaf = 0x200000;
+    else if ( !leaf.empty( ) )
+    {
+        std::cerr << "mem-sim: --ept-leaf takes 4k or 2m\n";
+        return 1;
+    }
+
+    if ( cfg.guest_mb < 2 || cfg.guest_mb > 1024 || ( cfg.guest_mb % 2 ) || cfg.contig == 0 || cfg.hole_pct > 100 || cfg.readonly_pct > 100 ||
+        cfg.transfers == 0 || cfg.max_kb == 0 || cfg.chunk_kb == 0 )
+    {
+        std::cerr << "mem-sim: need an even 2..1024 guest MB, contig >= 1, percentages up to 100, transfers, max KB and chunk KB >= 1\n";
+        return 1;
+    }
+
+    rng r{ cfg.seed };
+    guest g( cfg );
+    g.build( r );
+
+    char line[ 256 ];
+    snprintf( line, sizeof( line ), "mem-sim: %u MB guest ram, %s ept leaves in %llu host segments, %u%% holes, %u%% read-only, %u KB run cap",
+        cfg.guest_mb, cfg.ept_leaf == 0x1000 ? "4k" : "2m", g.segments( ), cfg.hole_pct, cfg.readonly_pct, cfg.chunk_kb );
+    std::cout << line << "\n\n";
+
+    sim_totals totals;
+    checker check( cfg, g, totals );
+    const ULONG64 max_bytes = static_cast< ULONG64 >( cfg.max_kb ) << 10;
+    std::vector<unsigned char> buffer( static_cast< size_t >( max_bytes ) );
+
+    for ( ULONG64 i = 0; i < cfg.transfers; ++i )
+    {
+        // mostly anywhere in guest ram, some across its end and some wholly past it
+        const ULONG64 pick = r.below( 32 );
+        ULONG64 gpa = r.below( g.guest_bytes( ) );
+        if ( pick == 0 ) gpa = g.guest_bytes( ) + r.below( hv_ept_walk::page_4k );
+        else if ( pick < 3 ) gpa = g.guest_bytes( ) - 1 - r.below( std::min( max_bytes, g.guest_bytes( ) ) );
+
+        const ULONG64 length = 1 + r.below( max_bytes );
+        const bool write = r.below( 2 ) == 0;
+        if ( write )
+        {
+            for ( ULONG64 b = 0; b < length; b += sizeof( ULONG64 ) )
+            {
+                const ULONG64 value = r.next( );
+                std::memcpy( buffer.data( ) + b, &value, static_cast< size_t >( std::min<ULONG64>( sizeof( value ), length - b ) ) );
+            }
+        }
+
+        check.transfer( gpa, length, write, buffer );
+    }
+
+    snprintf( line, sizeof( line ), "transfers: %llu (%llu reads, %llu writes), %.1f MB moved, %llu stopped early at a hole, a read-only leaf or the end of guest ram",
+        cfg.transfers, totals.reads, totals.writes, totals.bytes / 1048576.0, totals.stopped );
+    std::cout << line << "\n";
+    snprintf( line, sizeof( line ), "runs:      %llu, %.1f KB average, %llu crossed a 4K page boundary",
+        totals.runs, totals.runs ? totals.bytes / 1024.0 / totals.runs : 0.0, totals.crossing );
+    std::cout << line << "\n";
+    snprintf( line, sizeof( line ), "run ends:  chunk limit %llu, transfer end %llu, hole or access %llu, host discontinuity %llu",
+        totals.ends[ end_chunk ], totals.ends[ end_transfer ], totals.ends[ end_access ], totals.ends[ end_discontiguous ] );
+    std::cout << line << "\n";
+    snprintf( line, sizeof( line ), "copy:      %.0f MB/s through resolve_run and memcpy", totals.seconds > 0 ? totals.bytes / 1048576.0 / totals.seconds : 0.0 );
+    std::cout << line << "\n";
+
+    if ( totals.errors ) std::cout << "FAILED: " << totals.errors << " transfer check(s) disagree with the mapping\n";
+    else std::cout << "checks:    every run, byte count and byte matches the mapping\n";
+    return totals.errors ? 2 : 0;
+}
\ No newline at end of file
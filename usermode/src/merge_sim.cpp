@@ -0,0 +1,307 @@
+#include "../includes/merge_sim.h"
+#include "../includes/sim_util.h"
+#include "../../hypervisor/includes/hv_page_hash.h"
+#include "../../hypervisor/includes/hv_page_merge.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <cstring>
+#include <cstdio>
+
+namespace
+{
+    using sim_util::rng;
+
+    constexpr ULONG page_qwords = hv_page_hash::page_bytes / sizeof( ULONG64 );
+    constexpr ULONG private_page = ~0U;
+
+    struct sandbox
+    {
+        std::vector<ULONG64> ram;         // private frames, the frame of a merged page is stale until a write unshares it
+        std::vector<ULONG>   shared;      // per guest page, index into the share pool or private_page
+        std::vector<ULONG64> digests;     // merge_digests, the previous pass's digest per page
+        std::vector<ULONG>   hot;         // pages this sandbox keeps writing
+
+        ULONG64* page( ULONG n ) { return ram.data( ) + static_cast< size_t >( n ) * page_qwords; }
+    };
+
+    // stands in for hv_page_share: refcounted read only copies looked up by digest, bytes compared on a match
+    class share_pool
+    {
+    public:
+        ULONG find( ULONG64 digest, const ULONG64* content ) const
+        {
+            const auto range = by_digest_.equal_range( digest );
+            for ( auto it = range.first; it != range.second; ++it )
+            {
+                if ( std::memcmp( bytes( it->second ), content, hv_page_hash::page_bytes ) == 0 ) return it->second;
+            }
+
+            return private_page;
+        }
+
+        // the driver takes over the holder's page, here it is copied
+        ULONG adopt( ULONG64 digest, const ULONG64* content )
+        {
+            ULONG index = 0;
+            if ( free_.empty( ) )
+            {
+                index = static_cast< ULONG >( refs_.size( ) );
+                refs_.push_back( 0 );
+                digests_.push_back( 0 );
+                frames_.resize( frames_.size( ) + page_qwords );
+            }
+            else
+            {
+                index = free_.back( );
+                free_.pop_back( );
+            }
+
+            std::memcpy( &frames_[ static_cast< size_t >( index ) * page_qwords ], content, hv_page_hash::page_bytes );
+            digests_[ index ] = digest;
+            refs_[ index ] = 1;
+            by_digest_.emplace( digest, index );
+            ++page_count_;
+            ++ref_count_;
+            return index;
+        }
+
+        void acquire( ULONG index )
+        {
+            ++refs_[ index ];
+            ++ref_count_;
+        }
+
+        void release( ULONG index )
+        {
+            --ref_count_;
+            if ( --refs_[ index ] ) return;
+
+            const auto range = by_digest_.equal_range( digests_[ index ] );
+            for ( auto it = range.first; it != range.second; ++it )
+            {
+                if ( it->second != index ) continue;
+                by_digest_.erase( it );
+                break;
+            }
+
+            free_.push_back( index );
+            --page_count_;
+        }
+
+        const ULONG64* bytes( ULONG index ) const { return &frames_[ static_cast< size_t >( index ) * page_qwords ]; }
+        ULONG64 page_count( ) const { return page_count_; }
+        ULONG64 ref_count( ) const { return ref_count_; }
+
+    private:
+        std::vector<ULONG64> frames_;
+        std::vector<ULONG64> digests_;
+        std::vector<ULONG>   refs_;
+        std::vector<ULONG>   free_;
+        std::unordered_multimap<ULONG64, ULONG> by_digest_;
+        ULONG64 page_count_{ 0 };
+        ULONG64 ref_count_{ 0 };
+    };
+
+    struct pass_stats
+    {
+        ULONG64 scanned;
+        ULONG64 merges;
+        ULONG64 cow_breaks;
+        double  seconds;
+    };
+
+    // page n of the common image, zero or bytes that depend on n alone so every sandbox boots the same
+    void fill_image_page( ULONG64* out, ULONG n, const merge_sim_config& cfg )
+    {
+        rng r{ cfg.seed ^ ( ( n + 1ULL ) * 0x100000001B3ULL ) };
+        if ( r.below( 100 ) < cfg.zero_pct )
+        {
+            std::memset( out, 0, hv_page_hash::page_bytes );
+            return;
+        }
+
+        for ( ULONG q = 0; q < page_qwords; ++q ) out[ q ] = r.next( );
+    }
+
+    // a guest write under the driver: a merged page gets its private copy back first (handle_ept_violation)
+    void write_page( sandbox& s, ULONG page, share_pool& pool, rng& r, pass_stats& stats )
+    {
+        if ( s.shared[ page ] != private_page )
+        {
+            std::memcpy( s.page( page ), pool.bytes( s.shared[ page ] ), hv_page_hash::page_bytes );
+            pool.release( s.shared[ page ] );
+            s.shared[ page ] = private_page;
+            ++stats.cow_breaks;
+        }
+
+        s.page( page )[ r.below( page_qwords ) ] = r.next( ) | 1;
+    }
+
+    // hv_sandbox_manager::merge_page with the sandbox slot standing in for both owner and owner id
+    void merge_page( std::vector<sandbox>& sandboxes, ULONG slot, ULONG page, hv_page_hash::engine engine, hv_page_merge::candidate_table& candidates,
+        share_pool& pool, pass_stats& stats )
+    {
+        sandbox& s = sandboxes[ slot ];
+        if ( s.shared[ page ] != private_page ) return;
+
+        const ULONG64* content = s.page( page );
+        const ULONG64 digest = hv_page_merge::tag_digest( hv_page_hash::digest( engine, content ) );
+        const bool stable = s.digests[ page ] == digest;
+        s.digests[ page ] = digest;
+        ++stats.scanned;
+        if ( !stable ) return;
+
+        ULONG shared = pool.find( digest, content );
+        if ( shared == private_page )
+        {
+            const hv_page_merge::candidate* match = candidates.find( digest );
+            sandbox* holder = match ? &sandboxes[ match->owner ] : nullptr;
+            const bool usable = holder && holder->shared[ match->page ] == private_page && !( match->owner == slot && match->page == page ) &&
+                std::memcmp( holder->page( match->page ), content, hv_page_hash::page_bytes ) == 0;
+
+            if ( !usable )
+            {
+                candidates.insert( digest, slot, slot, page );
+                return;
+            }
+
+            shared = pool.adopt( digest, holder->page( match->page ) );
+            holder->shared[ match->page ] = shared;
+        }
+
+        s.shared[ page ] = shared;
+        pool.acquire( shared );
+        ++stats.merges;
+    }
+}
+
+int merge_sim_main( int argc, char** argv, int first_arg )
+{
+    merge_sim_config cfg;
+
+    sim_util::options opts( "merge-sim", argc, argv, first_arg );
+    while ( opts.next( ) )
+    {
+        if ( opts.take( "--sandboxes", cfg.sandboxes ) || opts.take( "--guest-mb", cfg.guest_mb ) || opts.take( "--zero", cfg.zero_pct ) ||
+            opts.take( "--private", cfg.private_pct ) || opts.take( "--hot", cfg.hot_pct ) || opts.take( "--writes", cfg.write_pct ) ||
+            opts.take( "--passes", cfg.passes ) || opts.take( "--candidates", cfg.candidates ) || opts.take( "--seed", cfg.seed ) )
+            continue;
+
+        return opts.unknown( );
+    }
+
+    if ( opts.failed( ) ) return 1;
+
+    if ( cfg.sandboxes == 0 || cfg.guest_mb == 0 || cfg.guest_mb > 1024 || cfg.zero_pct > 100 || cfg.private_pct > 100 || cfg.hot_pct > 100 ||
+        cfg.write_pct > 100 || cfg.passes == 0 || cfg.candidates < 2 || ( cfg.candidates & ( cfg.candidates - 1 ) ) )
+    {
+        std::cerr << "merge-sim: need sandboxes >= 1, 1..1024 guest MB, percentages up to 100, passes >= 1 and a power of two candidate slots\n";
+        return 1;
+    }
+
+    const ULONG guest_pages = static_cast< ULONG >( ( static_cast< ULONG64 >( cfg.guest_mb ) << 20 ) / hv_page_hash::page_bytes );
+    const ULONG64 total_pages = static_cast< ULONG64 >( guest_pages ) * cfg.sandboxes;
+
+    // every sandbox boots the image, then makes a share of it its own and picks the pages it keeps writing
+    std::vector<sandbox> sandboxes( cfg.sandboxes );
+    for ( ULONG slot = 0; slot < cfg.sandboxes; ++slot )
+    {
+        sandbox& s = sandboxes[ slot ];
+        s.ram.resize( static_cast< size_t >( guest_pages ) * page_qwords );
+        s.shared.assign( guest_pages, private_page );
+        s.digests.assign( guest_pages, 0 );
+
+        rng r{ cfg.seed * 0x2545F4914F6CDD1DULL + slot + 1 };
+        for ( ULONG page = 0; page < guest_pages; ++page )
+        {
+            ULONG64* frame = s.page( page );
+            fill_image_page( frame, page, cfg );
+            if ( r.below( 100 ) < cfg.private_pct )
+            {
+                for ( ULONG q = 0; q < page_qwords; ++q ) frame[ q ] = r.next( );
+            }
+
+            if ( r.below( 100 ) < cfg.hot_pct ) s.hot.push_back( page );
+        }
+    }
+
+    std::vector<hv_page_merge::candidate> slots( cfg.candidates );
+    hv_page_merge::candidate_table candidates( slots.data( ), cfg.candidates );
+    share_pool pool;
+
+    const hv_page_hash::engine engine = hv_page_hash::select_engine( );
+
+    char line[ 256 ];
+    snprintf( line, sizeof( line ), "merge-sim: %u sandbox(es) x %u MB, image %u%% zero pages, %u%% private, %u%% hot written %u%% of passes, %s page hash",
+        cfg.sandboxes, cfg.guest_mb, cfg.zero_pct, cfg.private_pct, cfg.hot_pct, cfg.write_pct, hv_page_hash::engine_name( engine ) );
+    std::cout << line << "\n\n";
+    std::cout << "pass  scanned  merged  cow breaks  shared pages  mappings  saved MB  resident MB  density  ns/page\n";
+
+    rng writes{ cfg.seed + 0xC0FFEE };
+    pass_stats totals = {};
+    for ( ULONG pass = 0; pass < cfg.passes; ++pass )
+    {
+        pass_stats stats = {};
+
+        // the guests run between two passes
+        if ( pass > 0 )
+        {
+            for ( sandbox& s : sandboxes )
+            {
+                for ( ULONG page : s.hot )
+                {
+                    if ( writes.below( 100 ) < cfg.write_pct ) write_page( s, page, pool, writes, stats );
+                }
+            }
+        }
+
+        sim_util::stopwatch timer;
+        candidates.clear( );
+        for ( ULONG slot = 0; slot < cfg.sandboxes; ++slot )
+        {
+            for ( ULONG page = 0; page < guest_pages; ++page ) merge_page( sandboxes, slot, page, engine, candidates, pool, stats );
+        }
+        stats.seconds = timer.seconds( );
+
+        totals.scanned += stats.scanned;
+        totals.merges += stats.merges;
+        totals.cow_breaks += stats.cow_breaks;
+        totals.seconds += stats.seconds;
+
+        // a shared page stands in for all its mappings, the private frame of a merged page is freed in the driver
+        const ULONG64 saved_pages = pool.ref_count( ) - pool.page_count( );
+        const ULONG64 resident_pages = total_pages - saved_pages;
+        snprintf( line, sizeof( line ), "%4u  %7llu  %6llu  %10llu  %12llu  %8llu  %8.1f  %11.1f  %6.2fx  %7.0f",
+            pass, stats.scanned, stats.merges, stats.cow_breaks, pool.page_count( ), pool.ref_count( ),
+            ( double )saved_pages * hv_page_hash::page_bytes / ( 1 << 20 ), ( double )resident_pages * hv_page_hash::page_bytes / ( 1 << 20 ),
+            ( double )total_pages / ( double )resident_pages, stats.scanned ? stats.seconds * 1e9 / ( double )( cfg.sandboxes * ( ULONG64 )guest_pages ) : 0.0 );
+        std::cout << line << "\n";
+    }
+
+    // the best any merger could do right now: one frame per distinct page content
+    std::unordered_set<ULONG64> distinct;
+    ULONG64 mismatches = 0;
+    for ( sandbox& s : sandboxes )
+    {
+        for ( ULONG page = 0; page < guest_pages; ++page )
+        {
+            const ULONG64* content = s.shared[ page ] == private_page ? s.page( page ) : pool.bytes( s.shared[ page ] );
+            distinct.insert( hv_page_hash::digest( engine, content ) );
+
+            // a merged page must still read what its guest last wrote
+            if ( s.shared[ page ] != private_page && std::memcmp( s.page( page ), content, hv_page_hash::page_bytes ) != 0 ) ++mismatches;
+        }
+    }
+
+    const ULONG64 resident_pages = total_pages - ( pool.ref_count( ) - pool.page_count( ) );
+    snprintf( line, sizeof( line ), "\n%llu merges, %llu cow breaks over %u passes; density %.2fx of an ideal %.2fx (%zu distinct pages), %.1f ms scanning",
+        totals.merges, totals.cow_breaks, cfg.passes, ( double )total_pages / ( double )resident_pages, ( double )total_pages / ( double )distinct.size( ),
+        distinct.size( ), totals.seconds * 1e3 );
+    std::cout << line << "\n";
+    std::cout << "content check: " << mismatches << " merged page(s) differ from what their guest wrote\n";
+    return mismatches ? 2 : 0;
+}
\ No newline at end of file
@@ -0,0 +1,246 @@
+#include "../includes/sched_sim.h"
+#include "../includes/sim_util.h"
+#include "../../hypervisor/includes/hv_sched.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <cstdio>
+
+namespace
+{
+    enum class policy
+    {
+        pinned,         // round robin placement, a vcpu never leaves its processor
+        steal,          // round robin placement, idle processors steal from anyone
+        steal_numa,     // node aware placement, stealing prefers the own node, wakeups go home
+    };
+
+    const char* policy_name( policy p )
+    {
+        return p == policy::pinned ? "pinned" : p == policy::steal ? "steal" : "steal-numa";
+    }
+
+    using sim_util::rng;
+
+    // v must stay the first member, the scheduler hands back hv_sched::vcpu pointers
+    struct sim_vcpu
+    {
+        hv_sched::vcpu v;
+        double         halt_chance{ 0 };  // per slice
+        double         mean_halt{ 1 };
+        ULONG64        wake_tick{ 0 };
+        bool           halted{ false };
+        ULONG64        demand{ 0 };       // slices it was runnable
+        ULONG64        ran{ 0 };
+    };
+
+    struct sim_result
+    {
+        ULONG64 busy{ 0 };
+        ULONG64 demand{ 0 };
+        ULONG64 min_busy{ ~0ULL };
+        ULONG64 max_busy{ 0 };
+        double  busy_cv{ 0 };
+        ULONG64 migrations{ 0 };
+        ULONG64 node_migrations{ 0 };
+        ULONG64 remote_slices{ 0 };
+        double  worst_share{ 1.0 };       // lowest ran / demand of any vcpu
+    };
+
+    // duty cycle of sandbox s is proportional to 1 / (s + 1)^skew, scaled so the total demand is `load`
+    // cpus worth and capped at always runnable. A vcpu with duty d runs 1 / p slices between halts and
+    // halts mean_halt slices, d = (1 / p) / (1 / p + mean_halt)
+    void build_workload( const sched_sim_config& cfg, std::vector<sim_vcpu>& vcpus )
+    {
+        rng r{ cfg.seed };
+        std::vector<ULONG> counts( cfg.sandboxes );
+        std::vector<double> weights( cfg.sandboxes );
+        double total = 0;
+
+        for ( ULONG s = 0; s < cfg.sandboxes; ++s )
+        {
+            counts[ s ] = 1 + static_cast< ULONG >( r.below( cfg.max_vcpus ) );
+            weights[ s ] = 1.0 / std::pow( static_cast< double >( s + 1 ), cfg.skew );
+            total += weights[ s ] * counts[ s ];
+        }
+
+        const double scale = cfg.load * cfg.cpus / total;
+        for ( ULONG s = 0; s < cfg.sandboxes; ++s )
+        {
+            double duty = weights[ s ] * scale;
+            if ( duty > 1.0 ) duty = 1.0;
+            if ( duty < 0.001 ) duty = 0.001;
+
+            for ( ULONG i = 0; i < counts[ s ]; ++i )
+            {
+                sim_vcpu v;
+                v.v.sandbox_id = s + 1;
+                v.v.index = i;
+                v.mean_halt = std::fmax( cfg.mean_halt, ( 1.0 - duty ) / duty );
+                v.halt_chance = ( 1.0 - duty ) / ( duty * v.mean_halt );
+                vcpus.push_back( v );
+            }
+        }
+    }
+
+    sim_result simulate( const sched_sim_config& cfg, policy p, std::vector<sim_vcpu> vcpus )
+    {
+        std::vector<hv_sched::cpu_slot> cpus( cfg.cpus );
+        const ULONG per_node = ( cfg.cpus + cfg.nodes - 1 ) / cfg.nodes;
+        for ( ULONG c = 0; c < cfg.cpus; ++c ) cpus[ c ].node = c / per_node;
+
+        auto slot_at = [ &cpus ]( ULONG cpu ) -> hv_sched::cpu_slot& { return cpus[ cpu ]; };
+        std::vector<ULONG64> busy( cfg.cpus, 0 );
+        rng r{ cfg.seed ^ 0xA5A5A5A5ULL };
+        sim_result result;
+
+        // placement, one sandbox at a time like create_sandbox
+        ULONG round_robin = 0;
+        for ( size_t i = 0; i < vcpus.size( ); )
+        {
+            const ULONG sandbox = vcpus[ i ].v.sandbox_id;
+            const ULONG node = p == policy::steal_numa ? hv_sched::pick_node( slot_at, cfg.cpus, cfg.nodes ) : cpus[ round_robin % cfg.cpus ].node;
+
+            for ( ; i < vcpus.size( ) && vcpus[ i ].v.sandbox_id == sandbox; ++i )
+            {
+                const ULONG cpu = p == policy::steal_numa ? hv_sched::pick_cpu( slot_at, cfg.cpus, node ) : round_robin++ % cfg.cpus;
+                vcpus[ i ].v.cpu = cpu;
+                vcpus[ i ].v.home_node = node;
+                vcpus[ i ].v.state = hv_sched::vcpu_state::queued;
+                cpus[ cpu ].queue.push_tail( &vcpus[ i ].v );
+            }
+        }
+
+        for ( ULONG64 tick = 0; tick < cfg.slices; ++tick )
+        {
+            // interrupts for halted vcpus, what wake_vcpu does
+            for ( sim_vcpu& v : vcpus )
+            {
+                if ( !v.halted || v.wake_tick > tick ) continue;
+
+                const ULONG target = p == policy::pinned ? v.v.cpu : hv_sched::wake_cpu( slot_at, cfg.cpus, v.v, p == policy::steal_numa );
+                if ( target != v.v.cpu )
+                {
+                    if ( cpus[ target ].node != cpus[ v.v.cpu ].node ) ++v.v.node_migrations;
+                    ++v.v.migrations;
+                    v.v.cpu = target;
+                }
+
+                v.halted = false;
+                v.v.state = hv_sched::vcpu_state::queued;
+                cpus[ target ].queue.push_tail( &v.v );
+            }
+
+            // what switch_next does on every processor at the end of a slice
+            for ( ULONG c = 0; c < cfg.cpus; ++c )
+            {
+                hv_sched::vcpu* next = hv_sched::rotate( cpus[ c ] );
+                if ( !next && p != policy::pinned )
+                {
+                    const LONG victim = hv_sched::pick_victim( slot_at, cfg.cpus, c, p == policy::steal_numa );
+                    if ( victim >= 0 ) next = hv_sched::steal( cpus[ victim ], cpus[ c ], c );
+                }
+
+                if ( next ) hv_sched::start( cpus[ c ], next );
+                else ++cpus[ c ].idle_picks;
+            }
+
+            for ( ULONG c = 0; c < cfg.cpus; ++c )
+            {
+                for ( hv_sched::vcpu* q = cpus[ c ].queue.head; q; q = q->next ) ++reinterpret_cast< sim_vcpu* >( q )->demand;
+
+                hv_sched::vcpu* current = cpus[ c ].current;
+                if ( !current ) continue;
+
+                sim_vcpu& v = *reinterpret_cast< sim_vcpu* >( current );
+                ++v.demand;
+                ++v.ran;
+                ++busy[ c ];
+                if ( cpus[ c ].node != v.v.home_node ) ++result.remote_slices;
+
+                // hlt exit, what park_current does
+                if ( r.unit( ) < v.halt_chance )
+                {
+                    v.halted = true;
+                    v.wake_tick = tick + 1 + static_cast< ULONG64 >( -std::log( r.unit( ) ) * ( v.mean_halt - 0.5 ) );
+                    v.v.state = hv_sched::vcpu_state::parked;
+                    cpus[ c ].current = nullptr;
+                }
+            }
+        }
+
+        double sum = 0, sum_sq = 0;
+        for ( ULONG c = 0; c < cfg.cpus; ++c )
+        {
+            result.busy += busy[ c ];
+            if ( busy[ c ] < result.min_busy ) result.min_busy = busy[ c ];
+            if ( busy[ c ] > result.max_busy ) result.max_busy = busy[ c ];
+            sum += static_cast< double >( busy[ c ] );
+            sum_sq += static_cast< double >( busy[ c ] ) * static_cast< double >( busy[ c ] );
+        }
+
+        const double mean = sum / cfg.cpus;
+        result.busy_cv = mean > 0 ? std::sqrt( std::fmax( 0.0, sum_sq / cfg.cpus - mean * mean ) ) / mean : 0.0;
+
+        for ( const sim_vcpu& v : vcpus )
+        {
+            result.demand += v.demand;
+            result.migrations += v.v.migrations;
+            result.node_migrations += v.v.node_migrations;
+            if ( v.demand && static_cast< double >( v.ran ) / v.demand < result.worst_share ) result.worst_share = static_cast< double >( v.ran ) / v.demand;
+        }
+
+        return result;
+    }
+}
+
+int sched_sim_main( int argc, char** argv, int first_arg )
+{
+    sched_sim_config cfg;
+
+    sim_util::options opts( "sched-sim", argc, argv, first_arg );
+    while ( opts.next( ) )
+    {
+        if ( opts.take( "--cpus", cfg.cpus ) || opts.take( "--nodes", cfg.nodes ) || opts.take( "--sandboxes", cfg.sandboxes ) ||
+            opts.take( "--vcpus", cfg.max_vcpus ) || opts.take( "--skew", cfg.skew ) || opts.take( "--load", cfg.load ) ||
+            opts.take( "--slices", cfg.slices ) || opts.take( "--halt", cfg.mean_halt ) || opts.take( "--seed", cfg.seed ) )
+            continue;
+
+        return opts.unknown( );
+    }
+
+    if ( opts.failed( ) ) return 1;
+
+    if ( cfg.cpus == 0 || cfg.nodes == 0 || cfg.nodes > cfg.cpus || cfg.sandboxes == 0 || cfg.max_vcpus == 0 || cfg.max_vcpus > HV_SANDBOX_MAX_VCPUS ||
+        cfg.load <= 0 || cfg.mean_halt < 1.0 )
+    {
+        std::cerr << "sched-sim: need cpus >= nodes >= 1, sandboxes >= 1, 1 <= vcpus <= " << HV_SANDBOX_MAX_VCPUS << ", load > 0 and halt >= 1\n";
+        return 1;
+    }
+
+    std::vector<sim_vcpu> vcpus;
+    build_workload( cfg, vcpus );
+
+    char line[ 256 ];
+    snprintf( line, sizeof( line ), "sched-sim: %u cpus on %u node(s), %u sandboxes with %zu vcpus, skew %.2f, load %.2f, %llu slices",
+        cfg.cpus, cfg.nodes, cfg.sandboxes, vcpus.size( ), cfg.skew, cfg.load, cfg.slices );
+    std::cout << line << "\n\n";
+    std::cout << "policy      util   delivered  busy min/max       busy cv  migrations  cross-node  remote  worst vcpu\n";
+
+    const policy policies[ ] = { policy::pinned, policy::steal, policy::steal_numa };
+    for ( policy p : policies )
+    {
+        const sim_result r = simulate( cfg, p, vcpus );
+        const double capacity = static_cast< double >( cfg.slices ) * cfg.cpus;
+
+        // delivered: cpu time the vcpus got out of the time they were runnable
+        snprintf( line, sizeof( line ), "%-10s %5.1f%%  %8.1f%%  %8llu/%-8llu  %6.3f  %10llu  %10llu  %5.1f%%  %9.1f%%",
+            policy_name( p ), 100.0 * r.busy / capacity, r.demand ? 100.0 * r.busy / r.demand : 0.0, r.min_busy, r.max_busy, r.busy_cv,
+            r.migrations, r.node_migrations, r.busy ? 100.0 * r.remote_slices / r.busy : 0.0, 100.0 * r.worst_share );
+        std::cout << line << "\n";
+    }
+
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,344 @@
+#include "../includes/session.h"
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <cstdio>
+#include <cstring>
+
+namespace
+{
+    // how a command orders against the ones already in flight
+    enum class dep_kind
+    {
+        none,       // touches no sandbox state (nop)
+        sandbox,    // mutates a single sandbox, ordered against the same id only
+        barrier,    // observes or mutates everything, waits for the whole window
+    };
+
+    struct session_op
+    {
+        ULONG              seq{ 0 };
+        std::string        name;
+        std::string        parse_error;
+        DWORD              code{ 0 };
+        dep_kind           dep{ dep_kind::none };
+        ULONG              sandbox_id{ 0 };
+        std::vector<BYTE>  in;
+        std::vector<BYTE>  out;
+        OVERLAPPED         ov{};
+        LARGE_INTEGER      started{};
+        LARGE_INTEGER      finished{};
+        bool               issued{ false };
+        bool               done{ false };
+        DWORD              error{ 0 };
+        DWORD              returned{ 0 };
+
+        ~session_op( )
+        {
+            if ( ov.hEvent ) CloseHandle( ov.hEvent );
+        }
+    };
+
+    using op_window = std::deque<std::unique_ptr<session_op>>;
+
+    std::string json_escape( const std::string& s )
+    {
+        std::string r;
+        r.reserve( s.size( ) );
+        for ( char c : s )
+        {
+            switch ( c )
+            {
+            case '"':  r += "\\\""; break;
+            case '\\': r += "\\\\"; break;
+            case '\n': r += "\\n"; break;
+            case '\r': r += "\\r"; break;
+            case '\t': r += "\\t"; break;
+            default:
+                if ( static_cast< unsigned char >( c ) < 0x20 )
+                {
+                    char buf[ 8 ];
+                    std::snprintf( buf, sizeof( buf ), "\\u%04x", c );
+                    r += buf;
+                }
+                else r += c;
+            }
+        }
+        return r;
+    }
+
+    bool parse_id( std::istringstream& args, ULONG& id )
+    {
+        std::string tok;
+        if ( !( args >> tok ) ) return false;
+        try
+        {
+            id = ( ULONG )std::stoul( tok );
+        }
+        catch ( ... )
+        {
+            return false;
+        }
+        return true;
+    }
+
+    // fills code/buffers/dependency for a script line; sets parse_error on failure
+    void parse_command( const std::string& line, session_op& op )
+    {
+        std::istringstream args( line );
+        args >> op.name;
+
+        if ( op.name == "nop" )
+        {
+            op.code = IOCTL_HV_NOP;
+            op.dep = dep_kind::none;
+        }
+        else if ( op.name == "query" )
+        {
+            op.code = IOCTL_HV_QUERY_CAPS;
+            op.dep = dep_kind::barrier;
+            op.out.resize( sizeof( hv_vmx_caps ) );
+        }
+        else if ( op.name == "build-ept" )
+        {
+            op.code = IOCTL_HV_BUILD_EPT;
+            op.dep = dep_kind::barrier;
+        }
+        else if ( op.name == "sandbox-create" || op.name == "sandbox-destroy" )
+        {
+            hv_sandbox_request req = {};
+            if ( !parse_id( args, req.id ) )
+            {
+                op.parse_error = op.name + " requires id";
+                return;
+            }
+
+            op.code = op.name == "sandbox-create" ? IOCTL_HV_SANDBOX_CREATE : IOCTL_HV_SANDBOX_DESTROY;
+            op.dep = dep_kind::sandbox;
+            op.sandbox_id = req.id;
+            op.in.resize( sizeof( req ) );
+            memcpy( op.in.data( ), &req, sizeof( req ) );
+        }
+        else if ( op.name == "sandbox-list" )
+        {
+            op.code = IOCTL_HV_SANDBOX_LIST;
+            op.dep = dep_kind::barrier;
+            op.out.resize( 64 * sizeof( ULONG ) );
+        }
+        else
+        {
+            op.parse_error = "unknown command: " + op.name;
+        }
+    }
+
+    bool conflicts( const op_window& window, const session_op& op )
+    {
+        for ( const auto& other : window )
+        {
+            if ( other->done ) continue;
+            if ( op.dep == dep_kind::barrier || other->dep == dep_kind::barrier ) return true;
+            if ( op.dep == dep_kind::sandbox && other->dep == dep_kind::sandbox && other->sandbox_id == op.sandbox_id ) return true;
+        }
+        return false;
+    }
+
+    void submit( HANDLE device, session_op& op )
+    {
+        op.ov.hEvent = CreateEventA( nullptr, TRUE, FALSE, nullptr );
+        op.issued = true;
+        QueryPerformanceCounter( &op.started );
+
+        if ( !op.ov.hEvent )
+        {
+            op.error = GetLastError( );
+            op.finished = op.started;
+            op.done = true;
+            return;
+        }
+
+        BOOL ok = DeviceIoControl( device, op.code,
+            op.in.empty( ) ? nullptr : op.in.data( ), ( DWORD )op.in.size( ),
+            op.out.empty( ) ? nullptr : op.out.data( ), ( DWORD )op.out.size( ),
+            &op.returned, &op.ov );
+
+        if ( ok )
+        {
+            QueryPerformanceCounter( &op.finished );
+            op.done = true;
+            return;
+        }
+
+        DWORD err = GetLastError( );
+        if ( err != ERROR_IO_PENDING )
+        {
+            QueryPerformanceCounter( &op.finished );
+            op.error = err;
+            op.done = true;
+        }
+    }
+
+    // blocks until at least one pending op completes; returns false when nothing is pending
+    bool wait_one( HANDLE device, op_window& window )
+    {
+        HANDLE events[ HV_SESSION_MAX_DEPTH ];
+        session_op* owners[ HV_SESSION_MAX_DEPTH ];
+        DWORD count = 0;
+
+        for ( auto& op : window )
+        {
+            if ( op->done || !op->issued ) continue;
+            if ( count == HV_SESSION_MAX_DEPTH ) break;
+            events[ count ] = op->ov.hEvent;
+            owners[ count ] = op.get( );
+            ++count;
+        }
+
+        if ( count == 0 ) return false;
+
+        DWORD r = WaitForMultipleObjects( count, events, FALSE, INFINITE );
+        if ( r >= WAIT_OBJECT_0 + count )
+        {
+            // the wait itself failed, fail every pending op rather than spin. The driver still owns their
+            // overlapped and buffers until the io is really over, so cancel it and wait that out first
+            DWORD err = GetLastError( );
+            for ( DWORD i = 0; i < count; ++i )
+            {
+                session_op* pending = owners[ i ];
+                CancelIoEx( device, &pending->ov );
+                if ( !GetOverlappedResult( device, &pending->ov, &pending->returned, TRUE ) )
+                {
+                    // an op the cancel caught fails with the wait error, one that had finished keeps its own
+                    const DWORD io_err = GetLastError( );
+                    pending->error = io_err == ERROR_OPERATION_ABORTED ? err : io_err;
+                }
+                QueryPerformanceCounter( &pending->finished );
+                pending->done = true;
+            }
+            return true;
+        }
+
+        session_op* op = owners[ r - WAIT_OBJECT_0 ];
+        QueryPerformanceCounter( &op->finished );
+        if ( !GetOverlappedResult( device, &op->ov, &op->returned, FALSE ) ) op->error = GetLastError( );
+        op->done = true;
+        return true;
+    }
+
+    void print_result( const session_op& op, const LARGE_INTEGER& freq )
+    {
+        std::ostringstream line;
+        line << "{\"seq\":" << op.seq << ",\"cmd\":\"" << json_escape( op.name ) << "\"";
+
+        if ( !op.parse_error.empty( ) )
+        {
+            line << ",\"ok\":false,\"error\":\"" << json_escape( op.parse_error ) << "\"}";
+            std::cout << line.str( ) << "\n";
+            return;
+        }
+
+        const double us = ( double )( op.finished.QuadPart - op.started.QuadPart ) * 1000000.0 / ( double )freq.QuadPart;
+        char us_buf[ 32 ];
+        std::snprintf( us_buf, sizeof( us_buf ), "%.1f", us );
+
+        if ( op.dep == dep_kind::sandbox ) line << ",\"id\":" << op.sandbox_id;
+        line << ",\"ok\":" << ( op.error == 0 ? "true" : "false" ) << ",\"error\":" << op.error << ",\"us\":" << us_buf;
+
+        if ( op.error == 0 && op.code == IOCTL_HV_QUERY_CAPS && op.returned >= sizeof( hv_vmx_caps ) )
+        {
+            hv_vmx_caps caps = {};
+            memcpy( &caps, op.out.data( ), sizeof( caps ) );
+            line << ",\"vmx_supported\":" << ( caps.vmx_supported ? "true" : "false" )
+                << ",\"cpu_count\":" << caps.cpu_count
+                << ",\"suggested_region_size\":" << caps.suggested_region_size
+                << ",\"ept_page_count\":" << caps.ept_page_count
+                << ",\"sandbox_count\":" << caps.sandbox_count;
+        }
+        else if ( op.error == 0 && op.code == IOCTL_HV_SANDBOX_LIST )
+        {
+            const ULONG* ids = reinterpret_cast< const ULONG* >( op.out.data( ) );
+            line << ",\"ids\":[";
+            for ( ULONG i = 0; i < op.returned / sizeof( ULONG ); ++i )
+            {
+                if ( i ) line << ",";
+                line << ids[ i ];
+            }
+            line << "]";
+        }
+
+        line << "}";
+        std::cout << line.str( ) << "\n";
+    }
+
+    // prints and retires the completed prefix of the window so output stays in script order
+    void retire_completed( op_window& window, const LARGE_INTEGER& freq, ULONG& failed )
+    {
+        while ( !window.empty( ) && window.front( )->done )
+        {
+            const session_op& op = *window.front( );
+            if ( !op.parse_error.empty( ) || op.error != 0 ) ++failed;
+            print_result( op, freq );
+            window.pop_front( );
+        }
+    }
+}
+
+ULONG run_session( HANDLE device, std::istream& script, ULONG depth )
+{
+    if ( depth == 0 ) depth = 1;
+    if ( depth > HV_SESSION_MAX_DEPTH ) depth = HV_SESSION_MAX_DEPTH;
+
+    LARGE_INTEGER freq = {};
+    LARGE_INTEGER wall_start = {};
+    LARGE_INTEGER wall_end = {};
+    QueryPerformanceFrequency( &freq );
+    QueryPerformanceCounter( &wall_start );
+
+    op_window window;
+    ULONG seq = 0;
+    ULONG failed = 0;
+    std::string line;
+
+    while ( std::getline( script, line ) )
+    {
+        if ( !line.empty( ) && line.back( ) == '\r' ) line.pop_back( );
+
+        const size_t first = line.find_first_not_of( " \t" );
+        if ( first == std::string::npos || line[ first ] == '#' ) continue;
+
+        auto op = std::make_unique<session_op>( );
+        op->seq = ++seq;
+        parse_command( line.substr( first ), *op );
+
+        if ( op->parse_error.empty( ) )
+        {
+            while ( window.size( ) >= depth || conflicts( window, *op ) )
+            {
+                if ( !wait_one( device, window ) ) break;
+                retire_completed( window, freq, failed );
+            }
+            submit( device, *op );
+        }
+        else
+        {
+            op->done = true;
+        }
+
+        window.push_back( std::move( op ) );
+        retire_completed( window, freq, failed );
+    }
+
+    while ( wait_one( device, window ) ) retire_completed( window, freq, failed );
+    retire_completed( window, freq, failed );
+
+    QueryPerformanceCounter( &wall_end );
+    const double wall_us = ( double )( wall_end.QuadPart - wall_start.QuadPart ) * 1000000.0 / ( double )freq.QuadPart;
+    char wall_buf[ 32 ];
+    std::snprintf( wall_buf, sizeof( wall_buf ), "%.1f", wall_us );
+
+    std::cout << "{\"summary\":true,\"commands\":" << seq << ",\"failed\":" << failed << ",\"depth\":" << depth << ",\"wall_us\":" << wall_buf << "}" << std::endl;
+    return failed;
+}
\ No newline at end of file
@@ -0,0 +1,132 @@
+#include "../includes/teardown_bench.h"
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+
+namespace
+{
+    bool query_reclaim( HANDLE device, hv_reclaim_stats& stats )
+    {
+        stats = {};
+        DWORD returned = 0;
+        BOOL ok = DeviceIoControl( device, IOCTL_HV_RECLAIM_QUERY, nullptr, 0, &stats, sizeof( stats ), &returned, nullptr );
+        if ( !ok || returned < sizeof( stats ) )
+        {
+            std::cerr << "query_reclaim failed: " << GetLastError( ) << "\n";
+            return false;
+        }
+        return true;
+    }
+
+    // best effort cleanup after a failed round, so the bench never leaves its sandboxes behind
+    void destroy_ids( HANDLE device, ULONG first_id, ULONG count )
+    {
+        for ( ULONG i = 0; i < count; ++i )
+        {
+            hv_sandbox_request req = {};
+            req.id = first_id + i;
+            DWORD returned = 0;
+            DeviceIoControl( device, IOCTL_HV_SANDBOX_DESTROY, &req, sizeof( req ), nullptr, 0, &returned, nullptr );
+        }
+    }
+}
+
+bool reclaim_stats( HANDLE device )
+{
+    hv_reclaim_stats stats = {};
+    if ( !query_reclaim( device, stats ) ) return false;
+
+    char line[ 256 ];
+    snprintf( line, sizeof( line ), "%llu destroys (last %llu us, longest %llu us under the lock), %llu torn down in place",
+        stats.destroys, stats.last_destroy_us, stats.longest_destroy_us, stats.inline_destroys );
+    std::cout << line << "\n";
+    snprintf( line, sizeof( line ), "backlog %llu sandbox(es), %.1f MB", stats.pending_sandboxes, ( double )stats.pending_bytes / ( 1 << 20 ) );
+    std::cout << line << "\n";
+    snprintf( line, sizeof( line ), "reclaimed %llu sandbox(es), %.1f MB in %llu batches (longest %llu us)",
+        stats.reclaimed_sandboxes, ( double )stats.reclaimed_bytes / ( 1 << 20 ), stats.batches, stats.longest_batch_us );
+    std::cout << line << "\n";
+    return true;
+}
+
+bool teardown_bench( HANDLE device, ULONG rounds, ULONG count, ULONG vcpus )
+{
+    // out of the way of ids picked by hand
+    const ULONG base_id = 0x7E000000;
+
+    LARGE_INTEGER freq = {};
+    QueryPerformanceFrequency( &freq );
+    auto us_since = [ &freq ]( const LARGE_INTEGER& start ) -> double
+    {
+        LARGE_INTEGER now = {};
+        QueryPerformanceCounter( &now );
+        return ( double )( now.QuadPart - start.QuadPart ) * 1e6 / ( double )freq.QuadPart;
+    };
+
+    std::vector<double> destroy_us;
+    double drain_total = 0.0, drain_max = 0.0;
+
+    for ( ULONG round = 0; round < rounds; ++round )
+    {
+        for ( ULONG i = 0; i < count; ++i )
+        {
+            hv_sandbox_create_request req = {};
+            req.id = base_id + i;
+            req.exit_policy = HV_EXIT_POLICY_DEFAULT;
+            req.vcpu_count = vcpus;
+            DWORD returned = 0;
+            if ( DeviceIoControl( device, IOCTL_HV_SANDBOX_CREATE, &req, sizeof( req ), nullptr, 0, &returned, nullptr ) ) continue;
+
+            std::cerr << "teardown-bench: create of sandbox " << req.id << " failed: " << GetLastError( ) << "\n";
+            destroy_ids( device, base_id, i );
+            return false;
+        }
+
+        for ( ULONG i = 0; i < count; ++i )
+        {
+            hv_sandbox_request req = {};
+            req.id = base_id + i;
+            DWORD returned = 0;
+
+            LARGE_INTEGER start = {};
+            QueryPerformanceCounter( &start );
+            BOOL ok = DeviceIoControl( device, IOCTL_HV_SANDBOX_DESTROY, &req, sizeof( req ), nullptr, 0, &returned, nullptr );
+            destroy_us.push_back( us_since( start ) );
+            if ( !ok )
+            {
+                std::cerr << "teardown-bench: destroy of sandbox " << req.id << " failed: " << GetLastError( ) << "\n";
+                destroy_ids( device, req.id + 1, count - i - 1 );
+                return false;
+            }
+        }
+
+        // every slot is free again already, wait for the memory
+        LARGE_INTEGER start = {};
+        QueryPerformanceCounter( &start );
+        hv_reclaim_stats stats = {};
+        for ( ;; )
+        {
+            if ( !query_reclaim( device, stats ) ) return false;
+            if ( stats.pending_sandboxes == 0 ) break;
+            Sleep( 1 );
+        }
+
+        const double drain = us_since( start );
+        drain_total += drain;
+        if ( drain > drain_max ) drain_max = drain;
+    }
+
+    if ( destroy_us.empty( ) ) return true;
+    std::sort( destroy_us.begin( ), destroy_us.end( ) );
+    auto percentile = [ &destroy_us ]( double p ) { return destroy_us[ ( size_t )( p * ( double )( destroy_us.size( ) - 1 ) ) ]; };
+
+    char line[ 256 ];
+    snprintf( line, sizeof( line ), "teardown-bench: %u round(s) x %u sandbox(es) x %u vcpu(s)", rounds, count, vcpus );
+    std::cout << line << "\n";
+    snprintf( line, sizeof( line ), "destroy ioctl   p50 %8.1f us  p99 %8.1f us  max %8.1f us", percentile( 0.5 ), percentile( 0.99 ), destroy_us.back( ) );
+    std::cout << line << "\n";
+    snprintf( line, sizeof( line ), "reclaim drain   avg %8.1f us  max %8.1f us after the last destroy of a round", drain_total / rounds, drain_max );
+    std::cout << line << "\n";
+    return reclaim_stats( device );
+}
\ No newline at end of file
@@ -0,0 +1,269 @@
+#include "../includes/trace.h"
+#include "../../hypervisor/includes/hv_page_hash.h"
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <cstdio>
+#include <cstring>
+
+namespace
+{
+    // holds the largest record the driver can produce
+    const DWORD drain_buffer_bytes = 256 * 1024;
+
+    // replayed ioctls that mismatch are listed individually up to this many
+    const ULONG max_reported_divergences = 20;
+
+    // records trace_replay does not reissue as they were recorded
+    enum skip_reason
+    {
+        skip_direct_io,       // mem-read / mem-write: the data buffer went through an mdl and is not in the trace
+        skip_truncated,       // input longer than HV_TRACE_MAX_INPUT, only its head was recorded
+        skip_wait,            // event waits pend until the driver has something to report
+        skip_state_change,    // changes the live driver, only replayed with --mutate
+        skip_count
+    };
+
+    bool should_skip( const hv_trace_record& rec, bool mutate, skip_reason& reason )
+    {
+        const ULONG method = rec.io_control_code & 3;
+        if ( method == METHOD_IN_DIRECT || method == METHOD_OUT_DIRECT ) reason = skip_direct_io;
+        else if ( rec.input_captured < rec.input_length ) reason = skip_truncated;
+        else if ( rec.io_control_code == IOCTL_HV_EVENT_WAIT ) reason = skip_wait;
+        else if ( mutate ) return false;
+        else if ( rec.io_control_code == IOCTL_HV_BUILD_EPT || rec.io_control_code == IOCTL_HV_SANDBOX_CREATE || rec.io_control_code == IOCTL_HV_SANDBOX_DESTROY ||
+            rec.io_control_code == IOCTL_HV_SANDBOX_SCAN || rec.io_control_code == IOCTL_HV_TRACE_CONTROL || rec.io_control_code == IOCTL_HV_TRACE_DRAIN )
+            reason = skip_state_change;
+        else return false;
+        return true;
+    }
+
+    // replayed, but their output is not expected to repeat: merge and reclaim counters move with the background
+    // threads and translations report host addresses of whatever pages back the guest right now
+    const ULONG varying_output_codes[] = { IOCTL_HV_MERGE_QUERY, IOCTL_HV_RECLAIM_QUERY, IOCTL_HV_MEM_TRANSLATE };
+
+    bool output_varies( ULONG io_control_code )
+    {
+        return std::find( std::begin( varying_output_codes ), std::end( varying_output_codes ), io_control_code ) != std::end( varying_output_codes );
+    }
+
+    struct latency_summary
+    {
+        double p50{ 0 };
+        double p99{ 0 };
+        double max{ 0 };
+    };
+
+    latency_summary summarize( std::vector<double>& samples )
+    {
+        latency_summary s;
+        if ( samples.empty( ) ) return s;
+
+        std::sort( samples.begin( ), samples.end( ) );
+        s.p50 = samples[ samples.size( ) / 2 ];
+        s.p99 = samples[ std::min( samples.size( ) - 1, samples.size( ) * 99 / 100 ) ];
+        s.max = samples.back( );
+        return s;
+    }
+
+    bool load_trace( const char* path, std::vector<BYTE>& records )
+    {
+        std::ifstream in( path, std::ios::binary );
+        if ( !in )
+        {
+            std::cerr << "failed to open " << path << "\n";
+            return false;
+        }
+
+        hv_trace_file_header header = {};
+        in.read( reinterpret_cast< char* >( &header ), sizeof( header ) );
+        if ( !in || header.magic != HV_TRACE_FILE_MAGIC || header.version != HV_TRACE_FILE_VERSION || header.record_header_size != sizeof( hv_trace_record ) )
+        {
+            std::cerr << path << " is not a version " << HV_TRACE_FILE_VERSION << " trace\n";
+            return false;
+        }
+
+        records.assign( std::istreambuf_iterator<char>( in ), std::istreambuf_iterator<char>( ) );
+        return true;
+    }
+}
+
+bool trace_control( HANDLE device, bool enable, ULONG buffer_bytes )
+{
+    hv_trace_control req = {};
+    req.enable = enable ? 1 : 0;
+    req.buffer_bytes = buffer_bytes;
+
+    DWORD returned = 0;
+    BOOL ok = DeviceIoControl( device, IOCTL_HV_TRACE_CONTROL, &req, sizeof( req ), nullptr, 0, &returned, nullptr );
+    if ( !ok )
+    {
+        std::cerr << "trace_control failed: " << GetLastError( ) << "\n";
+        return false;
+    }
+
+    std::cout << "trace recording " << ( enable ? "started" : "stopped" ) << "\n";
+    return true;
+}
+
+bool trace_drain( HANDLE device, const char* path )
+{
+    std::fstream out( path, std::ios::binary | std::ios::in | std::ios::out | std::ios::ate );
+    if ( !out.is_open( ) ) out.open( path, std::ios::binary | std::ios::out | std::ios::trunc );
+    if ( !out )
+    {
+        std::cerr << "failed to open " << path << "\n";
+        return false;
+    }
+
+    if ( out.tellp( ) == std::streampos( 0 ) )
+    {
+        hv_trace_file_header header = {};
+        header.magic = HV_TRACE_FILE_MAGIC;
+        header.version = HV_TRACE_FILE_VERSION;
+        header.record_header_size = sizeof( hv_trace_record );
+        out.write( reinterpret_cast< const char* >( &header ), sizeof( header ) );
+    }
+
+    std::vector<BYTE> buffer( drain_buffer_bytes );
+    const hv_trace_drain_result* result = reinterpret_cast< const hv_trace_drain_result* >( buffer.data( ) );
+    ULONG64 records = 0;
+    ULONG64 bytes = 0;
+
+    for ( ;; )
+    {
+        DWORD returned = 0;
+        BOOL ok = DeviceIoControl( device, IOCTL_HV_TRACE_DRAIN, nullptr, 0, buffer.data( ), ( DWORD )buffer.size( ), &returned, nullptr );
+        if ( !ok || returned < sizeof( hv_trace_drain_result ) )
+        {
+            std::cerr << "trace_drain failed: " << GetLastError( ) << "\n";
+            return false;
+        }
+
+        out.write( reinterpret_cast< const char* >( result + 1 ), result->bytes );
+        records += result->record_count;
+        bytes += result->bytes;
+
+        if ( result->pending_bytes == 0 || result->record_count == 0 )
+        {
+            std::cout << "trace-drain: " << records << " records (" << bytes << " bytes) appended to " << path
+                << ", " << result->dropped << " dropped, recording " << ( result->recording ? "on" : "off" ) << "\n";
+            break;
+        }
+    }
+
+    return out.good( );
+}
+
+bool trace_replay( HANDLE device, const char* path, bool mutate )
+{
+    std::vector<BYTE> records;
+    if ( !load_trace( path, records ) ) return false;
+
+    LARGE_INTEGER freq = {};
+    QueryPerformanceFrequency( &freq );
+
+    std::vector<double> replay_ns;
+    std::vector<double> recorded_ns;
+    std::vector<BYTE> input;
+    std::vector<BYTE> output;
+    ULONG64 count = 0;
+    ULONG64 divergences = 0;
+    ULONG64 skipped[ skip_count ] = {};
+    ULONG64 unchecked_output = 0;
+    double busy_ns = 0;
+
+    LARGE_INTEGER wall_start = {}, wall_end = {};
+    QueryPerformanceCounter( &wall_start );
+
+    size_t offset = 0;
+    while ( offset + sizeof( hv_trace_record ) <= records.size( ) )
+    {
+        hv_trace_record rec = {};
+        memcpy( &rec, records.data( ) + offset, sizeof( rec ) );
+        if ( rec.size < sizeof( rec ) + rec.input_captured || offset + rec.size > records.size( ) )
+        {
+            std::cerr << "trace-replay: truncated record at offset " << offset << "\n";
+            break;
+        }
+
+        skip_reason why = skip_count;
+        if ( should_skip( rec, mutate, why ) )
+        {
+            ++skipped[ why ];
+            offset += rec.size;
+            continue;
+        }
+
+        input.assign( records.data( ) + offset + sizeof( rec ), records.data( ) + offset + sizeof( rec ) + rec.input_length );
+        output.assign( rec.output_length, 0 );
+
+        DWORD returned = 0;
+        LARGE_INTEGER start = {}, end = {};
+        QueryPerformanceCounter( &start );
+        BOOL ok = DeviceIoControl( device, rec.io_control_code,
+            input.empty( ) ? nullptr : input.data( ), ( DWORD )input.size( ),
+            output.empty( ) ? nullptr : output.data( ), ( DWORD )output.size( ),
+            &returned, nullptr );
+        QueryPerformanceCounter( &end );
+        const DWORD error = ok ? 0 : GetLastError( );
+
+        const double ns = ( double )( end.QuadPart - start.QuadPart ) * 1e9 / ( double )freq.QuadPart;
+        replay_ns.push_back( ns );
+        recorded_ns.push_back( ( double )rec.latency_ns );
+        busy_ns += ns;
+        ++count;
+
+        // win32 errors do not map back to the recorded NTSTATUS, compare success and what came back instead
+        const bool recorded_ok = rec.status >= 0;
+        const bool varies = output_varies( rec.io_control_code );
+        if ( varies ) ++unchecked_output;
+
+        const char* reason = nullptr;
+        if ( ( ok != FALSE ) != recorded_ok ) reason = "status";
+        else if ( ok && returned != rec.information ) reason = "information";
+        else if ( ok && !varies && ( rec.flags & HV_TRACE_OUTPUT_CRC ) && hv_page_hash::crc32c_buffer( output.data( ), std::min< size_t >( returned, output.size( ) ) ) != rec.output_crc ) reason = "output";
+
+        if ( reason )
+        {
+            if ( divergences < max_reported_divergences )
+            {
+                char line[ 192 ];
+                snprintf( line, sizeof( line ), "divergence #%llu: ioctl 0x%08x %s (recorded status 0x%08x info %llu, replay error %u info %u)",
+                    count, rec.io_control_code, reason, ( ULONG )rec.status, rec.information, error, returned );
+                std::cout << line << "\n";
+            }
+            ++divergences;
+        }
+
+        offset += rec.size;
+    }
+
+    QueryPerformanceCounter( &wall_end );
+    const double wall_s = ( double )( wall_end.QuadPart - wall_start.QuadPart ) / ( double )freq.QuadPart;
+
+    const latency_summary replayed = summarize( replay_ns );
+    const latency_summary recorded = summarize( recorded_ns );
+
+    char line[ 256 ];
+    snprintf( line, sizeof( line ), "trace-replay: %llu ioctls in %.3f s (%.0f ops/s wall, %.0f ops/s in driver calls)", count, wall_s,
+        wall_s > 0 ? count / wall_s : 0.0, busy_ns > 0 ? count * 1e9 / busy_ns : 0.0 );
+    std::cout << line << "\n";
+    snprintf( line, sizeof( line ), "  replay   latency ns: p50 %.0f  p99 %.0f  max %.0f (round trip)", replayed.p50, replayed.p99, replayed.max );
+    std::cout << line << "\n";
+    snprintf( line, sizeof( line ), "  recorded latency ns: p50 %.0f  p99 %.0f  max %.0f (in driver)", recorded.p50, recorded.p99, recorded.max );
+    std::cout << line << "\n";
+    std::cout << "  divergences: " << divergences << "\n";
+    snprintf( line, sizeof( line ), "  not replayed: %llu direct i/o (data not recorded), %llu truncated input, %llu event wait(s), %llu state changing%s",
+        skipped[ skip_direct_io ], skipped[ skip_truncated ], skipped[ skip_wait ], skipped[ skip_state_change ],
+        skipped[ skip_state_change ] ? " (replay them with --mutate)" : "" );
+    std::cout << line << "\n";
+    snprintf( line, sizeof( line ), "  output not compared: %llu merge / reclaim / translate queries (status and information only)", unchecked_output );
+    std::cout << line << "\n";
+
+    return divergences == 0;
+}
\ No newline at end of file
@@ -0,0 +1,423 @@
+#include "../includes/vpid_bench.h"
+#include "../includes/sim_util.h"
+#include "../../hypervisor/includes/hv_vpid.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdio>
+
+namespace
+{
+    using sim_util::rng;
+
+    enum class policy
+    {
+        no_vpid,      // every vm transition flushes the whole tlb
+        broadcast,    // vpids, every recycle / remap invalidated on all processors at once
+        tracked,      // vpids, hv_vpid::plan_entry before every entry
+    };
+
+    const char* policy_name( policy p )
+    {
+        switch ( p )
+        {
+        case policy::no_vpid: return "no-vpid";
+        case policy::broadcast: return "broadcast";
+        default: return "tracked";
+        }
+    }
+
+    // the translations one context left in a processor's tlb. owner and version are what the hardware
+    // cannot see, they tell a live translation from a stale one
+    struct cached
+    {
+        ULONG   vpid;
+        ULONG64 owner;       // sandbox incarnation the vpid belonged to
+        ULONG64 eptp;
+        ULONG64 version;     // ept version they were filled under
+        ULONG64 last_use;
+    };
+
+    struct tlb
+    {
+        std::vector<cached> lines;
+
+        template < class Pred >
+        ULONG drop( Pred pred )
+        {
+            ULONG dropped = 0;
+            for ( size_t i = 0; i < lines.size( ); )
+            {
+                if ( !pred( lines[ i ] ) )
+                {
+                    ++i;
+                    continue;
+                }
+
+                lines[ i ] = lines.back( );
+                lines.pop_back( );
+                ++dropped;
+            }
+            return dropped;
+        }
+    };
+
+    struct vcpu
+    {
+        ULONG vpid;
+        ULONG cpu;
+    };
+
+    struct sandbox
+    {
+        ULONG64 owner;
+        ULONG64 eptp;
+        ULONG64 version;
+        std::vector<vcpu> vcpus;
+    };
+
+    struct run_result
+    {
+        ULONG64 entries;
+        ULONG64 warm;
+        ULONG64 invvpid;
+        ULONG64 invept;
+        ULONG64 flushes;
+        ULONG64 ipis;
+        ULONG64 stale_hits;
+        ULONG64 cycles;
+        ULONG64 stale_flushes;
+        ULONG64 eviction_flushes;
+        ULONG64 vpid_failures;
+    };
+
+    class machine
+    {
+    public:
+        machine( const vpid_bench_config& cfg, policy p )
+            : cfg_( cfg ), policy_( p ), rng_{ cfg.seed },
+            bitmap_( hv_vpid::allocator::bitmap_words( cfg.vpid_count ) ), epochs_( cfg.vpid_count ),
+            caches_( cfg.cpus, hv_vpid::cpu_cache{ } ), contexts_( cfg.cpus, hv_vpid::cpu_contexts{ } ), seen_( static_cast< size_t >( cfg.cpus ) * cfg.vpid_count ),
+            epts_( static_cast< size_t >( cfg.cpus ) * cfg.ept_ways, hv_vpid::context{ } ), tlbs_( cfg.cpus ), sandboxes_( cfg.sandboxes )
+        {
+            allocator_.attach( cfg.vpid_count, bitmap_.data( ), epochs_.data( ) );
+            for ( ULONG cpu = 0; cpu < cfg.cpus; ++cpu )
+            {
+                contexts_[ cpu ].seen = &seen_[ static_cast< size_t >( cpu ) * cfg.vpid_count ];
+                contexts_[ cpu ].epts = &epts_[ static_cast< size_t >( cpu ) * cfg.ept_ways ];
+                contexts_[ cpu ].ept_ways = cfg.ept_ways;
+            }
+
+            // pml4 pages of destroyed epts are handed out again first, so eptps really do get reused
+            for ( ULONG i = 0; i < cfg.sandboxes; ++i ) free_eptps_.push_back( ( 0x100000ULL + i * 0x1000ULL ) | 0x1E );
+            for ( sandbox& s : sandboxes_ ) create( s );
+        }
+
+        run_result run( )
+        {
+            for ( ULONG64 step = 1; step <= cfg_.entries; ++step )
+            {
+                if ( cfg_.recycle_every && step % cfg_.recycle_every == 0 )
+                {
+                    sandbox& s = sandboxes_[ rng_.below( sandboxes_.size( ) ) ];
+                    destroy( s );
+                    create( s );
+                }
+
+                if ( cfg_.remap_every && step % cfg_.remap_every == 0 ) remap( sandboxes_[ rng_.below( sandboxes_.size( ) ) ] );
+
+                sandbox& s = sandboxes_[ rng_.below( sandboxes_.size( ) ) ];
+                vcpu& v = s.vcpus[ rng_.below( s.vcpus.size( ) ) ];
+                if ( rng_.below( 100 ) < cfg_.migrate_pct ) v.cpu = static_cast< ULONG >( rng_.below( cfg_.cpus ) );
+                enter( s, v );
+            }
+
+            for ( const hv_vpid::cpu_contexts& c : contexts_ )
+            {
+                result_.stale_flushes += c.stale_flushes;
+                result_.eviction_flushes += c.eviction_flushes;
+            }
+
+            return result_;
+        }
+
+    private:
+        void create( sandbox& s )
+        {
+            s.owner = ++owners_;
+            s.eptp = free_eptps_.back( );
+            free_eptps_.pop_back( );
+            s.version = ++ept_instances_ << 32;
+
+            // the create request lands on whatever processor, the vcpus get spread from there
+            const ULONG cpu = static_cast< ULONG >( rng_.below( cfg_.cpus ) );
+            s.vcpus.assign( cfg_.vcpus, vcpu{ } );
+            for ( vcpu& v : s.vcpus )
+            {
+                v.vpid = allocate( cpu );
+                v.cpu = static_cast< ULONG >( rng_.below( cfg_.cpus ) );
+                if ( v.vpid == hv_vpid::invalid_vpid ) ++result_.vpid_failures;
+            }
+        }
+
+        void destroy( sandbox& s )
+        {
+            for ( const vcpu& v : s.vcpus )
+            {
+                release( v.vpid );
+                if ( policy_ == policy::broadcast ) broadcast( [ &v ]( const cached& c ) { return c.vpid == v.vpid; }, result_.invvpid );
+            }
+
+            if ( policy_ == policy::broadcast ) broadcast( [ &s ]( const cached& c ) { return c.eptp == s.eptp; }, result_.invept );
+            free_eptps_.push_back( s.eptp );
+        }
+
+        void remap( sandbox& s )
+        {
+            ++s.version;
+            if ( policy_ == policy::broadcast ) broadcast( [ &s ]( const cached& c ) { return c.eptp == s.eptp; }, result_.invept );
+        }
+
+        // hv_vpid_pool::allocate without the locks
+        ULONG allocate( ULONG cpu )
+        {
+            ULONG vpid = hv_vpid::invalid_vpid;
+            for ( ULONG attempt = 0; attempt < 2; ++attempt )
+            {
+                if ( attempt )
+                {
+                    for ( hv_vpid::cpu_cache& cache : caches_ ) allocator_.spill( cache, 0 );
+                }
+
+                if ( caches_[ cpu ].pop( vpid ) ) return vpid;
+                allocator_.refill( caches_[ cpu ], hv_vpid::cpu_cache::batch );
+                if ( caches_[ cpu ].pop( vpid ) ) return vpid;
+            }
+
+            return hv_vpid::invalid_vpid;
+        }
+
+        // hv_vpid_pool::release without the lock
+        void release( ULONG vpid )
+        {
+            if ( vpid == hv_vpid::invalid_vpid ) return;
+
+            allocator_.retire( vpid );
+        }
+
+        // one single context invalidation on every processor, the initiator sends an ipi to all others
+        template < class Pred >
+        void broadcast( Pred pred, ULONG64& counter )
+        {
+            for ( tlb& t : tlbs_ ) t.drop( pred );
+            counter += cfg_.cpus;
+            result_.ipis += cfg_.cpus - 1;
+            result_.cycles += static_cast< ULONG64 >( cfg_.cpus ) * cfg_.invalidate_cycles + static_cast< ULONG64 >( cfg_.cpus - 1 ) * cfg_.ipi_cycles;
+        }
+
+        void enter( const sandbox& s, const vcpu& v )
+        {
+            tlb& t = tlbs_[ v.cpu ];
+            ++result_.entries;
+            ++clock_;
+
+            if ( policy_ == policy::no_vpid )
+            {
+                t.lines.clear( );
+                ++result_.flushes;
+                result_.cycles += cfg_.flush_cycles;
+            }
+            else if ( policy_ == policy::tracked )
+            {
+                hv_vpid::entry_plan plan;
+                hv_vpid::plan_entry( contexts_[ v.cpu ], v.vpid, allocator_.epoch( v.vpid ), s.eptp, s.version, plan );
+                for ( ULONG i = 0; i < plan.invvpid_count; ++i )
+                {
+                    const ULONG64 tag = plan.invvpid[ i ];
+                    t.drop( [ tag ]( const cached& c ) { return c.vpid == tag; } );
+                }
+                for ( ULONG i = 0; i < plan.invept_count; ++i )
+                {
+                    const ULONG64 tag = plan.invept[ i ];
+                    t.drop( [ tag ]( const cached& c ) { return c.eptp == tag; } );
+                }
+
+                result_.invvpid += plan.invvpid_count;
+                result_.invept += plan.invept_count;
+                result_.cycles += static_cast< ULONG64 >( plan.invvpid_count + plan.invept_count ) * cfg_.invalidate_cycles;
+            }
+
+            // what the guest would now hit that belongs to an earlier owner of its vpid or an older ept
+            const ULONG stale = t.drop( [ &s, &v ]( const cached& c )
+            {
+                return ( c.vpid == v.vpid && c.owner != s.owner ) || ( c.eptp == s.eptp && c.version != s.version );
+            } );
+            if ( stale ) ++result_.stale_hits;
+
+            for ( cached& c : t.lines )
+            {
+                if ( c.vpid != v.vpid || c.owner != s.owner || c.eptp != s.eptp || c.version != s.version ) continue;
+                c.last_use = clock_;
+                ++result_.warm;
+                return;
+            }
+
+            // cold: the working set is walked in again, the least recently entered context makes room
+            result_.cycles += static_cast< ULONG64 >( cfg_.working_set ) * cfg_.walk_cycles;
+            if ( t.lines.size( ) >= cfg_.tlb_contexts )
+            {
+                size_t oldest = 0;
+                for ( size_t i = 1; i < t.lines.size( ); ++i )
+                {
+                    if ( t.lines[ i ].last_use < t.lines[ oldest ].last_use ) oldest = i;
+                }
+                t.lines[ oldest ] = t.lines.back( );
+                t.lines.pop_back( );
+            }
+
+            t.lines.push_back( cached{ v.vpid, s.owner, s.eptp, s.version, clock_ } );
+        }
+
+    private:
+        const vpid_bench_config& cfg_;
+        policy  policy_;
+        rng     rng_;
+        ULONG64 clock_{ 0 };
+        ULONG64 owners_{ 0 };
+        ULONG64 ept_instances_{ 0 };
+
+        hv_vpid::allocator               allocator_;
+        std::vector<ULONG64>             bitmap_;
+        std::vector<ULONG>               epochs_;
+        std::vector<hv_vpid::cpu_cache>  caches_;
+        std::vector<hv_vpid::cpu_contexts> contexts_;
+        std::vector<ULONG>               seen_;
+        std::vector<hv_vpid::context>    epts_;
+        std::vector<tlb>                 tlbs_;
+        std::vector<sandbox>             sandboxes_;
+        std::vector<ULONG64>             free_eptps_;
+        run_result                       result_{ };
+    };
+
+    // raw cost of the calls the driver makes: plan_entry per vm entry, allocate + release per vcpu lifetime
+    void time_primitives( const vpid_bench_config& cfg )
+    {
+        const ULONG64 calls = 10000000;
+        rng r{ cfg.seed + 7 };
+
+        std::vector<hv_vpid::cpu_contexts> contexts( cfg.cpus, hv_vpid::cpu_contexts{ } );
+        std::vector<ULONG> seen( static_cast< size_t >( cfg.cpus ) * cfg.vpid_count );
+        std::vector<hv_vpid::context> epts( static_cast< size_t >( cfg.cpus ) * cfg.ept_ways, hv_vpid::context{ } );
+        for ( ULONG cpu = 0; cpu < cfg.cpus; ++cpu )
+        {
+            contexts[ cpu ].seen = &seen[ static_cast< size_t >( cpu ) * cfg.vpid_count ];
+            contexts[ cpu ].epts = &epts[ static_cast< size_t >( cpu ) * cfg.ept_ways ];
+            contexts[ cpu ].ept_ways = cfg.ept_ways;
+        }
+        const ULONG live = cfg.sandboxes * cfg.vcpus;
+        hv_vpid::entry_plan plan;
+        ULONG64 sink = 0;
+
+        sim_util::stopwatch timer;
+        for ( ULONG64 i = 0; i < calls; ++i )
+        {
+            const ULONG vcpu = static_cast< ULONG >( r.below( live ) );
+            hv_vpid::plan_entry( contexts[ i % cfg.cpus ], vcpu + 1, 0, 0x100000ULL + ( vcpu / cfg.vcpus ) * 0x1000ULL, 1, plan );
+            sink += plan.invvpid_count + plan.invept_count;
+        }
+        const double plan_ns = timer.seconds( ) * 1e9 / ( double )calls;
+
+        std::vector<ULONG64> bitmap( hv_vpid::allocator::bitmap_words( cfg.vpid_count ) );
+        std::vector<ULONG> epochs( cfg.vpid_count );
+        std::vector<hv_vpid::cpu_cache> caches( cfg.cpus, hv_vpid::cpu_cache{ } );
+        hv_vpid::allocator allocator;
+        allocator.attach( cfg.vpid_count, bitmap.data( ), epochs.data( ) );
+
+        // a live set of vcpus, each step releases one and allocates a replacement on some processor
+        std::vector<ULONG> held( live, hv_vpid::invalid_vpid );
+        ULONG64 refills = 0;
+        auto allocate = [ & ]( ULONG cpu ) -> ULONG
+        {
+            ULONG vpid = hv_vpid::invalid_vpid;
+            if ( caches[ cpu ].pop( vpid ) ) return vpid;
+            ++refills;
+            allocator.refill( caches[ cpu ], hv_vpid::cpu_cache::batch );
+            return caches[ cpu ].pop( vpid ) ? vpid : hv_vpid::invalid_vpid;
+        };
+        for ( ULONG& vpid : held ) vpid = allocate( static_cast< ULONG >( r.below( cfg.cpus ) ) );
+
+        timer.restart( );
+        for ( ULONG64 i = 0; i < calls; ++i )
+        {
+            ULONG& vpid = held[ r.below( live ) ];
+            allocator.retire( vpid );
+            vpid = allocate( static_cast< ULONG >( r.below( cfg.cpus ) ) );
+            sink += vpid;
+        }
+        const double pair_ns = timer.seconds( ) * 1e9 / ( double )calls;
+
+        char line[ 256 ];
+        snprintf( line, sizeof( line ), "plan_entry: %.1f ns per vm entry; allocator: %.1f ns per release + allocate, %.2f%% of allocates refilled (%llu refills)",
+            plan_ns, pair_ns, 100.0 * ( double )refills / ( double )calls, refills );
+        std::cout << line << ( sink == 1 ? " " : "" ) << "\n";
+    }
+}
+
+int vpid_bench_main( int argc, char** argv, int first_arg )
+{
+    vpid_bench_config cfg;
+
+    sim_util::options opts( "vpid-bench", argc, argv, first_arg );
+    while ( opts.next( ) )
+    {
+        if ( opts.take( "--cpus", cfg.cpus ) || opts.take( "--sandboxes", cfg.sandboxes ) || opts.take( "--vcpus", cfg.vcpus ) ||
+            opts.take( "--entries", cfg.entries ) || opts.take( "--recycle", cfg.recycle_every ) || opts.take( "--remap", cfg.remap_every ) ||
+            opts.take( "--migrate", cfg.migrate_pct ) || opts.take( "--tlb", cfg.tlb_contexts ) || opts.take( "--working-set", cfg.working_set ) ||
+            opts.take( "--ept-ways", cfg.ept_ways ) || opts.take( "--vpids", cfg.vpid_count ) || opts.take( "--seed", cfg.seed ) )
+            continue;
+
+        return opts.unknown( );
+    }
+
+    if ( opts.failed( ) ) return 1;
+
+    if ( cfg.cpus == 0 || cfg.sandboxes == 0 || cfg.vcpus == 0 || cfg.entries == 0 || cfg.tlb_contexts == 0 || cfg.ept_ways == 0 || cfg.vpid_count < 2 || cfg.migrate_pct > 100 )
+    {
+        std::cerr << "vpid-bench: need cpus, sandboxes, vcpus, entries, tlb contexts and ept ways >= 1, at least 2 vpids and migrate up to 100\n";
+        return 1;
+    }
+
+    char line[ 256 ];
+    snprintf( line, sizeof( line ), "vpid-bench: %u cpus, %u sandbox(es) x %u vcpus, %llu entries, recycle every %u, remap every %u, tlb keeps %u contexts",
+        cfg.cpus, cfg.sandboxes, cfg.vcpus, cfg.entries, cfg.recycle_every, cfg.remap_every, cfg.tlb_contexts );
+    std::cout << line << "\n\n";
+    std::cout << "policy      warm %   invvpid    invept  full flushes      ipis  stale hits  cycles/entry  ns/entry\n";
+
+    ULONG64 failures = 0;
+    const policy policies[ ] = { policy::no_vpid, policy::broadcast, policy::tracked };
+    run_result tracked = {};
+
+    for ( policy p : policies )
+    {
+        machine m( cfg, p );
+        sim_util::stopwatch timer;
+        const run_result r = m.run( );
+        const double seconds = timer.seconds( );
+
+        snprintf( line, sizeof( line ), "%-10s %7.2f  %8llu  %8llu  %12llu  %8llu  %10llu  %12.0f  %8.0f",
+            policy_name( p ), 100.0 * ( double )r.warm / ( double )r.entries, r.invvpid, r.invept, r.flushes, r.ipis, r.stale_hits,
+            ( double )r.cycles / ( double )r.entries, seconds * 1e9 / ( double )r.entries );
+        std::cout << line << "\n";
+
+        failures += r.stale_hits + r.vpid_failures;
+        if ( p == policy::tracked ) tracked = r;
+    }
+
+    std::cout << "\ntracked: " << tracked.stale_flushes << " invalidations of recycled vpids / remapped epts, " << tracked.eviction_flushes
+        << " of eptps dropped from a full table (" << cfg.ept_ways << " per processor)\n";
+    time_primitives( cfg );
+
+    if ( failures ) std::cout << "FAILED: " << failures << " stale hit(s) or vpid allocation failure(s)\n";
+    return failures ? 2 : 0;
+}
\ No newline at end of file
@@ -0,0 +1,397 @@
+#include "../includes/walk_sim.h"
+#include "../includes/sim_util.h"
+#include "../../hypervisor/includes/hv_ept_walk.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <cstdio>
+
+namespace
+{
+    class lru_cache
+    {
+    public:
+        explicit lru_cache( size_t capacity ) : capacity_( capacity ) { }
+
+        bool lookup( ULONG64 key )
+        {
+            auto it = map_.find( key );
+            if ( it == map_.end( ) ) return false;
+            order_.splice( order_.begin( ), order_, it->second );
+            return true;
+        }
+
+        void insert( ULONG64 key )
+        {
+            if ( capacity_ == 0 ) return;
+            if ( lookup( key ) ) return;
+
+            if ( map_.size( ) == capacity_ )
+            {
+                map_.erase( order_.back( ) );
+                order_.pop_back( );
+            }
+
+            order_.push_front( key );
+            map_[ key ] = order_.begin( );
+        }
+
+    private:
+        size_t capacity_;
+        std::list<ULONG64> order_;
+        std::unordered_map<ULONG64, std::list<ULONG64>::iterator> map_;
+    };
+
+    using sim_util::mix64;
+
+    ULONG shift_of( ULONG64 size )
+    {
+        ULONG shift = 0;
+        while ( ( 1ULL << shift ) < size ) ++shift;
+        return shift;
+    }
+
+    // Walks every access through guest paging and, for each guest table entry and the final data address,
+    // through the ept. Only the guest side is synthetic: guest tables are placed per walk_sim_config. The
+    // ept side is the real table memory built by hv_ept_walk::build_tables and walked by hv_ept_walk::translate.
+    class nested_walker
+    {
+    public:
+        explicit nested_walker( const walk_sim_config& cfg )
+            : cfg_( cfg ),
+            tlb_( cfg.tlb_entries ),
+            ntlb_( cfg.ntlb_entries ),
+            guest_shift_( shift_of( cfg.guest_leaf ) ),
+            ept_shift_( shift_of( cfg.ept_leaf ) )
+        {
+            for ( ULONG level = 0; level <= 5; ++level )
+            {
+                psc_.emplace_back( cfg.psc_entries );
+                ept_psc_.emplace_back( cfg.ept_psc_entries );
+            }
+
+            const ULONG64 table_pages = hv_ept_walk::table_pages_for( cfg.guest_bytes, cfg.ept_leaf );
+            ept_tables_.assign( ( size_t )( table_pages * hv_ept_walk::entries_per_table ), 0 );
+            stats_.ept_table_pages = table_pages;
+
+            // fake but stable physical addresses: tables at ept_base_pa_, guest ram identity shifted above them
+            hv_ept_walk::build_tables( ept_tables_.data( ), cfg.guest_bytes, cfg.ept_leaf,
+                [ this ]( ULONG64* table ) { return ept_base_pa_ + ( ULONG64 )( table - ept_tables_.data( ) ) * sizeof( ULONG64 ); },
+                [ ]( ULONG64 gpa ) { return guest_ram_pa_ + gpa; } );
+
+            // the tlb caches the combined translation at the smaller of the two page sizes
+            tlb_shift_ = guest_shift_ < ept_shift_ ? guest_shift_ : ept_shift_;
+            next_packed_table_ = cfg.guest_bytes / 2;
+        }
+
+        void access( ULONG64 gva )
+        {
+            ++stats_.accesses;
+            gva &= ( 1ULL << ( 12 + 9 * cfg_.guest_levels ) ) - 1;
+
+            if ( tlb_.lookup( gva >> tlb_shift_ ) ) return;
+            ++stats_.tlb_misses;
+
+            const ULONG leaf_level = cfg_.guest_leaf == hv_ept_walk::level_page_size( 2 ) ? 2 : 1;
+
+            // deepest cached guest entry decides where the walk starts
+            ULONG start = cfg_.guest_levels;
+            for ( ULONG level = leaf_level + 1; level <= cfg_.guest_levels; ++level )
+            {
+                if ( psc_[ level ].lookup( level_key( gva, level ) ) )
+                {
+                    start = level - 1;
+                    break;
+                }
+            }
+
+            ULONG guest_refs = 0;
+            ULONG ept_refs = 0;
+            for ( ULONG level = start; level >= leaf_level; --level )
+            {
+                const ULONG64 entry_gpa = guest_table_gpa( gva, level ) + hv_ept_walk::table_index( gva, level ) * sizeof( ULONG64 );
+                ept_refs += ept_walk_refs( entry_gpa );
+                ++guest_refs;
+
+                if ( level > leaf_level ) psc_[ level ].insert( level_key( gva, level ) );
+            }
+
+            ept_refs += ept_walk_refs( gva % cfg_.guest_bytes );
+            tlb_.insert( gva >> tlb_shift_ );
+
+            stats_.guest_refs += guest_refs;
+            stats_.ept_refs += ept_refs;
+            if ( guest_refs + ept_refs > stats_.max_refs ) stats_.max_refs = guest_refs + ept_refs;
+        }
+
+        const walk_sim_stats& stats( ) const { return stats_; }
+
+    private:
+        static ULONG64 level_key( ULONG64 address, ULONG level )
+        {
+            return address >> ( 12 + 9 * ( level - 1 ) );
+        }
+
+        ULONG64 guest_table_gpa( ULONG64 gva, ULONG level )
+        {
+            // a table at `level` is identified by the address bits above the ones it indexes
+            const ULONG64 key = ( static_cast< ULONG64 >( level ) << 58 ) | ( gva >> ( 12 + 9 * level ) );
+            auto it = guest_tables_.find( key );
+            if ( it != guest_tables_.end( ) ) return it->second;
+
+            ULONG64 gpa = 0;
+            if ( cfg_.spread_tables )
+            {
+                gpa = ( mix64( key ) % ( cfg_.guest_bytes / hv_ept_walk::page_4k ) ) * hv_ept_walk::page_4k;
+            }
+            else
+            {
+                gpa = next_packed_table_;
+                next_packed_table_ = ( next_packed_table_ + hv_ept_walk::page_4k ) % cfg_.guest_bytes;
+            }
+
+            guest_tables_.emplace( key, gpa );
+            return gpa;
+        }
+
+        // memory references needed to turn gpa into a host physical address
+        ULONG ept_walk_refs( ULONG64 gpa )
+        {
+            if ( ntlb_.lookup( gpa >> ept_shift_ ) ) return 0;
+
+            hv_ept_walk::translation t = {};
+            const bool mapped = hv_ept_walk::translate( ept_base_pa_, gpa,
+                [ this ]( ULONG64 pa ) -> void*
+                {
+                    const ULONG64 offset = pa - ept_base_pa_;
+                    if ( pa < ept_base_pa_ || offset >= ept_tables_.size( ) * sizeof( ULONG64 ) ) return nullptr;
+                    return reinterpret_cast< BYTE* >( ept_tables_.data( ) ) + offset;
+                }, t );
+
+            if ( !mapped ) return hv_ept_walk::ept_levels;
+
+            const ULONG leaf_level = hv_ept_walk::ept_levels - t.depth + 1;
+            ULONG refs = t.depth;
+            for ( ULONG level = leaf_level + 1; level <= hv_ept_walk::ept_levels; ++level )
+            {
+                if ( ept_psc_[ level ].lookup( level_key( gpa, level ) ) )
+                {
+                    refs = t.depth - ( hv_ept_walk::ept_levels - level + 1 );
+                    break;
+                }
+            }
+
+            for ( ULONG level = leaf_level + 1; level <= hv_ept_walk::ept_levels; ++level ) ept_psc_[ level ].insert( level_key( gpa, level ) );
+            ntlb_.insert( gpa >> ept_shift_ );
+            return refs;
+        }
+
+    private:
+        static constexpr ULONG64 ept_base_pa_ = 0x100000;
+        static constexpr ULONG64 guest_ram_pa_ = 1ULL << 40;
+
+        walk_sim_config cfg_;
+        walk_sim_stats stats_;
+        lru_cache tlb_;
+        lru_cache ntlb_;
+        std::vector<lru_cache> psc_;
+        std::vector<lru_cache> ept_psc_;
+        std::vector<ULONG64> ept_tables_;
+        std::unordered_map<ULONG64, ULONG64> guest_tables_;
+        ULONG64 next_packed_table_{ 0 };
+        ULONG guest_shift_;
+        ULONG ept_shift_;
+        ULONG tlb_shift_{ 12 };
+    };
+
+    bool parse_size( const std::string& text, ULONG64& out )
+    {
+        if ( text == "4k" || text == "4K" ) out = 0x1000ULL;
+        else if ( text == "2m" || text == "2M" ) out = 0x200000ULL;
+        else if ( text == "1g" || text == "1G" ) out = 0x40000000ULL;
+        else return false;
+        return true;
+    }
+
+    bool load_trace( const std::string& path, std::vector<ULONG64>& addresses )
+    {
+        std::ifstream in( path );
+        if ( !in )
+        {
+            std::cerr << "walk-sim: failed to open " << path << "\n";
+            return false;
+        }
+
+        // one access per line, the first token that parses as hex is the guest virtual address ("R 0x7ff..." works)
+        std::string line;
+        while ( std::getline( in, line ) )
+        {
+            std::istringstream tokens( line );
+            std::string tok;
+            while ( tokens >> tok )
+            {
+                try
+                {
+                    size_t used = 0;
+                    ULONG64 value = std::stoull( tok, &used, 16 );
+                    if ( used == tok.size( ) )
+                    {
+                        addresses.push_back( value );
+                        break;
+                    }
+                }
+                catch ( ... ) { }
+            }
+        }
+
+        return true;
+    }
+
+    void synthesize( const std::string& pattern, ULONG64 working_set, ULONG64 count, std::vector<ULONG64>& addresses )
+    {
+        const ULONG64 base = 0x00007FF600000000ULL;
+        ULONG64 seed = 0x2545F4914F6CDD1DULL;
+        addresses.reserve( ( size_t )count );
+
+        for ( ULONG64 i = 0; i < count; ++i )
+        {
+            if ( pattern == "seq" ) addresses.push_back( base + ( i * 64 ) % working_set );
+            else if ( pattern == "stride" ) addresses.push_back( base + ( i * hv_ept_walk::page_4k ) % working_set );
+            else
+            {
+                seed = mix64( seed );
+                addresses.push_back( base + ( seed % working_set ) );
+            }
+        }
+    }
+
+    void print_row( const char* ept_leaf, const char* placement, const walk_sim_stats& s, ULONG ref_cycles )
+    {
+        const double misses = s.tlb_misses ? ( double )s.tlb_misses : 1.0;
+        const double refs_per_miss = ( double )( s.guest_refs + s.ept_refs ) / misses;
+        const double cycles_per_access = s.accesses ? ( double )( s.guest_refs + s.ept_refs ) * ref_cycles / ( double )s.accesses : 0.0;
+
+        char line[ 200 ];
+        snprintf( line, sizeof( line ), "%-4s %-7s %8.3f%% %10.2f %9.2f %9.2f %6u %12.1f %12.2f %10llu",
+            ept_leaf, placement,
+            s.accesses ? 100.0 * ( double )s.tlb_misses / ( double )s.accesses : 0.0,
+            refs_per_miss, ( double )s.guest_refs / misses, ( double )s.ept_refs / misses, s.max_refs,
+            refs_per_miss * ref_cycles, cycles_per_access, s.ept_table_pages );
+        std::cout << line << "\n";
+    }
+}
+
+int walk_sim_main( int argc, char** argv, int first_arg )
+{
+    walk_sim_config cfg;
+    std::string trace_path;
+    std::string pattern = "random";
+    ULONG64 working_set_mb = 256;
+    ULONG64 guest_mb = cfg.guest_bytes >> 20;
+    ULONG64 count = 2000000;
+    std::vector<ULONG64> ept_leaves = { 0x1000ULL, 0x200000ULL, 0x40000000ULL };
+    std::vector<int> placements = { 0, 1 };
+    std::string guest_leaf, ept_leaf, placement;
+
+    sim_util::options opts( "walk-sim", argc, argv, first_arg );
+    while ( opts.next( ) )
+    {
+        if ( opts.take( "--trace", trace_path ) || opts.take( "--pattern", pattern ) || opts.take( "--ws-mb", working_set_mb ) ||
+            opts.take( "--accesses", count ) || opts.take( "--guest-mb", guest_mb ) || opts.take( "--levels", cfg.guest_levels ) ||
+            opts.take( "--guest-leaf", guest_leaf ) || opts.take( "--ept-leaf", ept_leaf ) || opts.take( "--placement", placement ) ||
+            opts.take( "--tlb", cfg.tlb_entries ) || opts.take( "--psc", cfg.psc_entries ) || opts.take( "--ept-psc", cfg.ept_psc_entries ) ||
+            opts.take( "--ntlb", cfg.ntlb_entries ) || opts.take( "--ref-cycles", cfg.ref_cycles ) )
+            continue;
+
+        return opts.unknown( );
+    }
+
+    if ( opts.failed( ) ) return 1;
+
+    ULONG64 size = 0;
+    if ( !guest_leaf.empty( ) )
+    {
+        if ( !parse_size( guest_leaf, size ) )
+        {
+            std::cerr << "walk-sim: --guest-leaf takes 4k or 2m\n";
+            return 1;
+        }
+        cfg.guest_leaf = size;
+    }
+
+    if ( !ept_leaf.empty( ) )
+    {
+        if ( !parse_size( ept_leaf, size ) )
+        {
+            std::cerr << "walk-sim: --ept-leaf takes 4k, 2m or 1g\n";
+            return 1;
+        }
+        ept_leaves = { size };
+    }
+
+    if ( !placement.empty( ) ) placements = { placement == "spread" ? 1 : 0 };
+
+    ULONG64 working_set = working_set_mb << 20;
+    cfg.guest_bytes = guest_mb << 20;
+
+    if ( cfg.guest_levels != 4 && cfg.guest_levels != 5 )
+    {
+        std::cerr << "walk-sim: --levels must be 4 or 5\n";
+        return 1;
+    }
+
+    if ( cfg.guest_leaf > 0x200000ULL )
+    {
+        std::cerr << "walk-sim: --guest-leaf must be 4k or 2m\n";
+        return 1;
+    }
+
+    // build_tables maps whole leaves under a single pml4 entry
+    const ULONG64 round = ( 1ULL << 30 );
+    cfg.guest_bytes = ( cfg.guest_bytes + round - 1 ) / round * round;
+    if ( cfg.guest_bytes == 0 || cfg.guest_bytes > ( 512ULL << 30 ) )
+    {
+        std::cerr << "walk-sim: --guest-mb must be between 1 and 524288\n";
+        return 1;
+    }
+
+    std::vector<ULONG64> addresses;
+    if ( !trace_path.empty( ) )
+    {
+        if ( !load_trace( trace_path, addresses ) ) return 1;
+    }
+    else
+    {
+        if ( working_set == 0 ) working_set = 1;
+        synthesize( pattern, working_set, count, addresses );
+    }
+
+    char header[ 256 ];
+    snprintf( header, sizeof( header ), "walk-sim: %zu accesses (%s), guest %llu MB, %u-level guest paging, %s guest leaves, tlb %u, psc %u, ept psc %u, ntlb %u, %u cycles/ref",
+        addresses.size( ), trace_path.empty( ) ? pattern.c_str( ) : trace_path.c_str( ), cfg.guest_bytes >> 20, cfg.guest_levels,
+        cfg.guest_leaf == 0x1000ULL ? "4K" : "2M", cfg.tlb_entries, cfg.psc_entries, cfg.ept_psc_entries, cfg.ntlb_entries, cfg.ref_cycles );
+    std::cout << header << "\n\n";
+    std::cout << "ept  tables   tlb miss   refs/miss  guest/miss  ept/miss  max  cycles/miss  cycles/acc  ept pages\n";
+
+    for ( ULONG64 leaf : ept_leaves )
+    {
+        for ( int spread : placements )
+        {
+            walk_sim_config run = cfg;
+            run.ept_leaf = leaf;
+            run.spread_tables = spread != 0;
+
+            nested_walker walker( run );
+            for ( ULONG64 gva : addresses ) walker.access( gva );
+
+            print_row( leaf == 0x1000ULL ? "4K" : leaf == 0x200000ULL ? "2M" : "1G", spread ? "spread" : "packed", walker.stats( ), run.ref_cycles );
+        }
+    }
+
+    return 0;
+}
\ No newline at end of file